@@ -0,0 +1,84 @@
+#include "database.h"
+#include "linked_list.h"
+#include "rdb.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_DIR "rdb_load_bench_dir"
+#define BENCH_FILE "bench.rdb"
+
+/*
+Measures how fast a snapshot is loaded, the bulk of the restart time. The snapshot holds a mix of
+integer, short and longer string values, a tenth of them expiring, and a few long lists. It is
+loaded into a fresh database several times and the fastest run is reported.
+
+usage: rdb_load_bench [keys] [runs]
+*/
+int main(int argc, char *argv[]) {
+  long keys = argc > 1 ? atol(argv[1]) : 1000000;
+  int runs = argc > 2 ? atoi(argv[2]) : 5;
+  if (keys <= 0 || runs <= 0) {
+    fprintf(stderr, "usage: %s [keys] [runs]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  redis_db_t *db = redis_db_create();
+  char key[32];
+  char value[256];
+  long long expiration = current_time_millis() + 3600 * 1000;
+  for (long i = 0; i < keys; i++) {
+    snprintf(key, sizeof(key), "key:%ld", i);
+    switch (i % 4) {
+    case 0:
+      snprintf(value, sizeof(value), "%ld", i);
+      break;
+    case 1:
+      snprintf(value, sizeof(value), "value:%ld", i);
+      break;
+    default:
+      memset(value, 'a' + i % 26, 100 + i % 100);
+      value[100 + i % 100] = '\0';
+      break;
+    }
+    redis_db_set(db, key, value, TYPE_STRING, i % 10 == 0 ? expiration : 0);
+  }
+  for (int l = 0; l < 10; l++) {
+    snprintf(key, sizeof(key), "list:%d", l);
+    int length;
+    for (long i = 0; i < keys / 100; i++) {
+      snprintf(value, sizeof(value), i % 2 ? "%ld" : "job:%ld", i);
+      redis_db_rpush(db, key, value, &length);
+    }
+  }
+  if (!rdb_save_data_to_file(db, BENCH_DIR, BENCH_FILE)) {
+    fprintf(stderr, "save failed\n");
+    return EXIT_FAILURE;
+  }
+  size_t expected = redis_db_dbsize(db);
+  redis_db_destroy(db);
+
+  long long best = -1;
+  for (int run = 0; run < runs; run++) {
+    redis_db_t *loaded = redis_db_create();
+    long long start = current_time_millis();
+    if (rdb_load_data_from_file(loaded, BENCH_DIR, BENCH_FILE, NULL) != 0 ||
+        redis_db_dbsize(loaded) != expected) {
+      fprintf(stderr, "load failed\n");
+      return EXIT_FAILURE;
+    }
+    long long elapsed = current_time_millis() - start;
+    if (best == -1 || elapsed < best) best = elapsed;
+    redis_db_destroy(loaded);
+  }
+
+  double seconds = (best > 0 ? best : 1) / 1000.0;
+  printf("keys: %zu, best of %d: %lld ms, %.0f keys/s\n", expected, runs, best,
+         expected / seconds);
+
+  unlink(BENCH_DIR "/" BENCH_FILE);
+  rmdir(BENCH_DIR);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#include "database.h"
+#include "rdb.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BENCH_DIR "rdb_save_bench_dir"
+#define BENCH_FILE "bench.rdb"
+
+/*
+Measures how fast a snapshot is written. The database is filled with a mix of integer, short and
+longer string values, a tenth of them expiring, and saved several times; the fastest run is
+reported since the first ones also pay for the page cache.
+
+usage: rdb_save_bench [keys] [runs]
+*/
+int main(int argc, char *argv[]) {
+  long keys = argc > 1 ? atol(argv[1]) : 1000000;
+  int runs = argc > 2 ? atoi(argv[2]) : 5;
+  if (keys <= 0 || runs <= 0) {
+    fprintf(stderr, "usage: %s [keys] [runs]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  redis_db_t *db = redis_db_create();
+  char key[32];
+  char value[256];
+  long long expiration = current_time_millis() + 3600 * 1000;
+  for (long i = 0; i < keys; i++) {
+    snprintf(key, sizeof(key), "key:%ld", i);
+    switch (i % 4) {
+    case 0:
+      snprintf(value, sizeof(value), "%ld", i);
+      break;
+    case 1:
+      snprintf(value, sizeof(value), "value:%ld", i);
+      break;
+    default:
+      memset(value, 'a' + i % 26, 100 + i % 100);
+      value[100 + i % 100] = '\0';
+      break;
+    }
+    redis_db_set(db, key, value, TYPE_STRING, i % 10 == 0 ? expiration : 0);
+  }
+
+  long long best = -1;
+  for (int run = 0; run < runs; run++) {
+    long long start = current_time_millis();
+    if (!rdb_save_data_to_file(db, BENCH_DIR, BENCH_FILE)) {
+      fprintf(stderr, "save failed\n");
+      return EXIT_FAILURE;
+    }
+    long long elapsed = current_time_millis() - start;
+    if (best == -1 || elapsed < best) best = elapsed;
+  }
+
+  struct stat statbuf;
+  stat(BENCH_DIR "/" BENCH_FILE, &statbuf);
+  double seconds = (best > 0 ? best : 1) / 1000.0;
+  printf("keys: %ld, rdb size: %.1f MB, best of %d: %lld ms, %.1f MB/s, %.0f keys/s\n", keys,
+         statbuf.st_size / 1e6, runs, best, statbuf.st_size / 1e6 / seconds, keys / seconds);
+
+  unlink(BENCH_DIR "/" BENCH_FILE);
+  rmdir(BENCH_DIR);
+  redis_db_destroy(db);
+  return EXIT_SUCCESS;
+}
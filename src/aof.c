@@ -0,0 +1,591 @@
+#include "aof.h"
+#include "client.h"
+#include "command_handler.h"
+#include "commands.h"
+#include "database.h"
+#include "rdb.h"
+#include "replication.h"
+#include "resp.h"
+#include "server_config.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+Append-only file. Every command that changed the dataset is appended to the file in the RESP form
+it is propagated to the replicas with, so replaying the file rebuilds the dataset. Commands are
+collected in a buffer and written once per event loop iteration. How often the written bytes are
+forced to disk depends on appendfsync: always fsyncs before the reply is sent, everysec leaves the
+fsync to a background thread once per second and no leaves it to the kernel.
+
+A rewrite compacts the AOF: a forked child writes the dataset as an RDB snapshot, the preamble of
+the new AOF, while the parent keeps the commands it executes meanwhile in a rewrite buffer. Once
+the child exited the buffer is appended as the tail of the new file, which then replaces the old
+one. Loading maps the preamble with the RDB loader and only replays the tail.
+*/
+
+#define AOF_MAX_WRITE_DELAY_MS 2000 // longest a write waits for the background fsync to finish
+
+static int aof_fd = -1; // -1 while the AOF is closed
+static char *aof_buf = NULL;
+static size_t aof_buf_len = 0;
+static size_t aof_buf_capacity = 0;
+static long long aof_postponed_since = 0; // when a write started waiting for the fsync, 0 if none
+static unsigned long long aof_current_size = 0;
+static unsigned long long aof_base_size = 0; // size right after the last rewrite
+
+static pid_t aof_child_pid = -1; // -1 when no rewrite is running
+static bool aof_rewrite_scheduled = false;
+// commands executed while the child writes the preamble, they become the tail of the new AOF
+static char *aof_rewrite_buf = NULL;
+static size_t aof_rewrite_buf_len = 0;
+static size_t aof_rewrite_buf_capacity = 0;
+
+static pthread_t fsync_thread;
+static bool fsync_thread_started = false;
+static pthread_mutex_t fsync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fsync_cond = PTHREAD_COND_INITIALIZER;
+static bool fsync_pending = false; // bytes were written since the last fsync
+static bool fsync_in_progress = false;
+static bool fsync_stop = false;
+static int fsync_close_fd = -1; // replaced AOF the fsync thread closes, -1 if none
+
+/*
+Fsyncs the AOF once per second while the main thread keeps writing to it. It also closes the file
+a rewrite replaced: closing the last descriptor of the unlinked file frees its blocks, which can
+take long for a large file.
+*/
+static void *fsync_thread_main(void *arg) {
+  pthread_mutex_lock(&fsync_mutex);
+  while (!fsync_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&fsync_cond, &fsync_mutex, &deadline);
+    if (fsync_close_fd != -1) {
+      int fd = fsync_close_fd;
+      fsync_close_fd = -1;
+      pthread_mutex_unlock(&fsync_mutex);
+      close(fd);
+      pthread_mutex_lock(&fsync_mutex);
+    }
+    if (fsync_stop || !fsync_pending) continue;
+
+    // read under the lock, a rewrite swaps the file
+    int fd = aof_fd;
+    fsync_pending = false;
+    fsync_in_progress = true;
+    pthread_mutex_unlock(&fsync_mutex);
+    if (fdatasync(fd) == -1) {
+      perror("failed to fsync the append only file");
+    }
+    pthread_mutex_lock(&fsync_mutex);
+    fsync_in_progress = false;
+  }
+  if (fsync_close_fd != -1) {
+    close(fsync_close_fd);
+    fsync_close_fd = -1;
+  }
+  pthread_mutex_unlock(&fsync_mutex);
+  return NULL;
+}
+
+// appends len bytes of data to a buffer that grows by doubling
+static void buffer_append(char **buf, size_t *buf_len, size_t *capacity, const char *data,
+                          size_t len) {
+  if (*buf_len + len > *capacity) {
+    size_t new_capacity = *capacity ? *capacity : 4096;
+    while (new_capacity < *buf_len + len) new_capacity *= 2;
+    char *grown = realloc(*buf, new_capacity);
+    if (!grown) {
+      perror("memory realloc failed for the append only file buffer");
+      exit(EXIT_FAILURE);
+    }
+    *buf = grown;
+    *capacity = new_capacity;
+  }
+  memcpy(*buf + *buf_len, data, len);
+  *buf_len += len;
+}
+
+// writes as much of buf as possible, returns the number of bytes written
+static size_t write_all(int fd, const char *buf, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    ssize_t n = write(fd, buf + written, len - written);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror("failed to write to the append only file");
+      break;
+    }
+    written += n;
+  }
+  return written;
+}
+
+// the rewritten AOF is written to a file named after the child and renamed once complete
+static char *temp_rewrite_file_path(const char *dir, pid_t pid) {
+  char filename[48];
+  snprintf(filename, sizeof(filename), "temp-rewriteaof-bg-%d.aof", (int)pid);
+  return construct_file_path(dir, filename);
+}
+
+/*
+Opens the AOF for appending, creating it when it does not exist. With appendfsync everysec the
+background thread that fsyncs it is started too.
+*/
+bool aof_open(const char *dir, const char *filename) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    perror("failed to create directory for the append only file");
+    return false;
+  }
+  char *path = construct_file_path(dir, filename);
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  free(path);
+  if (fd == -1) {
+    perror("failed to open the append only file");
+    return false;
+  }
+  struct stat statbuf;
+  aof_current_size = fstat(fd, &statbuf) == 0 ? statbuf.st_size : 0;
+  aof_base_size = aof_current_size;
+  aof_fd = fd;
+
+  if (g_server_config.appendfsync == AOF_FSYNC_EVERYSEC) {
+    fsync_stop = false;
+    if (pthread_create(&fsync_thread, NULL, fsync_thread_main, NULL) != 0) {
+      perror("failed to create the append only file fsync thread");
+      close(aof_fd);
+      aof_fd = -1;
+      return false;
+    }
+    fsync_thread_started = true;
+  }
+  return true;
+}
+
+/*
+Writes what is still buffered, stops the fsync thread and closes the AOF after a final fsync.
+*/
+void aof_close() {
+  if (aof_fd == -1) return;
+
+  if (fsync_thread_started) {
+    pthread_mutex_lock(&fsync_mutex);
+    fsync_stop = true;
+    pthread_cond_signal(&fsync_cond);
+    pthread_mutex_unlock(&fsync_mutex);
+    pthread_join(fsync_thread, NULL);
+    fsync_thread_started = false;
+  }
+  aof_flush();
+  if (fdatasync(aof_fd) == -1) {
+    perror("failed to fsync the append only file");
+  }
+  close(aof_fd);
+  aof_fd = -1;
+  free(aof_buf);
+  aof_buf = NULL;
+  aof_buf_len = 0;
+  aof_buf_capacity = 0;
+}
+
+// whether propagated commands are recorded, by the open AOF or for a running rewrite
+bool aof_enabled() { return aof_fd != -1 || aof_child_pid != -1; }
+
+bool aof_rewrite_in_progress() { return aof_child_pid != -1; }
+
+static const char *aof_fsync_policy_names[] = {
+    [AOF_FSYNC_EVERYSEC] = "everysec",
+    [AOF_FSYNC_ALWAYS] = "always",
+    [AOF_FSYNC_NO] = "no",
+};
+
+const char *aof_fsync_policy_name(aof_fsync_policy_t policy) {
+  return aof_fsync_policy_names[policy];
+}
+
+// returns ERR_VALUE when name is not a known policy
+int parse_aof_fsync_policy(const char *name, aof_fsync_policy_t *policy) {
+  for (size_t i = 0; i < sizeof(aof_fsync_policy_names) / sizeof(aof_fsync_policy_names[0]); i++) {
+    if (strcasecmp(name, aof_fsync_policy_names[i]) == 0) {
+      *policy = (aof_fsync_policy_t)i;
+      return ERR_NONE;
+    }
+  }
+  return ERR_VALUE;
+}
+
+/*
+Appends a command to the AOF buffer. With appendfsync always it is written and fsynced right away,
+so the reply to the command is only sent once the command is on disk.
+*/
+void aof_feed(const char *buf, size_t len) {
+  if (aof_child_pid != -1) {
+    buffer_append(&aof_rewrite_buf, &aof_rewrite_buf_len, &aof_rewrite_buf_capacity, buf, len);
+  }
+  if (aof_fd == -1) return;
+
+  buffer_append(&aof_buf, &aof_buf_len, &aof_buf_capacity, buf, len);
+  if (g_server_config.appendfsync == AOF_FSYNC_ALWAYS) aof_flush();
+}
+
+/*
+Writes the buffered commands to the AOF, called once per event loop iteration. With everysec a
+write is postponed while the background fsync runs, because the kernel may block it until the
+fsync finished, but for no longer than AOF_MAX_WRITE_DELAY_MS.
+*/
+void aof_flush() {
+  if (aof_fd == -1 || aof_buf_len == 0) return;
+
+  if (fsync_thread_started) {
+    pthread_mutex_lock(&fsync_mutex);
+    bool busy = fsync_in_progress;
+    pthread_mutex_unlock(&fsync_mutex);
+    if (busy) {
+      long long now = current_time_millis();
+      if (aof_postponed_since == 0) aof_postponed_since = now;
+      if (now - aof_postponed_since < AOF_MAX_WRITE_DELAY_MS) return;
+    }
+    aof_postponed_since = 0;
+  }
+
+  size_t written = write_all(aof_fd, aof_buf, aof_buf_len);
+  aof_current_size += written;
+  // whatever could not be written is retried on the next flush
+  memmove(aof_buf, aof_buf + written, aof_buf_len - written);
+  aof_buf_len -= written;
+
+  switch (g_server_config.appendfsync) {
+  case AOF_FSYNC_ALWAYS:
+    // replying would acknowledge writes that may be lost
+    if (aof_buf_len > 0 || fdatasync(aof_fd) == -1) {
+      perror("failed to persist the append only file");
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case AOF_FSYNC_EVERYSEC:
+    if (written == 0) break;
+    pthread_mutex_lock(&fsync_mutex);
+    fsync_pending = true;
+    pthread_mutex_unlock(&fsync_mutex);
+    break;
+  case AOF_FSYNC_NO:
+    break;
+  }
+}
+
+/*
+Writes the whole dataset to the AOF as an RDB preamble. Used when the AOF is enabled for a dataset
+that was loaded from the RDB file, so the AOF alone rebuilds it on the next start.
+*/
+void aof_write_dataset(redis_db_t *db) {
+  if (aof_fd == -1) return;
+
+  aof_flush();
+  struct stat statbuf;
+  if (!rdb_save_to_fd(db, aof_fd) || fdatasync(aof_fd) == -1) {
+    perror("failed to write the dataset to the append only file");
+  }
+  aof_current_size = fstat(aof_fd, &statbuf) == 0 ? statbuf.st_size : aof_current_size;
+  aof_base_size = aof_current_size;
+}
+
+/*
+Forks a child that writes the dataset as the RDB preamble of a new AOF. Only one child runs at a
+time, so this returns false while a background save or rewrite runs, or when the fork failed.
+*/
+bool aof_rewrite_background(redis_db_t *db) {
+  if (aof_rewrite_in_progress() || rdb_background_save_in_progress()) return false;
+  if (mkdir(g_server_config.dir, 0755) != 0 && errno != EEXIST) {
+    perror("failed to create directory for the append only file");
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork failed");
+    return false;
+  }
+  if (pid == 0) {
+    char *temp_path = temp_rewrite_file_path(g_server_config.dir, getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd != -1 && rdb_save_to_fd(db, fd) && fsync(fd) == 0;
+    _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  printf("# Background append only file rewriting started by pid %d\n", (int)pid);
+  aof_child_pid = pid;
+  aof_rewrite_scheduled = false;
+  aof_rewrite_buf_len = 0;
+  return true;
+}
+
+// starts a rewrite from the server cron once the running background save finished
+void aof_schedule_rewrite() { aof_rewrite_scheduled = true; }
+
+/*
+Completes the rewrite of the child that exited: appends the commands executed meanwhile to the
+preamble it wrote, moves the new file into place and appends to it from now on.
+*/
+static bool aof_install_rewrite(pid_t pid) {
+  char *temp_path = temp_rewrite_file_path(g_server_config.dir, pid);
+  char *path = construct_file_path(g_server_config.dir, g_server_config.appendfilename);
+  int fd = open(temp_path, O_WRONLY | O_APPEND);
+  bool installed = fd != -1 &&
+                   write_all(fd, aof_rewrite_buf, aof_rewrite_buf_len) == aof_rewrite_buf_len &&
+                   fdatasync(fd) == 0 && rename(temp_path, path) == 0;
+  free(path);
+  if (!installed) {
+    perror("failed to install the rewritten append only file");
+    if (fd != -1) close(fd);
+    unlink(temp_path);
+    free(temp_path);
+    return false;
+  }
+  free(temp_path);
+
+  struct stat statbuf;
+  unsigned long long size = fstat(fd, &statbuf) == 0 ? statbuf.st_size : 0;
+  if (aof_fd == -1) {
+    close(fd);
+    return true;
+  }
+
+  // the commands still buffered for the old file are part of the tail
+  aof_buf_len = 0;
+  aof_postponed_since = 0;
+  pthread_mutex_lock(&fsync_mutex);
+  int old_fd = aof_fd;
+  aof_fd = fd;
+  fsync_pending = false;
+  if (fsync_thread_started && fsync_close_fd == -1) {
+    fsync_close_fd = old_fd;
+    old_fd = -1;
+    pthread_cond_signal(&fsync_cond);
+  }
+  pthread_mutex_unlock(&fsync_mutex);
+  if (old_fd != -1) close(old_fd);
+
+  aof_current_size = size;
+  aof_base_size = size;
+  return true;
+}
+
+// whether the AOF grew enough since the last rewrite to rewrite it on its own
+static bool aof_should_auto_rewrite() {
+  if (aof_fd == -1 || g_server_config.auto_aof_rewrite_percentage == 0 ||
+      aof_current_size < g_server_config.auto_aof_rewrite_min_size) {
+    return false;
+  }
+  unsigned long long base = aof_base_size ? aof_base_size : 1;
+  unsigned long long growth =
+      aof_current_size > base ? (aof_current_size - base) * 100 / base : 0;
+  return growth >= (unsigned long long)g_server_config.auto_aof_rewrite_percentage;
+}
+
+/*
+Reaps the rewrite child once it exited and installs its file, called from the server cron. Starts
+a scheduled or automatic rewrite while no child runs.
+*/
+void aof_check_background_rewrite(redis_db_t *db) {
+  if (!aof_rewrite_in_progress()) {
+    if (!rdb_background_save_in_progress() &&
+        (aof_rewrite_scheduled || aof_should_auto_rewrite())) {
+      aof_rewrite_background(db);
+    }
+    return;
+  }
+
+  int status;
+  pid_t pid = waitpid(aof_child_pid, &status, WNOHANG);
+  if (pid == 0) return; // still running
+  if (pid == -1) perror("waitpid failed");
+
+  bool written = pid != -1 && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+  if (written && aof_install_rewrite(aof_child_pid)) {
+    printf("# Background AOF rewrite finished successfully\n");
+  } else {
+    fprintf(stderr, "# Background AOF rewrite error\n");
+    char *temp_path = temp_rewrite_file_path(g_server_config.dir, aof_child_pid);
+    unlink(temp_path);
+    free(temp_path);
+  }
+  aof_child_pid = -1;
+  free(aof_rewrite_buf);
+  aof_rewrite_buf = NULL;
+  aof_rewrite_buf_len = 0;
+  aof_rewrite_buf_capacity = 0;
+
+  // replicas that arrived during the rewrite get their snapshot now
+  replication_start_waiting_bgsave();
+}
+
+/*
+Stops a running rewrite and removes its partial file, e.g. on shutdown.
+*/
+void aof_kill_background_rewrite() {
+  if (!aof_rewrite_in_progress()) return;
+
+  kill(aof_child_pid, SIGKILL);
+  waitpid(aof_child_pid, NULL, 0);
+  char *temp_path = temp_rewrite_file_path(g_server_config.dir, aof_child_pid);
+  unlink(temp_path);
+  free(temp_path);
+  aof_child_pid = -1;
+  free(aof_rewrite_buf);
+  aof_rewrite_buf = NULL;
+  aof_rewrite_buf_len = 0;
+  aof_rewrite_buf_capacity = 0;
+}
+
+/*
+Reads a "<prefix><number>\r\n" line. Returns 1 if it was read, 0 if the file ends before the line
+does and -1 if the line is invalid.
+*/
+static int aof_read_number(const char **p, const char *end, char prefix, long long *number) {
+  const char *s = *p;
+  if (s == end) return 0;
+  if (*s++ != prefix) return -1;
+
+  long long value = 0;
+  const char *digits = s;
+  while (s < end && *s >= '0' && *s <= '9') {
+    if (value > (LLONG_MAX - 9) / 10) return -1;
+    value = value * 10 + (*s++ - '0');
+  }
+  if (end - s < 2) return 0;
+  if (s == digits || s[0] != '\r' || s[1] != '\n') return -1;
+  *number = value;
+  *p = s + 2;
+  return 1;
+}
+
+/*
+Finds the end of the command that starts at p. Returns 1 and sets command_end if the command is
+complete, 0 if the file ends in the middle of it and -1 if it is not a RESP array of bulk strings.
+*/
+static int aof_command_end(const char *p, const char *end, const char **command_end) {
+  long long argc;
+  int status = aof_read_number(&p, end, '*', &argc);
+  if (status != 1) return status;
+  for (long long i = 0; i < argc; i++) {
+    long long len;
+    if ((status = aof_read_number(&p, end, '$', &len)) != 1) return status;
+    if (end - p < len + 2) return 0;
+    if (p[len] != '\r' || p[len + 1] != '\n') return -1;
+    p += len + 2;
+  }
+  *command_end = p;
+  return 1;
+}
+
+// drops the replies of the replayed commands, nobody reads them
+static void discard_output(Client *client) {
+  char *buf;
+  size_t len;
+  while (rb_readable(client->output_buffer, &buf, &len) == 0 && len > 0) {
+    client_release_output(client, len);
+  }
+}
+
+/*
+Rebuilds the dataset from the AOF: the RDB preamble a rewrite left is loaded with the RDB loader,
+then the commands following it are executed. A command that was cut off because the server
+stopped while writing it is dropped and the file is truncated before it, so appending continues
+behind the last complete command. Returns -1 if the file can not be opened, 1 if it is
+malformed and 0 otherwise.
+*/
+int aof_load_data_from_file(redis_db_t *db, const char *dir, const char *filename) {
+  char *path = construct_file_path(dir, filename);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    free(path);
+    return -1;
+  }
+
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) != 0) {
+    perror("failed to stat the append only file");
+    close(fd);
+    free(path);
+    return 1;
+  }
+  size_t size = statbuf.st_size;
+  if (size == 0) {
+    close(fd);
+    free(path);
+    return 0;
+  }
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping keeps the file open
+  if (mapping == MAP_FAILED) {
+    perror("failed to map the append only file");
+    free(path);
+    return 1;
+  }
+  madvise(mapping, size, MADV_SEQUENTIAL);
+
+  const char *p = mapping;
+  const char *end = p + size;
+  size_t preamble_len = 0;
+  if (size >= 5 && memcmp(p, "REDIS", 5) == 0 &&
+      !rdb_load_from_buffer(db, mapping, size, &preamble_len)) {
+    fprintf(stderr, "bad RDB preamble in the append only file\n");
+    munmap(mapping, size);
+    free(path);
+    return 1;
+  }
+  p += preamble_len;
+
+  Client *client = create_client(-1);
+  if (!client) {
+    munmap(mapping, size);
+    free(path);
+    return 1;
+  }
+  client->type = CLIENT_TYPE_REGULAR;
+  client->should_reply = false;
+  select_client_db(client, db);
+  parser_init(client->parser, create_command_handler(client, 256, 10));
+
+  // the replayed commands are already in the AOF and the replicas sync from the dataset
+  g_server_info.loading = true;
+  const char *command_end;
+  int status = 1;
+  while (p < end && (status = aof_command_end(p, end, &command_end)) == 1) {
+    parser_parse(client->parser, p, command_end);
+    discard_output(client);
+    p = command_end;
+  }
+  g_server_info.loading = false;
+  destroy_client(client);
+
+  size_t loaded = p - (const char *)mapping;
+  munmap(mapping, size);
+  if (status == -1) {
+    fprintf(stderr, "bad command in the append only file at offset %zu\n", loaded);
+    free(path);
+    return 1;
+  }
+  if (loaded < size) {
+    printf("# The append only file is truncated, dropping the last %zu bytes\n", size - loaded);
+    if (truncate(path, loaded) != 0) {
+      perror("failed to truncate the append only file");
+    }
+  }
+  free(path);
+  return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef AOF_H
+#define AOF_H
+
+#include "client.h"
+#include "database.h"
+#include "server_config.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+bool aof_open(const char *dir, const char *filename);
+void aof_close();
+bool aof_enabled();
+const char *aof_fsync_policy_name(aof_fsync_policy_t policy);
+int parse_aof_fsync_policy(const char *name, aof_fsync_policy_t *policy);
+void aof_feed(const char *buf, size_t len);
+void aof_flush();
+void aof_write_dataset(redis_db_t *db);
+bool aof_rewrite_in_progress();
+bool aof_rewrite_background(redis_db_t *db);
+void aof_schedule_rewrite();
+void aof_check_background_rewrite(redis_db_t *db);
+void aof_kill_background_rewrite();
+int aof_load_data_from_file(redis_db_t *db, const char *dir, const char *filename);
+
+#endif // AOF_H
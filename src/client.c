@@ -1,5 +1,7 @@
 #include "client.h"
+#include "command_handler.h"
 #include "database.h"
+#include "event_loop.h"
 #include "redis-server.h"
 #include "replication.h"
 #include "server_config.h"
@@ -7,6 +9,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -23,10 +26,39 @@ Client *create_client(int fd) {
   client->rdb_received_bytes = 0;
   client->rdb_file_size = 0;
   client->rdb_file_offset = 0;
+  client->rdb_fd = -1;
+  client->repl_preamble_len = 0;
+  client->repl_wait_start = 0;
+  client->repl_listening_port = 0;
+  client->repl_ack_offset = 0;
+  client->repl_ack_time = 0;
+  client->repl_ack_requested = false;
+  client->repl_last_io = 0;
+  client->psync_replid[0] = '\0';
+  client->psync_offset = -1;
+  client->repl_pending = NULL;
+  client->repl_pending_len = 0;
+  client->repl_pending_capacity = 0;
+  client->repl_block = NULL;
+  client->repl_block_pos = 0;
   client->tmp_rdb_fp = NULL;
   client->should_propogate_command = false;
   client->should_reply = true;
   client->epoll_events = 0;
+  client->pending_read = false;
+  client->close_asap = false;
+  client->blocked = false;
+  client->wait_offset = 0;
+  client->wait_replicas = 0;
+  client->wait_deadline = 0;
+  client->io_flags = 0;
+  client->io_refs = 0;
+  client->io_poll_events = 0;
+  client->destroy_pending = false;
+  client->input_spill = NULL;
+  client->input_spill_len = 0;
+  client->output_spill = NULL;
+  client->output_spill_len = 0;
 
   // create a ring buffer of 64KB (adjust size as needed)
   if (rb_create(RING_BUFFER_SIZE, &client->input_buffer) != 0 ||
@@ -52,7 +84,16 @@ Client *create_client(int fd) {
 void select_client_db(Client *client, redis_db_t *db) { client->db = db; }
 
 void destroy_client(Client *client) {
+  if (client->io_refs > 0) {
+    // io_uring requests still point at the client, the event loop destroys it once they completed
+    client->destroy_pending = true;
+    return;
+  }
   close(client->fd);
+  if (client->tmp_rdb_fp) fclose(client->tmp_rdb_fp);
+  free(client->repl_pending);
+  free(client->input_spill);
+  free(client->output_spill);
   rb_destroy(client->input_buffer);
   rb_destroy(client->output_buffer);
   destroy_command_handler(client->parser->command_handler);
@@ -64,6 +105,9 @@ size_t flush_client_output(Client *client) {
   char *output_buf;
   size_t readable_len;
 
+  // with io_uring the output of regular clients is sent by the event loop
+  if (event_loop_queue_send(g_event_loop, client)) return 0;
+
   size_t total_bytes_sent = 0;
   // get the readable portion of the ring buffer
   while (1) {
@@ -94,7 +138,7 @@ size_t flush_client_output(Client *client) {
       break; // Exit if nothing was sent
     }
 
-    if (rb_read(client->output_buffer, bytes_sent) != 0) {
+    if (client_release_output(client, bytes_sent) != 0) {
       fprintf(stderr, "failed to update read index for client output buffer\n");
     }
 
@@ -103,6 +147,155 @@ size_t flush_client_output(Client *client) {
   return total_bytes_sent;
 }
 
+/*
+Appends received bytes to the client's input buffer. Whatever does not fit is kept aside until the
+parser made room for it.
+*/
+void client_append_input(Client *client, const char *buf, size_t len) {
+  char *write_buf;
+  size_t writable_len;
+
+  if (client->input_spill_len == 0 &&
+      rb_writable(client->input_buffer, &write_buf, &writable_len) == 0) {
+    size_t copy_len = len < writable_len ? len : writable_len;
+    memcpy(write_buf, buf, copy_len);
+    rb_write(client->input_buffer, copy_len);
+    buf += copy_len;
+    len -= copy_len;
+  }
+  if (len == 0) return;
+
+  char *spill = realloc(client->input_spill, client->input_spill_len + len);
+  if (!spill) {
+    perror("memory realloc failed for client input");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(spill + client->input_spill_len, buf, len);
+  client->input_spill = spill;
+  client->input_spill_len += len;
+}
+
+// moves as much of the spilled input as fits into the input buffer
+static void move_input_spill(Client *client) {
+  char *write_buf;
+  size_t writable_len;
+
+  if (client->input_spill_len == 0 ||
+      rb_writable(client->input_buffer, &write_buf, &writable_len) != 0 || writable_len == 0) {
+    return;
+  }
+  size_t copy_len = client->input_spill_len < writable_len ? client->input_spill_len : writable_len;
+  memcpy(write_buf, client->input_spill, copy_len);
+  rb_write(client->input_buffer, copy_len);
+  client->input_spill_len -= copy_len;
+  memmove(client->input_spill, client->input_spill + copy_len, client->input_spill_len);
+  if (client->input_spill_len == 0) {
+    free(client->input_spill);
+    client->input_spill = NULL;
+  }
+}
+
+/*
+Appends reply bytes to the client's output buffer. Whatever does not fit is kept aside in order and
+moved there as the buffer is sent from, so a reply is never cut short.
+*/
+void client_append_output(Client *client, const char *buf, size_t len) {
+  char *write_buf;
+  size_t writable_len;
+
+  if (client->output_spill_len == 0 &&
+      rb_writable(client->output_buffer, &write_buf, &writable_len) == 0) {
+    size_t copy_len = len < writable_len ? len : writable_len;
+    memcpy(write_buf, buf, copy_len);
+    rb_write(client->output_buffer, copy_len);
+    buf += copy_len;
+    len -= copy_len;
+  }
+  if (len == 0) return;
+
+  char *spill = realloc(client->output_spill, client->output_spill_len + len);
+  if (!spill) {
+    perror("memory realloc failed for client output");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(spill + client->output_spill_len, buf, len);
+  client->output_spill = spill;
+  client->output_spill_len += len;
+}
+
+/*
+Releases len bytes that were sent from the client's output buffer and moves as much of the spilled
+output as fits into the room they left.
+*/
+int client_release_output(Client *client, size_t len) {
+  char *write_buf;
+  size_t writable_len;
+
+  if (rb_read(client->output_buffer, len) != 0) return -1;
+  if (client->output_spill_len == 0 ||
+      rb_writable(client->output_buffer, &write_buf, &writable_len) != 0 || writable_len == 0) {
+    return 0;
+  }
+  size_t copy_len =
+      client->output_spill_len < writable_len ? client->output_spill_len : writable_len;
+  memcpy(write_buf, client->output_spill, copy_len);
+  rb_write(client->output_buffer, copy_len);
+  client->output_spill_len -= copy_len;
+  memmove(client->output_spill, client->output_spill + copy_len, client->output_spill_len);
+  if (client->output_spill_len == 0) {
+    free(client->output_spill);
+    client->output_spill = NULL;
+  }
+  return 0;
+}
+
+/*
+Parses everything that is readable in the client's input buffer and releases the parsed bytes.
+Depending on the command handler, complete commands are either executed or queued.
+*/
+static size_t parse_client_input(Client *client) {
+  size_t total_parsed = 0;
+
+  for (;;) {
+    move_input_spill(client);
+
+    char *read_buf;
+    size_t readable_len;
+
+    // get the readable portion of the ring buffer
+    if (rb_readable(client->input_buffer, &read_buf, &readable_len) != 0) {
+      fprintf(stderr, "failed to get readable buffer\n");
+      return total_parsed;
+    }
+
+    const char *begin = read_buf;
+    const char *end = read_buf + readable_len;
+
+    // arguments of whole bulk strings are borrowed from the input buffer instead of copied. The
+    // master's stream is fed on as it was received, so it is left intact
+    CommandHandler *ch = client->parser->command_handler;
+    if (ch) ch->borrow_input = client->type != CLIENT_TYPE_MASTER;
+    size_t bytes_parsed = parser_parse(client->parser, begin, end) - begin;
+    if (ch) command_handler_release_input(ch);
+
+    if (client->type == CLIENT_TYPE_MASTER && client->repl_client_state == REPL_STATE_READY) {
+      // client is a master and it is either doing a partial sync or propogating commands, the
+      // replica advances its offset by the commands it ran
+      replication_feed_master_stream(client, begin, bytes_parsed, client->parser->value_end);
+    }
+
+    if (rb_read(client->input_buffer, bytes_parsed)) {
+      fprintf(stderr, "failed to update read index\n");
+    }
+    total_parsed += bytes_parsed;
+
+    // keep going while spilled input is waiting for the room the parser just made
+    if (client->input_spill_len == 0 || bytes_parsed == 0 || client->blocked) {
+      return total_parsed;
+    }
+  }
+}
+
 void process_client_input(Client *client) {
   for (;;) {
 
@@ -145,121 +338,128 @@ void process_client_input(Client *client) {
       }
     }
 
-    char *read_buf;
-    size_t readable_len;
+    parse_client_input(client);
 
-    // get the readable portion of the ring buffer
-    if (rb_readable(client->input_buffer, &read_buf, &readable_len) != 0) {
-      fprintf(stderr, "failed to get readable buffer\n");
+    if (client->blocked) {
+      // stop reading until the blocking command completes, the unparsed input stays buffered
+      client_disable_read_events(client);
+      flush_client_output(client);
       return;
     }
 
-    const char *begin = read_buf;
-    const char *end = read_buf + readable_len;
+    if (bytes_received < writable_len) {
+      flush_client_output(client);
+      return;
+    }
+  }
+}
 
-    size_t bytes_parsed = parser_parse(client->parser, begin, end) - begin;
+/*
+Handles input the io_uring backend already received into the client's input buffer.
+*/
+void process_client_received_input(Client *client) {
+  parse_client_input(client);
+  if (client->blocked) {
+    // stop receiving until the blocking command completes, the unparsed input stays buffered
+    client_disable_read_events(client);
+  }
+  flush_client_output(client);
+}
 
-    if (g_server_info.role == ROLE_SLAVE && client->type == CLIENT_TYPE_MASTER &&
-        client->type == REPL_STATE_READY) {
-      // client is a master and it is either doing a partial sync or propogating commands
-      g_server_info.master_repl_offset += bytes_parsed; // the replica advances its offset
-    }
+/*
+Resumes a client after its blocking command completed: runs the commands that were buffered or
+queued behind it and starts reading from the socket again.
+*/
+void unblock_client(Client *client) {
+  client->blocked = false;
+  client->wait_offset = 0;
+  client->wait_replicas = 0;
+  client->wait_deadline = 0;
+  if (client->close_asap) {
+    destroy_client(client);
+    return;
+  }
 
-    // todo add support for a replica propogating to a replica
-    if (client->should_propogate_command) {
-      // this is a write command, propogate it
-      g_server_info.master_repl_offset += bytes_parsed; // advance the masters offset
-      ring_buffer repl_backlog = g_server_info.repl_backlog;
-      char *repl_backlog_write_buf;
-      size_t repl_backlog_writable_len;
-
-      if (rb_writable(g_server_info.repl_backlog, &repl_backlog_write_buf,
-                      &repl_backlog_writable_len) != 0) {
-        perror("failed to get writable buffer");
-      }
+  // the commands a deferred parse queued behind the blocking one run first
+  CommandHandler *ch = client->parser->command_handler;
+  if (ch) execute_pending_commands(ch);
+  if (!client->blocked) {
+    parse_client_input(client);
+    if (ch) execute_pending_commands(ch);
+  }
+  flush_client_output(client);
+  if (!client->blocked) {
+    client_enable_read_events(client);
+  }
 
-      if (bytes_parsed <= repl_backlog_writable_len) {
-        // can copy bytes into repl backlog without overwriting
-        memcpy(repl_backlog_write_buf, client->input_buffer, bytes_parsed);
-        if (rb_write(repl_backlog, bytes_parsed) != 0) {
-          fprintf(stderr, "failed to update write index for replication backlog");
-        }
-      } else {
-        // we have to overwrite some bytes, advance the read pointer that many bytes
-        // then write the bytes parsed
-        size_t bytes_to_overwrite = bytes_parsed - repl_backlog_writable_len;
-        if (rb_read(repl_backlog, bytes_to_overwrite) != 0) {
-          fprintf(stderr, "failed to update read index for replication backlog by %ld bytes",
-                  bytes_to_overwrite);
-        }
-        g_server_info.repl_backlog_base_offset += bytes_to_overwrite;
-
-        memcpy(repl_backlog_write_buf, client->input_buffer, bytes_parsed);
-
-        if (rb_write(repl_backlog, bytes_parsed) != 0) {
-          fprintf(stderr, "failed to update write index for replication backlog");
-          exit(EXIT_FAILURE);
-        }
-      }
+  char *output_buf;
+  size_t output_len;
+  if (rb_readable(client->output_buffer, &output_buf, &output_len) == 0 && output_len > 0) {
+    client_enable_write_events(client);
+  }
+}
 
-      // for each replica, copy to the replica's output buffer
-      // and enable epoll to monitor for EPOLLOUT
-      for (int i = 0; i < g_server_info.num_replicas; i++) {
-        Client *replica_client = g_server_info.replicas[i];
-        if (replica_client != NULL) {
-          char *replica_output_write_buf;
-          size_t replica_output_writable_len;
-
-          if (rb_writable(replica_client->output_buffer, &replica_output_write_buf,
-                          &replica_output_writable_len) != 0) {
-            fprintf(stderr, "failed to get writable buffer for replica %d's output buffer.\n",
-                    replica_client->fd);
-            handle_client_disconnection(client);
-            continue;
-          }
-
-          // only copy it if we can fit it
-          if (bytes_parsed <= replica_output_writable_len) {
-            memcpy(replica_output_write_buf, begin, bytes_parsed);
-          } else {
-            // we can't fit the bytes into the replica's output buffer, disconnect
-            fprintf(
-                stderr,
-                "can't fit bytes parsed into replica %d's output buffer, disconnecting replica\n",
-                client->fd);
-            handle_client_disconnection(client);
-            continue;
-          }
-
-          if (rb_write(replica_client->output_buffer, bytes_parsed) != 0) {
-            fprintf(stderr, "failed to update write index for replica %d's output buffer.\n",
-                    replica_client->fd);
-
-            continue;
-          }
-
-          client_enable_write_events(replica_client);
-        }
+/*
+Reads everything available on the client's socket and parses it, queueing complete commands on
+the client's command handler instead of executing them. Safe to call from an I/O thread: it only
+touches the client's own buffers, parser and command handler. Returns -1 if the connection was
+closed or errored, in which case close_asap is set and the main thread disconnects the client.
+*/
+int client_read_and_parse(Client *client) {
+  for (;;) {
+    char *write_buf;
+    size_t writable_len;
+
+    if (rb_writable(client->input_buffer, &write_buf, &writable_len) != 0) {
+      fprintf(stderr, "failed to get writable buffer\n");
+      return 0;
+    }
+
+    if (writable_len == 0) {
+      fprintf(stderr, "input buffer full\n");
+      return 0;
+    }
+
+    ssize_t bytes_received = read(client->fd, write_buf, writable_len);
+    if (bytes_received == -1) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EWOULDBLOCK) {
+        return 0;
       }
+      perror("failed to read from client socket");
+      client->close_asap = true;
+      return -1;
+    } else if (bytes_received == 0) {
+      client->close_asap = true;
+      return -1;
     }
 
-    if (rb_read(client->input_buffer, bytes_parsed)) {
-      fprintf(stderr, "failed to update read index\n");
-      return;
+    if (rb_write(client->input_buffer, bytes_received) != 0) {
+      fprintf(stderr, "failed to update write index\n");
+      return 0;
     }
 
+    parse_client_input(client);
+
     if (bytes_received < writable_len) {
-      flush_client_output(client);
-      return;
+      return 0;
     }
   }
 }
 
 void handle_client_disconnection(Client *client) {
-  epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  event_loop_remove_client(g_event_loop, client);
+  if (client->blocked) {
+    // something still holds on to the client, it is destroyed once it is unblocked
+    client->close_asap = true;
+    return;
+  }
   if (client->type == CLIENT_TYPE_REPLICA) {
     printf("handling replica disconnection");
     remove_replica(client);
+  } else if (client->type == CLIENT_TYPE_MASTER) {
+    replication_handle_master_disconnection(client);
   }
   destroy_client(client);
 }
@@ -269,15 +469,7 @@ void client_enable_read_events(Client *client) {
     fprintf(stderr, "client_enable_read_events: client pointer is null\n");
     return;
   }
-  struct epoll_event event;
-  event.events = client->epoll_events | EPOLLIN;
-  event.data.fd = client->fd;
-  event.data.ptr = client;
-  if (epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
-    perror("epoll_ctl mod failed");
-    exit(EXIT_FAILURE);
-  }
-  client->epoll_events = event.events;
+  event_loop_set_client_events(g_event_loop, client, client->epoll_events | EPOLLIN);
 }
 
 void client_enable_write_events(Client *client) {
@@ -285,15 +477,15 @@ void client_enable_write_events(Client *client) {
     fprintf(stderr, "client_enable_write_events: client pointer is null\n");
     return;
   }
-  struct epoll_event event;
-  event.events = client->epoll_events | EPOLLOUT;
-  event.data.fd = client->fd;
-  event.data.ptr = client;
-  if (epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
-    perror("epoll_ctl mod failed");
-    exit(EXIT_FAILURE);
+  event_loop_set_client_events(g_event_loop, client, client->epoll_events | EPOLLOUT);
+}
+
+void client_disable_read_events(Client *client) {
+  if (!client) {
+    fprintf(stderr, "client_disable_read_events: client pointer is null\n");
+    return;
   }
-  client->epoll_events = event.events;
+  event_loop_set_client_events(g_event_loop, client, client->epoll_events & ~EPOLLIN);
 }
 
 void client_disable_write_events(Client *client) {
@@ -301,13 +493,5 @@ void client_disable_write_events(Client *client) {
     fprintf(stderr, "client_disable_write_events: client pointer is null\n");
     return;
   }
-  struct epoll_event event;
-  event.events = client->epoll_events & ~EPOLLOUT;
-  event.data.fd = client->fd;
-  event.data.ptr = client;
-  if (epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
-    perror("epoll_ctl mod failed");
-    exit(EXIT_FAILURE);
-  }
-  client->epoll_events = event.events;
+  event_loop_set_client_events(g_event_loop, client, client->epoll_events & ~EPOLLOUT);
 }
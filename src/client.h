@@ -8,6 +8,12 @@
 #include <stdio.h>
 
 struct Parser;
+struct repl_block;
+
+// a snapshot streamed without a length is followed by a marker of this many random characters
+#define RDB_EOF_MARK_SIZE 40
+// replication ids are this many random hex characters
+#define REPLID_SIZE 40
 
 typedef enum { CLIENT_TYPE_REGULAR, CLIENT_TYPE_REPLICA, CLIENT_TYPE_MASTER } ClientType;
 
@@ -22,13 +28,15 @@ typedef enum {
   REPL_STATE_RECEIVED_REPLCONF_CAPA_OK,
   REPL_STATE_SENT_PSYNC,
   REPL_STATE_RECEIVED_FULLRESYNC_RESPONSE,
+  REPL_STATE_RECEIVED_CONTINUE,
   REPL_STATE_RECEIVING_RDB_DATA,
   REPL_STATE_READY,
   REPL_STATE_ERROR
 } ReplicaClientState;
 
 typedef enum {
-  MASTER_REPL_STATE_PSYNC,
+  MASTER_REPL_STATE_WAIT_BGSAVE_START, // waits for the running background save to finish
+  MASTER_REPL_STATE_WAIT_BGSAVE_END,   // the snapshot it will be sent is being written
   MASTER_REPL_STATE_SENDING_RDB_DATA,
   MASTER_REPL_STATE_PROPAGATE
 } MasterReplicaState;
@@ -49,18 +57,77 @@ typedef struct Client {
   off_t rdb_file_offset;
   off_t rdb_file_size;
   long long repl_offset; // from the master's perspective, a replica's offset
+  // position of the next byte to send in the shared replication buffer, NULL until the replica
+  // knows where its stream starts
+  struct repl_block *repl_block;
+  size_t repl_block_pos;
+  // sent ahead of the snapshot, the FULLRESYNC reply and later the RDB length. The output buffer
+  // meanwhile collects the replication stream that follows the snapshot
+  char repl_preamble[128];
+  size_t repl_preamble_len;
+  long long repl_wait_start; // when it started waiting for a diskless sync, in milliseconds
+  int repl_listening_port;   // the port the replica accepts connections on, from REPLCONF
+  long long repl_ack_offset; // the offset the replica acknowledged last, by REPLCONF ACK
+  long long repl_ack_time;   // when it did, in milliseconds
 
   // replica specific fields
   ReplicaClientState repl_client_state;
-  long long rdb_expected_bytes;
+  long long rdb_expected_bytes; // -1 when the snapshot ends with rdb_eof_mark instead
   long long rdb_received_bytes;
   long long rdb_written_bytes;
   FILE *tmp_rdb_fp; // temporary file for writing rdb from master
+  char rdb_eof_mark[RDB_EOF_MARK_SIZE];
+  // the last bytes written to the temporary file, the marker may arrive split across reads
+  char rdb_eof_tail[RDB_EOF_MARK_SIZE];
+  // when the master last sent anything, in milliseconds. A link it is silent on for repl_timeout
+  // seconds is dropped
+  long long repl_last_io;
+  // the master asked for an acknowledgement, it is sent once the input read with the request was
+  // processed, so it covers the request
+  bool repl_ack_requested;
+  // the stream the master's PSYNC reply announced, adopted once the replica is in sync with it
+  char psync_replid[REPLID_SIZE + 1];
+  long long psync_offset;
+  // the master's stream parsed since the last complete command, fed on to the replica's own stream
+  // once the command is complete
+  char *repl_pending;
+  size_t repl_pending_len;
+  size_t repl_pending_capacity;
 
   // used to determine whether to propogate commands
   bool should_propogate_command;
   // used to determine whether this client should be replied to
   bool should_reply;
+
+  /* threaded I/O specific fields */
+  // set while the client is queued for an I/O thread to read and parse its input
+  bool pending_read;
+  // set by an I/O thread when the peer closed the connection or the socket errored,
+  // the main thread disconnects the client once its queued commands have run
+  bool close_asap;
+
+  // set while the client waits for the result of a command, e.g. one forwarded to another shard.
+  // the parser stops after the blocking command, so later commands keep their order
+  bool blocked;
+
+  /* WAIT specific fields */
+  long long wait_offset;   // the replication offset the replicas have to acknowledge
+  long long wait_replicas; // the number of replicas that have to acknowledge it
+  long long wait_deadline; // when WAIT times out, in milliseconds, 0 waits forever
+
+  /* io_uring specific fields */
+  int io_flags;       // requests the io_uring backend has in flight for the client
+  int io_refs;        // io_uring requests that still point at the client
+  int io_poll_events; // events the in-flight poll request waits for
+  // destroy_client was called while requests were in flight, the event loop destroys the client
+  // once they completed
+  bool destroy_pending;
+  // received bytes that did not fit in the input buffer, moved there once the parser made room
+  char *input_spill;
+  size_t input_spill_len;
+  // reply bytes that did not fit in the output buffer, moved there once it was sent from
+  char *output_spill;
+  size_t output_spill_len;
 } Client;
 
 Client *create_client(int fd);
@@ -68,7 +135,13 @@ void select_client_db(Client *client, redis_db_t *db);
 size_t flush_client_output(Client *client);
 void destroy_client(Client *client);
 void process_client_input(Client *client);
+void process_client_received_input(Client *client);
+void client_append_input(Client *client, const char *buf, size_t len);
+void client_append_output(Client *client, const char *buf, size_t len);
+int client_release_output(Client *client, size_t len);
+int client_read_and_parse(Client *client);
 void handle_client_disconnection(Client *client);
 void client_enable_read_events(Client *client);
+void unblock_client(Client *client);
 
 #endif // CLIENT_H
\ No newline at end of file
@@ -2,118 +2,197 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "command_handler.h"
 #include "commands.h"
 #include "replication.h"
+#include "server_config.h"
+#include "shard.h"
+#include "util.h"
 
 Handler *g_handler = NULL;
 
-CommandType get_command_type(char *command) {
-  if (strcmp(command, "PING") == 0)
-    return CMD_PING;
-  else if (strcmp(command, "ECHO") == 0)
-    return CMD_ECHO;
-  else if (strcmp(command, "SET") == 0)
-    return CMD_SET;
-  else if (strcmp(command, "GET") == 0)
-    return CMD_GET;
-  else if (strcmp(command, "EXIST") == 0)
-    return CMD_EXIST;
-  else if (strcmp(command, "DEL") == 0)
-    return CMD_DEL;
-  else if (strcmp(command, "INCR") == 0)
-    return CMD_INCR;
-  else if (strcmp(command, "DECR") == 0)
-    return CMD_DECR;
-  else if (strcmp(command, "LPUSH") == 0)
-    return CMD_LPUSH;
-  else if (strcmp(command, "RPUSH") == 0)
-    return CMD_RPUSH;
-  else if (strcmp(command, "LRANGE") == 0)
-    return CMD_LRANGE;
-  else if (strcmp(command, "CONFIG") == 0)
-    return CMD_CONFIG;
-  else if (strcmp(command, "SAVE") == 0)
-    return CMD_SAVE;
-  else if (strcmp(command, "DBSIZE") == 0)
-    return CMD_DBSIZE;
-  else if (strcmp(command, "INFO") == 0)
-    return CMD_INFO;
-  else if (strcmp(command, "REPLCONF") == 0) {
-    return CMD_REPLCONF;
-  } else if (strcmp(command, "PSYNC") == 0) {
-    return CMD_PSYNC;
-  } else
-    return CMD_UNKNOWN;
-}
-
-void handle_command(CommandHandler *ch) {
-  ch->client->should_propogate_command = false;
-
-  CommandType command_type = get_command_type(ch->args[0]);
-
-  switch (command_type) {
-  case CMD_PING:
-    handle_ping(ch);
-    break;
-  case CMD_ECHO:
-    handle_echo(ch);
-    break;
-  case CMD_SET:
-    handle_set(ch);
-    break;
-  case CMD_GET:
-    handle_get(ch);
-    break;
-  case CMD_EXIST:
-    handle_exist(ch);
-    break;
-  case CMD_DEL:
-    handle_delete(ch);
-    break;
-  case CMD_INCR:
-    handle_incr(ch);
-    break;
-  case CMD_DECR:
-    handle_decr(ch);
+static const RedisCommand command_table[CMD_UNKNOWN] = {
+    [CMD_PING] = {"ping", CMD_PING, handle_ping, -1, 0, 0, 0, 0},
+    [CMD_ECHO] = {"echo", CMD_ECHO, handle_echo, 2, 0, 0, 0, 0},
+    [CMD_SET] = {"set", CMD_SET, handle_set, -3, CMD_FLAG_WRITE | CMD_FLAG_DENYOOM, 1, 1, 1},
+    [CMD_GET] = {"get", CMD_GET, handle_get, 2, CMD_FLAG_READONLY, 1, 1, 1},
+    [CMD_EXIST] = {"exist", CMD_EXIST, handle_exist, -2, CMD_FLAG_READONLY, 1, -1, 1},
+    [CMD_DEL] = {"del", CMD_DEL, handle_delete, -2, CMD_FLAG_WRITE, 1, -1, 1},
+    [CMD_INCR] = {"incr", CMD_INCR, handle_incr, 2, CMD_FLAG_WRITE | CMD_FLAG_DENYOOM, 1, 1, 1},
+    [CMD_DECR] = {"decr", CMD_DECR, handle_decr, 2, CMD_FLAG_WRITE | CMD_FLAG_DENYOOM, 1, 1, 1},
+    [CMD_INCRBY] = {"incrby", CMD_INCRBY, handle_incrby, 3, CMD_FLAG_WRITE | CMD_FLAG_DENYOOM, 1, 1,
+                    1},
+    [CMD_DECRBY] = {"decrby", CMD_DECRBY, handle_decrby, 3, CMD_FLAG_WRITE | CMD_FLAG_DENYOOM, 1, 1,
+                    1},
+    [CMD_LPUSH] = {"lpush", CMD_LPUSH, handle_lpush, -3, CMD_FLAG_WRITE | CMD_FLAG_DENYOOM, 1, 1,
+                   1},
+    [CMD_RPUSH] = {"rpush", CMD_RPUSH, handle_rpush, -3, CMD_FLAG_WRITE | CMD_FLAG_DENYOOM, 1, 1,
+                   1},
+    [CMD_LRANGE] = {"lrange", CMD_LRANGE, handle_lrange, 4, CMD_FLAG_READONLY, 1, 1, 1},
+    [CMD_CONFIG] = {"config", CMD_CONFIG, handle_config, -3, 0, 0, 0, 0},
+    [CMD_SAVE] = {"save", CMD_SAVE, handle_save, 1, CMD_FLAG_NOSHARD, 0, 0, 0},
+    [CMD_DBSIZE] = {"dbsize", CMD_DBSIZE, handle_dbsize, 1, CMD_FLAG_READONLY, 0, 0, 0},
+    [CMD_INFO] = {"info", CMD_INFO, handle_info, -1, 0, 0, 0, 0},
+    [CMD_REPLCONF] = {"replconf", CMD_REPLCONF, handle_replconf, -1, CMD_FLAG_NOSHARD, 0, 0, 0},
+    [CMD_PSYNC] = {"psync", CMD_PSYNC, handle_psync, -3, CMD_FLAG_NOSHARD, 0, 0, 0},
+    [CMD_BGSAVE] = {"bgsave", CMD_BGSAVE, handle_bgsave, 1, CMD_FLAG_NOSHARD, 0, 0, 0},
+    [CMD_BGREWRITEAOF] = {"bgrewriteaof", CMD_BGREWRITEAOF, handle_bgrewriteaof, 1,
+                          CMD_FLAG_NOSHARD, 0, 0, 0},
+    [CMD_WAIT] = {"wait", CMD_WAIT, handle_wait, 3, CMD_FLAG_NOSHARD, 0, 0, 0},
+    [CMD_REPLICAOF] = {"replicaof", CMD_REPLICAOF, handle_replicaof, 3, CMD_FLAG_NOSHARD, 0, 0, 0},
+};
+
+/*
+Finds a command by name, ignoring case. The candidate is picked by the length and the first
+letter of the name, so a lookup costs a single comparison. Returns NULL for unknown commands.
+*/
+const RedisCommand *lookup_command(const char *name, size_t len) {
+  if (len == 0) return NULL;
+
+  CommandType type = CMD_UNKNOWN;
+  char first = name[0] | 0x20; // lowercase ASCII letters
+  switch (len) {
+  case 3:
+    type = first == 's' ? CMD_SET : first == 'g' ? CMD_GET : first == 'd' ? CMD_DEL : CMD_UNKNOWN;
     break;
-  case CMD_LPUSH:
-    handle_lpush(ch);
-    break;
-  case CMD_RPUSH:
-    handle_rpush(ch);
-    break;
-  case CMD_LRANGE:
-    handle_lrange(ch);
-    break;
-  case CMD_CONFIG:
-    handle_config(ch);
-    break;
-  case CMD_SAVE:
-    handle_save(ch);
+  case 4:
+    switch (first) {
+    case 'p':
+      type = CMD_PING;
+      break;
+    case 'e':
+      type = CMD_ECHO;
+      break;
+    case 'i':
+      // INCR and INFO share their first letter
+      type = (name[2] | 0x20) == 'c' ? CMD_INCR : CMD_INFO;
+      break;
+    case 'd':
+      type = CMD_DECR;
+      break;
+    case 's':
+      type = CMD_SAVE;
+      break;
+    case 'w':
+      type = CMD_WAIT;
+      break;
+    }
     break;
-  case CMD_DBSIZE:
-    handle_dbsize(ch);
+  case 5:
+    switch (first) {
+    case 'e':
+      type = CMD_EXIST;
+      break;
+    case 'l':
+      type = CMD_LPUSH;
+      break;
+    case 'r':
+      type = CMD_RPUSH;
+      break;
+    case 'p':
+      type = CMD_PSYNC;
+      break;
+    }
     break;
-  case CMD_INFO:
-    handle_info(ch);
+  case 6:
+    switch (first) {
+    case 'l':
+      type = CMD_LRANGE;
+      break;
+    case 'c':
+      type = CMD_CONFIG;
+      break;
+    case 'b':
+      type = CMD_BGSAVE;
+      break;
+    case 'i':
+      type = CMD_INCRBY;
+      break;
+    case 'd':
+      // DBSIZE and DECRBY share their first letter
+      type = (name[1] | 0x20) == 'b' ? CMD_DBSIZE : CMD_DECRBY;
+      break;
+    }
     break;
-  case CMD_REPLCONF:
-    handle_replconf(ch);
+  case 8:
+    type = first == 'r' ? CMD_REPLCONF : CMD_UNKNOWN;
     break;
-  case CMD_PSYNC:
-    handle_psync(ch);
+  case 9:
+    type = first == 'r' ? CMD_REPLICAOF : CMD_UNKNOWN;
     break;
-  default:
-    add_error_reply(ch->client, "ERR unknown command");
+  case 12:
+    type = first == 'b' ? CMD_BGREWRITEAOF : CMD_UNKNOWN;
     break;
   }
-  // if it is a write command
-  // for now propogate set
-  if (command_type == CMD_SET) {
-    ch->client->should_propogate_command = true;
+
+  if (type == CMD_UNKNOWN) return NULL;
+  const RedisCommand *command = &command_table[type];
+  return strncasecmp(name, command->name, len) == 0 ? command : NULL;
+}
+
+/*
+Returns true when one of the command's keys contains a NUL byte. The database and the propagation
+of deletions treat keys as NUL-terminated strings, such a key would be cut short at the NUL.
+*/
+static bool has_key_with_nul(CommandHandler *ch, const RedisCommand *command) {
+  if (command->first_key == 0) return false;
+
+  int last_key = command->last_key < 0 ? (int)ch->arg_count + command->last_key : command->last_key;
+  for (int i = command->first_key; i <= last_key; i += command->key_step) {
+    if (memchr(ch->args[i], '\0', ch->arg_lens[i])) return true;
+  }
+  return false;
+}
+
+void handle_command(CommandHandler *ch) {
+  Client *client = ch->client;
+  client->should_propogate_command = false;
+
+  const RedisCommand *command = lookup_command(ch->args[0], ch->arg_lens[0]);
+  if (command == NULL) {
+    if (client->should_reply) add_error_reply(client, "ERR unknown command");
+    return;
+  }
+
+  if ((command->arity > 0 && ch->arg_count != command->arity) ||
+      (command->arity < 0 && ch->arg_count < -command->arity)) {
+    if (client->should_reply) {
+      char error[64];
+      snprintf(error, sizeof(error), "ERR wrong number of arguments for '%s' command",
+               command->name);
+      add_error_reply(client, error);
+    }
+    return;
+  }
+
+  if (has_key_with_nul(ch, command)) {
+    if (client->should_reply) {
+      add_error_reply(client, "ERR keys containing NUL bytes are not supported");
+    }
+    return;
+  }
+
+  if (shard_dispatch_command(ch, command)) return;
+
+  // the master decides what is evicted, its replicas only apply the deletions it sends, whoever
+  // the command comes from. A replayed AOF restores the dataset it logged, maxmemory applies to
+  // the writes that follow
+  if (client->db && g_server_info.role != ROLE_SLAVE && !g_server_info.loading &&
+      redis_db_evict_if_needed(client->db) == ERR_OOM && (command->flags & CMD_FLAG_DENYOOM)) {
+    add_error_reply(client, "OOM command not allowed when used memory > 'maxmemory'");
+    return;
+  }
+
+  long long dirty = client->db ? client->db->dirty : 0;
+  command->proc(ch);
+
+  // replicate commands that changed the dataset
+  if ((command->flags & CMD_FLAG_WRITE) && client->db && client->db->dirty != dirty) {
+    client->should_propogate_command = true;
+    propogate_command(ch);
   }
 }
 
@@ -121,18 +200,19 @@ CommandHandler *create_command_handler(Client *client, size_t initial_buf_size,
                                        size_t initial_arg_capacity) {
   CommandHandler *ch = malloc(sizeof(CommandHandler));
 
-  ch->client = client;
-
   if (!ch) {
     perror("failed to allocate CommandHandler");
     exit(EXIT_FAILURE);
   }
 
+  ch->client = client;
+
   ch->buf = malloc(initial_buf_size);
   ch->args = malloc(sizeof(char *) * initial_arg_capacity);
-  ch->ends = malloc(sizeof(size_t) * initial_arg_capacity);
+  ch->arg_lens = malloc(sizeof(size_t) * initial_arg_capacity);
+  ch->arg_offsets = malloc(sizeof(size_t) * initial_arg_capacity);
 
-  if (!ch->buf || !ch->args || !ch->ends) {
+  if (!ch->buf || !ch->args || !ch->arg_lens || !ch->arg_offsets) {
     perror("failed to allocate CommandHandler buffers");
     exit(EXIT_FAILURE);
   }
@@ -141,92 +221,237 @@ CommandHandler *create_command_handler(Client *client, size_t initial_buf_size,
   ch->buf_used = 0;
   ch->arg_capacity = initial_arg_capacity;
   ch->arg_count = 0;
-  ch->ends_size = 0;
-  ch->ends_capacity = initial_arg_capacity;
+  ch->bulk_len = -1;
+  ch->bulk_start = 0;
+  ch->bulk_slice = NULL;
+  ch->borrow_input = false;
+  ch->should_respond = true;
+  ch->defer_execution = false;
+  ch->pending = NULL;
+  ch->pending_count = 0;
+  ch->pending_capacity = 0;
 
   return ch;
 }
 
+static void ensure_arg_capacity(CommandHandler *ch, size_t capacity) {
+  if (capacity <= ch->arg_capacity) return;
+  ch->args = realloc(ch->args, sizeof(char *) * capacity);
+  ch->arg_lens = realloc(ch->arg_lens, sizeof(size_t) * capacity);
+  ch->arg_offsets = realloc(ch->arg_offsets, sizeof(size_t) * capacity);
+  if (ch->args == NULL || ch->arg_lens == NULL || ch->arg_offsets == NULL) {
+    perror("memory realloc failed for args array");
+    exit(EXIT_FAILURE);
+  }
+  ch->arg_capacity = capacity;
+}
+
+// ensures buf can take len more bytes plus a NUL terminator
+static void ensure_buf_space(CommandHandler *ch, size_t len) {
+  size_t required_size = ch->buf_used + len + 1;
+  if (required_size <= ch->buf_size) return;
+  size_t new_size = ch->buf_size * 2;
+  if (new_size < required_size) new_size = required_size;
+  ch->buf = realloc(ch->buf, new_size);
+  if (ch->buf == NULL) {
+    perror("memory realloc failed for resizing buffer");
+    exit(EXIT_FAILURE);
+  }
+  ch->buf_size = new_size;
+}
+
 // Command handler methods
 void begin_array_handler(CommandHandler *ch, int64_t len) {
   ch->buf_used = 0;
   ch->arg_count = 0;
-  ch->ends_size = 0;
+  ch->bulk_start = 0;
+  ch->bulk_slice = NULL;
 
   // ensure args array has enough capacity
-  if (len > ch->arg_capacity) {
-    ch->arg_capacity = len;
-    ch->args = realloc(ch->args, sizeof(char *) * len);
-    if (ch->args == NULL) {
-      perror("memory realloc failed for args array");
+  if (len > 0) ensure_arg_capacity(ch, len);
+}
+
+/*
+Copies the arguments of the command that was just parsed into a single allocation owned by the
+caller, which frees it with free(command->args).
+*/
+void copy_parsed_command(CommandHandler *ch, ParsedCommand *command) {
+  size_t header_size = (sizeof(char *) + sizeof(size_t)) * ch->arg_count;
+  size_t size = header_size;
+  for (size_t i = 0; i < ch->arg_count; i++) {
+    size += ch->arg_lens[i] + 1;
+  }
+
+  char **args = malloc(size ? size : 1);
+  if (args == NULL) {
+    perror("failure to allocate memory for parsed command");
+    exit(EXIT_FAILURE);
+  }
+  size_t *arg_lens = (size_t *)(args + ch->arg_count);
+  char *data = (char *)args + header_size;
+  for (size_t i = 0; i < ch->arg_count; i++) {
+    args[i] = data;
+    arg_lens[i] = ch->arg_lens[i];
+    memcpy(data, ch->args[i], ch->arg_lens[i] + 1);
+    data += ch->arg_lens[i] + 1;
+  }
+
+  command->args = args;
+  command->arg_lens = arg_lens;
+  command->arg_count = ch->arg_count;
+}
+
+/*
+Copies the command that was just parsed into the pending queue, the input it was parsed from is
+consumed before the queue is executed.
+*/
+static void queue_parsed_command(CommandHandler *ch) {
+  if (ch->pending_count == ch->pending_capacity) {
+    size_t new_capacity = ch->pending_capacity ? ch->pending_capacity * 2 : 16;
+    ParsedCommand *pending = realloc(ch->pending, sizeof(ParsedCommand) * new_capacity);
+    if (pending == NULL) {
+      perror("memory realloc failed for pending commands");
       exit(EXIT_FAILURE);
     }
+    ch->pending = pending;
+    ch->pending_capacity = new_capacity;
   }
 
-  // ensure ends array has enough capacity
-  if (len > ch->ends_capacity) {
-    ch->ends_capacity = len;
-    ch->ends = realloc(ch->ends, sizeof(size_t) * len);
-    if (ch->ends == NULL) {
-      perror("memory realloc failed for ends array");
-      exit(EXIT_FAILURE);
+  copy_parsed_command(ch, &ch->pending[ch->pending_count]);
+  ch->pending_count++;
+  ch->arg_count = 0;
+}
+
+/*
+Executes the commands queued by a deferred parse in the order they were received. A command that
+blocks the client stops the execution, the commands behind it stay queued until the client is
+unblocked. Must be called from the main thread.
+*/
+void execute_pending_commands(CommandHandler *ch) {
+  // a command that is still being parsed keeps its arguments
+  char **args = ch->args;
+  size_t *arg_lens = ch->arg_lens;
+  size_t arg_count = ch->arg_count;
+
+  size_t executed = 0;
+  while (executed < ch->pending_count && !ch->client->blocked) {
+    ParsedCommand *command = &ch->pending[executed++];
+    ch->args = command->args;
+    ch->arg_lens = command->arg_lens;
+    ch->arg_count = command->arg_count;
+    if (ch->arg_count > 0) {
+      handle_command(ch);
     }
+    free(command->args);
   }
+
+  ch->args = args;
+  ch->arg_lens = arg_lens;
+  ch->arg_count = arg_count;
+  ch->pending_count -= executed;
+  memmove(ch->pending, ch->pending + executed, sizeof(ParsedCommand) * ch->pending_count);
 }
 
 void end_array_handler(CommandHandler *ch) {
-  // split buffer into arguments
-  char *begin = ch->buf;
-  for (size_t i = 0; i < ch->ends_size; i++) {
-    size_t len = ch->ends[i] - (begin - ch->buf);
-    ch->args[ch->arg_count] = malloc(len + 1);
-    if (ch->args[ch->arg_count] == NULL) {
-      perror("failure to allocate memory for arg");
-      return;
+  // buf is done growing, point the copied arguments into it
+  for (size_t i = 0; i < ch->arg_count; i++) {
+    if (ch->args[i] == NULL) {
+      ch->args[i] = ch->buf + ch->arg_offsets[i];
     }
+  }
 
-    memcpy(ch->args[ch->arg_count], begin, len);
-    ch->args[ch->arg_count][len] = '\0';
-
-    ch->arg_count++;
-    begin = ch->buf + ch->ends[i];
+  if (ch->defer_execution) {
+    queue_parsed_command(ch);
+    return;
   }
 
-  // execute the command
+  // execute the command, its arguments are only valid until it returns
   handle_command(ch);
-
-  // free memory allocated for arguments
-  for (int i = 0; i < ch->arg_count; i++) {
-    free(ch->args[i]);
-  }
+  ch->arg_count = 0;
 }
 
 void begin_bulk_string_handler(CommandHandler *ch, int64_t len) {
-  // ensure buffer has enough space for current content plus new string
-  size_t required_size = ch->buf_used + len;
-  if (required_size > ch->buf_size) {
-    ch->buf_size = required_size;
-    ch->buf = realloc(ch->buf, ch->buf_size);
-    if (ch->buf == NULL) {
-      perror("memory realloc failed for resizing buffer");
-      exit(EXIT_FAILURE);
-    }
-  }
+  ch->bulk_len = len;
+  ch->bulk_start = ch->buf_used;
+  ch->bulk_slice = NULL;
 }
 
 void end_bulk_string_handler(CommandHandler *ch) {
-  // update ends array with end of the current bulk string
-  ch->ends[ch->ends_size] = ch->buf_used;
-  ch->ends_size++;
+  ensure_arg_capacity(ch, ch->arg_count + 1);
+  size_t i = ch->arg_count++;
+
+  if (ch->bulk_slice) {
+    // terminate the argument in place, the CR after it was already parsed
+    char *arg = (char *)ch->bulk_slice;
+    arg[ch->bulk_len] = '\0';
+    ch->args[i] = arg;
+    ch->arg_lens[i] = ch->bulk_len;
+    ch->bulk_slice = NULL;
+  } else {
+    ensure_buf_space(ch, 0);
+    ch->buf[ch->buf_used++] = '\0';
+    ch->args[i] = NULL;
+    ch->arg_offsets[i] = ch->bulk_start;
+    ch->arg_lens[i] = ch->buf_used - 1 - ch->bulk_start;
+  }
+  ch->bulk_len = -1;
+  ch->bulk_start = ch->buf_used;
 }
 
 void chars_handler(CommandHandler *ch, const char *begin, const char *end) {
   size_t len = end - begin;
+  if (len == 0) return;
+
+  if (ch->borrow_input && (int64_t)len == ch->bulk_len && ch->bulk_start == ch->buf_used &&
+      ch->bulk_slice == NULL) {
+    // the whole bulk string is in the input, borrow it instead of copying
+    ch->bulk_slice = begin;
+    return;
+  }
+
+  ensure_buf_space(ch, len);
   memcpy(ch->buf + ch->buf_used, begin, len);
   ch->buf_used += len;
 }
 
-void begin_simple_string_handler(CommandHandler *ch) { ch->buf_used = 0; }
+/*
+Copies the arguments that still point into the input into buf. Must be called before the parsed
+input is consumed, so a command split across reads does not point at reused memory.
+*/
+void command_handler_release_input(CommandHandler *ch) {
+  size_t borrowed = 0;
+  for (size_t i = 0; i < ch->arg_count; i++) {
+    if (ch->args[i] != NULL) borrowed += ch->arg_lens[i] + 1;
+  }
+  size_t slice_len = ch->bulk_slice ? ch->bulk_len : 0;
+  if (borrowed == 0 && ch->bulk_slice == NULL) return;
+
+  ensure_buf_space(ch, borrowed + slice_len);
+
+  // the bulk string being parsed has to stay at the end of buf, make room in front of it
+  char *dest = ch->buf + ch->bulk_start;
+  memmove(dest + borrowed, dest, ch->buf_used - ch->bulk_start);
+  for (size_t i = 0; i < ch->arg_count; i++) {
+    if (ch->args[i] == NULL) continue;
+    memcpy(dest, ch->args[i], ch->arg_lens[i] + 1);
+    ch->arg_offsets[i] = dest - ch->buf;
+    ch->args[i] = NULL;
+    dest += ch->arg_lens[i] + 1;
+  }
+  ch->bulk_start += borrowed;
+  ch->buf_used += borrowed;
+
+  if (ch->bulk_slice) {
+    memcpy(ch->buf + ch->buf_used, ch->bulk_slice, slice_len);
+    ch->buf_used += slice_len;
+    ch->bulk_slice = NULL;
+  }
+}
+
+void begin_simple_string_handler(CommandHandler *ch) {
+  ch->buf_used = 0;
+  ch->bulk_len = -1; // simple strings are always copied
+}
 
 void end_simple_string_handler(CommandHandler *ch) {
   if (ch->buf_used < ch->buf_size) {
@@ -274,9 +499,14 @@ Handler *create_handler() {
 
 void destroy_command_handler(CommandHandler *ch) {
   if (ch) {
+    for (size_t i = 0; i < ch->pending_count; i++) {
+      free(ch->pending[i].args);
+    }
+    free(ch->pending);
     free(ch->args);
     free(ch->buf);
-    free(ch->ends);
+    free(ch->arg_lens);
+    free(ch->arg_offsets);
     free(ch);
   }
 }
@@ -18,6 +18,8 @@ typedef enum {
   CMD_DEL,
   CMD_INCR,
   CMD_DECR,
+  CMD_INCRBY,
+  CMD_DECRBY,
   CMD_LPUSH,
   CMD_RPUSH,
   CMD_LRANGE,
@@ -25,29 +27,86 @@ typedef enum {
   CMD_SAVE,
   CMD_DBSIZE,
   CMD_INFO,
-  CMD_UNKNOWN,
   CMD_REPLCONF,
-  CMD_PSYNC
+  CMD_PSYNC,
+  CMD_BGSAVE,
+  CMD_BGREWRITEAOF,
+  CMD_WAIT,
+  CMD_REPLICAOF,
+  CMD_UNKNOWN
 } CommandType;
 
+/*
+A fully parsed command that outlives the input it was parsed from, e.g. one waiting to be executed
+on the main thread. The argument pointers, lengths and bytes share one allocation, args.
+*/
+typedef struct ParsedCommand {
+  char **args;
+  size_t *arg_lens;
+  size_t arg_count;
+} ParsedCommand;
+
+/*
+Arguments are NUL-terminated strings with their lengths in arg_lens. When a bulk string arrives
+whole, its argument points straight into the input being parsed, which is terminated in place by
+overwriting the CR that follows it. Arguments that arrive in pieces are copied into buf.
+*/
 typedef struct CommandHandler {
   char *buf;
   size_t buf_size;
   size_t buf_used;
   char **args;
+  size_t *arg_lens;
+  size_t *arg_offsets; // offset in buf of copied arguments, their args entry is NULL until resolved
   size_t arg_capacity;
   size_t arg_count;
-  size_t *ends;
-  size_t ends_size;
-  size_t ends_capacity;
+  int64_t bulk_len;       // length of the bulk string being parsed
+  size_t bulk_start;      // offset in buf where the bulk string being parsed is copied to
+  const char *bulk_slice; // the bulk string being parsed, when it is borrowed from the input
+  // set when the input being parsed may be borrowed and modified, i.e. it is the client's input
+  // buffer and command_handler_release_input is called before the input is consumed
+  bool borrow_input;
   struct Client *client;
   bool should_respond;
+  // when set, end_array_handler queues parsed commands instead of executing them, so
+  // I/O threads can parse while execution stays on the main thread
+  bool defer_execution;
+  ParsedCommand *pending;
+  size_t pending_count;
+  size_t pending_capacity;
 } CommandHandler;
 
+// command flags
+#define CMD_FLAG_WRITE (1 << 0)    // may modify the dataset, propagated to replicas
+#define CMD_FLAG_READONLY (1 << 1) // only reads keys
+#define CMD_FLAG_NOSHARD (1 << 2)  // operates on the whole server, rejected in sharded mode
+#define CMD_FLAG_DENYOOM (1 << 3)  // may use more memory, rejected when maxmemory is reached
+
+/*
+An entry of the command table. Arity counts the command name, a negative arity -N means at least
+N arguments. Keys are found at first_key, first_key + key_step, ... up to last_key, where a
+negative last_key counts from the end of the arguments. Commands without keys have first_key 0.
+*/
+typedef struct RedisCommand {
+  const char *name;
+  CommandType type;
+  void (*proc)(CommandHandler *ch);
+  int arity;
+  int flags;
+  int first_key;
+  int last_key;
+  int key_step;
+} RedisCommand;
+
+const RedisCommand *lookup_command(const char *name, size_t len);
+
 CommandHandler *create_command_handler(struct Client *client, size_t initial_buf_size,
                                        size_t initial_arg_capacity);
 void handle_command(CommandHandler *ch);
 void destroy_command_handler(CommandHandler *ch);
+void execute_pending_commands(CommandHandler *ch);
+void copy_parsed_command(CommandHandler *ch, ParsedCommand *command);
+void command_handler_release_input(CommandHandler *ch);
 void begin_array_handler(CommandHandler *ch, int64_t len);
 void end_array_handler(CommandHandler *ch);
 void begin_bulk_string_handler(CommandHandler *ch, int64_t len);
@@ -1,65 +1,79 @@
 #include "commands.h"
+#include "aof.h"
 #include "client.h"
 #include "command_handler.h"
 #include "database.h"
 #include "linked_list.h"
+#include "rdb.h"
 #include "redis-server.h"
 #include "replication.h"
 #include "server_config.h"
+#include "shard.h"
 #include "sys/time.h"
 #include "util.h"
+#include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 
 #define MAX_PATH_LENGTH 256
 #define INFO_BUFFER_SIZE 2048 // a buffer for various INFO fields
+#define INFO_REPLICA_SIZE 128 // room for the INFO line of a replica
 
 void add_simple_string_reply(Client *client, const char *str) {
-  write_begin_simple_string(client->output_buffer);
-  write_chars(client->output_buffer, str);
-  write_end_simple_string(client->output_buffer);
+  write_begin_simple_string(client);
+  write_chars(client, str);
+  write_end_simple_string(client);
+}
+
+// replies with len bytes of str, which may contain NULs
+void add_bulk_string_reply_len(Client *client, const char *str, size_t len) {
+  write_begin_bulk_string(client, len);
+  write_chars_len(client, str, len);
+  write_end_bulk_string(client);
 }
 
 void add_bulk_string_reply(Client *client, const char *str) {
-  int64_t len = strlen(str);
-  write_begin_bulk_string(client->output_buffer, len);
-  write_chars(client->output_buffer, str);
-  write_end_bulk_string(client->output_buffer);
+  add_bulk_string_reply_len(client, str, strlen(str));
 }
 
 void add_array_reply(Client *client, char **array, int length) {
-  write_begin_array(client->output_buffer, length);
+  write_begin_array(client, length);
   if (array != NULL) {
     for (int i = 0; i < length; i++) {
       int64_t len = strlen(array[i]);
-      write_begin_bulk_string(client->output_buffer, len);
-      write_chars(client->output_buffer, array[i]);
-      write_end_bulk_string(client->output_buffer);
+      write_begin_bulk_string(client, len);
+      write_chars(client, array[i]);
+      write_end_bulk_string(client);
     }
   }
-  write_end_array(client->output_buffer);
+  write_end_array(client);
 }
 
 void add_null_reply(Client *client) {
-  write_begin_bulk_string(client->output_buffer, -1); // indicate that this is a null bulk string
-  write_end_bulk_string(client->output_buffer);
+  write_begin_bulk_string(client, -1); // indicate that this is a null bulk string
+  write_end_bulk_string(client);
 }
 
 void add_error_reply(Client *client, const char *str) {
-  write_begin_error(client->output_buffer);
-  write_chars(client->output_buffer, str);
-  write_end_error(client->output_buffer);
+  write_begin_error(client);
+  write_chars(client, str);
+  write_end_error(client);
 }
 
-void add_integer_reply(Client *client, int integer) {
+void add_integer_reply(Client *client, long long integer) {
   char number_str[32];
-  snprintf(number_str, sizeof(number_str), "%d", integer);
+  snprintf(number_str, sizeof(number_str), "%lld", integer);
 
-  write_begin_integer(client->output_buffer);
-  write_chars(client->output_buffer, number_str);
-  write_end_integer(client->output_buffer);
+  write_begin_integer(client);
+  write_chars(client, number_str);
+  write_end_integer(client);
 }
 
 void add_fullresync_reply(Client *client, char *master_replid, long long master_repl_offset) {
@@ -71,6 +85,106 @@ void add_fullresync_reply(Client *client, char *master_replid, long long master_
   add_simple_string_reply(client, full_resync_reply);
 }
 
+/*
+Encodes argc arguments as a RESP array of bulk strings, the form write commands are propagated in.
+Returns a buffer the caller frees and stores its length in len, or NULL if allocation failed.
+*/
+char *encode_command(size_t argc, char **args, size_t *lens, size_t *len) {
+  size_t total = snprintf(NULL, 0, "*%zu\r\n", argc);
+  for (size_t i = 0; i < argc; i++) {
+    total += snprintf(NULL, 0, "$%zu\r\n", lens[i]) + lens[i] + 2;
+  }
+
+  char *buf = malloc(total + 1);
+  if (!buf) {
+    perror("failed to allocate buffer for propagated command");
+    return NULL;
+  }
+
+  size_t offset = sprintf(buf, "*%zu\r\n", argc);
+  for (size_t i = 0; i < argc; i++) {
+    offset += sprintf(buf + offset, "$%zu\r\n", lens[i]);
+    memcpy(buf + offset, args[i], lens[i]);
+    offset += lens[i];
+    buf[offset++] = '\r';
+    buf[offset++] = '\n';
+  }
+  *len = total;
+  return buf;
+}
+
+// whether changes are fed to the replication stream, only masters keep one
+static bool should_replicate() {
+  return g_server_info.role == ROLE_MASTER && g_server_info.repl_backlog != NULL;
+}
+
+/*
+Hands a write command to everything that records the dataset's changes: the replication stream
+when this server is a master and the AOF when it is enabled.
+*/
+static void propagate(char **args, size_t *lens, size_t argc) {
+  if (g_server_info.loading) return;
+  bool replicate = should_replicate();
+  if (!replicate && !aof_enabled()) return;
+
+  size_t len;
+  char *buf = encode_command(argc, args, lens, &len);
+  if (!buf) return;
+  if (replicate) replication_feed(buf, len);
+  aof_feed(buf, len);
+  free(buf);
+}
+
+/*
+Propagates the command that was just executed. Encoding from the arguments rather than copying
+the raw input bytes keeps propagation correct when commands are parsed ahead of execution by the
+I/O threads. A relative SET expiration is rewritten to the absolute PXAT the key got, so the key
+does not live longer when the AOF is replayed later or the replica applies it late.
+*/
+void propogate_command(CommandHandler *ch) {
+  if (g_server_info.loading || (!should_replicate() && !aof_enabled())) return;
+
+  if (ch->arg_lens[0] == 3 && strncasecmp(ch->args[0], "set", 3) == 0) {
+    for (size_t i = 3; i + 1 < ch->arg_count; i++) {
+      if (strcmp(ch->args[i], "EX") != 0 && strcmp(ch->args[i], "PX") != 0) continue;
+      RedisValue *value = redis_db_get(ch->client->db, ch->args[1]);
+      if (!value) break; // expired right away, its deletion was propagated already
+
+      char **args = malloc(sizeof(char *) * ch->arg_count);
+      size_t *lens = malloc(sizeof(size_t) * ch->arg_count);
+      if (!args || !lens) {
+        perror("failed to allocate arguments for propagated command");
+        free(args);
+        free(lens);
+        return;
+      }
+      char expiration[LONG_STR_SIZE];
+      memcpy(args, ch->args, sizeof(char *) * ch->arg_count);
+      memcpy(lens, ch->arg_lens, sizeof(size_t) * ch->arg_count);
+      args[i] = "PXAT";
+      lens[i] = 4;
+      args[i + 1] = expiration;
+      lens[i + 1] =
+          snprintf(expiration, sizeof(expiration), "%lld", (long long)value->expiration);
+      propagate(args, lens, ch->arg_count);
+      free(args);
+      free(lens);
+      return;
+    }
+  }
+  propagate(ch->args, ch->arg_lens, ch->arg_count);
+}
+
+/*
+Propagates a key the server deleted on its own, because it expired or was evicted, as a DEL so the
+replicas and the AOF drop it too.
+*/
+void propagate_deletion(const char *key) {
+  char *args[] = {"DEL", (char *)key};
+  size_t lens[] = {3, strlen(key)};
+  propagate(args, lens, 2);
+}
+
 /*
 Parses the options sent to a SET command, returns 0 if successful, -1 if there is a syntax error
 */
@@ -151,20 +265,11 @@ void handle_ping(CommandHandler *ch) {
 
 void handle_echo(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count != 2) {
-    add_error_reply(client, "ERR wrong number of arguments for 'echo' command");
-    return;
-  }
   add_simple_string_reply(client, ch->args[1]);
 }
 
 void handle_set(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count < 3) {
-    add_error_reply(client, "ERR wrong number of arguments for 'set' command");
-    return;
-  }
-
   SetOptions options = {0};
   int parse_result = parse_set_options(ch->args + 3, ch->arg_count - 3, &options);
 
@@ -186,7 +291,7 @@ void handle_set(CommandHandler *ch) {
 
   RedisValue *existing_value = NULL;
   bool key_exists = false;
-  char *old_value = NULL;
+  sds old_value = NULL;
 
   // only get the existing value if we need to check conditions (NX, XX) or respond to GET
   // option
@@ -208,17 +313,20 @@ void handle_set(CommandHandler *ch) {
   }
 
   if (options.get) {
-    if (existing_value) {
-      old_value = strdup(existing_value->data.str); // store the old value
+    if (existing_value && existing_value->type == TYPE_STRING) {
+      char buf[LONG_STR_SIZE];
+      size_t len;
+      const char *value = redis_value_string(existing_value, buf, &len);
+      old_value = sds_new_len(value, len); // store the old value
     }
   }
 
-  redis_db_set(client->db, ch->args[1], ch->args[2], TYPE_STRING, expiration);
+  redis_db_set_string(client->db, ch->args[1], ch->args[2], ch->arg_lens[2], expiration);
 
   if (options.get) {
     if (old_value) {
-      if (client->should_reply) add_bulk_string_reply(client, old_value);
-      free(old_value);
+      if (client->should_reply) add_bulk_string_reply_len(client, old_value, sds_len(old_value));
+      sds_free(old_value);
     } else {
       if (client->should_reply) add_null_reply(client);
     }
@@ -229,12 +337,6 @@ void handle_set(CommandHandler *ch) {
 
 void handle_get(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count != 2) {
-    if (client->should_reply)
-      add_error_reply(client, "ERR wrong number of arguments for 'get' command");
-    return;
-  }
-
   RedisValue *redis_value = redis_db_get(client->db, ch->args[1]);
   if (redis_value == NULL) {
     if (client->should_reply) add_null_reply(client);
@@ -242,17 +344,15 @@ void handle_get(CommandHandler *ch) {
     if (client->should_reply)
       add_error_reply(client, "ERR Operation against a key holding the wrong kind of value");
   } else {
-    if (client->should_reply) add_bulk_string_reply(client, redis_value->data.str);
+    char buf[LONG_STR_SIZE];
+    size_t len;
+    const char *value = redis_value_string(redis_value, buf, &len);
+    if (client->should_reply) add_bulk_string_reply_len(client, value, len);
   }
 }
 
 void handle_exist(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count < 2) {
-    add_error_reply(client, "ERR wrong number of arguments for 'exist' command");
-    return;
-  }
-
   int count = 0;
   for (int i = 1; i < ch->arg_count; i++) {
     if (redis_db_exist(client->db, ch->args[i])) {
@@ -265,47 +365,29 @@ void handle_exist(CommandHandler *ch) {
 
 void handle_delete(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count < 2) {
-    add_error_reply(client, "ERR wrong number of arguments for 'delete' command");
-    return;
-  }
-
   for (int i = 1; i < ch->arg_count; i++) {
     redis_db_delete(client->db, ch->args[i]);
   }
   if (client->should_reply) add_simple_string_reply(client, "OK");
 }
 
-void handle_incr_decr(CommandHandler *ch, int increment) {
+void handle_incr_decr(CommandHandler *ch, long long increment) {
   Client *client = ch->client;
-  if (ch->arg_count < 2) {
+  long long new_value;
+  int result = redis_db_incr_by(client->db, ch->args[1], increment, &new_value);
+
+  switch (result) {
+  case ERR_TYPE_MISMATCH:
     if (client->should_reply)
-      add_error_reply(client, "ERR wrong number of arguments for 'incr/decr' command");
+      add_error_reply(client, "ERR Operation against a key holding the wrong kind of value");
+    return;
+  case ERR_VALUE:
+    if (client->should_reply) add_error_reply(client, "ERR value is not an integer");
+    return;
+  case ERR_OVERFLOW:
+    if (client->should_reply) add_error_reply(client, "ERR increment or decrement would overflow");
     return;
   }
-
-  RedisValue *redis_value = redis_db_get(client->db, ch->args[1]);
-  long current_value = 0;
-
-  // check if the key exists and parse its value
-  if (redis_value != NULL) {
-    int parse_result = parse_integer(redis_value->data.str, &current_value);
-    if (parse_result == ERR_VALUE) {
-      if (client->should_reply) add_error_reply(client, "ERR value is not an integer");
-      return;
-    }
-  } else {
-    // if the key does not exist, initialize current_value to 0
-    current_value = 0;
-  }
-
-  // calculate the new value based on increment or decrement
-  long new_value = current_value + increment;
-  char new_value_str[21];
-  snprintf(new_value_str, sizeof(new_value_str), "%ld", new_value);
-
-  // set the new value in the database
-  redis_db_set(client->db, ch->args[1], new_value_str, TYPE_STRING, 0);
   if (client->should_reply) add_integer_reply(client, new_value);
 }
 
@@ -313,13 +395,32 @@ void handle_incr(CommandHandler *ch) { handle_incr_decr(ch, 1); }
 
 void handle_decr(CommandHandler *ch) { handle_incr_decr(ch, -1); }
 
-void handle_lpush(CommandHandler *ch) {
-  Client *client = ch->client;
-  if (ch->arg_count < 3) { // at least 2 arguments: key and one element
-    if (client->should_reply)
-      add_error_reply(client, "ERR wrong number of arguments for 'lpush' command");
+void handle_incrby(CommandHandler *ch) {
+  long long increment;
+  if (parse_long_long(ch->args[2], &increment) != ERR_NONE) {
+    if (ch->client->should_reply)
+      add_error_reply(ch->client, "ERR value is not an integer or out of range");
+    return;
+  }
+  handle_incr_decr(ch, increment);
+}
+
+void handle_decrby(CommandHandler *ch) {
+  long long decrement;
+  if (parse_long_long(ch->args[2], &decrement) != ERR_NONE) {
+    if (ch->client->should_reply)
+      add_error_reply(ch->client, "ERR value is not an integer or out of range");
+    return;
+  }
+  if (decrement == LLONG_MIN) {
+    if (ch->client->should_reply) add_error_reply(ch->client, "ERR decrement would overflow");
     return;
   }
+  handle_incr_decr(ch, -decrement);
+}
+
+void handle_lpush(CommandHandler *ch) {
+  Client *client = ch->client;
   const char *key = ch->args[1];
   int length = 0;
   for (int i = 2; i < ch->arg_count; i++) {
@@ -335,11 +436,6 @@ void handle_lpush(CommandHandler *ch) {
 
 void handle_rpush(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count < 3) { // at least 2 arguments: key and one element
-    if (client->should_reply)
-      add_error_reply(client, "ERR wrong number of arguments for 'rpush' command");
-    return;
-  }
   const char *key = ch->args[1];
   int length = 0; // stores the length of the list after operation
   for (int i = 2; i < ch->arg_count; i++) {
@@ -355,11 +451,6 @@ void handle_rpush(CommandHandler *ch) {
 
 void handle_lrange(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count < 4) { // needs 3 arguments: LRANGE key start end
-    add_error_reply(client, "ERR wrong number of arguments for 'rpush' command");
-    return;
-  }
-
   char **range;
   int range_length;
   char *list_key = ch->args[1];
@@ -380,14 +471,21 @@ void handle_lrange(CommandHandler *ch) {
 
 void handle_config(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count < 3) {
-    add_error_reply(client, "ERR wrong number of arguments for 'config get' command");
-    return;
-  }
-
   int param_count = ch->arg_count - 2;
   char *response[param_count * 2];
   int response_index = 0;
+  char maxmemory[LONG_STR_SIZE];
+  snprintf(maxmemory, sizeof(maxmemory), "%llu", g_server_config.maxmemory);
+  char diskless_sync_delay[LONG_STR_SIZE];
+  snprintf(diskless_sync_delay, sizeof(diskless_sync_delay), "%d",
+           g_server_config.repl_diskless_sync_delay);
+  char backlog_size[LONG_STR_SIZE];
+  snprintf(backlog_size, sizeof(backlog_size), "%llu", g_server_config.repl_backlog_size);
+  char repl_timeout[LONG_STR_SIZE];
+  snprintf(repl_timeout, sizeof(repl_timeout), "%d", g_server_config.repl_timeout);
+  char ping_replica_period[LONG_STR_SIZE];
+  snprintf(ping_replica_period, sizeof(ping_replica_period), "%d",
+           g_server_config.repl_ping_replica_period);
 
   if (strcmp(ch->args[1], "GET") == 0) {
     for (int i = 0; i < param_count; i++) {
@@ -398,30 +496,118 @@ void handle_config(CommandHandler *ch) {
       } else if (strcmp(param, "dbfilename") == 0) {
         response[response_index++] = "dbfilename";
         response[response_index++] = g_server_config.dbfilename;
+      } else if (strcmp(param, "maxmemory") == 0) {
+        response[response_index++] = "maxmemory";
+        response[response_index++] = maxmemory;
+      } else if (strcmp(param, "maxmemory-policy") == 0) {
+        response[response_index++] = "maxmemory-policy";
+        response[response_index++] =
+            (char *)maxmemory_policy_name(g_server_config.maxmemory_policy);
+      } else if (strcmp(param, "appendonly") == 0) {
+        response[response_index++] = "appendonly";
+        response[response_index++] = g_server_config.appendonly ? "yes" : "no";
+      } else if (strcmp(param, "appendfsync") == 0) {
+        response[response_index++] = "appendfsync";
+        response[response_index++] = (char *)aof_fsync_policy_name(g_server_config.appendfsync);
+      } else if (strcmp(param, "appendfilename") == 0) {
+        response[response_index++] = "appendfilename";
+        response[response_index++] = g_server_config.appendfilename;
+      } else if (strcmp(param, "repl-diskless-sync") == 0) {
+        response[response_index++] = "repl-diskless-sync";
+        response[response_index++] = g_server_config.repl_diskless_sync ? "yes" : "no";
+      } else if (strcmp(param, "repl-diskless-sync-delay") == 0) {
+        response[response_index++] = "repl-diskless-sync-delay";
+        response[response_index++] = diskless_sync_delay;
+      } else if (strcmp(param, "repl-diskless-load") == 0) {
+        response[response_index++] = "repl-diskless-load";
+        response[response_index++] = g_server_config.repl_diskless_load ? "yes" : "no";
+      } else if (strcmp(param, "repl-backlog-size") == 0) {
+        response[response_index++] = "repl-backlog-size";
+        response[response_index++] = backlog_size;
+      } else if (strcmp(param, "repl-timeout") == 0) {
+        response[response_index++] = "repl-timeout";
+        response[response_index++] = repl_timeout;
+      } else if (strcmp(param, "repl-ping-replica-period") == 0) {
+        response[response_index++] = "repl-ping-replica-period";
+        response[response_index++] = ping_replica_period;
       } else {
         add_error_reply(client, "ERR Unknown config parameter");
         return;
       }
     }
     add_array_reply(client, response, response_index);
+  } else if (strcmp(ch->args[1], "SET") == 0) {
+    // CONFIG SET parameter value, only parameters that can change at runtime
+    unsigned long long size;
+    if (ch->arg_count != 4) {
+      add_error_reply(client, "ERR wrong number of arguments for 'config|set' command");
+    } else if (strcmp(ch->args[2], "repl-backlog-size") != 0) {
+      add_error_reply(client, "ERR Unsupported CONFIG parameter");
+    } else if (parse_memory_size(ch->args[3], &size) != ERR_NONE) {
+      add_error_reply(client, "ERR Invalid argument for CONFIG SET 'repl-backlog-size'");
+    } else {
+      replication_set_backlog_size(size);
+      add_simple_string_reply(client, "OK");
+    }
+  } else {
+    add_error_reply(client, "ERR unknown subcommand for 'config'");
   }
 }
 
 void handle_save(CommandHandler *ch) {
   Client *client = ch->client;
-  if (ch->arg_count != 1) {
-    add_error_reply(client, "ERR wrong number of arguments for 'save' command");
+  if (rdb_background_save_in_progress()) {
+    add_error_reply(client, "ERR Background save already in progress");
+    return;
   }
-
   redis_db_save(client->db);
 
   add_simple_string_reply(client, "OK");
 }
 
+void handle_bgsave(CommandHandler *ch) {
+  Client *client = ch->client;
+  if (rdb_background_save_in_progress()) {
+    add_error_reply(client, "ERR Background save already in progress");
+    return;
+  }
+  if (aof_rewrite_in_progress()) {
+    add_error_reply(client, "ERR Background append only file rewriting in progress");
+    return;
+  }
+  if (!rdb_save_background(client->db)) {
+    add_error_reply(client, "ERR Background save failed to start");
+    return;
+  }
+  add_simple_string_reply(client, "Background saving started");
+}
+
+/*
+Compacts the AOF in a forked child. While a background save runs the rewrite is scheduled to start
+after it, only one child runs at a time.
+*/
+void handle_bgrewriteaof(CommandHandler *ch) {
+  Client *client = ch->client;
+  if (aof_rewrite_in_progress()) {
+    add_error_reply(client, "ERR Background append only file rewriting already in progress");
+    return;
+  }
+  if (rdb_background_save_in_progress()) {
+    aof_schedule_rewrite();
+    add_simple_string_reply(client, "Background append only file rewriting scheduled");
+    return;
+  }
+  if (!aof_rewrite_background(client->db)) {
+    add_error_reply(client, "ERR Background append only file rewriting failed to start");
+    return;
+  }
+  add_simple_string_reply(client, "Background append only file rewriting started");
+}
+
 // gets the key count for the currently selected db
 void handle_dbsize(CommandHandler *ch) {
   Client *client = ch->client;
-  size_t dbsize = redis_db_dbsize(client->db);
+  size_t dbsize = shard_mode_enabled() ? shard_total_dbsize() : redis_db_dbsize(client->db);
 
   int size = (int)dbsize;
 
@@ -430,10 +616,17 @@ void handle_dbsize(CommandHandler *ch) {
 
 void handle_info(CommandHandler *ch) {
   Client *client = ch->client;
-  char info_output_buffer[INFO_BUFFER_SIZE];
+  // every replica gets a line of its own
+  size_t info_size = INFO_BUFFER_SIZE + g_server_info.num_replicas * INFO_REPLICA_SIZE;
+  char *info_output_buffer = malloc(info_size);
+  if (!info_output_buffer) {
+    perror("failed to allocate INFO reply");
+    add_error_reply(client, "ERR out of memory");
+    return;
+  }
   int current_offset = 0;
-  current_offset += snprintf(info_output_buffer + current_offset,
-                             sizeof(info_output_buffer) - current_offset, "# Replication\r\n");
+  current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                             "# Replication\r\n");
 
   const char *role_str;
   switch (g_server_info.role) {
@@ -445,28 +638,180 @@ void handle_info(CommandHandler *ch) {
     break;
   }
 
-  current_offset += snprintf(info_output_buffer + current_offset,
-                             sizeof(info_output_buffer) - current_offset, "role:%s\r\n", role_str);
-
-  current_offset +=
-      snprintf(info_output_buffer + current_offset, sizeof(info_output_buffer) - current_offset,
-               "master_replid:%s\r\n", g_server_info.master_replid);
-
-  current_offset +=
-      snprintf(info_output_buffer + current_offset, sizeof(info_output_buffer) - current_offset,
-               "master_repl_offset:%lld\r\n", g_server_info.master_repl_offset);
+  current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                             "role:%s\r\n", role_str);
+
+  long long now = current_time_millis();
+  if (g_server_info.role == ROLE_SLAVE) {
+    Client *master = g_server_info.master;
+    bool link_up = master && master->repl_client_state == REPL_STATE_READY;
+    current_offset += snprintf(
+        info_output_buffer + current_offset, info_size - current_offset,
+        "master_host:%s\r\nmaster_port:%s\r\nmaster_link_status:%s\r\n"
+        "master_last_io_seconds_ago:%lld\r\n",
+        g_server_config.master_host, g_server_config.master_port, link_up ? "up" : "down",
+        master ? (now - master->repl_last_io) / 1000 : -1);
+    if (!link_up) {
+      current_offset +=
+          snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                   "master_link_down_since_seconds:%lld\r\n",
+                   (now - g_server_info.master_link_down_since) / 1000);
+    }
+  }
+  if (g_server_info.role == ROLE_MASTER) {
+    current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                               "connected_slaves:%zu\r\n", g_server_info.num_replicas);
+  }
+  // the acknowledged offset and the seconds since the last acknowledgement tell how far behind
+  // each replica is
+  for (size_t i = 0; i < g_server_info.num_replicas; i++) {
+    Client *replica = g_server_info.replicas[i];
+    char ip[INET6_ADDRSTRLEN] = "?";
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(replica->fd, (struct sockaddr *)&addr, &addr_len) == 0) {
+      if (addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, ip, sizeof(ip));
+      } else if (addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, ip, sizeof(ip));
+      }
+    }
+    const char *state = "wait_bgsave";
+    if (replica->master_repl_state == MASTER_REPL_STATE_SENDING_RDB_DATA) state = "send_bulk";
+    if (replica->master_repl_state == MASTER_REPL_STATE_PROPAGATE) state = "online";
+    current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                               "slave%zu:ip=%s,port=%d,state=%s,offset=%lld,lag=%lld\r\n", i, ip,
+                               replica->repl_listening_port, state, replica->repl_ack_offset,
+                               (now - replica->repl_ack_time) / 1000);
+  }
+
+  current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                             "master_replid:%s\r\n", g_server_info.master_replid);
+
+  current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                             "master_replid2:%s\r\n", g_server_info.master_replid2);
+
+  current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                             "master_repl_offset:%lld\r\nsecond_repl_offset:%lld\r\n",
+                             g_server_info.master_repl_offset, g_server_info.second_replid_offset);
+
+  // the backlog holds the stream from repl_backlog_first_byte_offset on, replicas that are behind
+  // by no more than repl_backlog_histlen bytes can partially resync
+  bool backlog_active = g_server_info.repl_backlog != NULL;
+  current_offset += snprintf(
+      info_output_buffer + current_offset, info_size - current_offset,
+      "repl_backlog_active:%d\r\nrepl_backlog_size:%llu\r\n"
+      "repl_backlog_first_byte_offset:%lld\r\nrepl_backlog_histlen:%lld\r\n",
+      backlog_active, g_server_config.repl_backlog_size,
+      backlog_active ? g_server_info.repl_backlog_base_offset : 0,
+      backlog_active ? g_server_info.master_repl_offset - g_server_info.repl_backlog_base_offset
+                     : 0);
+
+  if (client->db) {
+    current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                               "# Memory\r\nused_memory:%zu\r\nmaxmemory:%llu\r\n"
+                               "maxmemory_policy:%s\r\nevicted_keys:%lld\r\n",
+                               redis_db_used_memory(client->db), g_server_config.maxmemory,
+                               maxmemory_policy_name(g_server_config.maxmemory_policy),
+                               client->db->evicted_keys);
+  }
+
+  current_offset += snprintf(info_output_buffer + current_offset, info_size - current_offset,
+                             "# Persistence\r\nrdb_bgsave_in_progress:%d\r\naof_enabled:%d\r\n"
+                             "aof_rewrite_in_progress:%d\r\n",
+                             rdb_background_save_in_progress() ? 1 : 0,
+                             g_server_config.appendonly ? 1 : 0, aof_rewrite_in_progress() ? 1 : 0);
   add_bulk_string_reply(client, info_output_buffer);
+  free(info_output_buffer);
 }
 
 void handle_replconf(CommandHandler *ch) {
-  if (ch->arg_count >= 3 && strcmp(ch->args[1], "GETACK") == 0 && strcmp(ch->args[2], "*") == 0) {
+  Client *client = ch->client;
+  if (ch->arg_count >= 3 && strcasecmp(ch->args[1], "GETACK") == 0 &&
+      strcmp(ch->args[2], "*") == 0) {
+    if (client->type == CLIENT_TYPE_MASTER) {
+      // acknowledged once the commands read along with the request ran
+      client->repl_ack_requested = true;
+      return;
+    }
     char offset_str[32];
     snprintf(offset_str, 32, "%lld", g_server_info.master_repl_offset);
     char *reply[3] = {"REPLCONF", "ACK", offset_str};
-    add_array_reply(ch->client, reply, 3);
+    add_array_reply(client, reply, 3);
+    return;
+  }
+  if (ch->arg_count >= 3 && strcasecmp(ch->args[1], "ACK") == 0) {
+    // a replica processed the stream up to the offset, acknowledgements are not replied to
+    long long offset;
+    if (client->type == CLIENT_TYPE_REPLICA && parse_long_long(ch->args[2], &offset) == ERR_NONE) {
+      if (offset > client->repl_ack_offset) client->repl_ack_offset = offset;
+      client->repl_ack_time = current_time_millis();
+    }
     return;
   }
-  add_simple_string_reply(ch->client, "OK");
+  if (ch->arg_count >= 3 && strcasecmp(ch->args[1], "listening-port") == 0) {
+    long port;
+    if (parse_integer(ch->args[2], &port) == ERR_NONE) client->repl_listening_port = (int)port;
+  }
+  if (client->should_reply) add_simple_string_reply(client, "OK");
+}
+
+/*
+WAIT numreplicas timeout, blocks the client until numreplicas replicas acknowledged the writes made
+before it, or timeout milliseconds passed, 0 waits forever. Replies with the number of replicas
+that acknowledged them.
+*/
+void handle_wait(CommandHandler *ch) {
+  Client *client = ch->client;
+  if (g_server_info.role == ROLE_SLAVE) {
+    add_error_reply(client, "ERR WAIT cannot be used with replica instances");
+    return;
+  }
+  long long numreplicas;
+  long long timeout;
+  if (parse_long_long(ch->args[1], &numreplicas) != ERR_NONE ||
+      parse_long_long(ch->args[2], &timeout) != ERR_NONE) {
+    add_error_reply(client, "ERR value is not an integer or out of range");
+    return;
+  }
+  if (timeout < 0) {
+    add_error_reply(client, "ERR timeout is negative");
+    return;
+  }
+  long long acked = replication_wait(client, numreplicas, timeout);
+  if (acked >= 0) add_integer_reply(client, acked);
+}
+
+/*
+REPLICAOF host port makes this server a replica of the master at host and port, REPLICAOF NO ONE
+promotes a replica to a master, which keeps its dataset and continues the stream of its former
+master.
+*/
+void handle_replicaof(CommandHandler *ch) {
+  Client *client = ch->client;
+  if (strcasecmp(ch->args[1], "no") == 0 && strcasecmp(ch->args[2], "one") == 0) {
+    if (g_server_info.role == ROLE_SLAVE) replication_unset_master();
+    add_simple_string_reply(client, "OK");
+    return;
+  }
+  long long port;
+  if (parse_long_long(ch->args[2], &port) != ERR_NONE || port < 1 || port > 65535) {
+    add_error_reply(client, "ERR Invalid master port");
+    return;
+  }
+  if (strlen(ch->args[1]) >= sizeof(g_server_config.master_host)) {
+    add_error_reply(client, "ERR Invalid master host");
+    return;
+  }
+  if (g_server_info.role == ROLE_SLAVE && strcmp(g_server_config.master_host, ch->args[1]) == 0 &&
+      strcmp(g_server_config.master_port, ch->args[2]) == 0) {
+    add_simple_string_reply(client, "OK Already connected to specified master");
+    return;
+  }
+  char port_str[6];
+  snprintf(port_str, sizeof(port_str), "%lld", port);
+  replication_set_master(client->db, ch->args[1], port_str);
+  add_simple_string_reply(client, "OK");
 }
 
 void handle_simple_string_reply(CommandHandler *ch) {
@@ -497,13 +842,21 @@ void handle_simple_string_reply(CommandHandler *ch) {
         client->repl_client_state = REPL_STATE_ERROR;
       };
     } else if (repl_client_state == REPL_STATE_SENT_PSYNC) {
-      if (strncmp(reply, "FULLRESYNC", 9) == 0) {
-        sscanf("FULLRESYNC %40s %lld", g_server_info.master_replid,
-               g_server_info.master_repl_offset);
-
-        printf("Replica sync: Master ID: %s, Offset: %lld\n", g_server_info.master_replid,
-               g_server_info.master_repl_offset);
+      char replid[REPLID_SIZE + 1];
+      long long offset;
+      if (sscanf(reply, "FULLRESYNC %40s %lld", replid, &offset) == 2) {
+        // the stream that follows the snapshot starts at this offset, the replica switches to it
+        // once the snapshot loaded
+        memcpy(client->psync_replid, replid, sizeof(client->psync_replid));
+        client->psync_offset = offset;
+
+        printf("Replica sync: Master ID: %s, Offset: %lld\n", replid, offset);
         client->repl_client_state = REPL_STATE_RECEIVED_FULLRESYNC_RESPONSE;
+      } else if (strncmp(reply, "CONTINUE", 8) == 0 && (reply[8] == '\0' || reply[8] == ' ')) {
+        // the master continues the stream from our offset, a promoted master under its new id
+        const char *replid = reply[8] == ' ' ? reply + 9 : g_server_info.master_replid;
+        snprintf(client->psync_replid, sizeof(client->psync_replid), "%s", replid);
+        client->repl_client_state = REPL_STATE_RECEIVED_CONTINUE;
       } else {
         fprintf(stderr, "error: expected reply in REPL_STATE_SENT_PSYNC, got '%s'\n", reply);
         client->repl_client_state = REPL_STATE_ERROR;
@@ -515,59 +868,31 @@ void handle_simple_string_reply(CommandHandler *ch) {
 void handle_psync(CommandHandler *ch) {
   Client *client = ch->client;
 
-  // Expect PSYNC <replid> <offset>
-  if (ch->arg_count < 3) {
-    add_error_reply(client, "ERR wrong number of arguments for 'psync' command");
+  // a replica passes on the stream of its master, which it only has once it is in sync with it
+  if (g_server_info.role == ROLE_SLAVE &&
+      (!g_server_info.master || g_server_info.master->repl_client_state != REPL_STATE_READY)) {
+    add_error_reply(client, "NOMASTERLINK Can't SYNC while not connected with my master");
     return;
   }
 
+  // Expect PSYNC <replid> <offset>
   char *replid = ch->args[1];
   char *offset_str = ch->args[2];
   char *endptr = NULL;
   long long replica_offset = strtoll(offset_str, &endptr, 10);
 
-  // If the replica provided a known master id and a valid numeric offset that falls
-  // inside the backlog window, do a partial resync
-  if (replid != NULL && replid[0] != '?' && strcmp(replid, g_server_info.master_replid) == 0 &&
-      endptr != NULL && *endptr == '\0' &&
-      replica_offset >= g_server_info.repl_backlog_base_offset &&
-      replica_offset <= g_server_info.master_repl_offset) {
+  // If the replica provided a known master id and a valid numeric offset whose stream is still
+  // in the replication buffer, do a partial resync
+  if (replid != NULL && replid[0] != '?' && endptr != NULL && *endptr == '\0' &&
+      continue_psync(client, replid, replica_offset)) {
     printf("Performing partial resync for replica %d from offset %lld\n", client->fd,
            replica_offset);
-    add_replica(client);
-    add_simple_string_reply(client, "CONTINUE");
-    client->repl_offset = replica_offset;
-    client->master_repl_state = MASTER_REPL_STATE_PSYNC;
-    client_enable_write_events(client);
     return;
   }
 
   // otherwise perform a full resync
   printf("Performing full resync for replica %d\n", client->fd);
-  add_replica(client);
-  add_fullresync_reply(client, g_server_info.master_replid, g_server_info.master_repl_offset);
-  // call save and send the RDB file
-  redis_db_save(client->db);
-
-  char *db_file_path = construct_file_path(g_server_config.dir, g_server_config.dbfilename);
-  printf("%s\n", db_file_path);
-  FILE *file = fopen(db_file_path, "rb");
-  if (!file) {
-    perror("Failed to open RDB file or it does not exist\n");
-  }
-  int rdb_file_fd = fileno(file);
-  struct stat statbuf;
-  fstat(rdb_file_fd, &statbuf);
-  off_t db_file_size = (off_t)statbuf.st_size;
-
-  client->rdb_fd = rdb_file_fd;
-  client->rdb_file_size = db_file_size;
-  printf("rdb file size: %ld\n", db_file_size);
-  client->rdb_file_offset = 0;
-
-  client->master_repl_state = MASTER_REPL_STATE_SENDING_RDB_DATA;
-  write_begin_bulk_string(client->output_buffer, (int64_t)db_file_size);
-  client_enable_write_events(client);
+  begin_fullresync(client);
 }
 
 void send_ping_command(Client *client) {
@@ -595,11 +920,26 @@ void send_replconf_capa_command(Client *client) {
   printf("sent replconf capa command with args: capa psync2\n");
 }
 
+void send_replconf_ack_command(Client *client) {
+  char offset_str[LONG_STR_SIZE];
+  snprintf(offset_str, sizeof(offset_str), "%lld", g_server_info.master_repl_offset);
+  char *args[3] = {"REPLCONF", "ACK", offset_str};
+  add_array_reply(client, args, 3);
+  flush_client_output(client);
+}
+
 void send_psync_command(Client *client) {
-  // initially hardcode PSYNC ? -1, for testing handshake
-  char *args[3] = {"PSYNC", "?", "-1"};
+  // a replica that knows the master's stream asks to continue it from its offset, PSYNC ? -1 asks
+  // for a full resync
+  char offset_str[LONG_STR_SIZE] = "-1";
+  char *replid = "?";
+  if (g_server_info.master_replid[0] != '\0') {
+    replid = g_server_info.master_replid;
+    snprintf(offset_str, sizeof(offset_str), "%lld", g_server_info.master_repl_offset);
+  }
+  char *args[3] = {"PSYNC", replid, offset_str};
   add_array_reply(client, args, 3);
   flush_client_output(client);
   client->repl_client_state = REPL_STATE_SENT_PSYNC;
-  printf("sent psync command with args: ? -1\n");
+  printf("sent psync command with args: %s %s\n", replid, offset_str);
 }
\ No newline at end of file
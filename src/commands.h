@@ -21,15 +21,21 @@ void handle_exist(CommandHandler *ch);
 void handle_delete(CommandHandler *ch);
 void handle_incr(CommandHandler *ch);
 void handle_decr(CommandHandler *ch);
+void handle_incrby(CommandHandler *ch);
+void handle_decrby(CommandHandler *ch);
 void handle_lpush(CommandHandler *ch);
 void handle_rpush(CommandHandler *ch);
 void handle_lrange(CommandHandler *ch);
 void handle_config(CommandHandler *ch);
 void handle_save(CommandHandler *ch);
+void handle_bgsave(CommandHandler *ch);
+void handle_bgrewriteaof(CommandHandler *ch);
 void handle_dbsize(CommandHandler *ch);
 void handle_info(CommandHandler *ch);
 void handle_replconf(CommandHandler *ch);
 void handle_psync(CommandHandler *ch);
+void handle_wait(CommandHandler *ch);
+void handle_replicaof(CommandHandler *ch);
 
 void handle_simple_string_reply(CommandHandler *ch);
 
@@ -42,9 +48,13 @@ void send_ping_command(Client *client);
 void send_replconf_listening_port_command(Client *client, char *replica_port);
 void send_replconf_capa_command(Client *client);
 void send_psync_command(Client *client);
+void send_replconf_ack_command(Client *client);
 
+char *encode_command(size_t argc, char **args, size_t *lens, size_t *len);
 void propogate_command(CommandHandler *ch);
+void propagate_deletion(const char *key);
 
 void add_error_reply(Client *client, const char *str);
+void add_integer_reply(Client *client, long long integer);
 
 #endif // COMMAND_H
\ No newline at end of file
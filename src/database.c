@@ -1,137 +1,449 @@
 #include "database.h"
-#include "khash.h"
+#include "commands.h"
+#include "dict.h"
 #include "linked_list.h"
 #include "rdb.h"
 #include "server_config.h"
 #include "util.h"
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 
-void destroy_redis_hash(khash_t(redis_hash) * h) {
-  for (khiter_t k = kh_begin(h); k != kh_end(h); k++) {
-    if (kh_exist(h, k)) {
-      free((char *)kh_key(h, k)); // free the key
-      RedisValue *rv = kh_value(h, k);
-      if (rv->type == TYPE_STRING) {
-        free(rv->data.str); // free the string data
-      } else if (rv->type == TYPE_LIST) {
-        destroy_list(rv->data.list);
-      }
-      free(rv);
+/*
+Every key lives in a single allocation together with its value header and, for short strings,
+the string itself:
+
+  [ RedisValue | dict link | expire_index | key_len | payload_size | key bytes, NUL | padding |
+    embedded sds ]
+
+The entry is linked into the keyspace through its dict link, whose key points at the key bytes.
+The RedisValue comes first so freeing the value frees the whole entry. Longer strings and lists
+are allocated separately.
+*/
+typedef struct db_entry {
+  RedisValue value;
+  dict_entry link;
+  size_t expire_index; // position in the expiry heap, only meaningful with an expiration
+  uint32_t key_len;
+  uint32_t payload_size; // bytes reserved for an embedded string
+  char key[];
+} db_entry;
+
+// strings up to this length are embedded in their entry
+#define EMBSTR_MAX_LEN 64
+
+// share of every server cron tick the active expire cycle may use
+#define ACTIVE_EXPIRE_CYCLE_PERCENT 25
+
+// the clock is checked once per this many reclaimed keys
+#define ACTIVE_EXPIRE_CYCLE_CHECK_INTERVAL 16
+
+// keys sampled per eviction round and candidates kept between rounds
+#define EVICTION_SAMPLES 5
+#define EVICTION_POOL_SIZE 16
+
+#define LRU_CLOCK_MAX ((1u << 24) - 1)
+
+// see touch_value
+#define LFU_INIT_VAL 5
+#define LFU_LOG_FACTOR 10
+#define LFU_DECAY_MINUTES 1
+
+// a key sampled for eviction, the most idle candidates are kept sorted by idle score
+typedef struct eviction_candidate {
+  unsigned long long idle;
+  sds key;
+} eviction_candidate;
+
+static size_t entry_payload_offset(size_t key_len) {
+  size_t offset = sizeof(db_entry) + key_len + 1;
+  // the embedded sds header holds a size_t
+  return (offset + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+static db_entry *create_entry(const char *key, size_t key_len, size_t payload_size) {
+  db_entry *entry = malloc(entry_payload_offset(key_len) + payload_size);
+  if (!entry) {
+    perror("failed to allocate database entry");
+    exit(EXIT_FAILURE);
+  }
+  entry->key_len = key_len;
+  entry->payload_size = payload_size;
+  memcpy(entry->key, key, key_len + 1);
+  entry->link.key = entry->key;
+  return entry;
+}
+
+static db_entry *entry_of(dict_entry *link) {
+  return (db_entry *)((char *)link - offsetof(db_entry, link));
+}
+
+// frees what the value owns outside of its entry
+static void free_value_payload(RedisValue *value) {
+  if (value->type == TYPE_STRING && value->encoding == ENCODING_RAW) {
+    sds_free(value->data.str);
+  } else if (value->type == TYPE_LIST) {
+    destroy_list(value->data.list);
+  }
+}
+
+static void free_entry(RedisValue *value) {
+  free_value_payload(value);
+  free(value);
+}
+
+static void free_linked_entry(dict_entry *link) { free_entry(&entry_of(link)->value); }
+
+// bytes allocated for what the value owns outside of its entry
+static size_t value_payload_memory_usage(const RedisValue *value) {
+  if (value->type == TYPE_STRING && value->encoding == ENCODING_RAW) {
+    return sizeof(struct sds_header) + sds_len(value->data.str) + 1;
+  } else if (value->type == TYPE_LIST) {
+    return list_memory_usage(value->data.list);
+  }
+  return 0;
+}
+
+static size_t entry_memory_usage(const db_entry *entry) {
+  return entry_payload_offset(entry->key_len) + entry->payload_size +
+         value_payload_memory_usage(&entry->value);
+}
+
+/*
+Access clocks for the eviction policies, kept in the 24 lru bits of every value. With LRU they hold
+the time of the last access in seconds. With LFU the upper 16 bits hold the time of the last
+decrement in minutes and the lower 8 bits a logarithmic access counter, which is incremented with a
+probability that drops as it grows and decremented once per LFU_DECAY_MINUTES of not being used.
+*/
+static unsigned lru_clock() { return (unsigned)(current_time_millis() / 1000) & LRU_CLOCK_MAX; }
+
+static unsigned long long lru_idle_seconds(const RedisValue *value) {
+  unsigned now = lru_clock();
+  if (now >= value->lru) return now - value->lru;
+  return now + LRU_CLOCK_MAX + 1 - value->lru; // the clock wrapped around
+}
+
+static unsigned lfu_minutes() { return (unsigned)(current_time_millis() / 60000) & 0xFFFF; }
+
+static unsigned lfu_decayed_counter(const RedisValue *value) {
+  unsigned elapsed = (lfu_minutes() - (value->lru >> 8)) & 0xFFFF;
+  unsigned periods = elapsed / LFU_DECAY_MINUTES;
+  unsigned counter = value->lru & 0xFF;
+  return periods > counter ? 0 : counter - periods;
+}
+
+static unsigned lfu_log_incr(unsigned counter) {
+  static __thread unsigned seed = 1;
+  if (counter == 255) return counter;
+  unsigned base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+  double p = 1.0 / (base * LFU_LOG_FACTOR + 1);
+  if ((double)rand_r(&seed) / RAND_MAX < p) counter++;
+  return counter;
+}
+
+// records an access to the value for the eviction policy
+static void touch_value(RedisValue *value, bool created) {
+  switch (g_server_config.maxmemory_policy) {
+  case MAXMEMORY_ALLKEYS_LRU:
+    value->lru = lru_clock();
+    break;
+  case MAXMEMORY_ALLKEYS_LFU: {
+    unsigned counter = created ? LFU_INIT_VAL : lfu_log_incr(lfu_decayed_counter(value));
+    value->lru = (lfu_minutes() << 8) | counter;
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+/*
+Keys with an expiration are kept in a binary min-heap ordered by expiration time, so the keys that
+expire first are found without scanning the keyspace. Every entry knows its position in the heap,
+which lets it be removed or moved when it is deleted or its expiration changes.
+*/
+static bool expires_before(const db_entry *a, const db_entry *b) {
+  return a->value.expiration < b->value.expiration;
+}
+
+static void expire_heap_place(redis_db_t *db, size_t index, db_entry *entry) {
+  db->expires[index] = entry;
+  entry->expire_index = index;
+}
+
+static void expire_heap_sift_up(redis_db_t *db, size_t index) {
+  db_entry *entry = db->expires[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (!expires_before(entry, db->expires[parent])) break;
+    expire_heap_place(db, index, db->expires[parent]);
+    index = parent;
+  }
+  expire_heap_place(db, index, entry);
+}
+
+static void expire_heap_sift_down(redis_db_t *db, size_t index) {
+  db_entry *entry = db->expires[index];
+  for (;;) {
+    size_t child = index * 2 + 1;
+    if (child >= db->expiry_count) break;
+    if (child + 1 < db->expiry_count &&
+        expires_before(db->expires[child + 1], db->expires[child])) {
+      child++;
     }
+    if (!expires_before(db->expires[child], entry)) break;
+    expire_heap_place(db, index, db->expires[child]);
+    index = child;
   }
-  kh_destroy(redis_hash, h);
+  expire_heap_place(db, index, entry);
 }
 
-static void set(redis_db_t *db, const char *key, const void *value, ValueType type,
-                long long expiration) {
-  khash_t(redis_hash) *h = db->h;
-  int ret;
-  char *old_key = NULL;
+static void expire_add(redis_db_t *db, db_entry *entry) {
+  if (db->expiry_count == db->expires_capacity) {
+    size_t capacity = db->expires_capacity ? db->expires_capacity * 2 : 16;
+    db_entry **expires = realloc(db->expires, capacity * sizeof(db_entry *));
+    if (!expires) {
+      perror("failed to grow the expiry index");
+      exit(EXIT_FAILURE);
+    }
+    db->expires = expires;
+    db->expires_capacity = capacity;
+  }
+  expire_heap_place(db, db->expiry_count++, entry);
+  expire_heap_sift_up(db, entry->expire_index);
+}
 
-  // check if the key already exists
-  khiter_t k = kh_get(redis_hash, h, key);
-  if (k != kh_end(h)) {
-    old_key = (char *)kh_key(h, k);
+static void expire_remove(redis_db_t *db, db_entry *entry) {
+  size_t index = entry->expire_index;
+  db_entry *last = db->expires[--db->expiry_count];
+  if (last == entry) return;
+  expire_heap_place(db, index, last);
+  expire_heap_sift_up(db, index);
+  expire_heap_sift_down(db, last->expire_index);
+}
+
+// moves the entry in the heap after its expiration changed from old_expiration
+static void expire_update(redis_db_t *db, db_entry *entry, long long old_expiration) {
+  bool had_expiration = old_expiration > 0;
+  bool has_expiration = entry->value.expiration > 0;
+  if (!had_expiration && has_expiration) {
+    expire_add(db, entry);
+  } else if (had_expiration && !has_expiration) {
+    expire_remove(db, entry);
+  } else if (has_expiration && entry->value.expiration != old_expiration) {
+    expire_heap_sift_up(db, entry->expire_index);
+    expire_heap_sift_down(db, entry->expire_index);
   }
+}
 
-  // attempt to put the key into the hash table
-  k = kh_put(redis_hash, h, key, &ret);
-  if (ret == 0) { // key present, we're updating an existing entry
-    RedisValue *old_value = kh_value(h, k);
-    if (old_value->type == TYPE_STRING) {
-      free(old_value->data.str);
+static void set(redis_db_t *db, const char *key, const void *value, size_t len, ValueType type,
+                long long expiration) {
+  // pick the representation first, it decides how large the entry has to be
+  ValueEncoding encoding = ENCODING_RAW;
+  long long integer;
+  size_t payload_size = 0;
+  if (type == TYPE_STRING) {
+    if (string_to_long_long(value, len, &integer) == ERR_NONE) {
+      encoding = ENCODING_INT;
+    } else if (len <= EMBSTR_MAX_LEN) {
+      encoding = ENCODING_EMBSTR;
+      payload_size = sizeof(struct sds_header) + len + 1;
+    }
+  }
+
+  db_entry *entry;
+  long long old_expiration = 0;
+  dict_entry *link = dict_find(db->keys, key);
+  if (link) { // key present, the entry is reused and only grown when its payload does not fit
+    entry = entry_of(link);
+    db->used_memory -= value_payload_memory_usage(&entry->value);
+    free_value_payload(&entry->value);
+    old_expiration = entry->value.expiration;
+    if (entry->payload_size < payload_size) {
+      // the entry moves, it is linked again at its new address
+      dict_unlink(db->keys, key);
+      entry = realloc(entry, entry_payload_offset(entry->key_len) + payload_size);
+      if (!entry) {
+        perror("failed to grow database entry");
+        exit(EXIT_FAILURE);
+      }
+      db->used_memory += payload_size - entry->payload_size;
+      entry->payload_size = payload_size;
+      entry->link.key = entry->key;
+      dict_add(db->keys, &entry->link);
+      if (old_expiration > 0) db->expires[entry->expire_index] = entry;
     }
-    free(old_key);
-    free(old_value);
   } else { // key is not present, inserting new key, increment db_key_count
+    entry = create_entry(key, strlen(key), payload_size);
+    db->used_memory += entry_payload_offset(entry->key_len) + payload_size;
+    dict_add(db->keys, &entry->link);
     db->key_count++;
-    if (expiration > 0) { // key has an expiration
-      db->expiry_count++;
-    }
   }
+  db->dirty++;
 
-  kh_key(h, k) = strdup(key);
-
-  RedisValue *redis_value = malloc(sizeof(RedisValue));
+  RedisValue *redis_value = &entry->value;
   redis_value->type = type;
-  redis_value->expiration = expiration;
+  redis_value->encoding = encoding;
+  redis_value->expiration = expiration > 0 ? expiration : 0;
+  expire_update(db, entry, old_expiration);
 
   // handle the value based on its type
   if (type == TYPE_STRING) {
-    redis_value->data.str = strdup(value);
+    if (encoding == ENCODING_INT) {
+      redis_value->data.integer = integer;
+    } else if (encoding == ENCODING_EMBSTR) {
+      struct sds_header *header =
+          (struct sds_header *)((char *)entry + entry_payload_offset(entry->key_len));
+      header->len = len;
+      memcpy(header->buf, value, len);
+      header->buf[len] = '\0';
+      redis_value->data.str = header->buf;
+    } else {
+      redis_value->data.str = sds_new_len(value, len);
+    }
   } else if (type == TYPE_LIST) {
     redis_value->data.list = (List)value;
   }
-
-  kh_value(h, k) = redis_value;
+  db->used_memory += value_payload_memory_usage(redis_value);
+  touch_value(redis_value, link == NULL);
 }
 
 static RedisValue *get(redis_db_t *db, const char *key) {
-  khash_t(redis_hash) *h = db->h;
-  khiter_t k = kh_get(redis_hash, h, key);
-  if (k != kh_end(h)) {
-    RedisValue *value = kh_value(h, k);
+  dict_entry *link = dict_find(db->keys, key);
+  if (link) {
+    RedisValue *value = &entry_of(link)->value;
     if (value->expiration > 0 && value->expiration < current_time_millis()) {
       // key value has expired, remove it
+      propagate_deletion(key);
       db->key_count--;
-      db->expiry_count--;
-      if (value->type == TYPE_STRING) {
-        free(value->data.str);
-      }
-      free(value);
-      kh_del(redis_hash, h, k);
+      db->used_memory -= entry_memory_usage(entry_of(link));
+      expire_remove(db, entry_of(link));
+      dict_unlink(db->keys, key);
+      free_entry(value);
       return NULL;
     }
+    touch_value(value, false);
     return value;
   }
   return NULL; // key not found
 }
 
-static bool exist(redis_db_t *db, const char *key) {
-  khash_t(redis_hash) *h = db->h;
-  khiter_t k = kh_get(redis_hash, h, key);
-  return k != kh_end(h) && kh_exist(h, k) ? true : false;
+/*
+Returns the bytes of a string value and stores their count in len. Integer encoded values are
+formatted into buf, which must hold LONG_STR_SIZE bytes.
+*/
+const char *redis_value_string(const RedisValue *value, char *buf, size_t *len) {
+  if (value->encoding == ENCODING_INT) {
+    *len = snprintf(buf, LONG_STR_SIZE, "%lld", value->data.integer);
+    return buf;
+  }
+  *len = sds_len(value->data.str);
+  return value->data.str;
+}
+
+/*
+Adds increment to the integer stored at key, creating it with value 0 first when the key does not
+exist. An integer encoded value is updated in place. Returns ERR_TYPE_MISMATCH for non-strings,
+ERR_VALUE when the value is not an integer and ERR_OVERFLOW when the result would not fit.
+*/
+int redis_db_incr_by(redis_db_t *db, const char *key, long long increment, long long *result) {
+  RedisValue *value = get(db, key);
+  if (value == NULL) {
+    char buf[LONG_STR_SIZE];
+    int len = snprintf(buf, sizeof(buf), "%lld", increment);
+    set(db, key, buf, len, TYPE_STRING, 0);
+    *result = increment;
+    return ERR_NONE;
+  }
+  if (value->type != TYPE_STRING) return ERR_TYPE_MISMATCH;
+
+  // every canonical integer is stored integer encoded, other strings are never integers
+  if (value->encoding != ENCODING_INT) return ERR_VALUE;
+
+  long long current = value->data.integer;
+  if ((increment < 0 && current < LLONG_MIN - increment) ||
+      (increment > 0 && current > LLONG_MAX - increment)) {
+    return ERR_OVERFLOW;
+  }
+  value->data.integer = current + increment;
+  db->dirty++;
+  *result = value->data.integer;
+  return ERR_NONE;
 }
 
+static bool exist(redis_db_t *db, const char *key) { return dict_find(db->keys, key) != NULL; }
+
 static void delete(redis_db_t *db, const char *key) {
-  khash_t(redis_hash) *h = db->h;
-  khiter_t k = kh_get(redis_hash, h, key);
-
-  if (k != kh_end(h)) { // check if the key exists
-    RedisValue *rv = kh_value(h, k);
-    if (rv != NULL) { // additional check to ensure rv is not NULL
-      if (rv->type == TYPE_STRING) {
-        free(rv->data.str);
-      } else if (rv->type == TYPE_LIST) {
-        destroy_list(rv->data.list);
-      }
-      free(rv);
-    }
-    free((char *)kh_key(h, k));
-    kh_del(redis_hash, h, k);
+  dict_entry *link = dict_unlink(db->keys, key);
+
+  if (link) { // check if the key exists
+    RedisValue *rv = &entry_of(link)->value;
+    db->used_memory -= entry_memory_usage(entry_of(link));
+    if (rv->expiration > 0) expire_remove(db, entry_of(link));
+    free_entry(rv); // the key is part of the entry
     db->key_count--;
+    db->dirty++;
   }
 }
 
 redis_db_t *redis_db_create() {
   redis_db_t *db = malloc(sizeof(redis_db_t));
   if (!db) return NULL;
-  db->h = kh_init(redis_hash);
+  db->keys = dict_create();
   db->key_count = 0;
+  db->expires = NULL;
   db->expiry_count = 0;
+  db->expires_capacity = 0;
+  db->used_memory = 0;
+  db->evicted_keys = 0;
+  db->eviction_pool = NULL;
+  db->eviction_pool_count = 0;
+  db->dirty = 0;
   return db;
 }
 
+/*
+Sizes the keyspace and the expiry index for the given number of keys, used when the count is known
+before the keys are added.
+*/
+void redis_db_expand(redis_db_t *db, size_t keys, size_t expires) {
+  dict_expand(db->keys, keys);
+  if (expires <= db->expires_capacity) return;
+  db_entry **grown = realloc(db->expires, expires * sizeof(db_entry *));
+  if (!grown) {
+    perror("failed to grow the expiry index");
+    exit(EXIT_FAILURE);
+  }
+  db->expires = grown;
+  db->expires_capacity = expires;
+}
+
 void redis_db_destroy(redis_db_t *db) {
   if (!db) return;
-  destroy_redis_hash(db->h);
+  dict_destroy(db->keys, free_linked_entry);
+  free(db->expires);
+  for (size_t i = 0; i < db->eviction_pool_count; i++) {
+    sds_free(db->eviction_pool[i].key);
+  }
+  free(db->eviction_pool);
   free(db);
 }
 
 void redis_db_set(redis_db_t *db, const char *key, const void *value, ValueType type,
                   long long expiration) {
-  set(db, key, value, type, expiration);
+  set(db, key, value, type == TYPE_STRING ? strlen(value) : 0, type, expiration);
+}
+
+/*
+Sets a string value of len bytes, which may contain NULs.
+*/
+void redis_db_set_string(redis_db_t *db, const char *key, const char *value, size_t len,
+                         long long expiration) {
+  set(db, key, value, len, TYPE_STRING, expiration);
 }
 RedisValue *redis_db_get(redis_db_t *db, const char *key) { return get(db, key); }
 bool redis_db_exist(redis_db_t *db, const char *key) { return exist(db, key); }
@@ -147,9 +459,11 @@ int redis_db_lpush(redis_db_t *db, const char *key, const char *item, int *lengt
   } else {
     // if no existing value, create a new list
     list = create_list();
-    set(db, key, list, TYPE_LIST, -1);
+    set(db, key, list, 0, TYPE_LIST, -1);
   }
   lpush(list, item, length);
+  db->used_memory += list_node_memory_usage(strlen(item));
+  db->dirty++;
   return 0;
 }
 
@@ -164,9 +478,11 @@ int redis_db_rpush(redis_db_t *db, const char *key, const char *item, int *lengt
   } else {
     // if no existing value, create a new list
     list = create_list();
-    set(db, key, list, TYPE_LIST, 0);
+    set(db, key, list, 0, TYPE_LIST, 0);
   }
   rpush(list, item, length);
+  db->used_memory += list_node_memory_usage(strlen(item));
+  db->dirty++;
   return 0;
 }
 
@@ -189,6 +505,55 @@ int redis_db_lrange(redis_db_t *db, const char *key, int start, int end, char **
   return 0;
 }
 
+/*
+Exchanges the datasets of two databases. A dataset loaded aside replaces the one clients use
+without changing the database they point at.
+*/
+void redis_db_swap(redis_db_t *a, redis_db_t *b) {
+  redis_db_t tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+// moves every key of src into dsts[owner(key)], or into dsts[0] without an owner
+static void move_keys(redis_db_t *src, redis_db_t **dsts, int (*owner)(const char *key)) {
+  dict_iterator it;
+  dict_iter_init(&it, src->keys);
+  dict_entry *link;
+  while ((link = dict_iter_next(&it))) {
+    db_entry *entry = entry_of(link);
+    redis_db_t *dst = dsts[owner ? owner(link->key) : 0];
+
+    delete (dst, link->key);
+    dict_add(dst->keys, link);
+    dst->key_count++;
+    dst->used_memory += entry_memory_usage(entry);
+    if (entry->value.expiration > 0) {
+      expire_add(dst, entry);
+    }
+  }
+  dict_iter_release(&it);
+  dict_clear(src->keys, NULL);
+  src->key_count = 0;
+  src->expiry_count = 0;
+  src->used_memory = 0;
+}
+
+/*
+Moves every key of src into dst without copying the keys or values, src is left empty. When a key
+exists in both databases the value from src wins.
+*/
+void redis_db_merge(redis_db_t *dst, redis_db_t *src) { move_keys(src, &dst, NULL); }
+
+/*
+Moves every key of src into the database owner picks for it among dsts, e.g. a loaded snapshot
+into the shards owning its keys. Like redis_db_merge the keys and values are not copied, src is
+left empty.
+*/
+void redis_db_split(redis_db_t *src, redis_db_t **dsts, int (*owner)(const char *key)) {
+  move_keys(src, dsts, owner);
+}
+
 bool redis_db_save(redis_db_t *db) {
   return rdb_save_data_to_file(db, g_server_config.dir, g_server_config.dbfilename);
 }
@@ -196,3 +561,169 @@ bool redis_db_save(redis_db_t *db) {
 size_t redis_db_dbsize(redis_db_t *db) { return db->key_count; }
 
 size_t redis_db_expiry_count(redis_db_t *db) { return db->expiry_count; }
+
+/*
+Iterates over every key of the database, expired keys included. Keys must not be added or removed
+until the iterator is released, except for the key just returned.
+*/
+void redis_db_iter_init(redis_db_iterator *it, redis_db_t *db) { dict_iter_init(it, db->keys); }
+
+bool redis_db_iter_next(redis_db_iterator *it, const char **key, RedisValue **value) {
+  dict_entry *link = dict_iter_next(it);
+  if (!link) return false;
+  *key = link->key;
+  *value = &entry_of(link)->value;
+  return true;
+}
+
+void redis_db_iter_release(redis_db_iterator *it) { dict_iter_release(it); }
+
+/*
+Deletes keys whose expiration passed, earliest first, until none is left or time_limit_ms is used
+up. Returns the number of keys deleted.
+*/
+size_t redis_db_active_expire(redis_db_t *db, long long time_limit_ms) {
+  long long start = current_time_millis();
+  long long now = start;
+  size_t expired = 0;
+  while (db->expiry_count > 0 && db->expires[0]->value.expiration < now) {
+    propagate_deletion(db->expires[0]->key);
+    delete (db, db->expires[0]->key);
+    expired++;
+    if (expired % ACTIVE_EXPIRE_CYCLE_CHECK_INTERVAL == 0) {
+      now = current_time_millis();
+      if (now - start >= time_limit_ms) break;
+    }
+  }
+  return expired;
+}
+
+/*
+Background work done on every tick of the server cron. Reclaims expired keys that are never read
+again, within a share of the tick, then moves keys to a grown table for up to a millisecond so
+rehashing finishes even when no commands are running.
+*/
+void redis_db_cron(redis_db_t *db) {
+  long long tick_ms = 1000 / g_server_config.hz;
+  // a replica deletes expired keys when its master tells it to
+  if (g_server_info.role == ROLE_MASTER) {
+    redis_db_active_expire(db, tick_ms * ACTIVE_EXPIRE_CYCLE_PERCENT / 100);
+  }
+  if (dict_is_rehashing(db->keys)) dict_rehash_milliseconds(db->keys, 1);
+}
+
+// score of a value for eviction, the higher the sooner it is evicted
+static unsigned long long eviction_idle_score(const RedisValue *value) {
+  if (g_server_config.maxmemory_policy == MAXMEMORY_ALLKEYS_LFU) {
+    return 255 - lfu_decayed_counter(value);
+  }
+  return lru_idle_seconds(value);
+}
+
+// adds a sampled key to the pool, which keeps the EVICTION_POOL_SIZE most idle keys seen so far
+static void eviction_pool_insert(redis_db_t *db, const char *key, unsigned long long idle) {
+  eviction_candidate *pool = db->eviction_pool;
+  for (size_t i = 0; i < db->eviction_pool_count; i++) {
+    if (strcmp(pool[i].key, key) == 0) return;
+  }
+  if (db->eviction_pool_count == EVICTION_POOL_SIZE) {
+    if (idle <= pool[0].idle) return;
+    // drop the least idle candidate to make room
+    sds_free(pool[0].key);
+    memmove(pool, pool + 1, (EVICTION_POOL_SIZE - 1) * sizeof(eviction_candidate));
+    db->eviction_pool_count--;
+  }
+  size_t index = db->eviction_pool_count;
+  while (index > 0 && pool[index - 1].idle > idle) {
+    pool[index] = pool[index - 1];
+    index--;
+  }
+  pool[index].idle = idle;
+  pool[index].key = sds_new(key);
+  db->eviction_pool_count++;
+}
+
+/*
+Approximates the configured policy: a few random keys are sampled into the pool of the best
+candidates seen so far, and the most idle candidate that still exists is picked. Returns NULL when
+the keyspace is empty.
+*/
+static db_entry *pick_eviction_candidate(redis_db_t *db) {
+  if (!db->eviction_pool) {
+    db->eviction_pool = malloc(EVICTION_POOL_SIZE * sizeof(eviction_candidate));
+    if (!db->eviction_pool) {
+      perror("failed to allocate eviction pool");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  while (db->key_count > 0) {
+    dict_entry *samples[EVICTION_SAMPLES];
+    size_t count = dict_sample(db->keys, samples, EVICTION_SAMPLES);
+    for (size_t i = 0; i < count; i++) {
+      eviction_pool_insert(db, samples[i]->key, eviction_idle_score(&entry_of(samples[i])->value));
+    }
+
+    // candidates may have been deleted or overwritten since they were sampled
+    while (db->eviction_pool_count > 0) {
+      sds key = db->eviction_pool[--db->eviction_pool_count].key;
+      dict_entry *link = dict_find(db->keys, key);
+      sds_free(key);
+      if (link) return entry_of(link);
+    }
+  }
+  return NULL;
+}
+
+/*
+Evicts keys following the maxmemory policy until the keyspace fits in maxmemory again. In sharded
+mode every shard gets an equal share of maxmemory. Returns ERR_OOM when memory could not be freed,
+the caller then rejects commands that would use more.
+*/
+int redis_db_evict_if_needed(redis_db_t *db) {
+  unsigned long long limit = g_server_config.maxmemory;
+  if (limit == 0) return ERR_NONE;
+  if (g_server_config.shards > 1) limit /= g_server_config.shards;
+  if (db->used_memory <= limit) return ERR_NONE;
+  if (g_server_config.maxmemory_policy == MAXMEMORY_NO_EVICTION) return ERR_OOM;
+
+  while (db->used_memory > limit) {
+    db_entry *victim;
+    if (g_server_config.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
+      // the expiry heap already orders the keys by time to live
+      victim = db->expiry_count > 0 ? db->expires[0] : NULL;
+    } else {
+      victim = pick_eviction_candidate(db);
+    }
+    if (!victim) return ERR_OOM;
+
+    propagate_deletion(victim->key);
+    delete (db, victim->key);
+    db->evicted_keys++;
+  }
+  return ERR_NONE;
+}
+
+static const char *maxmemory_policy_names[] = {
+    [MAXMEMORY_NO_EVICTION] = "noeviction",
+    [MAXMEMORY_ALLKEYS_LRU] = "allkeys-lru",
+    [MAXMEMORY_ALLKEYS_LFU] = "allkeys-lfu",
+    [MAXMEMORY_VOLATILE_TTL] = "volatile-ttl",
+};
+
+const char *maxmemory_policy_name(maxmemory_policy_t policy) {
+  return maxmemory_policy_names[policy];
+}
+
+// returns ERR_VALUE when name is not a known policy
+int parse_maxmemory_policy(const char *name, maxmemory_policy_t *policy) {
+  for (size_t i = 0; i < sizeof(maxmemory_policy_names) / sizeof(maxmemory_policy_names[0]); i++) {
+    if (strcasecmp(name, maxmemory_policy_names[i]) == 0) {
+      *policy = (maxmemory_policy_t)i;
+      return ERR_NONE;
+    }
+  }
+  return ERR_VALUE;
+}
+
+size_t redis_db_used_memory(redis_db_t *db) { return db->used_memory; }
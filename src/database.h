@@ -1,41 +1,83 @@
 #ifndef DATABASE_H
 #define DATABASE_H
-#include "khash.h"
+#include "dict.h"
 #include "linked_list.h"
+#include "sds.h"
 #include "sys/time.h"
 #include <stdbool.h>
 
 typedef enum { TYPE_STRING, TYPE_LIST } ValueType;
 
+/*
+How a TYPE_STRING value is stored. Strings that are canonical integers are kept as integers, short
+strings are embedded in the allocation of their key and longer strings have their own sds.
+*/
+typedef enum { ENCODING_RAW, ENCODING_INT, ENCODING_EMBSTR } ValueEncoding;
+
+// which keys are evicted once maxmemory is reached
+typedef enum {
+  MAXMEMORY_NO_EVICTION, // writes are rejected instead
+  MAXMEMORY_ALLKEYS_LRU,
+  MAXMEMORY_ALLKEYS_LFU,
+  MAXMEMORY_VOLATILE_TTL, // the keys closest to expiring
+} maxmemory_policy_t;
+
 typedef struct {
-  ValueType type;
+  ValueType type : 4;
+  ValueEncoding encoding : 4;
+  unsigned lru : 24; // access clock of the maxmemory policy, LRU time or LFU counter
   union {
-    char *str;
+    sds str;
+    long long integer;
     List list;
   } data;
   time_t expiration;
 } RedisValue;
 
-KHASH_MAP_INIT_STR(redis_hash, RedisValue *)
-
 typedef struct redis_db {
-  khash_t(redis_hash) * h;
+  dict *keys;
   size_t key_count;
+  struct db_entry **expires; // min-heap of the keys with an expiration, earliest first
   size_t expiry_count;
+  size_t expires_capacity;
+  size_t used_memory; // bytes allocated for keys and values
+  long long evicted_keys;
+  struct eviction_candidate *eviction_pool;
+  size_t eviction_pool_count;
+  long long dirty; // number of changes, tells whether a command modified the dataset
 } redis_db_t;
 
+typedef dict_iterator redis_db_iterator;
+
 redis_db_t *redis_db_create();
 void redis_db_destroy(redis_db_t *db);
 void redis_db_set(redis_db_t *db, const char *key, const void *value, ValueType type,
                   long long expiration);
+void redis_db_set_string(redis_db_t *db, const char *key, const char *value, size_t len,
+                         long long expiration);
 RedisValue *redis_db_get(redis_db_t *db, const char *key);
+const char *redis_value_string(const RedisValue *value, char *buf, size_t *len);
+int redis_db_incr_by(redis_db_t *db, const char *key, long long increment, long long *result);
 bool redis_db_exist(redis_db_t *db, const char *key);
 void redis_db_delete(redis_db_t *db, const char *key);
 int redis_db_lpush(redis_db_t *db, const char *key, const char *item, int *length);
 int redis_db_rpush(redis_db_t *db, const char *key, const char *item, int *length);
 int redis_db_lrange(redis_db_t *db, const char *key, int start, int end, char ***range,
                     int *range_length);
+void redis_db_merge(redis_db_t *dst, redis_db_t *src);
+void redis_db_split(redis_db_t *src, redis_db_t **dsts, int (*owner)(const char *key));
+void redis_db_swap(redis_db_t *a, redis_db_t *b);
+void redis_db_expand(redis_db_t *db, size_t keys, size_t expires);
 bool redis_db_save(redis_db_t *db);
 size_t redis_db_dbsize(redis_db_t *db);
 size_t redis_db_expiry_count(redis_db_t *db);
+void redis_db_iter_init(redis_db_iterator *it, redis_db_t *db);
+bool redis_db_iter_next(redis_db_iterator *it, const char **key, RedisValue **value);
+void redis_db_iter_release(redis_db_iterator *it);
+size_t redis_db_active_expire(redis_db_t *db, long long time_limit_ms);
+void redis_db_cron(redis_db_t *db);
+size_t redis_db_used_memory(redis_db_t *db);
+int redis_db_evict_if_needed(redis_db_t *db);
+const char *maxmemory_policy_name(maxmemory_policy_t policy);
+int parse_maxmemory_policy(const char *name, maxmemory_policy_t *policy);
 #endif // DATABASE_H
\ No newline at end of file
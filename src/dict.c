@@ -0,0 +1,307 @@
+#include "dict.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DICT_INITIAL_SIZE 4
+
+// buckets moved per step are bounded, but so are the empty buckets skipped to find them
+#define DICT_EMPTY_VISITS_PER_STEP 10
+
+// xorshift64*, per thread since every shard samples its own keyspace
+static __thread uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t dict_random() {
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return random_state * 2685821657736338717ULL;
+}
+
+// FNV-1a
+static uint64_t dict_hash(const char *key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void table_init(dict_table *table, size_t size) {
+  table->buckets = NULL;
+  table->size = size;
+  table->used = 0;
+  if (size == 0) return;
+  table->buckets = calloc(size, sizeof(dict_entry *));
+  if (!table->buckets) {
+    perror("failed to allocate hash table");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void table_free(dict_table *table, dict_free_proc free_proc) {
+  for (size_t i = 0; i < table->size && free_proc; i++) {
+    dict_entry *entry = table->buckets[i];
+    while (entry) {
+      dict_entry *next = entry->next;
+      free_proc(entry);
+      entry = next;
+    }
+  }
+  free(table->buckets);
+  table_init(table, 0);
+}
+
+dict *dict_create() {
+  dict *d = malloc(sizeof(dict));
+  if (!d) {
+    perror("failed to allocate dict");
+    exit(EXIT_FAILURE);
+  }
+  table_init(&d->tables[0], 0);
+  table_init(&d->tables[1], 0);
+  d->rehash_index = -1;
+  d->iterators = 0;
+  return d;
+}
+
+/*
+Removes every entry, calling free_proc on each unless it is NULL.
+*/
+void dict_clear(dict *d, dict_free_proc free_proc) {
+  table_free(&d->tables[0], free_proc);
+  table_free(&d->tables[1], free_proc);
+  d->rehash_index = -1;
+}
+
+void dict_destroy(dict *d, dict_free_proc free_proc) {
+  if (!d) return;
+  dict_clear(d, free_proc);
+  free(d);
+}
+
+size_t dict_size(const dict *d) { return d->tables[0].used + d->tables[1].used; }
+
+bool dict_is_rehashing(const dict *d) { return d->rehash_index != -1; }
+
+/*
+Moves up to steps buckets from the old table to the new one. Returns true while there is more to
+move.
+*/
+bool dict_rehash(dict *d, int steps) {
+  if (!dict_is_rehashing(d)) return false;
+  dict_table *from = &d->tables[0];
+  dict_table *to = &d->tables[1];
+  int empty_visits = steps * DICT_EMPTY_VISITS_PER_STEP;
+
+  while (steps-- && from->used > 0) {
+    while (from->buckets[d->rehash_index] == NULL) {
+      d->rehash_index++;
+      if (--empty_visits == 0) return true;
+    }
+    dict_entry *entry = from->buckets[d->rehash_index];
+    while (entry) {
+      dict_entry *next = entry->next;
+      size_t index = dict_hash(entry->key) & (to->size - 1);
+      entry->next = to->buckets[index];
+      to->buckets[index] = entry;
+      from->used--;
+      to->used++;
+      entry = next;
+    }
+    from->buckets[d->rehash_index] = NULL;
+    d->rehash_index++;
+  }
+
+  if (from->used > 0) return true;
+
+  // every entry moved, the new table takes the place of the old one
+  free(from->buckets);
+  *from = *to;
+  table_init(to, 0);
+  d->rehash_index = -1;
+  return false;
+}
+
+/*
+Rehashes in batches for about ms milliseconds, used when the server is idle. Returns the number of
+buckets moved.
+*/
+int dict_rehash_milliseconds(dict *d, int ms) {
+  if (d->iterators > 0) return 0;
+  long long start = current_time_millis();
+  int moved = 0;
+  while (dict_rehash(d, 100)) {
+    moved += 100;
+    if (current_time_millis() - start > ms) break;
+  }
+  return moved;
+}
+
+// moves a single bucket on behalf of a lookup or update, unless an iterator is running
+static void rehash_step(dict *d) {
+  if (d->iterators == 0) dict_rehash(d, 1);
+}
+
+static void expand_if_needed(dict *d) {
+  if (dict_is_rehashing(d)) return;
+  dict_table *table = &d->tables[0];
+  if (table->size == 0) {
+    table_init(table, DICT_INITIAL_SIZE);
+    return;
+  }
+  if (table->used < table->size) return;
+
+  size_t size = table->size;
+  while (size < table->used * 2) size *= 2;
+  table_init(&d->tables[1], size);
+  d->rehash_index = 0;
+}
+
+/*
+Makes room for size entries up front, e.g. before loading a snapshot whose key count is known, so
+the table does not go through every doubling on the way. Does nothing while rehashing or when the
+table is already large enough.
+*/
+void dict_expand(dict *d, size_t size) {
+  if (dict_is_rehashing(d) || size <= d->tables[0].size) return;
+  size_t real_size = DICT_INITIAL_SIZE;
+  while (real_size < size) real_size *= 2;
+  if (d->tables[0].size == 0) {
+    table_init(&d->tables[0], real_size);
+    return;
+  }
+  table_init(&d->tables[1], real_size);
+  d->rehash_index = 0;
+}
+
+dict_entry *dict_find(dict *d, const char *key) {
+  if (dict_size(d) == 0) return NULL;
+  if (dict_is_rehashing(d)) rehash_step(d);
+
+  uint64_t hash = dict_hash(key);
+  for (int t = 0; t <= 1; t++) {
+    dict_table *table = &d->tables[t];
+    if (table->size == 0) continue;
+    for (dict_entry *entry = table->buckets[hash & (table->size - 1)]; entry;
+         entry = entry->next) {
+      if (strcmp(entry->key, key) == 0) return entry;
+    }
+    if (!dict_is_rehashing(d)) break;
+  }
+  return NULL;
+}
+
+/*
+Inserts an entry whose key must not be in the table yet.
+*/
+void dict_add(dict *d, dict_entry *entry) {
+  if (dict_is_rehashing(d)) rehash_step(d);
+  expand_if_needed(d);
+
+  // while rehashing new entries go to the new table, the old one only shrinks
+  dict_table *table = dict_is_rehashing(d) ? &d->tables[1] : &d->tables[0];
+  size_t index = dict_hash(entry->key) & (table->size - 1);
+  entry->next = table->buckets[index];
+  table->buckets[index] = entry;
+  table->used++;
+}
+
+/*
+Removes the entry holding key from the table without freeing it. Returns NULL when the key is not
+in the table.
+*/
+dict_entry *dict_unlink(dict *d, const char *key) {
+  if (dict_size(d) == 0) return NULL;
+  if (dict_is_rehashing(d)) rehash_step(d);
+
+  uint64_t hash = dict_hash(key);
+  for (int t = 0; t <= 1; t++) {
+    dict_table *table = &d->tables[t];
+    if (table->size == 0) continue;
+    dict_entry **link = &table->buckets[hash & (table->size - 1)];
+    for (dict_entry *entry = *link; entry; link = &entry->next, entry = entry->next) {
+      if (strcmp(entry->key, key) == 0) {
+        *link = entry->next;
+        table->used--;
+        return entry;
+      }
+    }
+    if (!dict_is_rehashing(d)) break;
+  }
+  return NULL;
+}
+
+/*
+Collects up to count entries from a random position, for callers that approximate a policy over
+the whole table by looking at a few keys, like eviction. Entries that share a bucket or sit in
+neighbouring buckets are returned together, so the result is random but not uniform. Returns the
+number of entries stored in entries.
+*/
+size_t dict_sample(dict *d, dict_entry **entries, size_t count) {
+  if (dict_size(d) == 0 || count == 0) return 0;
+  if (dict_is_rehashing(d)) rehash_step(d);
+
+  // buckets of tables[0] below rehash_index are empty, they were already moved
+  size_t max_size = d->tables[0].size;
+  if (dict_is_rehashing(d) && d->tables[1].size > max_size) max_size = d->tables[1].size;
+  size_t index = dict_random() & (max_size - 1);
+  size_t empty_visits = count * DICT_EMPTY_VISITS_PER_STEP;
+  size_t stored = 0;
+
+  for (size_t steps = 0; stored < count && steps < max_size; steps++) {
+    bool found = false;
+    for (int t = 0; t <= 1; t++) {
+      dict_table *table = &d->tables[t];
+      if (index >= table->size) continue;
+      if (t == 0 && dict_is_rehashing(d) && (long)index < d->rehash_index) continue;
+      for (dict_entry *entry = table->buckets[index]; entry && stored < count;
+           entry = entry->next) {
+        entries[stored++] = entry;
+        found = true;
+      }
+      if (!dict_is_rehashing(d)) break;
+    }
+    if (!found && --empty_visits == 0) {
+      // sparse table, jump somewhere else
+      index = dict_random() & (max_size - 1);
+      empty_visits = count * DICT_EMPTY_VISITS_PER_STEP;
+      continue;
+    }
+    index = (index + 1) & (max_size - 1);
+  }
+  return stored;
+}
+
+/*
+Iterates over every entry. Rehashing is paused until the iterator is released, the entry just
+returned may be unlinked or freed but nothing else may be removed or added meanwhile.
+*/
+void dict_iter_init(dict_iterator *it, dict *d) {
+  it->d = d;
+  it->table = 0;
+  it->index = 0;
+  it->next = NULL;
+  d->iterators++;
+}
+
+dict_entry *dict_iter_next(dict_iterator *it) {
+  while (!it->next) {
+    dict_table *table = &it->d->tables[it->table];
+    if (it->index >= table->size) {
+      if (it->table == 1 || !dict_is_rehashing(it->d)) return NULL;
+      it->table = 1;
+      it->index = 0;
+      continue;
+    }
+    it->next = table->buckets[it->index++];
+  }
+  dict_entry *entry = it->next;
+  it->next = entry->next;
+  return entry;
+}
+
+void dict_iter_release(dict_iterator *it) { it->d->iterators--; }
@@ -0,0 +1,70 @@
+#ifndef DICT_H
+#define DICT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+Hash table of C string keys that grows without stopping the world. When the table fills up a
+second table twice its size is allocated and the buckets are moved over a few at a time: every
+lookup, insert and delete moves one bucket, and the server cron moves more while the server is
+idle. Until the move completes lookups check both tables and inserts go to the new one.
+
+The table is intrusive: callers embed a dict_entry in their own allocation and point its key at
+bytes that stay valid while the entry is in the table, so no memory is allocated per key.
+*/
+typedef struct dict_entry {
+  struct dict_entry *next;
+  const char *key;
+} dict_entry;
+
+typedef struct dict_table {
+  dict_entry **buckets;
+  size_t size; // a power of two, 0 when nothing is allocated
+  size_t used;
+} dict_table;
+
+typedef struct dict {
+  dict_table tables[2]; // entries move from tables[0] to tables[1] while rehashing
+  long rehash_index;    // next bucket of tables[0] to move, -1 when not rehashing
+  int iterators;        // rehashing is paused while iterators are running
+} dict;
+
+typedef struct dict_iterator {
+  dict *d;
+  int table;
+  size_t index;
+  dict_entry *next;
+} dict_iterator;
+
+typedef void (*dict_free_proc)(dict_entry *entry);
+
+dict *dict_create();
+void dict_destroy(dict *d, dict_free_proc free_proc);
+void dict_clear(dict *d, dict_free_proc free_proc);
+size_t dict_size(const dict *d);
+bool dict_is_rehashing(const dict *d);
+
+dict_entry *dict_find(dict *d, const char *key);
+void dict_add(dict *d, dict_entry *entry);
+dict_entry *dict_unlink(dict *d, const char *key);
+
+size_t dict_sample(dict *d, dict_entry **entries, size_t count);
+
+void dict_expand(dict *d, size_t size);
+bool dict_rehash(dict *d, int steps);
+int dict_rehash_milliseconds(dict *d, int ms);
+
+void dict_iter_init(dict_iterator *it, dict *d);
+dict_entry *dict_iter_next(dict_iterator *it);
+void dict_iter_release(dict_iterator *it);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DICT_H
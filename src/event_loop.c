@@ -0,0 +1,293 @@
+#include "event_loop.h"
+#include "event_loop_uring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define EPOLL_MAX_EVENTS 10000
+
+// epoll data of listening and wakeup fds is tagged with this bit, clients are stored untagged
+#define EPOLL_SOURCE_TAG 1
+
+typedef enum { SOURCE_LISTENER, SOURCE_WAKEUP } source_type_t;
+
+// a listening socket or a wakeup fd registered with the epoll backend
+typedef struct event_source {
+  source_type_t type;
+  int fd;
+  event_loop_accept_proc accept_proc;
+  event_loop_wakeup_proc wakeup_proc;
+  void *data;
+  struct event_source *next;
+} event_source_t;
+
+// a timerfd registered as a wakeup fd, works the same on both backends
+typedef struct event_timer {
+  int fd;
+  event_loop_wakeup_proc proc;
+  void *data;
+  struct event_timer *next;
+} event_timer_t;
+
+struct event_loop {
+  io_backend_t backend;
+  event_loop_client_proc client_proc;
+  event_timer_t *timers;
+
+  /* epoll backend */
+  int epoll_fd;
+  struct epoll_event *events;
+  event_source_t *sources;
+
+  /* io_uring backend */
+  uring_t *uring;
+};
+
+event_loop_t *event_loop_create(io_backend_t backend, event_loop_client_proc client_proc) {
+  event_loop_t *loop = calloc(1, sizeof(event_loop_t));
+  if (!loop) {
+    perror("failed to allocate event loop");
+    exit(EXIT_FAILURE);
+  }
+  loop->client_proc = client_proc;
+  loop->epoll_fd = -1;
+
+  if (backend == IO_BACKEND_IO_URING) {
+    loop->uring = uring_create(client_proc);
+    if (loop->uring) {
+      loop->backend = IO_BACKEND_IO_URING;
+      return loop;
+    }
+    fprintf(stderr, "io_uring is not available, falling back to epoll\n");
+  }
+
+  loop->backend = IO_BACKEND_EPOLL;
+  loop->epoll_fd = epoll_create(1);
+  loop->events = malloc(sizeof(struct epoll_event) * EPOLL_MAX_EVENTS);
+  if (loop->epoll_fd == -1 || !loop->events) {
+    perror("epoll_create failed");
+    exit(EXIT_FAILURE);
+  }
+  return loop;
+}
+
+void event_loop_destroy(event_loop_t *loop) {
+  if (!loop) return;
+  if (loop->uring) uring_destroy(loop->uring);
+  if (loop->epoll_fd != -1) close(loop->epoll_fd);
+  while (loop->sources) {
+    event_source_t *next = loop->sources->next;
+    free(loop->sources);
+    loop->sources = next;
+  }
+  while (loop->timers) {
+    event_timer_t *next = loop->timers->next;
+    close(loop->timers->fd);
+    free(loop->timers);
+    loop->timers = next;
+  }
+  free(loop->events);
+  free(loop);
+}
+
+io_backend_t event_loop_backend(event_loop_t *loop) { return loop->backend; }
+
+static void epoll_add_source(event_loop_t *loop, event_source_t *source) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = (uint64_t)(uintptr_t)source | EPOLL_SOURCE_TAG;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == -1) {
+    perror("epoll_ctl failed");
+    exit(EXIT_FAILURE);
+  }
+  source->next = loop->sources;
+  loop->sources = source;
+}
+
+/*
+Registers a listening socket. The accept proc is called with every accepted connection.
+*/
+void event_loop_add_listener(event_loop_t *loop, int fd, event_loop_accept_proc proc, void *data) {
+  if (loop->backend == IO_BACKEND_IO_URING) {
+    uring_add_listener(loop->uring, fd, proc, data);
+    return;
+  }
+  event_source_t *source = calloc(1, sizeof(event_source_t));
+  if (!source) {
+    perror("failed to allocate event source");
+    exit(EXIT_FAILURE);
+  }
+  source->type = SOURCE_LISTENER;
+  source->fd = fd;
+  source->accept_proc = proc;
+  source->data = data;
+  epoll_add_source(loop, source);
+}
+
+/*
+Registers an fd, e.g. an eventfd, whose readability wakes the loop up. The wakeup proc is
+responsible for draining it.
+*/
+void event_loop_add_wakeup(event_loop_t *loop, int fd, event_loop_wakeup_proc proc, void *data) {
+  if (loop->backend == IO_BACKEND_IO_URING) {
+    uring_add_wakeup(loop->uring, fd, proc, data);
+    return;
+  }
+  event_source_t *source = calloc(1, sizeof(event_source_t));
+  if (!source) {
+    perror("failed to allocate event source");
+    exit(EXIT_FAILURE);
+  }
+  source->type = SOURCE_WAKEUP;
+  source->fd = fd;
+  source->wakeup_proc = proc;
+  source->data = data;
+  epoll_add_source(loop, source);
+}
+
+static void timer_fired(void *data) {
+  event_timer_t *timer = data;
+  uint64_t expirations;
+  if (read(timer->fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+    perror("failed to read timerfd");
+  }
+  timer->proc(timer->data);
+}
+
+/*
+Calls proc every interval_ms milliseconds. Ticks missed while the loop was busy are coalesced into
+a single call.
+*/
+void event_loop_add_timer(event_loop_t *loop, int interval_ms, event_loop_wakeup_proc proc,
+                          void *data) {
+  event_timer_t *timer = calloc(1, sizeof(event_timer_t));
+  if (!timer) {
+    perror("failed to allocate timer");
+    exit(EXIT_FAILURE);
+  }
+  timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer->fd == -1) {
+    perror("timerfd_create failed");
+    exit(EXIT_FAILURE);
+  }
+  struct itimerspec spec;
+  spec.it_interval.tv_sec = interval_ms / 1000;
+  spec.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+  spec.it_value = spec.it_interval;
+  if (timerfd_settime(timer->fd, 0, &spec, NULL) == -1) {
+    perror("timerfd_settime failed");
+    exit(EXIT_FAILURE);
+  }
+  timer->proc = proc;
+  timer->data = data;
+  timer->next = loop->timers;
+  loop->timers = timer;
+  event_loop_add_wakeup(loop, timer->fd, timer_fired, timer);
+}
+
+void event_loop_add_client(event_loop_t *loop, Client *client) {
+  client->epoll_events = 0;
+  if (loop->backend == IO_BACKEND_IO_URING) return; // nothing is armed until events are set
+
+  struct epoll_event event;
+  event.events = 0;
+  event.data.ptr = client;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client->fd, &event) == -1) {
+    perror("epoll_ctl failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+Stops reporting events for a client. With io_uring, operations still in flight are cancelled and
+destroy_client defers freeing the client until they completed.
+*/
+void event_loop_remove_client(event_loop_t *loop, Client *client) {
+  if (!loop) return;
+  if (loop->backend == IO_BACKEND_IO_URING) {
+    uring_remove_client(loop->uring, client);
+    return;
+  }
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+}
+
+/*
+Sets the events (EPOLLIN and/or EPOLLOUT) the client is interested in.
+*/
+void event_loop_set_client_events(event_loop_t *loop, Client *client, int events) {
+  if (!loop) {
+    // no event loop on this thread, e.g. in tests
+    client->epoll_events = events;
+    return;
+  }
+  if (loop->backend == IO_BACKEND_IO_URING) {
+    client->epoll_events = events;
+    uring_sync_client(loop->uring, client);
+    return;
+  }
+
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = client;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) == -1) {
+    perror("epoll_ctl mod failed");
+    exit(EXIT_FAILURE);
+  }
+  client->epoll_events = events;
+}
+
+/*
+Hands the client's pending output to the backend. Returns false when the caller should write it to
+the socket itself, true when the backend sends it (io_uring batches the sends of all clients into
+one submission per loop iteration).
+*/
+bool event_loop_queue_send(event_loop_t *loop, Client *client) {
+  if (!loop || loop->backend != IO_BACKEND_IO_URING) return false;
+  return uring_queue_send(loop->uring, client);
+}
+
+static int epoll_process_events(event_loop_t *loop) {
+  int num_events = epoll_wait(loop->epoll_fd, loop->events, EPOLL_MAX_EVENTS, -1);
+  if (num_events == -1) {
+    if (errno == EINTR) return 0;
+    perror("epoll_wait failed");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < num_events; i++) {
+    struct epoll_event *event = &loop->events[i];
+    if (!(event->data.u64 & EPOLL_SOURCE_TAG)) {
+      loop->client_proc((Client *)event->data.ptr, event->events);
+      continue;
+    }
+
+    event_source_t *source = (event_source_t *)(uintptr_t)(event->data.u64 & ~EPOLL_SOURCE_TAG);
+    if (source->type == SOURCE_WAKEUP) {
+      source->wakeup_proc(source->data);
+      continue;
+    }
+    int fd = accept(source->fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept failed");
+      }
+      continue;
+    }
+    source->accept_proc(fd, source->data);
+  }
+  return num_events;
+}
+
+/*
+Waits for events and dispatches them. Returns the number of events handled.
+*/
+int event_loop_process_events(event_loop_t *loop) {
+  if (loop->backend == IO_BACKEND_IO_URING) {
+    return uring_process_events(loop->uring);
+  }
+  return epoll_process_events(loop);
+}
@@ -0,0 +1,48 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "client.h"
+#include "server_config.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+Event loop abstraction over the I/O backends. With epoll the loop reports which sockets are ready
+and the server does the reads and writes itself. With io_uring the reads and writes of regular
+clients are performed by the kernel: the loop receives into the client's input buffer and sends
+out of its output buffer, and only reports what happened. Clients of the other types (replicas
+and the master connection) are still driven by readiness on both backends.
+*/
+
+// reported with a client's events when the backend already received bytes into its input buffer
+#define EVENT_LOOP_INPUT (1u << 24)
+
+typedef struct event_loop event_loop_t;
+
+typedef void (*event_loop_accept_proc)(int fd, void *data);
+typedef void (*event_loop_wakeup_proc)(void *data);
+typedef void (*event_loop_client_proc)(Client *client, uint32_t events);
+
+event_loop_t *event_loop_create(io_backend_t backend, event_loop_client_proc client_proc);
+void event_loop_destroy(event_loop_t *loop);
+io_backend_t event_loop_backend(event_loop_t *loop);
+int event_loop_process_events(event_loop_t *loop);
+
+void event_loop_add_listener(event_loop_t *loop, int fd, event_loop_accept_proc proc, void *data);
+void event_loop_add_wakeup(event_loop_t *loop, int fd, event_loop_wakeup_proc proc, void *data);
+void event_loop_add_timer(event_loop_t *loop, int interval_ms, event_loop_wakeup_proc proc,
+                          void *data);
+
+void event_loop_add_client(event_loop_t *loop, Client *client);
+void event_loop_remove_client(event_loop_t *loop, Client *client);
+void event_loop_set_client_events(event_loop_t *loop, Client *client, int events);
+bool event_loop_queue_send(event_loop_t *loop, Client *client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,550 @@
+#include "event_loop_uring.h"
+#include "client.h"
+#include "ring_buffer.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+io_uring backend. Listening sockets use a multishot accept, regular clients a multishot recv
+that picks its buffers from a ring of provided buffers, and replies are sent with send requests.
+Requests are only queued in the submission queue while events are handled, so a single
+io_uring_enter() call per loop iteration submits the sends of every client and waits for the next
+completions. Clients of the other types, and wakeup fds, are driven by poll requests that report
+readiness like epoll does.
+
+The liburing helpers are not used, the rings are set up with the raw system calls.
+*/
+
+#define URING_ENTRIES 4096
+#define URING_BUF_COUNT 1024 // must be a power of two
+#define URING_BUF_SIZE 16384
+#define URING_BUF_GROUP 0
+
+// the low bits of a request's user_data tell what it was, the remaining bits are a pointer
+typedef enum {
+  URING_OP_ACCEPT = 1,
+  URING_OP_WAKEUP,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_POLL,
+  URING_OP_CANCEL
+} uring_op_t;
+#define URING_OP_MASK 7
+
+// requests a client has in flight, kept in client->io_flags
+#define URING_RECV_ARMED (1 << 0)
+#define URING_RECV_CANCELING (1 << 1)
+#define URING_SEND_INFLIGHT (1 << 2)
+#define URING_POLL_ARMED (1 << 3)
+#define URING_POLL_CANCELING (1 << 4)
+#define URING_CLOSING (1 << 5)
+
+// a listening socket or a wakeup fd
+typedef struct uring_source {
+  int fd;
+  event_loop_accept_proc accept_proc;
+  event_loop_wakeup_proc wakeup_proc;
+  void *data;
+  struct uring_source *next;
+} uring_source_t;
+
+struct uring {
+  int fd;
+  event_loop_client_proc client_proc;
+
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail; // requests queued so far, published to the kernel on submission
+  unsigned sq_submitted;  // requests the kernel consumed
+  struct io_uring_sqe *sqes;
+
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  // provided buffers multishot receives pick from
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *bufs;
+  unsigned short buf_tail;
+
+  uring_source_t *sources;
+};
+
+static uint64_t uring_user_data(void *ptr, uring_op_t op) { return (uint64_t)(uintptr_t)ptr | op; }
+
+static int uring_enter(uring_t *ring, unsigned wait_nr) {
+  unsigned to_submit = ring->sq_local_tail - ring->sq_submitted;
+  if (to_submit == 0 && wait_nr == 0) return 0;
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, NULL, 0);
+  if (ret > 0) ring->sq_submitted += ret;
+  return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head >= ring->sq_entries) {
+    // the submission queue is full, submit what is queued without waiting for completions
+    if (uring_enter(ring, 0) < 0 && errno != EINTR && errno != EBUSY) {
+      perror("io_uring_enter failed");
+      exit(EXIT_FAILURE);
+    }
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+      fprintf(stderr, "io_uring submission queue is full\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+  ring->sq_local_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void uring_recycle_buffer(uring_t *ring, unsigned short bid) {
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_setup_rings(uring_t *ring, struct io_uring_params *params) {
+  ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params->features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) return -1;
+  if (single_mmap) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) return -1;
+  }
+  ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) return -1;
+
+  char *sq = ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + params->sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params->sq_off.ring_mask);
+  ring->sq_entries = *(unsigned *)(sq + params->sq_off.ring_entries);
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->sq_submitted = ring->sq_local_tail;
+  // submission queue entries are always used in order
+  unsigned *sq_array = (unsigned *)(sq + params->sq_off.array);
+  for (unsigned i = 0; i < ring->sq_entries; i++) {
+    sq_array[i] = i;
+  }
+
+  char *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + params->cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+  return 0;
+}
+
+static int uring_setup_buffers(uring_t *ring) {
+  ring->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ring->buf_ring == MAP_FAILED) {
+    ring->buf_ring = NULL;
+    return -1;
+  }
+  ring->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+  if (!ring->bufs) return -1;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid = URING_BUF_GROUP;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return -1;
+  }
+
+  ring->buf_tail = 0;
+  for (unsigned short bid = 0; bid < URING_BUF_COUNT; bid++) {
+    uring_recycle_buffer(ring, bid);
+  }
+  return 0;
+}
+
+/*
+Creates an io_uring instance for the calling thread. Returns NULL if the kernel does not support
+the features the backend needs, in which case the caller falls back to epoll.
+*/
+uring_t *uring_create(event_loop_client_proc client_proc) {
+  uring_t *ring = calloc(1, sizeof(uring_t));
+  if (!ring) {
+    perror("failed to allocate io_uring");
+    return NULL;
+  }
+  ring->client_proc = client_proc;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // the ring is only used by the thread running the event loop, completions are only processed
+  // when it waits for them
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  params.cq_entries = URING_ENTRIES * 4;
+  ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ring->fd == -1 && errno == EINVAL) {
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  }
+  if (ring->fd == -1) {
+    perror("io_uring_setup failed");
+    free(ring);
+    return NULL;
+  }
+
+  if (!(params.features & IORING_FEAT_NODROP) || uring_setup_rings(ring, &params) == -1 ||
+      uring_setup_buffers(ring) == -1) {
+    perror("io_uring setup failed");
+    uring_destroy(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+void uring_destroy(uring_t *ring) {
+  if (ring->sqes && ring->sqes != MAP_FAILED && ring->buf_ring) {
+    // the ring is torn down asynchronously after it is closed, cancel everything still in flight
+    // first so the sockets, e.g. the listening one, are released right away
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = uring_user_data(NULL, URING_OP_CANCEL);
+    uring_enter(ring, 1);
+  }
+  if (ring->fd != -1) close(ring->fd);
+  if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_ring_size);
+  free(ring->bufs);
+  while (ring->sources) {
+    uring_source_t *next = ring->sources->next;
+    free(ring->sources);
+    ring->sources = next;
+  }
+  free(ring);
+}
+
+static void uring_arm_accept(uring_t *ring, uring_source_t *source) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = source->fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = uring_user_data(source, URING_OP_ACCEPT);
+}
+
+static void uring_arm_wakeup(uring_t *ring, uring_source_t *source) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = source->fd;
+  sqe->poll32_events = EPOLLIN;
+  sqe->user_data = uring_user_data(source, URING_OP_WAKEUP);
+}
+
+static uring_source_t *uring_add_source(uring_t *ring, int fd, void *data) {
+  uring_source_t *source = calloc(1, sizeof(uring_source_t));
+  if (!source) {
+    perror("failed to allocate event source");
+    exit(EXIT_FAILURE);
+  }
+  source->fd = fd;
+  source->data = data;
+  source->next = ring->sources;
+  ring->sources = source;
+  return source;
+}
+
+void uring_add_listener(uring_t *ring, int fd, event_loop_accept_proc proc, void *data) {
+  uring_source_t *source = uring_add_source(ring, fd, data);
+  source->accept_proc = proc;
+  uring_arm_accept(ring, source);
+}
+
+void uring_add_wakeup(uring_t *ring, int fd, event_loop_wakeup_proc proc, void *data) {
+  uring_source_t *source = uring_add_source(ring, fd, data);
+  source->wakeup_proc = proc;
+  uring_arm_wakeup(ring, source);
+}
+
+static void uring_cancel(uring_t *ring, Client *client, uring_op_t op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = uring_user_data(client, op);
+  sqe->user_data = uring_user_data(NULL, URING_OP_CANCEL);
+}
+
+static void uring_send(uring_t *ring, Client *client) {
+  if (client->io_flags & URING_SEND_INFLIGHT) return;
+
+  char *output_buf;
+  size_t readable_len;
+  if (rb_readable(client->output_buffer, &output_buf, &readable_len) != 0 || readable_len == 0) {
+    return;
+  }
+
+  // the readable region is not touched until the send completes, replies are appended after it
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = client->fd;
+  sqe->addr = (uint64_t)(uintptr_t)output_buf;
+  sqe->len = readable_len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = uring_user_data(client, URING_OP_SEND);
+  client->io_flags |= URING_SEND_INFLIGHT;
+  client->io_refs++;
+}
+
+/*
+Brings the requests a client has in flight in line with the events it is interested in. Regular
+clients receive with a multishot recv and send whatever is in their output buffer, other clients
+get a poll request for their events.
+*/
+void uring_sync_client(uring_t *ring, Client *client) {
+  if ((client->io_flags & URING_CLOSING) || client->destroy_pending) return;
+
+  bool regular = client->type == CLIENT_TYPE_REGULAR;
+  // stop receiving while bytes that did not fit in the input buffer are waiting to be parsed
+  bool want_recv = regular && (client->epoll_events & EPOLLIN) && client->input_spill_len == 0;
+  if (want_recv && !(client->io_flags & URING_RECV_ARMED)) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = uring_user_data(client, URING_OP_RECV);
+    client->io_flags |= URING_RECV_ARMED;
+    client->io_refs++;
+  } else if (!want_recv && (client->io_flags & URING_RECV_ARMED) &&
+             !(client->io_flags & URING_RECV_CANCELING)) {
+    uring_cancel(ring, client, URING_OP_RECV);
+    client->io_flags |= URING_RECV_CANCELING;
+  }
+
+  int poll_events = 0;
+  if (regular) {
+    uring_send(ring, client);
+  } else {
+    poll_events = client->epoll_events & (EPOLLIN | EPOLLOUT);
+  }
+
+  if (client->io_flags & URING_POLL_ARMED) {
+    // the poll is re-armed with the new events once the cancellation completed
+    if (client->io_poll_events != poll_events && !(client->io_flags & URING_POLL_CANCELING)) {
+      uring_cancel(ring, client, URING_OP_POLL);
+      client->io_flags |= URING_POLL_CANCELING;
+    }
+  } else if (poll_events) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->fd;
+    sqe->poll32_events = poll_events;
+    sqe->user_data = uring_user_data(client, URING_OP_POLL);
+    client->io_flags |= URING_POLL_ARMED;
+    client->io_poll_events = poll_events;
+    client->io_refs++;
+  }
+}
+
+/*
+Queues a send of the client's output. Only regular clients are written through the ring, the
+others write to their sockets directly unless a send queued earlier is still in flight.
+*/
+bool uring_queue_send(uring_t *ring, Client *client) {
+  if (client->io_flags & URING_CLOSING) return true;
+  if (client->type != CLIENT_TYPE_REGULAR) return client->io_flags & URING_SEND_INFLIGHT;
+  uring_send(ring, client);
+  return true;
+}
+
+void uring_remove_client(uring_t *ring, Client *client) {
+  if (client->io_flags & URING_CLOSING) return;
+  client->io_flags |= URING_CLOSING;
+  if ((client->io_flags & URING_RECV_ARMED) && !(client->io_flags & URING_RECV_CANCELING)) {
+    uring_cancel(ring, client, URING_OP_RECV);
+  }
+  if ((client->io_flags & URING_POLL_ARMED) && !(client->io_flags & URING_POLL_CANCELING)) {
+    uring_cancel(ring, client, URING_OP_POLL);
+  }
+  if (client->io_flags & URING_SEND_INFLIGHT) {
+    uring_cancel(ring, client, URING_OP_SEND);
+  }
+}
+
+/*
+Reports the events of a completed request to the server and, when the request is done, drops the
+reference it held on the client. A client destroyed while requests were in flight is freed when
+the last one completes.
+*/
+static void uring_complete(uring_t *ring, Client *client, uint32_t events, bool done) {
+  if (events && !(client->io_flags & URING_CLOSING) && !client->destroy_pending) {
+    client->io_refs++; // keeps the client around while its events are handled
+    ring->client_proc(client, events);
+    client->io_refs--;
+  }
+  if (done) client->io_refs--;
+
+  if (client->destroy_pending) {
+    if (client->io_refs == 0) destroy_client(client);
+    return;
+  }
+  uring_sync_client(ring, client);
+}
+
+static void uring_handle_recv(uring_t *ring, Client *client, struct io_uring_cqe *cqe) {
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0 && !(client->io_flags & URING_CLOSING)) {
+      client_append_input(client, ring->bufs + (size_t)bid * URING_BUF_SIZE, cqe->res);
+    }
+    uring_recycle_buffer(ring, bid);
+  }
+  if (!more) client->io_flags &= ~(URING_RECV_ARMED | URING_RECV_CANCELING);
+
+  uint32_t events = 0;
+  if (cqe->res > 0) {
+    events = EVENT_LOOP_INPUT;
+  } else if (cqe->res == 0) {
+    events = EPOLLHUP; // the peer closed the connection
+  } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+    events = EPOLLERR;
+  }
+  uring_complete(ring, client, events, !more);
+}
+
+static void uring_handle_send(uring_t *ring, Client *client, struct io_uring_cqe *cqe) {
+  client->io_flags &= ~URING_SEND_INFLIGHT;
+  uint32_t events = 0;
+  if (!(client->io_flags & URING_CLOSING)) {
+    if (cqe->res > 0) {
+      if (client_release_output(client, cqe->res) != 0) {
+        fprintf(stderr, "failed to update read index for client output buffer\n");
+      }
+    } else if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+      events = EPOLLERR;
+    }
+  }
+  uring_complete(ring, client, events, true);
+}
+
+static void uring_handle_poll(uring_t *ring, Client *client, struct io_uring_cqe *cqe) {
+  client->io_flags &= ~(URING_POLL_ARMED | URING_POLL_CANCELING);
+  uint32_t events = 0;
+  if (cqe->res > 0) {
+    // a poll cancelled after it fired may report events the client is no longer interested in
+    events = (uint32_t)cqe->res & (client->epoll_events | EPOLLHUP | EPOLLERR);
+  }
+  uring_complete(ring, client, events, true);
+}
+
+static void uring_handle_cqe(uring_t *ring, struct io_uring_cqe *cqe) {
+  uring_op_t op = cqe->user_data & URING_OP_MASK;
+  void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+  switch (op) {
+  case URING_OP_ACCEPT: {
+    uring_source_t *source = ptr;
+    if (cqe->res >= 0) {
+      source->accept_proc(cqe->res, source->data);
+    } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+      fprintf(stderr, "accept failed: %s\n", strerror(-cqe->res));
+    }
+    // a multishot accept stops after an error
+    if (!(cqe->flags & IORING_CQE_F_MORE)) uring_arm_accept(ring, source);
+    break;
+  }
+  case URING_OP_WAKEUP: {
+    uring_source_t *source = ptr;
+    if (cqe->res > 0) source->wakeup_proc(source->data);
+    uring_arm_wakeup(ring, source);
+    break;
+  }
+  case URING_OP_RECV:
+    uring_handle_recv(ring, ptr, cqe);
+    break;
+  case URING_OP_SEND:
+    uring_handle_send(ring, ptr, cqe);
+    break;
+  case URING_OP_POLL:
+    uring_handle_poll(ring, ptr, cqe);
+    break;
+  case URING_OP_CANCEL:
+    // the cancelled request completes on its own
+    break;
+  }
+}
+
+/*
+Submits everything queued since the last call, waits for at least one completion and handles
+all available completions.
+*/
+int uring_process_events(uring_t *ring) {
+  if (uring_enter(ring, 1) < 0) {
+    if (errno == EINTR) return 0;
+    if (errno != EBUSY && errno != EAGAIN) {
+      perror("io_uring_enter failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  int handled = 0;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+    head++;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    uring_handle_cqe(ring, &cqe);
+    handled++;
+    if (head == tail) tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  }
+  return handled;
+}
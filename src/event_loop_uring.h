@@ -0,0 +1,21 @@
+#ifndef EVENT_LOOP_URING_H
+#define EVENT_LOOP_URING_H
+
+#include "event_loop.h"
+
+// io_uring backend of the event loop, only used through event_loop.c
+
+typedef struct uring uring_t;
+
+uring_t *uring_create(event_loop_client_proc client_proc);
+void uring_destroy(uring_t *ring);
+int uring_process_events(uring_t *ring);
+
+void uring_add_listener(uring_t *ring, int fd, event_loop_accept_proc proc, void *data);
+void uring_add_wakeup(uring_t *ring, int fd, event_loop_wakeup_proc proc, void *data);
+
+void uring_remove_client(uring_t *ring, Client *client);
+void uring_sync_client(uring_t *ring, Client *client);
+bool uring_queue_send(uring_t *ring, Client *client);
+
+#endif // EVENT_LOOP_URING_H
@@ -0,0 +1,207 @@
+#include "io_threads.h"
+#include "client.h"
+#include "command_handler.h"
+#include "redis-server.h"
+#include "ring_buffer.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+Threaded I/O. The main thread collects the clients that became readable during an event loop
+iteration, then the I/O threads (the main thread takes a share as thread 0) read their sockets
+and parse the input into queued commands. The main thread executes every queued command against
+the database, so the keyspace keeps a single writer, and finally the replies are written back to
+the sockets by the I/O threads again. The main thread waits for each phase to finish, so a client
+is only ever touched by one thread at a time.
+*/
+
+typedef enum { IO_OP_READ, IO_OP_WRITE } io_op_t;
+
+static pthread_t io_thread_ids[IO_THREADS_MAX];
+static int io_threads_num = 1;
+
+// clients queued for the current event loop iteration
+static Client **pending_clients = NULL;
+static size_t pending_count = 0;
+static size_t pending_capacity = 0;
+
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long io_generation = 0; // incremented every time a new job is handed out
+static io_op_t io_op;
+static int io_pending = 0; // worker threads that have not finished the current job
+static bool io_stop = false;
+
+// processes every client assigned to a thread, clients are assigned round robin
+static void process_clients(int id, io_op_t op) {
+  for (size_t i = id; i < pending_count; i += io_threads_num) {
+    Client *client = pending_clients[i];
+    if (op == IO_OP_READ) {
+      client_read_and_parse(client);
+    } else {
+      flush_client_output(client);
+    }
+  }
+}
+
+static void *io_thread_main(void *arg) {
+  int id = (int)(long)arg;
+  unsigned long seen_generation = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&io_mutex);
+    while (io_generation == seen_generation && !io_stop) {
+      pthread_cond_wait(&io_start_cond, &io_mutex);
+    }
+    if (io_stop) {
+      pthread_mutex_unlock(&io_mutex);
+      break;
+    }
+    seen_generation = io_generation;
+    io_op_t op = io_op;
+    pthread_mutex_unlock(&io_mutex);
+
+    process_clients(id, op);
+
+    pthread_mutex_lock(&io_mutex);
+    if (--io_pending == 0) {
+      pthread_cond_signal(&io_done_cond);
+    }
+    pthread_mutex_unlock(&io_mutex);
+  }
+  return NULL;
+}
+
+/*
+Runs an operation over all pending clients. When there are fewer clients than threads it is not
+worth waking the I/O threads up, so the main thread does all of the work itself.
+*/
+static void run_io_job(io_op_t op) {
+  if (io_threads_num == 1 || pending_count < (size_t)io_threads_num) {
+    for (size_t i = 0; i < pending_count; i++) {
+      if (op == IO_OP_READ) {
+        client_read_and_parse(pending_clients[i]);
+      } else {
+        flush_client_output(pending_clients[i]);
+      }
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&io_mutex);
+  io_op = op;
+  io_pending = io_threads_num - 1;
+  io_generation++;
+  pthread_cond_broadcast(&io_start_cond);
+  pthread_mutex_unlock(&io_mutex);
+
+  process_clients(0, op);
+
+  pthread_mutex_lock(&io_mutex);
+  while (io_pending > 0) {
+    pthread_cond_wait(&io_done_cond, &io_mutex);
+  }
+  pthread_mutex_unlock(&io_mutex);
+}
+
+void io_threads_init(int num_threads) {
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > IO_THREADS_MAX) num_threads = IO_THREADS_MAX;
+  io_threads_num = num_threads;
+  if (io_threads_num == 1) return;
+
+  // the I/O threads should never receive signals, those are handled by the main thread
+  sigset_t set, old_set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, &old_set);
+
+  for (int i = 1; i < io_threads_num; i++) {
+    if (pthread_create(&io_thread_ids[i], NULL, io_thread_main, (void *)(long)i) != 0) {
+      perror("failed to create I/O thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+  printf("# Started %d I/O threads\n", io_threads_num);
+}
+
+void io_threads_shutdown() {
+  if (io_threads_num > 1) {
+    pthread_mutex_lock(&io_mutex);
+    io_stop = true;
+    pthread_cond_broadcast(&io_start_cond);
+    pthread_mutex_unlock(&io_mutex);
+
+    for (int i = 1; i < io_threads_num; i++) {
+      pthread_join(io_thread_ids[i], NULL);
+    }
+  }
+  free(pending_clients);
+  pending_clients = NULL;
+  pending_count = 0;
+  pending_capacity = 0;
+}
+
+void io_threads_queue_read(Client *client) {
+  // a blocked client is not read until its blocking command completed, see unblock_client
+  if (client->pending_read || client->blocked) return;
+
+  if (pending_count == pending_capacity) {
+    size_t new_capacity = pending_capacity ? pending_capacity * 2 : 64;
+    Client **clients = realloc(pending_clients, sizeof(Client *) * new_capacity);
+    if (!clients) {
+      perror("memory realloc failed for pending clients");
+      exit(EXIT_FAILURE);
+    }
+    pending_clients = clients;
+    pending_capacity = new_capacity;
+  }
+  client->pending_read = true;
+  pending_clients[pending_count++] = client;
+}
+
+void io_threads_handle_pending_reads() {
+  if (pending_count == 0) return;
+
+  // read and parse in parallel
+  run_io_job(IO_OP_READ);
+
+  // execute the queued commands on the main thread, dropping closed clients from the list
+  size_t remaining = 0;
+  for (size_t i = 0; i < pending_count; i++) {
+    Client *client = pending_clients[i];
+    client->pending_read = false;
+    execute_pending_commands(client->parser->command_handler);
+    if (client->blocked) {
+      // stop reading until the blocking command completes, the queued commands wait for it
+      client_disable_read_events(client);
+    }
+
+    if (client->close_asap) {
+      handle_client_disconnection(client);
+      continue;
+    }
+    pending_clients[remaining++] = client;
+  }
+  pending_count = remaining;
+
+  // write the replies in parallel
+  run_io_job(IO_OP_WRITE);
+
+  // anything that did not fit in the socket buffer is written when the socket is writable
+  for (size_t i = 0; i < pending_count; i++) {
+    Client *client = pending_clients[i];
+    char *buf;
+    size_t len;
+    if (client->type != CLIENT_TYPE_REGULAR) continue;
+    if (rb_readable(client->output_buffer, &buf, &len) == 0 && len > 0) {
+      client_enable_write_events(client);
+    }
+  }
+  pending_count = 0;
+}
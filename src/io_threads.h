@@ -0,0 +1,14 @@
+#ifndef IO_THREADS_H
+#define IO_THREADS_H
+
+#include "client.h"
+
+#define IO_THREADS_MAX 128
+
+void io_threads_init(int num_threads);
+void io_threads_shutdown();
+
+void io_threads_queue_read(Client *client);
+void io_threads_handle_pending_reads();
+
+#endif // IO_THREADS_H
@@ -5,9 +5,10 @@
 #include <string.h>
 
 typedef struct Node {
-  char *data;
   struct Node *prev;
   struct Node *next;
+  size_t len;
+  char data[]; // allocated together with the node
 } Node;
 
 struct list_struct {
@@ -23,9 +24,22 @@ List create_list() {
   }
   list->head = NULL;
   list->tail = NULL;
+  list->length = 0;
   return list;
 }
 
+// allocates a node holding a NUL-terminated copy of len bytes of data
+static Node *create_node(const char *data, size_t len) {
+  Node *node = malloc(sizeof(Node) + len + 1);
+  if (node == NULL) {
+    return NULL;
+  }
+  node->len = len;
+  memcpy(node->data, data, len);
+  node->data[len] = '\0';
+  return node;
+}
+
 void destroy_list(List list) {
   if (list == NULL) {
     return;
@@ -36,7 +50,6 @@ void destroy_list(List list) {
     Node *temp = cur->next;
     cur->prev = NULL;
     cur->next = NULL;
-    free(cur->data);
     free(cur);
     cur = temp;
   }
@@ -48,15 +61,10 @@ int lpush(List list, const char *data, int *length) {
     return 0;
   }
 
-  Node *new_node = malloc(sizeof(Node));
+  Node *new_node = create_node(data, strlen(data));
   if (new_node == NULL) {
     return 0;
   }
-  new_node->data = strdup(data);
-  if (new_node->data == NULL) {
-    free(new_node); // clean up allocated node if strdup fails
-    return 0;
-  }
 
   // list is empty
   if (list->head == NULL && list->tail == NULL) {
@@ -83,33 +91,31 @@ int rpush(List list, const char *data, int *length) {
     return 0;
   }
 
-  Node *new_node = malloc(sizeof(Node));
-  if (new_node == NULL) {
-    return 0;
-  }
-  new_node->data = strdup(data);
-  if (new_node->data == NULL) {
-    free(new_node); // clean up allocated node if strdup fails
-    return 0;
-  }
+  int status = rpush_len(list, data, strlen(data));
+  *length = list->length;
+  return status;
+}
 
-  // list is empty
-  if (list->head == NULL && list->tail == NULL) {
-    list->head = new_node;
-    list->tail = new_node;
-    new_node->prev = NULL;
-    new_node->next = NULL;
-    list->length = 1;
-    *length = list->length;
-    return 0;
+/*
+Appends len bytes of data, e.g. an element that is not NUL-terminated where it is read from.
+Returns -1 when the node could not be allocated.
+*/
+int rpush_len(List list, const char *data, size_t len) {
+  Node *new_node = create_node(data, len);
+  if (new_node == NULL) {
+    return -1;
   }
 
   new_node->prev = list->tail;
   new_node->next = NULL;
-  list->tail->next = new_node;
+  if (list->tail == NULL) {
+    // list is empty
+    list->head = new_node;
+  } else {
+    list->tail->next = new_node;
+  }
   list->tail = new_node;
   list->length++;
-  *length = list->length;
   return 0;
 }
 
@@ -181,6 +187,37 @@ size_t get_list_length(List list) {
   return list->length;
 }
 
+void list_iter_init(list_iterator *it, List list) { it->next = list ? list->head : NULL; }
+
+/*
+Returns the elements from head to tail, false once every element was returned. data stays valid
+while the element is in the list.
+*/
+bool list_iter_next(list_iterator *it, const char **data, size_t *len) {
+  if (it->next == NULL) {
+    return false;
+  }
+  *data = it->next->data;
+  *len = it->next->len;
+  it->next = it->next->next;
+  return true;
+}
+
+// bytes allocated for a node holding data_len bytes
+size_t list_node_memory_usage(size_t data_len) { return sizeof(Node) + data_len + 1; }
+
+// bytes allocated for the list and all of its nodes
+size_t list_memory_usage(List list) {
+  if (list == NULL) {
+    return 0;
+  }
+  size_t usage = sizeof(struct list_struct);
+  for (Node *cur = list->head; cur != NULL; cur = cur->next) {
+    usage += list_node_memory_usage(cur->len);
+  }
+  return usage;
+}
+
 void cleanup_lrange_result(char **range, int range_length) {
   for (int i = 0; i < range_length; i++) {
     free(range[i]);
@@ -1,16 +1,26 @@
 #ifndef LINKED_LIST_H
 #define LINKED_LIST_H
+#include "stdbool.h"
 #include "stddef.h"
 
 struct list_struct;
 typedef struct list_struct *List;
 
+typedef struct list_iterator {
+  struct Node *next;
+} list_iterator;
+
 List create_list();
 void destroy_list(List list);
 int lpush(List list, const char *data, int *length);
 int rpush(List list, const char *data, int *length);
+int rpush_len(List list, const char *data, size_t len);
 char **lrange(List list, int start, int end, int *range_length);
 size_t get_list_length(List list);
+void list_iter_init(list_iterator *it, List list);
+bool list_iter_next(list_iterator *it, const char **data, size_t *len);
+size_t list_node_memory_usage(size_t data_len);
+size_t list_memory_usage(List list);
 void cleanup_lrange_result(char **range, int range_length);
 
 #endif // LINKED_LIST_H
\ No newline at end of file
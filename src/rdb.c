@@ -1,365 +1,1198 @@
 #include "rdb.h"
+#include "aof.h"
 #include "client.h"
 #include "commands.h"
 #include "database.h"
+#include "linked_list.h"
 #include "redis-server.h"
+#include "replication.h"
 #include "server_config.h"
 #include "util.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-char *read_rdb_string(FILE *file);
-int write_rdb_string(FILE *file, const char *str);
+#define RDB_WRITE_BUFFER_SIZE (1 << 20)
+#define RDB_STREAM_BUFFER_SIZE (1 << 20)
+// a transfer over a socket fails once it made no progress for this long
+#define RDB_SOCKET_TIMEOUT_MS 60000
 
-int rdb_load_data_from_file(redis_db_t *db, const char *dir, const char *filename) {
-  const char *path = construct_file_path(dir, filename);
-  FILE *file = fopen(path, "rb");
-  if (!file) {
-    perror("failed to open RDB file or it does not exist");
-    return -1;
+// value types
+#define RDB_TYPE_STRING 0
+#define RDB_TYPE_LIST_QUICKLIST_2 18
+
+// a quicklist node holds either a single element or a listpack of elements
+#define QUICKLIST_NODE_CONTAINER_PLAIN 1
+#define QUICKLIST_NODE_CONTAINER_PACKED 2
+
+// lists are split into listpacks of about this size, like Redis' default list-max-listpack-size
+#define LISTPACK_TARGET_SIZE 8192
+
+// total bytes (32 bits) and number of elements (16 bits), both little-endian
+#define LISTPACK_HEADER_SIZE 6
+#define LISTPACK_EOF 0xFF
+#define LISTPACK_MAX_COUNT 65535 // a listpack with at least as many elements stores this count
+
+/*
+Collects the serialized snapshot in a large buffer so the file is written with a few big writes
+instead of one stdio call per byte. A payload that does not fit in what is left of the buffer is
+written together with the buffer by a single writev, without being copied. The snapshot can go to
+several replica sockets at once, a socket whose write failed is set to -1 and skipped from then on.
+Once no target is left everything is dropped, the caller checks failed when done.
+*/
+typedef struct rdb_writer {
+  int *fds;
+  int fd_count;
+  char *buf;
+  size_t len;
+  bool failed;
+  // values like lists are serialized here first, their encoded size is written before them
+  unsigned char *scratch;
+  size_t scratch_len;
+  size_t scratch_capacity;
+} rdb_writer;
+
+/*
+Snapshot received over a socket. It is read into a window that is refilled as the records are
+parsed, offset is the position of the window's start in the stream.
+*/
+typedef struct rdb_stream {
+  int fd;
+  unsigned char *buf;
+  size_t capacity;
+  uint64_t offset;
+} rdb_stream;
+
+/*
+Cursor over a snapshot mapped into memory. Records are parsed straight from the mapping: strings
+are handed to the database as pointers into it and copied once, into the entry that keeps them.
+For a streamed snapshot the cursor moves over the stream's window, whose strings stay valid until
+the next read.
+*/
+typedef struct rdb_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  rdb_stream *stream;       // NULL when the whole snapshot is in memory
+  rdb_repl_info *repl_info; // receives the replication metadata, NULL when it is not wanted
+} rdb_reader;
+
+/*
+Makes sure n bytes follow the cursor. A snapshot in memory has them or not, a streamed one moves
+the unread part of its window to the front and reads from the socket until they arrived, waiting
+at most RDB_SOCKET_TIMEOUT_MS for every read.
+*/
+static bool rdb_reader_ensure(rdb_reader *r, size_t n) {
+  size_t available = r->end - r->p;
+  if (available >= n) return true;
+  rdb_stream *s = r->stream;
+  if (!s) return false;
+
+  s->offset += r->p - s->buf;
+  memmove(s->buf, r->p, available);
+  r->p = s->buf;
+  r->end = s->buf + available;
+  if (n > s->capacity) {
+    size_t capacity = s->capacity;
+    while (capacity < n) capacity *= 2;
+    unsigned char *grown = realloc(s->buf, capacity);
+    if (!grown) {
+      perror("failed to grow buffer for RDB transfer");
+      return false;
+    }
+    s->buf = grown;
+    s->capacity = capacity;
+    r->p = s->buf;
+    r->end = s->buf + available;
   }
 
-  // consume header section, magic string + version number (ASCII): REDIS0012
-  char buf[64];
-  if (fread(buf, 1, 9, file) != 9) {
-    perror("failed to read header\n");
-    fclose(file);
-    return 1;
+  while (available < n) {
+    ssize_t bytes_read = read(s->fd, s->buf + available, s->capacity - available);
+    if (bytes_read > 0) {
+      available += bytes_read;
+      r->end = s->buf + available;
+      continue;
+    }
+    if (bytes_read == 0) {
+      fprintf(stderr, "connection closed during RDB transfer\n");
+      return false;
+    }
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("failed to read RDB transfer");
+      return false;
+    }
+    // the socket stays non-blocking for the event loop, wait until more arrived
+    struct pollfd pfd = {.fd = s->fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, RDB_SOCKET_TIMEOUT_MS);
+    if (ready == 0) {
+      fprintf(stderr, "timeout during RDB transfer\n");
+      return false;
+    }
+    if (ready == -1 && errno != EINTR) {
+      perror("poll failed during RDB transfer");
+      return false;
+    }
   }
-  buf[9] = '\0';
+  return true;
+}
 
-  if (strcmp(buf, "REDIS0012") != 0) {
-    printf("header does not contain expected magic string + version number (0012)\n");
-    printf("expected: REDIS0012, got: %s\n", buf);
-    fclose(file);
-    return 1;
+static bool rdb_read_byte(rdb_reader *r, int *byte) {
+  if (!rdb_reader_ensure(r, 1)) return false;
+  *byte = *r->p++;
+  return true;
+}
+
+static bool rdb_read_bytes(rdb_reader *r, void *buf, size_t len) {
+  if (!rdb_reader_ensure(r, len)) return false;
+  memcpy(buf, r->p, len);
+  r->p += len;
+  return true;
+}
+
+/*
+Reads a length in the RDB length encoding, see rdb_write_length. For the special string encodings
+(first two bits 11) encoded is set and len holds the encoding type. Returns false at the end of the
+snapshot.
+*/
+static bool rdb_read_length(rdb_reader *r, uint64_t *len, bool *encoded) {
+  int first;
+  if (!rdb_read_byte(r, &first)) return false;
+  *encoded = false;
+
+  switch (first >> 6) {
+  case 0b00:
+    // remaining 6 bits is length
+    *len = first & 0x3F;
+    return true;
+  case 0b01: {
+    // next 14 bits is length
+    int second;
+    if (!rdb_read_byte(r, &second)) return false;
+    *len = ((uint64_t)(first & 0x3F) << 8) | second;
+    return true;
+  }
+  case 0b10: {
+    // 0x80 is followed by a 32-bit, 0x81 by a 64-bit big-endian length
+    int bytes = first == 0x81 ? 8 : 4;
+    if (first != 0x80 && first != 0x81) return false;
+    unsigned char buf[8];
+    if (!rdb_read_bytes(r, buf, bytes)) return false;
+    *len = 0;
+    for (int i = 0; i < bytes; i++) *len = (*len << 8) | buf[i];
+    return true;
+  }
+  default:
+    // this is a string encoded value
+    *encoded = true;
+    *len = first & 0x3F;
+    return true;
+  }
+}
+
+// reads a length that must not be a special string encoding
+static bool rdb_read_plain_length(rdb_reader *r, uint64_t *len) {
+  bool encoded;
+  return rdb_read_length(r, len, &encoded) && !encoded;
+}
+
+/*
+Reads a string. A raw string is returned as a pointer into the mapping, an integer encoded one is
+formatted into buf, which has room for LONG_STR_SIZE bytes. Returns false when the string is
+malformed or runs past the end of the snapshot.
+*/
+static bool rdb_read_string(rdb_reader *r, const char **str, size_t *len, char *buf) {
+  uint64_t length;
+  bool encoded;
+  if (!rdb_read_length(r, &length, &encoded)) return false;
+
+  if (!encoded) {
+    if (length > SIZE_MAX || !rdb_reader_ensure(r, length)) return false;
+    *str = (const char *)r->p;
+    *len = length;
+    r->p += length;
+    return true;
+  }
+
+  // 8, 16 or 32-bit integer as string, little-endian
+  int bytes = length == 0 ? 1 : length == 1 ? 2 : length == 2 ? 4 : 0;
+  if (bytes == 0) {
+    // LZF-compressed strings (3) are not supported
+    fprintf(stderr, "unsupported RDB string encoding %d\n", (int)length);
+    return false;
+  }
+  unsigned char value[4];
+  if (!rdb_read_bytes(r, value, bytes)) return false;
+  uint32_t v = 0;
+  for (int i = 0; i < bytes; i++) v |= (uint32_t)value[i] << (8 * i);
+  long long integer = bytes == 1 ? (int8_t)v : bytes == 2 ? (int16_t)v : (int32_t)v;
+  *len = snprintf(buf, LONG_STR_SIZE, "%lld", integer);
+  *str = buf;
+  return true;
+}
+
+/*
+Reads a key. Keys are looked up as C strings, so unlike values they are copied, into the growable
+buffer *key, to be NUL-terminated.
+*/
+static bool rdb_read_key(rdb_reader *r, char **key, size_t *capacity) {
+  const char *str;
+  size_t len;
+  char buf[LONG_STR_SIZE];
+  if (!rdb_read_string(r, &str, &len, buf)) return false;
+  if (len + 1 > *capacity) {
+    size_t grown_capacity = *capacity ? *capacity : 64;
+    while (grown_capacity < len + 1) grown_capacity *= 2;
+    char *grown = realloc(*key, grown_capacity);
+    if (!grown) {
+      perror("failed to grow buffer for RDB key");
+      exit(EXIT_FAILURE);
+    }
+    *key = grown;
+    *capacity = grown_capacity;
+  }
+  memcpy(*key, str, len);
+  (*key)[len] = '\0';
+  return true;
+}
+
+// size of the backwards encoded length that ends a listpack entry of len bytes
+static size_t listpack_backlen_size(size_t len) {
+  size_t n = 1;
+  while (n < 5 && len >> (7 * n)) n++;
+  return n;
+}
+
+/*
+Appends the elements of a listpack to list, straight from the listpack's bytes. Returns false when
+the listpack is malformed.
+*/
+static bool listpack_append_to_list(const unsigned char *lp, size_t size, List list) {
+  if (size < LISTPACK_HEADER_SIZE + 1) return false;
+  uint32_t total = lp[0] | lp[1] << 8 | lp[2] << 16 | (uint32_t)lp[3] << 24;
+  if (total != size || lp[size - 1] != LISTPACK_EOF) return false;
+
+  const unsigned char *p = lp + LISTPACK_HEADER_SIZE;
+  const unsigned char *end = lp + size - 1;
+  while (p < end) {
+    unsigned char encoding = p[0];
+    const char *str = NULL;
+    uint64_t len = 0;
+    size_t header = 1;
+    uint64_t v = 0;
+    int bytes = 0;
+    long long value;
+    bool is_integer = true;
+
+    if ((encoding & 0x80) == 0) { // 7-bit unsigned integer
+      value = encoding;
+    } else if ((encoding & 0xC0) == 0x80) { // 6-bit string length
+      is_integer = false;
+      len = encoding & 0x3F;
+    } else if ((encoding & 0xE0) == 0xC0) { // 13-bit integer
+      if (end - p < 2) return false;
+      v = (uint64_t)(encoding & 0x1F) << 8 | p[1];
+      value = v >= (1 << 12) ? (long long)v - (1 << 13) : (long long)v;
+      header = 2;
+    } else if ((encoding & 0xF0) == 0xE0) { // 12-bit string length
+      if (end - p < 2) return false;
+      is_integer = false;
+      len = (uint64_t)(encoding & 0x0F) << 8 | p[1];
+      header = 2;
+    } else if (encoding == 0xF0) { // 32-bit string length
+      if (end - p < 5) return false;
+      is_integer = false;
+      for (int i = 0; i < 4; i++) len |= (uint64_t)p[1 + i] << (8 * i);
+      header = 5;
+    } else {
+      bytes = encoding == 0xF1 ? 2 : encoding == 0xF2 ? 3 : encoding == 0xF3 ? 4 : 8;
+      if (encoding < 0xF1 || encoding > 0xF4 || end - p < 1 + bytes) return false;
+      for (int i = 0; i < bytes; i++) v |= (uint64_t)p[1 + i] << (8 * i);
+      // sign-extend from the encoding's width
+      if (bytes < 8 && v >> (8 * bytes - 1)) v |= ~0ULL << (8 * bytes);
+      value = (long long)v;
+      header = 1 + bytes;
+    }
+
+    char buf[LONG_STR_SIZE];
+    if (is_integer) {
+      len = snprintf(buf, sizeof(buf), "%lld", value);
+      str = buf;
+    } else {
+      if ((uint64_t)(end - p) < header + len) return false;
+      str = (const char *)p + header;
+    }
+    size_t entry_len = header + (is_integer ? 0 : len);
+    size_t entry_size = entry_len + listpack_backlen_size(entry_len);
+    if ((size_t)(end - p) < entry_size) return false;
+    if (rpush_len(list, str, len) != 0) return false;
+    p += entry_size;
+  }
+  return true;
+}
+
+/*
+Reads a list stored as a quicklist. Every listpack node is decoded into list nodes straight from the
+mapping. Returns NULL when the list is malformed.
+*/
+static List rdb_read_list(rdb_reader *r) {
+  uint64_t nodes;
+  if (!rdb_read_plain_length(r, &nodes)) return NULL;
+  List list = create_list();
+  if (!list) return NULL;
+
+  for (uint64_t i = 0; i < nodes; i++) {
+    uint64_t container;
+    const char *node;
+    size_t node_len;
+    char buf[LONG_STR_SIZE];
+    bool valid = rdb_read_plain_length(r, &container) && rdb_read_string(r, &node, &node_len, buf);
+    if (valid && container == QUICKLIST_NODE_CONTAINER_PACKED) {
+      valid = listpack_append_to_list((const unsigned char *)node, node_len, list);
+    } else if (valid && container == QUICKLIST_NODE_CONTAINER_PLAIN) {
+      valid = rpush_len(list, node, node_len) == 0;
+    } else {
+      valid = false;
+    }
+    if (!valid) {
+      destroy_list(list);
+      return NULL;
+    }
+  }
+  return list;
+}
+
+/*
+Loads the records of a mapped snapshot into db. Returns false when the snapshot is malformed.
+*/
+static bool rdb_load_records(rdb_reader *r, redis_db_t *db) {
+  // consume header section, magic string + version number (ASCII): REDIS0012
+  if (!rdb_reader_ensure(r, 9) || memcmp(r->p, "REDIS0012", 9) != 0) {
+    fprintf(stderr, "header does not contain expected magic string + version number (0012)\n");
+    return false;
   }
+  r->p += 9;
 
-  // main RDB section loop
-  int done = 0;
-  while (!done) {
-    int opcode = fgetc(file);
-    if (opcode == EOF) {
-      perror("unexpected end of file while reading RDB\n");
+  // every record takes more than a byte, size hints larger than the snapshot are corrupt. The size
+  // of a streamed snapshot is not known up front, it is only held to the limits of the format
+  uint64_t size = r->stream ? UINT32_MAX : (uint64_t)(r->end - r->p);
+  char *key = NULL;
+  size_t key_capacity = 0;
+  uint64_t expire_time = 0;
+  bool loaded = false;
+
+  // main RDB section loop, key-value records follow each other until 0xFF
+  for (bool done = false; !done;) {
+    int opcode;
+    if (!rdb_read_byte(r, &opcode)) {
+      fprintf(stderr, "unexpected end of file while reading RDB\n");
       break;
     }
     switch (opcode) {
-    case 0xFA: // mwetadata section start
-      while (1) {
-        int next = fgetc(file);
-        if (next == 0xFE) {
-          // end of metadata section
-          break;
-        }
-        if (next == EOF) {
-          perror("unexpected end of file while reading metadata section\n");
-          fclose(file);
-          return 1;
+    case 0xFA: { // metadata section start, key-value pairs until 0xFE
+      const char *str;
+      size_t len;
+      char buf[LONG_STR_SIZE];
+      while (rdb_reader_ensure(r, 1) && *r->p != 0xFE) {
+        if (!rdb_read_string(r, &str, &len, buf)) break;
+        // a streamed key does not survive reading its value, so it is matched first
+        bool is_replid = len == 7 && memcmp(str, "repl-id", 7) == 0;
+        bool is_offset = len == 11 && memcmp(str, "repl-offset", 11) == 0;
+        if (!rdb_read_string(r, &str, &len, buf)) break;
+        if (!r->repl_info) continue;
+        if (is_replid && len == REPLID_SIZE) {
+          memcpy(r->repl_info->replid, str, REPLID_SIZE);
+          r->repl_info->replid[REPLID_SIZE] = '\0';
+        } else if (is_offset) {
+          string_to_long_long(str, len, &r->repl_info->offset);
         }
-        ungetc(next, file); // put back for string read
-        char *key = read_rdb_string(file);
-        if (!key) break;
-        char *value = read_rdb_string(file);
-        if (!value) {
-          free(key);
-          break;
-        }
-        free(key);
-        free(value);
+      }
+      int end_of_metadata;
+      if (!rdb_read_byte(r, &end_of_metadata)) {
+        fprintf(stderr, "unexpected end of file while reading metadata section\n");
+        done = true;
       }
       break;
+    }
     case 0xFB: { // hash table size info
-      int kv_size;
-      int exp_size;
-      int i;
-      int type;
-      uint64_t expire_time;
-
-      kv_size = fgetc(file);  // number of key-value pairs in the hash table
-      exp_size = fgetc(file); // number of keys with expiry
-      if (kv_size == EOF || exp_size == EOF) {
-        perror("unexpected end of file while reading hash table size info\n");
-        fclose(file);
-        return 1;
+      uint64_t kv_size;  // number of key-value pairs in the hash table
+      uint64_t exp_size; // number of keys with expiry
+      if (!rdb_read_plain_length(r, &kv_size) || !rdb_read_plain_length(r, &exp_size)) {
+        fprintf(stderr, "unexpected end of file while reading hash table size info\n");
+        done = true;
+        break;
       }
-      // read the key-value pairs
-      for (i = 0; i < kv_size; i++) {
-        type = fgetc(file); // read type/encoding opcode
-        expire_time = 0;
-
-        if (type == EOF) {
-          perror("unexpected end of file while reading key-value pairs\n");
-          fclose(file);
-          return 1;
-        }
-
-        // check for expiration
-        if (type == 0xFD) { // expire time in seconds
-          uint32_t seconds;
-          if (fread(&seconds, 4, 1, file) != 1) {
-            perror("failed to read expiration time from RDB file\n");
-            fclose(file);
-            return 1;
-          }
-          expire_time = seconds * 1000; // convert seconds to milliseconds
-          type = fgetc(file);           // read the next type byte
-        } else if (type == 0xFC) {      // expire time in milliseconds
-          uint64_t milliseconds;
-          if (fread(&milliseconds, 8, 1, file) != 1) {
-            perror("failed to read expiration time from RDB file\n");
-            fclose(file);
-            return 1;
-          }
-          expire_time = milliseconds; // already in milliseconds
-          type = fgetc(file);         // read the next type byte
-        }
-
-        if (type == 0x00) { // string
-          // read the key-value pair as a string
-          char *key = read_rdb_string(file);
-          if (!key) {
-            perror("failed to read key from RDB file\n");
-            fclose(file);
-            return 1;
-          }
-          char *value = read_rdb_string(file);
-          if (!value) {
-            free(key);
-            perror("failed to read value from RDB file\n");
-            fclose(file);
-            return 1;
-          }
-
-          // Debug print to verify key and value
-          // printf("RDB LOAD: key='%s', value='%s', expire_time=%llu\n", key, value, (unsigned long
-          // long)expire_time);
-
-          // insert in DB
-          redis_db_set(db, key, value, TYPE_STRING, expire_time);
-
-          free(key);
-          free(value);
-        } else {
-          printf("Unhandled type: 0x%02X\n", type);
-        }
+      // size the keyspace up front instead of growing it through every doubling
+      if (kv_size <= size && exp_size <= kv_size) redis_db_expand(db, kv_size, exp_size);
+      break;
+    }
+    case 0xFD: { // expire time in seconds, the type of the key-value pair follows
+      uint32_t seconds;
+      if (!rdb_read_bytes(r, &seconds, 4)) {
+        fprintf(stderr, "failed to read expiration time from RDB file\n");
+        done = true;
+        break;
+      }
+      expire_time = (uint64_t)seconds * 1000; // convert seconds to milliseconds
+      break;
+    }
+    case 0xFC: { // expire time in milliseconds
+      if (!rdb_read_bytes(r, &expire_time, 8)) {
+        fprintf(stderr, "failed to read expiration time from RDB file\n");
+        done = true;
+      }
+      break;
+    }
+    case RDB_TYPE_STRING: {
+      const char *value;
+      size_t len;
+      char buf[LONG_STR_SIZE];
+      if (!rdb_read_key(r, &key, &key_capacity) || !rdb_read_string(r, &value, &len, buf)) {
+        fprintf(stderr, "failed to read string from RDB file\n");
+        done = true;
+        break;
+      }
+      // the value is copied once, from the mapping into the database
+      redis_db_set_string(db, key, value, len, expire_time);
+      expire_time = 0;
+      break;
+    }
+    case RDB_TYPE_LIST_QUICKLIST_2: {
+      List list = rdb_read_key(r, &key, &key_capacity) ? rdb_read_list(r) : NULL;
+      if (!list) {
+        fprintf(stderr, "failed to read list from RDB file\n");
+        done = true;
+        break;
       }
+      if (get_list_length(list) > 0) {
+        redis_db_set(db, key, list, TYPE_LIST, expire_time);
+      } else {
+        destroy_list(list);
+      }
+      expire_time = 0;
       break;
     }
-    case 0xFE:
-      // database index
-      printf("database selector (0xFE) encountered.\n");
+    case 0xFE: { // database selector
       // No support for multiple databases yet, so we just read the index.
-      int db_index = fgetc(file);
-      if (db_index == EOF) {
-        perror("unexpected end of file while reading database index\n");
-        fclose(file);
-        return 1;
+      uint64_t db_index;
+      if (!rdb_read_plain_length(r, &db_index)) {
+        fprintf(stderr, "unexpected end of file while reading database index\n");
+        done = true;
       }
+      break;
+    }
     case 0xFF: // end of RDB file
-      done = 1;
+      loaded = true;
+      done = true;
       break;
     default:
+      fprintf(stderr, "unhandled RDB opcode: 0x%02X\n", opcode);
+      done = true;
       break;
     }
   }
 
-  fclose(file);
-  return 0;
+  free(key);
+  return loaded;
 }
 
-char *read_rdb_string(FILE *file) {
-  int first = fgetc(file);
-  if (first == EOF) return NULL;
-  unsigned char first_byte = (unsigned char)first;
+/*
+Loads a snapshot into db. The file is mapped rather than read, so records are parsed in place, and
+the kernel is told it is read sequentially so it reads ahead while the keys are inserted. When
+repl_info is set it receives the replication id and offset the snapshot was taken at, an empty id
+and -1 when the snapshot carries none. Returns -1 when the file cannot be opened and 1 when it is
+malformed.
+*/
+int rdb_load_data_from_file(redis_db_t *db, const char *dir, const char *filename,
+                            rdb_repl_info *repl_info) {
+  if (repl_info) {
+    repl_info->replid[0] = '\0';
+    repl_info->offset = -1;
+  }
 
-  int type = first_byte >> 6;
-  int len = 0;
+  char *path = construct_file_path(dir, filename);
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1) {
+    perror("failed to open RDB file or it does not exist");
+    return -1;
+  }
 
-  if (type == 0b00) {
-    // remaining 6 bits is length
-    len = first_byte & 0x3F;
-  } else if (type == 0b01) {
-    // next 14 bits is length
-    len = (first_byte & 0x3F) << 8;
-    int second = fgetc(file);
-    if (second == EOF) return NULL;
-    len |= second; // combine with the next byte
-  } else if (type == 0b10) {
-    // next 4 bytes is length in big-endian
-    len = 0;
-    for (int i = 0; i < 4; i++) {
-      char byte = fgetc(file);
-      if (byte == EOF) return NULL;
-      len = (len << 8) | (unsigned char)byte; // shift left and add the next byte
-    }
-  } else if (type == 0b11) {
-    // this is a string encoded value
-    int enc_type = first_byte & 0x3F;
-    char buf[32];
-    if (enc_type == 0) {
-      // 8-bit integer as string
-      int val = fgetc(file);
-      if (val == EOF) return NULL;
-      snprintf(buf, sizeof(buf), "%d", (int8_t)val);
-      return strdup(buf);
-    } else if (enc_type == 1) {
-      // 16-bit integer as string (little-endian)
-      int lo = fgetc(file);
-      int hi = fgetc(file);
-      if (lo == EOF || hi == EOF) return NULL;
-      int16_t val = (hi << 8) | lo;
-      snprintf(buf, sizeof(buf), "%d", val);
-      return strdup(buf);
-    } else if (enc_type == 2) {
-      // 32-bit integer as string (little-endian)
-      uint32_t val = 0;
-      for (int i = 0; i < 4; ++i) {
-        int b = fgetc(file);
-        if (b == EOF) return NULL;
-        val |= ((uint32_t)b) << (8 * i);
-      }
-      snprintf(buf, sizeof(buf), "%d", (int32_t)val);
-      return strdup(buf);
-    } else if (enc_type == 3) {
-      // LZF-compressed string (not implemented)
-      printf("LZF-compressed string not supported.\n");
-      return NULL;
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) != 0 || statbuf.st_size == 0) {
+    fprintf(stderr, "failed to read header\n");
+    close(fd);
+    return 1;
+  }
+  size_t size = statbuf.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping keeps the file open
+  if (mapping == MAP_FAILED) {
+    perror("failed to map RDB file");
+    return 1;
+  }
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  madvise(mapping, size, MADV_WILLNEED);
+
+  rdb_reader r = {mapping, (const unsigned char *)mapping + size, NULL, repl_info};
+  bool loaded = rdb_load_records(&r, db);
+  munmap(mapping, size);
+  return loaded ? 0 : 1;
+}
+
+/*
+Loads a snapshot held in memory, e.g. the RDB preamble of an AOF, and stores the number of bytes
+it took up to its end of file marker in consumed. Returns false when the snapshot is malformed.
+*/
+bool rdb_load_from_buffer(redis_db_t *db, const void *buf, size_t len, size_t *consumed) {
+  rdb_reader r = {buf, (const unsigned char *)buf + len, NULL, NULL};
+  bool loaded = rdb_load_records(&r, db);
+  *consumed = r.p - (const unsigned char *)buf;
+  return loaded;
+}
+
+/*
+Loads a snapshot into db while it is received over a socket, without writing it anywhere first.
+The snapshot is length bytes long or, when eof_mark is set, ends with the marker. *buf holds the
+*len bytes already read from the socket and is replaced by the bytes read past the snapshot, which
+the caller frees. Returns false when the snapshot is malformed or the transfer failed.
+*/
+bool rdb_load_from_socket(redis_db_t *db, int fd, long long length, const char *eof_mark,
+                          char **buf, size_t *len) {
+  rdb_stream stream = {fd, (unsigned char *)*buf, *len, 0};
+  if (stream.capacity < RDB_STREAM_BUFFER_SIZE) {
+    unsigned char *grown = realloc(stream.buf, RDB_STREAM_BUFFER_SIZE);
+    if (!grown) {
+      perror("failed to allocate buffer for RDB transfer");
+      return false;
+    }
+    stream.buf = grown;
+    stream.capacity = RDB_STREAM_BUFFER_SIZE;
+  }
+  rdb_reader r = {stream.buf, stream.buf + *len, &stream, NULL};
+
+  bool loaded = rdb_load_records(&r, db);
+  if (loaded && eof_mark) {
+    loaded = rdb_reader_ensure(&r, RDB_EOF_MARK_SIZE) &&
+             memcmp(r.p, eof_mark, RDB_EOF_MARK_SIZE) == 0;
+    if (loaded) r.p += RDB_EOF_MARK_SIZE;
+  } else if (loaded) {
+    loaded = stream.offset + (r.p - stream.buf) == (uint64_t)length;
+  }
+  if (!loaded) fprintf(stderr, "RDB transfer does not end where the snapshot ends\n");
+
+  *len = r.end - r.p;
+  memmove(stream.buf, r.p, *len);
+  *buf = (char *)stream.buf;
+  return loaded;
+}
+
+/*
+Writes every iovec completely, retrying after partial writes. A socket shared with the parent
+stays non-blocking, it is waited on for at most RDB_SOCKET_TIMEOUT_MS when it is full.
+*/
+static bool write_iovecs(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, iov, iovcnt);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+      struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+      int ready = poll(&pfd, 1, RDB_SOCKET_TIMEOUT_MS);
+      if (ready == 0 || (ready == -1 && errno != EINTR)) return false;
+      continue;
+    }
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+static bool rdb_writer_init(rdb_writer *w, int *fds, int fd_count) {
+  w->fds = fds;
+  w->fd_count = fd_count;
+  w->len = 0;
+  w->failed = false;
+  w->scratch = NULL;
+  w->scratch_len = 0;
+  w->scratch_capacity = 0;
+  w->buf = malloc(RDB_WRITE_BUFFER_SIZE);
+  return w->buf != NULL;
+}
+
+// writes the iovecs to every target left, marks the writer failed once none is
+static void rdb_writer_output(rdb_writer *w, const struct iovec *iov, int iovcnt) {
+  bool written = false;
+  for (int i = 0; i < w->fd_count; i++) {
+    if (w->fds[i] == -1) continue;
+    // write_iovecs advances the iovecs it was given
+    struct iovec remaining[2];
+    memcpy(remaining, iov, iovcnt * sizeof(struct iovec));
+    if (write_iovecs(w->fds[i], remaining, iovcnt)) {
+      written = true;
     } else {
-      return NULL;
+      w->fds[i] = -1;
     }
   }
-  char *str = malloc(len + 1);
-  if (!str) {
-    perror("failed to allocate memory for string\n");
-    return NULL;
+  if (!written) w->failed = true;
+}
+
+static bool rdb_writer_flush(rdb_writer *w) {
+  struct iovec iov = {w->buf, w->len};
+  if (!w->failed) rdb_writer_output(w, &iov, 1);
+  w->len = 0;
+  return !w->failed;
+}
+
+static void rdb_writer_release(rdb_writer *w) {
+  free(w->buf);
+  free(w->scratch);
+}
+
+// makes room for len more bytes in the scratch buffer
+static unsigned char *rdb_scratch_reserve(rdb_writer *w, size_t len) {
+  if (w->scratch_len + len > w->scratch_capacity) {
+    size_t capacity = w->scratch_capacity ? w->scratch_capacity : LISTPACK_TARGET_SIZE;
+    while (capacity < w->scratch_len + len) capacity *= 2;
+    unsigned char *scratch = realloc(w->scratch, capacity);
+    if (!scratch) {
+      perror("failed to grow rdb scratch buffer");
+      exit(EXIT_FAILURE);
+    }
+    w->scratch = scratch;
+    w->scratch_capacity = capacity;
+  }
+  return w->scratch + w->scratch_len;
+}
+
+static void rdb_write(rdb_writer *w, const void *data, size_t len) {
+  if (w->failed) return;
+  if (len <= RDB_WRITE_BUFFER_SIZE - w->len) {
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    return;
+  }
+  struct iovec iov[2] = {{w->buf, w->len}, {(void *)data, len}};
+  rdb_writer_output(w, iov, 2);
+  w->len = 0;
+}
+
+static void rdb_write_byte(rdb_writer *w, uint8_t byte) {
+  if (w->len < RDB_WRITE_BUFFER_SIZE) {
+    w->buf[w->len++] = byte;
+  } else {
+    rdb_write(w, &byte, 1);
+  }
+}
+
+/*
+Writes a length in the RDB length encoding: 6 bits in the first byte, 14 bits in the first two, or
+a 0x80 (32-bit) or 0x81 (64-bit) marker followed by the big-endian length.
+*/
+static void rdb_write_length(rdb_writer *w, uint64_t len) {
+  unsigned char buf[9];
+  size_t n;
+  if (len < (1 << 6)) {
+    buf[0] = len;
+    n = 1;
+  } else if (len < (1 << 14)) {
+    buf[0] = 0x40 | (len >> 8);
+    buf[1] = len & 0xFF;
+    n = 2;
+  } else if (len <= UINT32_MAX) {
+    buf[0] = 0x80;
+    for (int i = 0; i < 4; i++) buf[1 + i] = (len >> (8 * (3 - i))) & 0xFF;
+    n = 5;
+  } else {
+    buf[0] = 0x81;
+    for (int i = 0; i < 8; i++) buf[1 + i] = (len >> (8 * (7 - i))) & 0xFF;
+    n = 9;
+  }
+  rdb_write(w, buf, n);
+}
+
+/*
+Writes an integer in the 8, 16 or 32-bit string encoding. Returns false, writing nothing, when the
+value needs more than 32 bits.
+*/
+static bool rdb_write_integer_encoded(rdb_writer *w, long long value) {
+  unsigned char buf[5];
+  size_t n;
+  if (value >= INT8_MIN && value <= INT8_MAX) {
+    buf[0] = 0xC0;
+    buf[1] = (uint8_t)value;
+    n = 2;
+  } else if (value >= INT16_MIN && value <= INT16_MAX) {
+    buf[0] = 0xC1;
+    for (int i = 0; i < 2; i++) buf[1 + i] = ((uint16_t)value >> (8 * i)) & 0xFF;
+    n = 3;
+  } else if (value >= INT32_MIN && value <= INT32_MAX) {
+    buf[0] = 0xC2;
+    for (int i = 0; i < 4; i++) buf[1 + i] = ((uint32_t)value >> (8 * i)) & 0xFF;
+    n = 5;
+  } else {
+    return false;
+  }
+  rdb_write(w, buf, n);
+  return true;
+}
+
+static void rdb_write_raw_string(rdb_writer *w, const char *str, size_t len) {
+  rdb_write_length(w, len);
+  rdb_write(w, str, len);
+}
+
+// the longest 32-bit integer, INT32_MIN, has 11 characters
+#define RDB_MAX_INT_ENCODED_LEN 11
+
+/*
+Writes len bytes of str, integer encoded when they are the canonical form of an integer that fits
+in 32 bits.
+*/
+static void rdb_write_string(rdb_writer *w, const char *str, size_t len) {
+  long long value;
+  if (len <= RDB_MAX_INT_ENCODED_LEN && string_to_long_long(str, len, &value) == ERR_NONE &&
+      rdb_write_integer_encoded(w, value)) {
+    return;
   }
+  rdb_write_raw_string(w, str, len);
+}
 
-  if (fread(str, 1, len, file) != len) {
-    perror("failed to read string from file\n");
-    free(str);
-    return NULL;
+/*
+Writes a string value. Integer encoded values are written without formatting them first, and other
+values are never canonical integers, set() would have integer encoded them, so they are written
+as they are.
+*/
+static void rdb_write_string_value(rdb_writer *w, const RedisValue *value) {
+  if (value->encoding == ENCODING_INT) {
+    if (rdb_write_integer_encoded(w, value->data.integer)) return;
+    char buf[LONG_STR_SIZE];
+    int len = snprintf(buf, sizeof(buf), "%lld", value->data.integer);
+    rdb_write_raw_string(w, buf, len);
+    return;
   }
+  rdb_write_raw_string(w, value->data.str, sds_len(value->data.str));
+}
 
-  str[len] = '\0';
-  return str;
+/*
+Writes the length of a listpack entry of len bytes backwards, so the listpack can be walked from
+its tail: 7 bits per byte, every byte but the first with its high bit set. Returns the number of
+bytes written.
+*/
+static size_t listpack_encode_backlen(unsigned char *buf, size_t len) {
+  size_t n = 1;
+  while (n < 5 && len >> (7 * n)) n++;
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = (len >> (7 * (n - 1 - i))) & 127;
+    if (i > 0) buf[i] |= 128;
+  }
+  return n;
 }
 
-int write_rdb_string(FILE *file, const char *str) {
-  int len = strlen(str);
-  char *endptr;
-  long long value = strtoll(str, &endptr, 10);
-  if (*endptr == '\0') { // string is a valid integer
-    if (value >= INT8_MIN && value <= INT8_MAX) {
-      // 8-bit integer encoding: 1 byte header + 1 byte value = 2 bytes (16 bits)
-      uint8_t header = 0xC0;
-      fputc(header, file);
-      fputc((int8_t)value, file);
-      return 2;
+/*
+Encodes an element as a listpack entry at p, which needs room for len + 10 bytes. Canonical
+integers take the smallest integer encoding. Returns the size of the entry.
+*/
+static size_t listpack_encode_entry(unsigned char *p, const char *str, size_t len) {
+  long long value;
+  size_t n;
+  if (string_to_long_long(str, len, &value) == ERR_NONE) {
+    // negative values are stored in two's complement of the encoding's width
+    uint64_t v = (uint64_t)value;
+    int bytes;
+    if (value >= 0 && value <= 127) {
+      p[0] = value; // 7-bit unsigned integer
+      n = 1;
+      bytes = 0;
+    } else if (value >= -4096 && value <= 4095) {
+      p[0] = 0xC0 | ((v >> 8) & 0x1F); // 13-bit integer
+      p[1] = v & 0xFF;
+      n = 2;
+      bytes = 0;
     } else if (value >= INT16_MIN && value <= INT16_MAX) {
-      // 16-bit integer encoding: 1 byte header + 2 bytes value = 3 bytes (24 bits)
-      uint8_t header = 0xC1;
-      fputc(header, file);
-      int16_t v = (int16_t)value;
-      fputc(v & 0xFF, file);
-      fputc((v >> 8) & 0xFF, file);
-      return 3;
+      p[0] = 0xF1;
+      bytes = 2;
+    } else if (value >= -(1 << 23) && value < (1 << 23)) {
+      p[0] = 0xF2;
+      bytes = 3;
     } else if (value >= INT32_MIN && value <= INT32_MAX) {
-      // 32-bit integer encoding: 1 byte header + 4 bytes value = 5 bytes (40 bits)
-      uint8_t header = 0xC2;
-      fputc(header, file);
-      int32_t v = (int32_t)value;
-      for (int i = 0; i < 4; i++) {
-        fputc((v >> (8 * i)) & 0xFF, file);
-      }
-      return 5;
-    }
-  }
-
-  if (len <= 63) {
-    // 1-byte header + len bytes data = len+1 bytes = (len+1)*8 bits
-    uint8_t header = (0b00 << 6) | len;
-    fputc(header, file);
-    fwrite(str, 1, len, file);
-    return 1 + len;
-  } else if (len <= 16383) {
-    // 2-byte header + len bytes data = len+2 bytes = (len+2)*8 bits
-    uint16_t header = (0b01 << 14) | len;
-    fputc((header >> 8) & 0xFF, file);
-    fputc(header & 0xFF, file);
-    fwrite(str, 1, len, file);
-    return 2 + len;
+      p[0] = 0xF3;
+      bytes = 4;
+    } else {
+      p[0] = 0xF4;
+      bytes = 8;
+    }
+    if (bytes > 0) {
+      for (int i = 0; i < bytes; i++) p[1 + i] = (v >> (8 * i)) & 0xFF;
+      n = 1 + bytes;
+    }
   } else {
-    // 1-byte header + 4-byte length + len bytes data = len+5 bytes = (len+5)*8 bits
-    uint8_t header = (0b10 << 6);
-    fputc(header, file);
-    uint32_t ulen = (uint32_t)len;
-    for (int i = 3; i >= 0; i--) {
-      fputc((ulen >> (8 * i)) & 0xFF, file);
+    if (len < 64) {
+      p[0] = 0x80 | len; // 6-bit string length
+      n = 1;
+    } else if (len < 4096) {
+      p[0] = 0xE0 | (len >> 8); // 12-bit string length
+      p[1] = len & 0xFF;
+      n = 2;
+    } else {
+      p[0] = 0xF0; // 32-bit string length, little-endian
+      for (int i = 0; i < 4; i++) p[1 + i] = (len >> (8 * i)) & 0xFF;
+      n = 5;
     }
-    fwrite(str, 1, len, file);
-    return 5 + len;
+    memcpy(p + n, str, len);
+    n += len;
   }
+  return n + listpack_encode_backlen(p + n, n);
 }
 
-bool rdb_save_data_to_file(redis_db_t *db, const char *dir, const char *filename) {
-  const char *path = construct_file_path(dir, filename);
+// writes the total size and element count into the header of the listpack starting at start
+static void listpack_finish(rdb_writer *w, size_t start, size_t count) {
+  *rdb_scratch_reserve(w, 1) = LISTPACK_EOF;
+  w->scratch_len++;
+  uint32_t total = w->scratch_len - start;
+  uint16_t stored_count = count < LISTPACK_MAX_COUNT ? count : LISTPACK_MAX_COUNT;
+  unsigned char *header = w->scratch + start;
+  for (int i = 0; i < 4; i++) header[i] = (total >> (8 * i)) & 0xFF;
+  header[4] = stored_count & 0xFF;
+  header[5] = stored_count >> 8;
+}
 
-  // create directory
-  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
-    perror("failed to create directory for RDB file");
-    return false;
+/*
+Writes a list as a quicklist: the number of nodes, then every node as a listpack of about
+LISTPACK_TARGET_SIZE bytes. The listpacks are built in the scratch buffer first since the node count
+comes before them.
+*/
+static void rdb_write_list_value(rdb_writer *w, List list) {
+  w->scratch_len = 0;
+  size_t nodes = 0;
+  size_t start = 0;
+  size_t count = 0;
+  list_iterator it;
+  list_iter_init(&it, list);
+  const char *data;
+  size_t len;
+  while (list_iter_next(&it, &data, &len)) {
+    if (nodes == 0 || w->scratch_len - start >= LISTPACK_TARGET_SIZE) {
+      if (nodes > 0) listpack_finish(w, start, count);
+      start = w->scratch_len;
+      rdb_scratch_reserve(w, LISTPACK_HEADER_SIZE);
+      w->scratch_len += LISTPACK_HEADER_SIZE;
+      count = 0;
+      nodes++;
+    }
+    w->scratch_len += listpack_encode_entry(rdb_scratch_reserve(w, len + 10), data, len);
+    count++;
   }
-  FILE *file = fopen(path, "wb");
-  if (!file) {
-    perror("could not open rdb file");
+  if (nodes > 0) listpack_finish(w, start, count);
+
+  rdb_write_length(w, nodes);
+  for (size_t offset = 0; offset < w->scratch_len;) {
+    const unsigned char *lp = w->scratch + offset;
+    uint32_t total = lp[0] | lp[1] << 8 | lp[2] << 16 | (uint32_t)lp[3] << 24;
+    rdb_write_length(w, QUICKLIST_NODE_CONTAINER_PACKED);
+    rdb_write_raw_string(w, (const char *)lp, total);
+    offset += total;
   }
+}
+
+// a snapshot is written to a file named after the writing process and renamed once complete
+static char *temp_rdb_file_path(const char *dir, pid_t pid) {
+  char filename[32];
+  snprintf(filename, sizeof(filename), "temp-%d.rdb", (int)pid);
+  return construct_file_path(dir, filename);
+}
+
+// writes the snapshot from the header to the end of file marker, without flushing the writer
+static void rdb_write_snapshot(rdb_writer *w, redis_db_t *db) {
   // write header:
-  fwrite("REDIS0012", 1, 9, file);
+  rdb_write(w, "REDIS0012", 9);
   // write metadata section
-  fputc(0xFA, file); // start metadata section
-  // for each metadata key/value pair:
-  // write_rdb_String(file, "meta_key");
-  // write_rdb_string(file, "meta_value");
-  fputc(0xFE, file); // end metadata section
+  rdb_write_byte(w, 0xFA); // start metadata section
+  // the replication stream the snapshot was taken at, a replica restarted from it continues there
+  char offset[LONG_STR_SIZE];
+  int offset_len = snprintf(offset, sizeof(offset), "%lld", g_server_info.master_repl_offset);
+  rdb_write_string(w, "repl-id", 7);
+  rdb_write_string(w, g_server_info.master_replid, strlen(g_server_info.master_replid));
+  rdb_write_string(w, "repl-offset", 11);
+  rdb_write_string(w, offset, offset_len);
+  rdb_write_byte(w, 0xFE); // end metadata section
 
-  // write 0xFB, kv_size, exp-size
-  fputc(0xFB, file); // hash table size information
-  fputc(db->key_count, file);
-  fputc(db->expiry_count, file); // for now I can count all the keys with an expiry
+  // write 0xFB, kv_size, exp-size. the loader sizes the keyspace from them
+  rdb_write_byte(w, 0xFB); // hash table size information
+  rdb_write_length(w, db->key_count);
+  rdb_write_length(w, db->expiry_count);
 
   // for each key:
   // -if has expiry, write 0xFD/0xFC and expiry time
   //  write type
-  //  write_rdb_string(key)
-  //  write_rdb_string(value)
-  khash_t(redis_hash) *h = db->h;
-  for (khiter_t k = kh_begin(h); k != kh_end(h); k++) {
-    if (!kh_exist(h, k)) continue;
-    const char *key = kh_key(h, k);
-    RedisValue *val = kh_value(h, k);
-    // write expiry if it has
+  //  rdb_write_string(key)
+  //  rdb_write_string(value)
+  redis_db_iterator it;
+  redis_db_iter_init(&it, db);
+  const char *key;
+  RedisValue *val;
+  while (redis_db_iter_next(&it, &key, &val) && !w->failed) {
+    // a list without elements is not stored, like in Redis
+    if (val->type == TYPE_LIST && get_list_length(val->data.list) == 0) continue;
+
     if (val->expiration > 0) {
-      fputc(0xFC, file); // type for ms expiry, since we store all expiry in ms
+      // type for ms expiry, since we store all expiry in ms, followed by 8 bytes little-endian
+      unsigned char expiry[9] = {0xFC};
       uint64_t ms = (uint64_t)val->expiration;
-      // Write 8 bytes in little-endian order
-      for (int i = 0; i < 8; i++) {
-        fputc((ms >> (8 * i)) & 0xFF, file);
-      }
+      for (int i = 0; i < 8; i++) expiry[1 + i] = (ms >> (8 * i)) & 0xFF;
+      rdb_write(w, expiry, sizeof(expiry));
     }
-    // persist string values (write_rdb_string will handle integer encoding if possible)
     if (val->type == TYPE_STRING) {
-      fputc(0x00, file); // type for string
-      write_rdb_string(file, key);
-      write_rdb_string(file, val->data.str);
-    } else {
-      // TODO persist other value types
+      // integers keep their integer encoding
+      rdb_write_byte(w, RDB_TYPE_STRING);
+      rdb_write_string(w, key, strlen(key));
+      rdb_write_string_value(w, val);
+    } else if (val->type == TYPE_LIST) {
+      rdb_write_byte(w, RDB_TYPE_LIST_QUICKLIST_2);
+      rdb_write_string(w, key, strlen(key));
+      rdb_write_list_value(w, val->data.list);
     }
   }
+  redis_db_iter_release(&it);
 
   // write 0xFF
-  fputc(0xFF, file);
-  // close file
-  fclose(file);
+  rdb_write_byte(w, 0xFF);
+}
+
+/*
+Writes a snapshot of the database to fd, from the header to the end of file marker. Returns false
+when writing failed.
+*/
+bool rdb_save_to_fd(redis_db_t *db, int fd) {
+  rdb_writer w;
+  if (!rdb_writer_init(&w, &fd, 1)) {
+    perror("failed to allocate rdb write buffer");
+    return false;
+  }
+  rdb_write_snapshot(&w, db);
+  bool written = rdb_writer_flush(&w);
+  rdb_writer_release(&w);
+  return written;
+}
+
+/*
+Writes a snapshot of the database. The snapshot replaces the file at dir/filename only once it was
+written completely, so a crash or a failed save never leaves a truncated file behind.
+*/
+bool rdb_save_data_to_file(redis_db_t *db, const char *dir, const char *filename) {
+  // create directory
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    perror("failed to create directory for RDB file");
+    return false;
+  }
+  char *temp_path = temp_rdb_file_path(dir, getpid());
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("could not open rdb file");
+    free(temp_path);
+    return false;
+  }
+
+  bool written = rdb_save_to_fd(db, fd) && fsync(fd) == 0;
+  if (close(fd) != 0) written = false;
+  if (!written) {
+    perror("failed to write rdb file");
+    unlink(temp_path);
+    free(temp_path);
+    return false;
+  }
+
+  char *path = construct_file_path(dir, filename);
+  bool renamed = rename(temp_path, path) == 0;
+  if (!renamed) {
+    perror("failed to move rdb file into place");
+    unlink(temp_path);
+  }
+  free(path);
+  free(temp_path);
+  return renamed;
+}
+
+bool rdb_background_save_in_progress() { return g_server_info.rdb_child_pid != -1; }
+
+/*
+Forks a child that writes the snapshot while the parent keeps serving clients. Thanks to
+copy-on-write the child sees the dataset exactly as it was at the fork, and only pages the parent
+modifies meanwhile get copied. Returns false when a background save or AOF rewrite is already
+running or the fork failed.
+*/
+bool rdb_save_background(redis_db_t *db) {
+  if (rdb_background_save_in_progress() || aof_rewrite_in_progress()) return false;
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork failed");
+    return false;
+  }
+  if (pid == 0) {
+    // the child only writes the snapshot, _exit skips the atexit handlers and stdio buffers it
+    // inherited from the parent
+    bool saved = rdb_save_data_to_file(db, g_server_config.dir, g_server_config.dbfilename);
+    _exit(saved ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  printf("# Background saving started by pid %d\n", (int)pid);
+  g_server_info.rdb_child_pid = pid;
+  g_server_info.rdb_child_repl_offset = g_server_info.master_repl_offset;
+  g_server_info.rdb_child_type = RDB_CHILD_TYPE_DISK;
+  return true;
+}
+
+/*
+Forks a child that streams the snapshot straight to the sockets of the replicas in fds, so a full
+resync never touches the disk. The snapshot is framed as $EOF:<mark>\r\n<snapshot><mark>, its
+length is not known before it was written. A replica whose socket fails is dropped while the
+others keep receiving, the child reports the sockets that received all of it through a pipe.
+Returns false when a background save or AOF rewrite is already running or the fork failed.
+*/
+bool rdb_save_background_to_sockets(redis_db_t *db, const int *fds, int fd_count) {
+  if (rdb_background_save_in_progress() || aof_rewrite_in_progress()) return false;
+
+  int pipe_fds[2];
+  if (pipe(pipe_fds) == -1) {
+    perror("failed to create pipe for diskless sync");
+    return false;
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork failed");
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(pipe_fds[0]);
+    // a replica that disconnects fails its writes instead of killing the child
+    signal(SIGPIPE, SIG_IGN);
+    int *targets = malloc(fd_count * sizeof(int));
+    rdb_writer w;
+    if (!targets || !rdb_writer_init(&w, targets, fd_count)) _exit(EXIT_FAILURE);
+    memcpy(targets, fds, fd_count * sizeof(int));
+
+    // a random marker of hex digits ends the snapshot, its length is not known up front
+    char mark[RDB_EOF_MARK_SIZE];
+    random_hex(mark, RDB_EOF_MARK_SIZE);
+    rdb_write(&w, "$EOF:", 5);
+    rdb_write(&w, mark, RDB_EOF_MARK_SIZE);
+    rdb_write(&w, "\r\n", 2);
+    rdb_write_snapshot(&w, db);
+    rdb_write(&w, mark, RDB_EOF_MARK_SIZE);
+    bool written = rdb_writer_flush(&w);
+
+    // writes to a pipe of up to PIPE_BUF bytes are never partial
+    for (int i = 0; i < fd_count; i++) {
+      if (targets[i] != -1 && write(pipe_fds[1], &targets[i], sizeof(int)) != sizeof(int)) {
+        written = false;
+      }
+    }
+    _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  close(pipe_fds[1]);
+  printf("# Starting diskless sync of %d replicas by pid %d\n", fd_count, (int)pid);
+  g_server_info.rdb_child_pid = pid;
+  g_server_info.rdb_child_repl_offset = g_server_info.master_repl_offset;
+  g_server_info.rdb_child_type = RDB_CHILD_TYPE_SOCKET;
+  g_server_info.rdb_child_pipe = pipe_fds[0];
   return true;
-}
\ No newline at end of file
+}
+
+// reads the sockets a diskless sync child reported as synced, until the pipe is closed
+static size_t read_synced_sockets(int **fds) {
+  size_t count = 0;
+  size_t capacity = 0;
+  *fds = NULL;
+  for (;;) {
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      int *grown = realloc(*fds, capacity * sizeof(int));
+      if (!grown) break;
+      *fds = grown;
+    }
+    ssize_t bytes_read = read(g_server_info.rdb_child_pipe, *fds + count, sizeof(int));
+    if (bytes_read == -1 && errno == EINTR) continue;
+    if (bytes_read != sizeof(int)) break;
+    count++;
+  }
+  close(g_server_info.rdb_child_pipe);
+  g_server_info.rdb_child_pipe = -1;
+  return count;
+}
+
+/*
+Reaps the background save child once it exited, called from the server cron. The replicas waiting
+for the snapshot are told how it went.
+*/
+void rdb_check_background_save() {
+  if (!rdb_background_save_in_progress()) return;
+
+  int status;
+  pid_t pid = waitpid(g_server_info.rdb_child_pid, &status, WNOHANG);
+  if (pid == 0) return; // still running
+  if (pid == -1) perror("waitpid failed");
+
+  bool saved = pid != -1 && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+  g_server_info.rdb_child_pid = -1;
+  if (g_server_info.rdb_child_type == RDB_CHILD_TYPE_SOCKET) {
+    // the replicas the snapshot reached are synced even when it failed for others
+    int *synced;
+    size_t count = read_synced_sockets(&synced);
+    if (saved) {
+      printf("# Diskless sync terminated with success\n");
+    } else {
+      fprintf(stderr, "# Diskless sync error\n");
+    }
+    replication_socket_save_done(synced, count);
+    free(synced);
+    return;
+  }
+
+  if (saved) {
+    printf("# Background saving terminated with success\n");
+  } else {
+    fprintf(stderr, "# Background saving error\n");
+  }
+  replication_background_save_done(saved);
+}
+
+/*
+Stops a running background save and removes its partial snapshot, e.g. on shutdown before the
+final synchronous save.
+*/
+void rdb_kill_background_save() {
+  if (!rdb_background_save_in_progress()) return;
+
+  pid_t pid = g_server_info.rdb_child_pid;
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  g_server_info.rdb_child_pid = -1;
+  if (g_server_info.rdb_child_type == RDB_CHILD_TYPE_SOCKET) {
+    close(g_server_info.rdb_child_pipe);
+    g_server_info.rdb_child_pipe = -1;
+    replication_socket_save_done(NULL, 0);
+    return;
+  }
+  char *temp_path = temp_rdb_file_path(g_server_config.dir, pid);
+  unlink(temp_path);
+  free(temp_path);
+  replication_background_save_done(false);
+}
@@ -4,9 +4,26 @@
 #include "client.h"
 #include "database.h"
 
-int rdb_load_data_from_file(redis_db_t *db, const char *dir, const char *filename);
+// the replication stream a snapshot was taken at, stored in its metadata section
+typedef struct rdb_repl_info {
+  char replid[REPLID_SIZE + 1];
+  long long offset;
+} rdb_repl_info;
+
+int rdb_load_data_from_file(redis_db_t *db, const char *dir, const char *filename,
+                            rdb_repl_info *repl_info);
+bool rdb_load_from_buffer(redis_db_t *db, const void *buf, size_t len, size_t *consumed);
+bool rdb_load_from_socket(redis_db_t *db, int fd, long long length, const char *eof_mark,
+                          char **buf, size_t *len);
+bool rdb_save_to_fd(redis_db_t *db, int fd);
 bool rdb_save_data_to_file(redis_db_t *db, const char *dir, const char *filename);
+bool rdb_save_background(redis_db_t *db);
+bool rdb_save_background_to_sockets(redis_db_t *db, const int *fds, int fd_count);
+bool rdb_background_save_in_progress();
+void rdb_check_background_save();
+void rdb_kill_background_save();
 void master_send_rdb_snapshot(Client *client);
 void replica_receive_rdb_snapshot(Client *client);
+void replica_load_rdb_from_socket(Client *client);
 
 #endif // RDB_H
@@ -1,62 +1,62 @@
 #include "redis-server.h"
+#include "aof.h"
 #include "arpa/inet.h"
 #include "client.h"
 #include "command_handler.h"
 #include "commands.h"
 #include "database.h"
+#include "event_loop.h"
+#include "io_threads.h"
 #include "rdb.h"
 #include "replication.h"
 #include "resp.h"
 #include "ring_buffer.h"
 #include "server_config.h"
+#include "shard.h"
 #include "util.h"
 #include <errno.h>
-#include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 #define DEFAULT_PORT 6379
-#define MAX_EVENTS 10000
 #define MAX_PATH_LENGTH 256
-#define REPL_BACKLOG_SIZE 1048576
 
-server_config_t g_server_config = {.dir = "/tmp/redis-data", .dbfilename = "dump.rdb"};
+server_config_t g_server_config = {.dir = "/tmp/redis-data",
+                                   .dbfilename = "dump.rdb",
+                                   .io_threads = 1,
+                                   .hz = 10,
+                                   .appendfilename = "appendonly.aof",
+                                   .auto_aof_rewrite_percentage = 100,
+                                   .auto_aof_rewrite_min_size = 64 * 1024 * 1024,
+                                   .repl_diskless_sync_delay = 5,
+                                   .repl_backlog_size = 1024 * 1024,
+                                   .repl_timeout = 60,
+                                   .repl_ping_replica_period = 10};
 
 server_info_t g_server_info = {.role = ROLE_MASTER,
-                               .master_replid =
-                                   "8371b4fb1155b71f4a04d3e1bc3e18c4a990aeeb", // hard code for now
                                .master_repl_offset = 0,
-                               .repl_backlog_base_offset = 0};
+                               .second_replid_offset = -1,
+                               .repl_backlog_base_offset = 0,
+                               .rdb_child_pid = -1,
+                               .rdb_child_pipe = -1};
 
-int g_epoll_fd; // epollfd global
+__thread event_loop_t *g_event_loop; // event loop running on the calling thread
 int port = DEFAULT_PORT;
 volatile sig_atomic_t stop_server = 0;
 
 void sigint_handler(int sig) { stop_server = 1; }
 
-int start_server(int argc, char *argv[]) {
-  g_handler = create_handler();
-  // create replication backlog
-  if (rb_create(REPL_BACKLOG_SIZE, &g_server_info.repl_backlog) != 0) {
-    fprintf(stderr, "creating repl_backlog ring buffer failed\n");
-  }
-
-  redis_db_t *db = redis_db_create();
-  g_epoll_fd = epoll_create(1);
-  if (g_epoll_fd == -1) {
-    perror("epoll_create failed");
-    exit(EXIT_FAILURE);
-  }
-
-  // parse command-line args
+/*
+Parses the command-line arguments into the server config.
+*/
+static void parse_args(int argc, char *argv[]) {
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--dir") == 0) {
       if (i + 1 < argc) {
@@ -81,82 +81,166 @@ int start_server(int argc, char *argv[]) {
         strcpy(g_server_config.master_port, argv[i + 2]);
         i += 2;
       }
-    }
-  }
-
-  if (g_server_info.role == ROLE_SLAVE) {
-    int master_fd;
-    char port_str[6];
-
-    // resolve address
-    struct addrinfo hints, *res;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    int status =
-        getaddrinfo(g_server_config.master_host, g_server_config.master_port, &hints, &res);
-    if (status != 0) {
-      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-      exit(EXIT_FAILURE);
-    }
-
-    // loop through all the results and connect to the first one we can
-    bool connected = false;
-    struct addrinfo *p;
-    for (p = res; p != NULL; p = p->ai_next) {
-
-      // create socket
-      master_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-      if (master_fd == -1) {
-        perror("cannot create socket for master connection");
-        exit(EXIT_FAILURE);
+    } else if (strcmp(argv[i], "--io-threads") == 0) {
+      if (i + 1 < argc) {
+        g_server_config.io_threads = atoi(argv[i + 1]);
+        i++;
       }
-
-      // connect to master
-      if (connect(master_fd, p->ai_addr, p->ai_addrlen) == -1) {
-        close(master_fd);
-        continue;
+    } else if (strcmp(argv[i], "--shards") == 0) {
+      if (i + 1 < argc) {
+        g_server_config.shards = atoi(argv[i + 1]);
+        i++;
+      }
+    } else if (strcmp(argv[i], "--hz") == 0) {
+      if (i + 1 < argc) {
+        g_server_config.hz = atoi(argv[i + 1]);
+        if (g_server_config.hz < 1) g_server_config.hz = 1;
+        if (g_server_config.hz > 500) g_server_config.hz = 500;
+        i++;
+      }
+    } else if (strcmp(argv[i], "--maxmemory") == 0) {
+      if (i + 1 < argc) {
+        if (parse_memory_size(argv[i + 1], &g_server_config.maxmemory) != ERR_NONE) {
+          fprintf(stderr, "invalid maxmemory '%s'\n", argv[i + 1]);
+          exit(EXIT_FAILURE);
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--maxmemory-policy") == 0) {
+      if (i + 1 < argc) {
+        if (parse_maxmemory_policy(argv[i + 1], &g_server_config.maxmemory_policy) != ERR_NONE) {
+          fprintf(stderr,
+                  "unknown maxmemory policy '%s', expected noeviction, allkeys-lru, allkeys-lfu or "
+                  "volatile-ttl\n",
+                  argv[i + 1]);
+          exit(EXIT_FAILURE);
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--io-backend") == 0) {
+      if (i + 1 < argc) {
+        if (strcmp(argv[i + 1], "epoll") == 0) {
+          g_server_config.io_backend = IO_BACKEND_EPOLL;
+        } else if (strcmp(argv[i + 1], "io_uring") == 0) {
+          g_server_config.io_backend = IO_BACKEND_IO_URING;
+        } else {
+          fprintf(stderr, "unknown io backend '%s', expected epoll or io_uring\n", argv[i + 1]);
+          exit(EXIT_FAILURE);
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--appendonly") == 0) {
+      if (i + 1 < argc) {
+        if (strcmp(argv[i + 1], "yes") == 0) {
+          g_server_config.appendonly = true;
+        } else if (strcmp(argv[i + 1], "no") == 0) {
+          g_server_config.appendonly = false;
+        } else {
+          fprintf(stderr, "invalid appendonly '%s', expected yes or no\n", argv[i + 1]);
+          exit(EXIT_FAILURE);
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--appendfsync") == 0) {
+      if (i + 1 < argc) {
+        if (parse_aof_fsync_policy(argv[i + 1], &g_server_config.appendfsync) != ERR_NONE) {
+          fprintf(stderr, "unknown appendfsync '%s', expected always, everysec or no\n",
+                  argv[i + 1]);
+          exit(EXIT_FAILURE);
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--appendfilename") == 0) {
+      if (i + 1 < argc) {
+        snprintf(g_server_config.appendfilename, MAX_PATH_LENGTH, "%s", argv[i + 1]);
+        i++;
+      }
+    } else if (strcmp(argv[i], "--auto-aof-rewrite-percentage") == 0) {
+      if (i + 1 < argc) {
+        g_server_config.auto_aof_rewrite_percentage = atoi(argv[i + 1]);
+        if (g_server_config.auto_aof_rewrite_percentage < 0) {
+          g_server_config.auto_aof_rewrite_percentage = 0;
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--auto-aof-rewrite-min-size") == 0) {
+      if (i + 1 < argc) {
+        if (parse_memory_size(argv[i + 1], &g_server_config.auto_aof_rewrite_min_size) !=
+            ERR_NONE) {
+          fprintf(stderr, "invalid auto-aof-rewrite-min-size '%s'\n", argv[i + 1]);
+          exit(EXIT_FAILURE);
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--repl-diskless-sync") == 0 ||
+               strcmp(argv[i], "--repl-diskless-load") == 0) {
+      if (i + 1 < argc) {
+        bool *option = strcmp(argv[i], "--repl-diskless-sync") == 0
+                           ? &g_server_config.repl_diskless_sync
+                           : &g_server_config.repl_diskless_load;
+        if (strcmp(argv[i + 1], "yes") == 0) {
+          *option = true;
+        } else if (strcmp(argv[i + 1], "no") == 0) {
+          *option = false;
+        } else {
+          fprintf(stderr, "invalid %s '%s', expected yes or no\n", argv[i] + 2, argv[i + 1]);
+          exit(EXIT_FAILURE);
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--repl-diskless-sync-delay") == 0) {
+      if (i + 1 < argc) {
+        g_server_config.repl_diskless_sync_delay = atoi(argv[i + 1]);
+        if (g_server_config.repl_diskless_sync_delay < 0) {
+          g_server_config.repl_diskless_sync_delay = 0;
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--repl-backlog-size") == 0) {
+      if (i + 1 < argc) {
+        if (parse_memory_size(argv[i + 1], &g_server_config.repl_backlog_size) != ERR_NONE) {
+          fprintf(stderr, "invalid repl-backlog-size '%s'\n", argv[i + 1]);
+          exit(EXIT_FAILURE);
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--repl-timeout") == 0) {
+      if (i + 1 < argc) {
+        g_server_config.repl_timeout = atoi(argv[i + 1]);
+        if (g_server_config.repl_timeout < 1) {
+          g_server_config.repl_timeout = 1;
+        }
+        i++;
+      }
+    } else if (strcmp(argv[i], "--repl-ping-replica-period") == 0) {
+      if (i + 1 < argc) {
+        g_server_config.repl_ping_replica_period = atoi(argv[i + 1]);
+        if (g_server_config.repl_ping_replica_period < 1) {
+          g_server_config.repl_ping_replica_period = 1;
+        }
+        i++;
       }
-
-      connected = true;
-      break;
-    }
-
-    freeaddrinfo(res);
-
-    if (!connected) {
-      perror("Replica: failed to connect to master...\n");
-      exit(EXIT_FAILURE);
-    }
-
-    Client *master_client = create_client(master_fd);
-    set_non_blocking(master_fd);
-    master_client->db = db;
-    master_client->type = CLIENT_TYPE_MASTER;
-    master_client->repl_client_state = REPL_STATE_CONNECTING;
-
-    CommandHandler *command_handler = create_command_handler(master_client, 256, 10);
-    parser_init(master_client->parser, command_handler);
-
-    struct epoll_event event;
-    event.data.fd = master_fd;
-    event.data.ptr = master_client;
-
-    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, master_fd, &event) == -1) {
-      perror("epoll_ctl for master_fd failed");
-      exit(EXIT_FAILURE);
     }
-
-    client_enable_write_events(master_client);
   }
+}
 
-  // register the signal handler
-  signal(SIGINT, sigint_handler);
-  if (g_server_info.role == ROLE_SLAVE) {
-    // for now only load file if it is not a replica
-    rdb_load_data_from_file(db, g_server_config.dir, g_server_config.dbfilename);
-  }
 
+/*
+Runs background tasks of the database served by the calling thread's event loop, hz times per
+second.
+*/
+void server_cron(void *db) {
+  redis_db_cron(db);
+  rdb_check_background_save();
+  aof_check_background_rewrite(db);
+  replication_cron(db);
+}
+
+/*
+Creates a non-blocking TCP socket listening on the given port. With reuse_port set, several sockets
+can listen on the same port and the kernel balances incoming connections between them.
+*/
+int create_listening_socket(int port, bool reuse_port) {
   struct sockaddr_in sa;
   int SocketFD = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (SocketFD == -1) {
@@ -179,6 +263,11 @@ int start_server(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
+  if (reuse_port && setsockopt(SocketFD, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+    perror("setsockopt SO_REUSEPORT");
+    exit(EXIT_FAILURE);
+  }
+
   printf("# Creating Server TCP listening socket %s:%d\n", bind_address, ntohs(sa.sin_port));
 
   if (bind(SocketFD, (struct sockaddr *)&sa, sizeof sa) == -1) {
@@ -187,107 +276,200 @@ int start_server(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  if (listen(SocketFD, 10) == -1) {
+  if (listen(SocketFD, SOMAXCONN) == -1) {
     perror("listen failed");
     close(SocketFD);
     exit(EXIT_FAILURE);
   }
 
   set_non_blocking(SocketFD);
+  return SocketFD;
+}
 
-  struct epoll_event event;
-  event.events = EPOLLIN; // EPOLLIN is the flag for read events
-  event.data.ptr = NULL;
-
-  if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, SocketFD, &event) == -1) {
-    perror("epoll_ctl failed");
-    exit(EXIT_FAILURE);
+/*
+Sets up a regular client for an accepted connection and registers it with the calling thread's
+event loop. The data is the database the client starts with.
+*/
+void accept_client(int fd, void *db) {
+  set_non_blocking(fd);
+
+  Client *new_client = create_client(fd);
+  if (!new_client) {
+    close(fd);
+    return;
   }
 
-  struct epoll_event events[MAX_EVENTS];
-  int num_events;
+  new_client->type = CLIENT_TYPE_REGULAR;
+  select_client_db(new_client, db);
+  CommandHandler *command_handler = create_command_handler(new_client, 256, 10);
+  command_handler->defer_execution = g_server_config.io_threads > 1;
+  parser_init(new_client->parser, command_handler);
 
-  printf("# Ready to accept connections\n");
-  for (;;) {
-    num_events = epoll_wait(g_epoll_fd, events, MAX_EVENTS, -1);
-    if (num_events == -1 && errno != EINTR) {
-      perror("epoll_wait failed");
-      exit(EXIT_FAILURE);
-    }
+  int optval = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
 
-    // iterate through the events
-    for (int i = 0; i < num_events; i++) {
-      struct epoll_event *current_event = &events[i];
-      Client *client = (Client *)current_event->data.ptr;
-      if (!current_event->data.ptr) { // server socket is ready, new connection
-        int ConnectFD = accept(SocketFD, NULL, NULL);
-        if (ConnectFD == -1) {
-          perror("accept failed");
-          close(SocketFD);
-          exit(EXIT_FAILURE);
-        }
+  event_loop_add_client(g_event_loop, new_client);
+  client_enable_read_events(new_client);
+}
 
-        set_non_blocking(ConnectFD);
+/*
+Dispatches the events the event loop reported for a client based on the client's type.
+*/
+void handle_client_event(Client *client, uint32_t events) {
+  if (events & EVENT_LOOP_INPUT) {
+    // the io_uring backend already received the bytes, only regular clients are read that way. A
+    // client that just became a replica may have sent its first acknowledgement before that stopped
+    if (client->type == CLIENT_TYPE_REGULAR || client->type == CLIENT_TYPE_REPLICA) {
+      process_client_received_input(client);
+    }
+    return;
+  }
+  if (events & (EPOLLIN | EPOLLOUT)) {
+    if (events & EPOLLIN) {
+      if (client->type == CLIENT_TYPE_REGULAR) {
+        if (g_server_config.io_threads > 1) {
+          // read and parse later, together with the other readable clients
+          io_threads_queue_read(client);
+        } else {
+          process_client_input(client);
+        }
+      } else if (client->type == CLIENT_TYPE_MASTER) {
+        replica_handle_master_data(client);
+        // the connection to a master that closed it has no events left
+        if (g_server_info.master != client) return;
+      } else if (client->type == CLIENT_TYPE_REPLICA) {
+        // replicas only send acknowledgements, a disconnected replica has no events left
+        if (master_handle_replica_input(client) == -1) return;
+      }
+    }
+    if (events & EPOLLOUT) {
+      if (client->type == CLIENT_TYPE_REPLICA) {
+        master_handle_replica_out(client);
+      } else if (client->type == CLIENT_TYPE_MASTER) {
+        replica_handle_master_data(client);
+      } else if (client->type == CLIENT_TYPE_REGULAR) {
+        flush_client_output(client);
+        char *output_buf;
+        size_t output_len;
+        if (rb_readable(client->output_buffer, &output_buf, &output_len) == 0 &&
+            output_len == 0) {
+          client_disable_write_events(client);
+        }
+      }
+    }
+  } else if (events & (EPOLLHUP | EPOLLERR)) {
+    handle_client_disconnection(client);
+  } else {
+    fprintf(stderr, "Unexpected event type: %d\n", events);
+  }
+}
 
-        Client *new_client = create_client(ConnectFD);
+int start_server(int argc, char *argv[]) {
+  g_handler = create_handler();
+  parse_args(argc, argv);
+  // jitters the reconnects, replicas of a restarted master don't all connect at once
+  srandom(current_time_millis() ^ getpid());
+
+  if (g_server_config.shards > 1) {
+    if (g_server_config.appendonly) {
+      // the shards would have to agree on the order their commands are appended in
+      printf("# The append only file is not supported with shards\n");
+      g_server_config.appendonly = false;
+    }
+    // every shard runs its own event loop over its own slice of the keyspace
+    int status = start_sharded_server(g_server_config.shards);
+    destroy_handler(g_handler);
+    return status;
+  }
 
-        new_client->type = CLIENT_TYPE_REGULAR;
-        select_client_db(new_client, db);
-        CommandHandler *command_handler = create_command_handler(new_client, 256, 10);
-        parser_init(new_client->parser, command_handler);
+  redis_db_t *db = redis_db_create();
+  g_event_loop = event_loop_create(g_server_config.io_backend, handle_client_event);
+  if (event_loop_backend(g_event_loop) == IO_BACKEND_IO_URING && g_server_config.io_threads > 1) {
+    // the kernel already performs the socket I/O asynchronously
+    printf("# I/O threads are not used with the io_uring backend\n");
+    g_server_config.io_threads = 1;
+  }
 
-        int optval = 1;
-        setsockopt(ConnectFD, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+  io_threads_init(g_server_config.io_threads);
 
-        event.data.fd = ConnectFD;
-        event.data.ptr = new_client;
+  // register the signal handler
+  signal(SIGINT, sigint_handler);
+  // The AOF has the latest writes, so with appendonly it is loaded instead of the RDB file
+  int aof_status = g_server_config.appendonly
+                       ? aof_load_data_from_file(db, g_server_config.dir,
+                                                 g_server_config.appendfilename)
+                       : -1;
+  if (aof_status == 1) {
+    fprintf(stderr, "bad append only file, fix or remove it before starting the server\n");
+    exit(EXIT_FAILURE);
+  }
+  rdb_repl_info repl_info = {"", -1};
+  if (aof_status == -1) {
+    rdb_load_data_from_file(db, g_server_config.dir, g_server_config.dbfilename, &repl_info);
+  }
+  bool aof_missing = aof_status == -1;
+
+  // a replica restarted from its snapshot asks its master to continue the stream from there. A
+  // master starts a new stream, its replicas resync with it
+  if (g_server_info.role == ROLE_SLAVE && repl_info.replid[0] != '\0' && repl_info.offset >= 0) {
+    memcpy(g_server_info.master_replid, repl_info.replid, sizeof(g_server_info.master_replid));
+    g_server_info.master_repl_offset = repl_info.offset;
+  } else if (g_server_info.role == ROLE_MASTER) {
+    random_hex(g_server_info.master_replid, REPLID_SIZE);
+  }
+  // create replication backlog, at the offset the dataset is at
+  replication_create_backlog();
+  // the handshake with the master runs in the event loop, the replica serves its dataset meanwhile
+  if (g_server_info.role == ROLE_SLAVE) replication_connect_to_master(db);
 
-        if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, ConnectFD, &event) == -1) {
-          perror("epoll_ctl failed");
-          exit(EXIT_FAILURE);
-        }
-        client_enable_read_events(new_client);
-      } else if (events[i].events & EPOLLIN | EPOLLOUT) {
-        if (events[i].events & EPOLLIN) {
-          if (client->type == CLIENT_TYPE_REGULAR) {
-            process_client_input(client);
-          } else if (client->type == CLIENT_TYPE_MASTER) {
-            replica_handle_master_data(client);
-          }
-        }
-        if (events[i].events & EPOLLOUT) {
-          if (client->type == CLIENT_TYPE_REPLICA) {
-            master_handle_replica_out(client);
-          } else if (client->type == CLIENT_TYPE_MASTER) {
-            replica_handle_master_data(client);
-          } else if (client->type == CLIENT_TYPE_REGULAR) {
-            flush_client_output(client);
-          }
-        }
-      } else if (events[i].events & EPOLLHUP | EPOLLERR) {
-        handle_client_disconnection(client);
-      } else {
-        fprintf(stderr, "Unexpected event type: %d\n", events[i].events);
-      }
+  if (g_server_config.appendonly) {
+    if (!aof_open(g_server_config.dir, g_server_config.appendfilename)) {
+      exit(EXIT_FAILURE);
     }
+    // the dataset that was loaded from the RDB file is not in the new AOF yet
+    if (aof_missing) aof_write_dataset(db);
+  }
+
+  int SocketFD = create_listening_socket(port, false);
+  event_loop_add_listener(g_event_loop, SocketFD, accept_client, db);
+  event_loop_add_timer(g_event_loop, 1000 / g_server_config.hz, server_cron, db);
+
+  printf("# Ready to accept connections\n");
+  for (;;) {
+    event_loop_process_events(g_event_loop);
+
+    // read, parse and reply to the clients that became readable in this iteration
+    io_threads_handle_pending_reads();
+
+    // reply to the clients in WAIT whose writes the replicas acknowledged, or that timed out
+    replication_handle_waiting_clients();
+
+    // write the commands this iteration appended, the fsync policy decides when they hit the disk
+    aof_flush();
+    // and send them to the replicas, all of them at once
+    replication_send_pending();
 
     if (stop_server) {
       printf("# User requested shutdown...\n");
       break;
     }
   }
-  close(g_epoll_fd);
+  io_threads_shutdown();
+  event_loop_destroy(g_event_loop);
+  g_event_loop = NULL;
   close(SocketFD);
   // saves the currently selected db
   // TODO when we support multiple databases, save all of the databases
+  rdb_kill_background_save();
+  aof_kill_background_rewrite();
+  aof_close();
   printf("# Saving the final RDB snapshot before exiting.\n");
   if (redis_db_save(db)) {
     printf("# DB saved on disk\n");
   }
   redis_db_destroy(db);
   destroy_handler(g_handler);
-  // TODO destroy repl backlog
-  rb_destroy(g_server_info.repl_backlog);
+  replication_free_backlog();
   printf("# redis_lite is now ready to exit, bye bye...\n");
   return EXIT_SUCCESS;
 }
@@ -6,8 +6,9 @@ extern "C" {
 
 #include "client.h"
 #include "command_handler.h"
-#include "khash.h"
 #include "resp.h"
+#include <signal.h>
+#include <stdbool.h>
 #include <sys/epoll.h>
 
 // foward declarations
@@ -16,10 +17,19 @@ struct CommandHandler;
 void handle_client_disconnection(Client *client);
 
 int start_server();
+void sigint_handler(int sig);
+int create_listening_socket(int port, bool reuse_port);
+void accept_client(int fd, void *db);
+void handle_client_event(Client *client, uint32_t events);
+void server_cron(void *db);
 
-extern int g_epoll_fd; // global epoll fd
+// event loop running on the calling thread, every shard has its own
+extern __thread struct event_loop *g_event_loop;
+extern int port;
+extern volatile sig_atomic_t stop_server;
 void client_enable_write_events(Client *client);
 void client_disable_write_events(Client *client);
+void client_disable_read_events(Client *client);
 
 #ifdef __cplusplus
 }
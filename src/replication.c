@@ -1,151 +1,676 @@
 #include "replication.h"
+#include "aof.h"
 #include "commands.h"
+#include "event_loop.h"
 #include "rdb.h"
 #include "redis-server.h"
 #include "server_config.h"
 #include "util.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+// the stream is appended to blocks of at least this size
+#define REPL_BLOCK_SIZE (16 * 1024)
+// a replica this far behind is disconnected rather than have the buffer keep all of it
+#define REPL_REPLICA_MAX_LAG (256LL * 1024 * 1024)
+// blocks sent to a replica by a single writev
+#define REPL_MAX_IOVECS 64
+// milliseconds between the acknowledgements a replica sends on its own
+#define REPL_ACK_INTERVAL 1000
+// milliseconds a replica waits before it connects to its master again. The delay doubles with every
+// failed attempt up to the maximum
+#define REPL_RECONNECT_MIN_DELAY 100
+#define REPL_RECONNECT_MAX_DELAY 5000
+
+// clients blocked in WAIT, until enough replicas acknowledged their writes or they timed out
+static Client **waiting_clients;
+static size_t num_waiting_clients;
+static size_t waiting_clients_capacity;
+// a client started waiting, the replicas are asked for an acknowledgement after the iteration's
+// commands
+static bool get_ack_pending;
+// attempts to connect to the master since the link was last up, and when the next one starts
+static int connect_attempts;
+static long long next_connect_time;
+
+/*
+Sends what is left of the replica's preamble. Returns true once all of it was sent.
+*/
+static bool send_repl_preamble(Client *client) {
+  while (client->repl_preamble_len > 0) {
+    ssize_t bytes_sent = write(client->fd, client->repl_preamble, client->repl_preamble_len);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("failed to send data to replica");
+      return false;
+    }
+    client->repl_preamble_len -= bytes_sent;
+    memmove(client->repl_preamble, client->repl_preamble + bytes_sent, client->repl_preamble_len);
+  }
+  return true;
+}
+
+static repl_block *repl_block_create(long long offset, size_t size) {
+  repl_block *block = malloc(sizeof(repl_block) + size);
+  if (!block) {
+    perror("failed to allocate replication buffer block");
+    exit(EXIT_FAILURE);
+  }
+  block->next = NULL;
+  block->offset = offset;
+  block->refcount = 0;
+  block->used = 0;
+  block->size = size;
+  return block;
+}
+
+// frees the blocks at the head of the buffer that no cursor points into, the tail is kept
+static void repl_buffer_trim() {
+  repl_block *head = g_server_info.repl_buffer_head;
+  while (head != g_server_info.repl_buffer_tail && head->refcount == 0) {
+    repl_block *next = head->next;
+    free(head);
+    head = next;
+  }
+  g_server_info.repl_buffer_head = head;
+}
+
+/*
+Finds the position of a replication offset in the buffer. Returns false when the stream at the
+offset was freed already or has not been written yet.
+*/
+static bool repl_buffer_find(long long offset, repl_block **block, size_t *pos) {
+  for (repl_block *b = g_server_info.repl_buffer_head; b; b = b->next) {
+    if (offset < b->offset) return false;
+    if (offset <= b->offset + (long long)b->used) {
+      *block = b;
+      *pos = offset - b->offset;
+      return true;
+    }
+  }
+  return false;
+}
+
+// points the replica's cursor at pos in block, and lets go of the block it pointed into before
+static void set_replica_cursor(Client *client, repl_block *block, size_t pos) {
+  if (block) block->refcount++;
+  repl_block *previous = client->repl_block;
+  client->repl_block = block;
+  client->repl_block_pos = pos;
+  if (previous) {
+    previous->refcount--;
+    repl_buffer_trim();
+  }
+}
+
+// moves the replica's cursor past bytes it was sent, onto the next block once a block was sent
+static void advance_replica_cursor(Client *client, size_t sent) {
+  repl_block *block = client->repl_block;
+  size_t pos = client->repl_block_pos + sent;
+  while (pos >= block->used && block->next) {
+    pos -= block->used;
+    block = block->next;
+  }
+  if (block != client->repl_block) {
+    set_replica_cursor(client, block, pos);
+  } else {
+    client->repl_block_pos = pos;
+  }
+}
+
+/*
+Sends the replica the stream from its cursor on. The blocks go out by writev, straight from the
+shared buffer. What the socket does not take is sent once it is writable, write events stay
+enabled until the replica caught up.
+*/
+static void send_replication_stream(Client *client) {
+  for (;;) {
+    struct iovec iov[REPL_MAX_IOVECS];
+    int iovcnt = 0;
+    size_t pos = client->repl_block_pos;
+    for (repl_block *b = client->repl_block; b && iovcnt < REPL_MAX_IOVECS; b = b->next) {
+      if (b->used > pos) iov[iovcnt++] = (struct iovec){b->buf + pos, b->used - pos};
+      pos = 0;
+    }
+    if (iovcnt == 0) {
+      if (client->epoll_events & EPOLLOUT) client_disable_write_events(client);
+      return;
+    }
+
+    ssize_t sent = writev(client->fd, iov, iovcnt);
+    if (sent == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // the rest goes out once the socket is writable again
+        if (!(client->epoll_events & EPOLLOUT)) client_enable_write_events(client);
+        return;
+      }
+      perror("failed to send replication stream");
+      handle_client_disconnection(client);
+      return;
+    }
+    advance_replica_cursor(client, sent);
+  }
+}
+
+/*
+Creates the replication buffer with the backlog pointing at its start, replicas can partially
+resync from the stream written from now on.
+*/
+void replication_create_backlog() {
+  repl_block *block = repl_block_create(g_server_info.master_repl_offset, REPL_BLOCK_SIZE);
+  block->refcount++;
+  g_server_info.repl_buffer_head = block;
+  g_server_info.repl_buffer_tail = block;
+  g_server_info.repl_backlog = block;
+  g_server_info.repl_backlog_base_offset = block->offset;
+}
+
+void replication_free_backlog() {
+  repl_block *block = g_server_info.repl_buffer_head;
+  while (block) {
+    repl_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  g_server_info.repl_buffer_head = NULL;
+  g_server_info.repl_buffer_tail = NULL;
+  g_server_info.repl_backlog = NULL;
+}
+
 void master_handle_replica_out(Client *client) {
   MasterReplicaState master_repl_state = client->master_repl_state;
   switch (master_repl_state) {
   case MASTER_REPL_STATE_PROPAGATE:
-    flush_client_output(client);
+    if (send_repl_preamble(client)) send_replication_stream(client);
+    break;
+  case MASTER_REPL_STATE_WAIT_BGSAVE_START:
+    client_disable_write_events(client);
+    break;
+  case MASTER_REPL_STATE_WAIT_BGSAVE_END:
+    // the FULLRESYNC reply can go out already, the stream that follows the snapshot is held back
+    if (send_repl_preamble(client)) client_disable_write_events(client);
     break;
   case MASTER_REPL_STATE_SENDING_RDB_DATA:
-    master_send_rdb_snapshot(client);
+    if (send_repl_preamble(client)) master_send_rdb_snapshot(client);
     break;
-  case MASTER_REPL_STATE_PSYNC:
-    continue_psync(client, g_server_info.repl_backlog); // create this function, once it is
-                                                        // complete, set state to propogate
+  }
+}
+
+/*
+Reads whatever the other end of a replication link, the master or a replica, sent into the input
+buffer without parsing it. Returns -1 when the connection was closed or failed, in which case the
+client was disconnected.
+*/
+static int read_replication_input(Client *client) {
+  const char *peer = client->type == CLIENT_TYPE_MASTER ? "master" : "replica";
+  for (;;) {
+    char *write_buf;
+    size_t writable_len;
+    if (rb_writable(client->input_buffer, &write_buf, &writable_len) != 0 || writable_len == 0) {
+      return 0;
+    }
+    ssize_t bytes_read = read(client->fd, write_buf, writable_len);
+    if (bytes_read == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      fprintf(stderr, "failed to read from %s: %s\n", peer, strerror(errno));
+      handle_client_disconnection(client);
+      return -1;
+    }
+    if (bytes_read == 0) {
+      fprintf(stderr, "%s closed the connection\n", peer);
+      handle_client_disconnection(client);
+      return -1;
+    }
+    rb_write(client->input_buffer, bytes_read);
+    client->repl_last_io = current_time_millis();
+  }
+}
+
+/*
+Reads and runs what a replica sent, its REPLCONF ACKs. Nothing is replied, the replica's socket
+carries the replication stream. Returns -1 when the replica was disconnected.
+*/
+int master_handle_replica_input(Client *client) {
+  if (read_replication_input(client) != 0) return -1;
+  process_client_received_input(client);
+  return 0;
+}
+
+// tells the master how much of the replication stream this replica processed
+static void send_ack(Client *master_client) {
+  master_client->repl_ack_requested = false;
+  send_replconf_ack_command(master_client);
+}
+
+// the link to the master is up again, a later reconnect starts with the shortest delay
+static void master_link_up() {
+  connect_attempts = 0;
+  g_server_info.master_link_down_since = 0;
+}
+
+// disconnects the replicas of this server, so they learn about a change of its stream when they
+// sync again
+static void disconnect_replicas() {
+  // iterate backwards since disconnecting a replica swaps the last one into its slot
+  for (int i = (int)g_server_info.num_replicas - 1; i >= 0; i--) {
+    handle_client_disconnection(g_server_info.replicas[i]);
+  }
+}
+
+/*
+Continues the stream under a new id. The current id becomes the previous one, replicas that
+followed it can still partially resync up to the current offset.
+*/
+static void shift_replid(const char *replid) {
+  if (g_server_info.master_replid[0] != '\0') {
+    memcpy(g_server_info.master_replid2, g_server_info.master_replid,
+           sizeof(g_server_info.master_replid2));
+    g_server_info.second_replid_offset = g_server_info.master_repl_offset;
+  }
+  snprintf(g_server_info.master_replid, sizeof(g_server_info.master_replid), "%s", replid);
+  printf("replication id is now %s, the previous id is valid up to offset %lld\n",
+         g_server_info.master_replid, g_server_info.second_replid_offset);
+}
+
+/*
+Switches the replica to the dataset a full resync loaded into db and to the stream the master's
+FULLRESYNC reply announced. The stream fed on to the replica's own replicas starts over at the new
+offset, they are disconnected and sync again.
+*/
+static void finish_fullresync(Client *master_client, redis_db_t *db) {
+  redis_db_swap(master_client->db, db);
+  disconnect_replicas();
+  memcpy(g_server_info.master_replid, master_client->psync_replid,
+         sizeof(g_server_info.master_replid));
+  g_server_info.master_replid2[0] = '\0';
+  g_server_info.second_replid_offset = -1;
+  g_server_info.master_repl_offset = master_client->psync_offset;
+  replication_free_backlog();
+  replication_create_backlog();
+
+  master_client->repl_client_state = REPL_STATE_READY;
+  // loading the snapshot took a while, the master was not silent meanwhile
+  master_client->repl_last_io = current_time_millis();
+  master_link_up();
+}
+
+/*
+Switches the replica to the stream the master continues after a partial resync. A master that was
+promoted continues the stream of its former master under its own id, the replica takes it over and
+disconnects its own replicas, which continue from the previous id when they sync again.
+*/
+static void finish_partial_resync(Client *master_client) {
+  if (strcmp(master_client->psync_replid, g_server_info.master_replid) != 0) {
+    shift_replid(master_client->psync_replid);
+    disconnect_replicas();
+  }
+  printf("partial resync with master, continuing from offset %lld\n",
+         g_server_info.master_repl_offset);
+  master_client->repl_client_state = REPL_STATE_READY;
+  master_link_up();
+
+  // the stream may have been read along with the reply
+  process_client_received_input(master_client);
+}
+
+// drops the newlines a master sends as keepalive while the replica waits for its snapshot
+static void skip_keepalive_newlines(Client *master_client) {
+  char *read_buf;
+  size_t readable_len;
+  while (rb_readable(master_client->input_buffer, &read_buf, &readable_len) == 0 &&
+         readable_len > 0 && read_buf[0] == '\n') {
+    rb_read(master_client->input_buffer, 1);
+  }
+}
+
+/*
+Parses the $<length>\r\n or $EOF:<marker>\r\n header the master sends ahead of the snapshot, and
+starts receiving the snapshot once the header is complete.
+*/
+static void receive_rdb_header(Client *master_client) {
+  char *read_buf;
+  size_t readable_len;
+
+  skip_keepalive_newlines(master_client);
+  if (rb_readable(master_client->input_buffer, &read_buf, &readable_len) != 0) {
+    fprintf(stderr, "Failed to get readable buffer for client %d\n", master_client->fd);
+    return; // error getting buffer state
+  }
+
+  if (readable_len < 4) {
+    // not enough data for even a minimal header
+    return;
+  }
+
+  // first character must be $
+  if (read_buf[0] != '$') {
+    fprintf(stderr, "protocol error for client %d, expected '$' for RDB header, got %c\n",
+            master_client->fd, read_buf[0]);
+    handle_client_disconnection(master_client);
+    return;
+  }
+
+  char *crlf_pos = NULL;
+  for (size_t i = 0; i < readable_len - 1; i++) {
+    if (read_buf[i] == '\r' && read_buf[i + 1] == '\n') {
+      crlf_pos = read_buf + i;
+      break;
+    }
+  }
+
+  if (crlf_pos == NULL) {
+    // \r\n not found yet, need more data to complete the header
+    return;
+  }
+
+  // calculate length between the $ and \r\n
+  size_t size_str_len = crlf_pos - (read_buf + 1);
+  if (size_str_len == 0) {
+    fprintf(stderr,
+            "error in parsing bulk string header for rdb transfer, empty rdb size string\n");
+  }
+
+  // a diskless master does not know the length, the snapshot is followed by a marker instead
+  bool eof_framed = size_str_len == 4 + RDB_EOF_MARK_SIZE && strncmp(read_buf + 1, "EOF:", 4) == 0;
+  if (eof_framed) memcpy(master_client->rdb_eof_mark, read_buf + 5, RDB_EOF_MARK_SIZE);
+
+  int64_t length = -1;
+
+  char *end_ptr;
+  if (!eof_framed) length = strtol(read_buf + 1, &end_ptr, 10);
+
+  // length from read_buf to \r, plus 2 for \r\n
+  size_t bytes_to_consume = (crlf_pos - read_buf) + 2;
+  if (rb_read(master_client->input_buffer, bytes_to_consume) != 0) {
+    fprintf(stderr, "failed to consume RDB header from buffer for client %d\n", master_client->fd);
+    return;
+  }
+
+  master_client->rdb_expected_bytes = length;
+  master_client->rdb_received_bytes = 0;
+  master_client->rdb_written_bytes = 0;
+  master_client->repl_client_state = REPL_STATE_RECEIVING_RDB_DATA;
+
+  if (g_server_config.repl_diskless_load) {
+    replica_load_rdb_from_socket(master_client);
+    return;
+  }
+  // proceed to receive RDB data, as some might already be in the buffer
+  // after the header was confused
+  replica_receive_rdb_snapshot(master_client);
+}
+
+/*
+Takes the handshake one step further once the master replied: it is sent the next command of the
+handshake, PING, REPLCONF listening-port, REPLCONF capa and PSYNC follow each other, and the
+replica starts receiving the snapshot or continues the stream after PSYNC. A reply the handshake did
+not expect drops the link, the replica connects again.
+*/
+static void continue_handshake(Client *master_client) {
+  switch (master_client->repl_client_state) {
+  case REPL_STATE_RECEIVED_PONG:
+    send_replconf_listening_port_command(master_client, g_server_config.port);
+    break;
+  case REPL_STATE_RECEIVED_REPLCONF_PORT_OK:
+    send_replconf_capa_command(master_client);
+    break;
+  case REPL_STATE_RECEIVED_REPLCONF_CAPA_OK:
+    send_psync_command(master_client);
+    break;
+  case REPL_STATE_RECEIVED_FULLRESYNC_RESPONSE:
+    // the header may have been read along with the reply
+    receive_rdb_header(master_client);
+    break;
+  case REPL_STATE_RECEIVED_CONTINUE:
+    finish_partial_resync(master_client);
+    break;
+  case REPL_STATE_ERROR:
+    fprintf(stderr, "replication handshake with master failed\n");
+    handle_client_disconnection(master_client);
+    break;
+  default:
     break;
   }
 }
 
+// the non-blocking connect to the master completed once the socket became writable
+static void finish_connect(Client *master_client) {
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  if (getsockopt(master_client->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1) error = errno;
+  if (error != 0) {
+    fprintf(stderr, "failed to connect to master: %s\n", strerror(error));
+    handle_client_disconnection(master_client);
+    return;
+  }
+  printf("connected to master %s:%s\n", g_server_config.master_host,
+         g_server_config.master_port);
+  master_client->repl_last_io = current_time_millis();
+  // from now on the replica only waits for what the master sends
+  client_disable_write_events(master_client);
+  client_enable_read_events(master_client);
+  send_ping_command(master_client);
+}
+
+/*
+Drives the replica's side of the replication link: the connect completes, the handshake replies
+arrive, the snapshot is received and the stream is applied. Any of them may drop the link, the
+replica then connects again from replication_cron.
+*/
 void replica_handle_master_data(Client *master_client) {
   switch (master_client->repl_client_state) {
   case REPL_STATE_CONNECTING:
-    send_ping_command(master_client);
-    master_client->repl_client_state = REPL_STATE_SENT_PING;
+    finish_connect(master_client);
     break;
   case REPL_STATE_SENT_PING:
   case REPL_STATE_SENT_REPLCONF_PORT:
   case REPL_STATE_SENT_REPLCONF_CAPA:
   case REPL_STATE_SENT_PSYNC:
     // we are expecting replys from master
-    process_client_input(master_client);
+    if (read_replication_input(master_client) != 0) return;
+    skip_keepalive_newlines(master_client);
+    process_client_received_input(master_client);
+    continue_handshake(master_client);
     break;
-  case REPL_STATE_RECEIVED_PONG:
-    send_replconf_listening_port_command(master_client, g_server_config.port);
-    master_client->repl_client_state = REPL_STATE_SENT_REPLCONF_PORT;
+  case REPL_STATE_RECEIVED_FULLRESYNC_RESPONSE:
+    // the master sends the RDB header once its background save finished
+    if (read_replication_input(master_client) != 0) return;
+    receive_rdb_header(master_client);
     break;
-  case REPL_STATE_RECEIVED_REPLCONF_PORT_OK:
-    send_replconf_capa_command(master_client);
-    master_client->repl_client_state = REPL_STATE_SENT_REPLCONF_CAPA;
+  case REPL_STATE_RECEIVING_RDB_DATA:
+    replica_receive_rdb_snapshot(master_client);
     break;
-  case REPL_STATE_RECEIVED_REPLCONF_CAPA_OK:
-    send_psync_command(master_client);
-    master_client->repl_client_state = REPL_STATE_SENT_PSYNC;
+  case REPL_STATE_READY:
+    if (read_replication_input(master_client) != 0) return;
+    process_client_received_input(master_client);
+    if (master_client->repl_ack_requested) send_ack(master_client);
     break;
-  case REPL_STATE_RECEIVED_FULLRESYNC_RESPONSE:
-    char *read_buf;
-    size_t readable_len;
+  default:
+    fprintf(stderr, "invalid state for replica handling master data\n");
+  }
+}
 
-    if (rb_readable(master_client->input_buffer, &read_buf, &readable_len) != 0) {
-      fprintf(stderr, "Failed to get readable buffer for client %d\n", master_client->fd);
-      return; // error getting buffer state
-    }
+/*
+Moves the start of the backlog forward to keep at least repl_backlog_size bytes of the stream. It
+lets go of whole blocks, which are freed once no replica is still sending from them.
+*/
+static void trim_backlog() {
+  repl_block *backlog = g_server_info.repl_backlog;
+  while (backlog->next && (unsigned long long)(g_server_info.master_repl_offset -
+                                               backlog->next->offset) >=
+                              g_server_config.repl_backlog_size) {
+    backlog->next->refcount++;
+    backlog->refcount--;
+    backlog = backlog->next;
+  }
+  g_server_info.repl_backlog = backlog;
+  g_server_info.repl_backlog_base_offset = backlog->offset;
+  repl_buffer_trim();
+}
 
-    if (readable_len < 4) {
-      // not enough data for even a minimal header
-      return;
-    }
+/*
+Appends bytes to the replication stream. The bytes are copied once, into the shared replication
+buffer, where the backlog and the replicas read them from. They are sent to the replicas at the
+end of the event loop iteration, by replication_send_pending.
+*/
+void replication_feed(const char *buf, size_t len) {
+  repl_block *tail = g_server_info.repl_buffer_tail;
+  g_server_info.master_repl_offset += len; // advance the masters offset
 
-    // first character must be $
-    if (read_buf[0] != '$') {
-      fprintf(stderr, "protocol error for client %d, expected '$' for RDB header, got %c\n",
-              master_client->fd, read_buf[0]);
+  while (len > 0) {
+    if (tail->used == tail->size) {
+      size_t size = len > REPL_BLOCK_SIZE ? len : REPL_BLOCK_SIZE;
+      repl_block *block = repl_block_create(tail->offset + tail->used, size);
+      tail->next = block;
+      tail = block;
+      g_server_info.repl_buffer_tail = block;
     }
+    size_t bytes = len < tail->size - tail->used ? len : tail->size - tail->used;
+    memcpy(tail->buf + tail->used, buf, bytes);
+    tail->used += bytes;
+    buf += bytes;
+    len -= bytes;
+  }
 
-    char *crlf_pos = NULL;
-    for (size_t i = 0; i < readable_len - 1; i++) {
-      if (read_buf[i] == '\r' && read_buf[i + 1] == '\n') {
-        crlf_pos = read_buf + i;
-        break;
-      }
-    }
+  trim_backlog();
+}
 
-    if (crlf_pos == NULL) {
-      // \r\n not found yet, need more data to complete the header
-      return;
+/*
+Feeds the len bytes of the master's stream a replica just parsed on to its own replication stream,
+for its replicas and to continue the stream once it is promoted. Only complete commands are fed, so
+the offset the replica acknowledges and resyncs from is always on a command boundary. command_end
+is where the last complete command in the bytes ended, NULL when none did, the bytes after it are
+held back until their command is complete.
+*/
+void replication_feed_master_stream(Client *master_client, const char *buf, size_t len,
+                                    const char *command_end) {
+  if (command_end) {
+    if (master_client->repl_pending_len > 0) {
+      replication_feed(master_client->repl_pending, master_client->repl_pending_len);
+      master_client->repl_pending_len = 0;
     }
+    replication_feed(buf, command_end - buf);
+    len -= command_end - buf;
+    buf = command_end;
+  }
+  if (len == 0) return;
 
-    // calculate length between the $ and \r\n
-    size_t size_str_len = crlf_pos - (read_buf + 1);
-    if (size_str_len == 0) {
-      fprintf(stderr,
-              "error in parsing bulk string header for rdb transfer, empty rdb size string\n");
+  size_t needed = master_client->repl_pending_len + len;
+  if (needed > master_client->repl_pending_capacity) {
+    size_t capacity = master_client->repl_pending_capacity ? master_client->repl_pending_capacity
+                                                           : REPL_BLOCK_SIZE;
+    while (capacity < needed) capacity *= 2;
+    char *pending = realloc(master_client->repl_pending, capacity);
+    if (!pending) {
+      perror("failed to grow the pending part of the master's stream");
+      exit(EXIT_FAILURE);
     }
+    master_client->repl_pending = pending;
+    master_client->repl_pending_capacity = capacity;
+  }
+  memcpy(master_client->repl_pending + master_client->repl_pending_len, buf, len);
+  master_client->repl_pending_len = needed;
+}
 
-    int64_t length = 0;
-
-    char *end_ptr;
-    length = strtol(read_buf + 1, &end_ptr, 10);
+/*
+Resizes the backlog, CONFIG SET repl-backlog-size. A smaller backlog lets go of the blocks it does
+not need anymore right away, a larger one keeps more of the stream written from now on.
+*/
+void replication_set_backlog_size(unsigned long long size) {
+  g_server_config.repl_backlog_size = size;
+  if (g_server_info.repl_backlog) trim_backlog();
+}
 
-    size_t bytes_to_consume =
-        (crlf_pos - read_buf) + 2; // length from read_buf to \r, plus 2 for \r\n
-    if (rb_read(master_client->input_buffer, bytes_to_consume) != 0) {
-      fprintf(stderr, "failed to consume RDB header from buffer for client %d\n",
-              master_client->fd);
-      return;
-    }
+/*
+Sends the stream appended during this event loop iteration to the replicas, called once per
+iteration. Every replica gets all the commands of the iteration with a single writev, instead of
+being visited for every command. Replicas that are already waiting for their socket to become
+writable are left to the event loop, replicas too far behind are disconnected.
+*/
+void replication_send_pending() {
+  static long long sent_offset = 0;
+  if (get_ack_pending) {
+    // the replicas acknowledge once they processed everything before the request
+    get_ack_pending = false;
+    static const char getack[] = "*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n";
+    replication_feed(getack, sizeof(getack) - 1);
+  }
+  if (g_server_info.master_repl_offset == sent_offset) return;
+  sent_offset = g_server_info.master_repl_offset;
 
-    master_client->rdb_expected_bytes = length;
-    master_client->rdb_received_bytes = 0;
-    master_client->repl_client_state = REPL_STATE_RECEIVING_RDB_DATA;
+  // iterate backwards since disconnecting a replica swaps the last one into its slot
+  for (int i = (int)g_server_info.num_replicas - 1; i >= 0; i--) {
+    Client *replica = g_server_info.replicas[i];
+    // its snapshot is not being written yet, it will contain these bytes
+    if (!replica->repl_block) continue;
 
-    // proceed to receive RDB data, as some might already be in the buffer
-    // after the header was confused
-    replica_receive_rdb_snapshot(master_client);
-    break;
-  case REPL_STATE_RECEIVING_RDB_DATA:
-    replica_receive_rdb_snapshot(master_client);
-    break;
-  case REPL_STATE_READY:
-    process_client_input(master_client);
-    break;
-  default:
-    fprintf(stderr, "invalid state for replica handling master data\n");
+    long long lag =
+        g_server_info.master_repl_offset - replica->repl_block->offset - replica->repl_block_pos;
+    if (lag > REPL_REPLICA_MAX_LAG) {
+      fprintf(stderr, "replica %d is %lld bytes behind the replication stream, disconnecting\n",
+              replica->fd, lag);
+      handle_client_disconnection(replica);
+      continue;
+    }
+    // until its snapshot was sent the stream only accumulates
+    if (replica->master_repl_state == MASTER_REPL_STATE_PROPAGATE &&
+        !(replica->epoll_events & EPOLLOUT)) {
+      send_replication_stream(replica);
+    }
   }
 }
 
 /*
-Add a replica to the array of replicas. Write commands will be propogated to replicas.
+Add a replica to the array of replicas. Write commands will be propogated to replicas. The array
+grows as replicas connect.
 */
 void add_replica(Client *client) {
   if (!client) {
     fprintf(stderr, "add_replica: client is null");
+    return;
+  }
+  if (g_server_info.num_replicas == g_server_info.replicas_capacity) {
+    size_t capacity = g_server_info.replicas_capacity ? g_server_info.replicas_capacity * 2 : 16;
+    Client **replicas = realloc(g_server_info.replicas, capacity * sizeof(Client *));
+    if (!replicas) {
+      perror("failed to grow the replica array");
+      exit(EXIT_FAILURE);
+    }
+    g_server_info.replicas = replicas;
+    g_server_info.replicas_capacity = capacity;
   }
   client->type = CLIENT_TYPE_REPLICA;
   client->should_reply = false;
+  client->repl_ack_time = current_time_millis();
+  // a replica is read on the main thread, its acknowledgements are handled as they arrive
+  CommandHandler *ch = client->parser->command_handler;
+  if (ch) ch->defer_execution = false;
   g_server_info.replicas[g_server_info.num_replicas++] = client;
 }
 
 /*
 Remove a replica from the array of replicas.
-Swaps the replica to be re
+Swaps the last replica into the slot of the removed one.
 */
 void remove_replica(Client *client) {
   if (!client) {
     fprintf(stderr, "remove_replica: client is null");
+    return;
   }
 
   int num_replicas = g_server_info.num_replicas;
-  Client *replica = NULL;
   int replica_pos = -1;
   for (int i = 0; i < num_replicas; i++) {
     if (g_server_info.replicas[i] == client) {
@@ -156,10 +681,17 @@ void remove_replica(Client *client) {
 
   if (replica_pos == -1) {
     fprintf(stderr, "remove_replica: replica not found in replicas");
+    return;
   }
 
   g_server_info.replicas[replica_pos] = g_server_info.replicas[num_replicas - 1];
   g_server_info.num_replicas--;
+  set_replica_cursor(client, NULL, 0);
+
+  if (client->rdb_fd != -1) {
+    close(client->rdb_fd);
+    client->rdb_fd = -1;
+  }
 }
 
 /*
@@ -195,198 +727,690 @@ void master_send_rdb_snapshot(Client *client) {
 
   if (client->rdb_file_offset == client->rdb_file_size) {
     printf("RDB file transmission complete for client %d\n", client->fd);
-    client_disable_write_events(client);
+    close(client->rdb_fd);
+    client->rdb_fd = -1;
     client->master_repl_state = MASTER_REPL_STATE_PROPAGATE;
+    // the replica loads the snapshot before it acknowledges anything
+    client->repl_ack_time = current_time_millis();
+    // the stream written since the snapshot was taken follows it
+    send_replication_stream(client);
   }
 }
 
-void replica_receive_rdb_snapshot(Client *client) {
-  ssize_t bytes_read;
+/*
+Finds the marker that ends a snapshot sent without its length in the next len received bytes. It
+may have started in the bytes received before, which end with rdb_eof_tail. Returns the number of
+bytes up to and including the marker, 0 when it did not arrive yet.
+*/
+static size_t find_eof_mark(Client *client, const char *buf, size_t len) {
+  const char *mark = client->rdb_eof_mark;
+  for (size_t k = 1; k < RDB_EOF_MARK_SIZE && k <= len; k++) {
+    size_t before = RDB_EOF_MARK_SIZE - k;
+    if ((long long)before <= client->rdb_written_bytes &&
+        memcmp(client->rdb_eof_tail + k, mark, before) == 0 && memcmp(buf, mark + before, k) == 0) {
+      return k;
+    }
+  }
+  for (const char *p = buf; (p = memchr(p, mark[0], buf + len - p)) != NULL; p++) {
+    if ((size_t)(buf + len - p) < RDB_EOF_MARK_SIZE) break;
+    if (memcmp(p, mark, RDB_EOF_MARK_SIZE) == 0) return p - buf + RDB_EOF_MARK_SIZE;
+  }
+  return 0;
+}
 
+// keeps the last RDB_EOF_MARK_SIZE bytes written to the temporary file
+static void update_eof_tail(Client *client, const char *buf, size_t len) {
+  if (len >= RDB_EOF_MARK_SIZE) {
+    memcpy(client->rdb_eof_tail, buf + len - RDB_EOF_MARK_SIZE, RDB_EOF_MARK_SIZE);
+    return;
+  }
+  memmove(client->rdb_eof_tail, client->rdb_eof_tail + len, RDB_EOF_MARK_SIZE - len);
+  memcpy(client->rdb_eof_tail + RDB_EOF_MARK_SIZE - len, buf, len);
+}
+
+/*
+Parses the snapshot straight from the master's socket into a fresh database, which replaces the
+replica's dataset once the snapshot was loaded completely, so a failed transfer leaves the dataset
+alone. Like a load from disk it blocks the event loop until the snapshot arrived.
+*/
+void replica_load_rdb_from_socket(Client *client) {
+  // the part of the snapshot read along with the header is where the transfer starts
+  char *read_buf;
+  size_t readable_len;
+  if (rb_readable(client->input_buffer, &read_buf, &readable_len) != 0) {
+    fprintf(stderr, "failed to get readable buffer\n");
+    return;
+  }
+  char *buf = malloc(readable_len);
+  redis_db_t *db = redis_db_create();
+  if ((!buf && readable_len > 0) || !db) {
+    perror("failed to allocate database for diskless load");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(buf, read_buf, readable_len);
+  rb_read(client->input_buffer, readable_len);
+
+  size_t len = readable_len;
+  const char *eof_mark = client->rdb_expected_bytes == -1 ? client->rdb_eof_mark : NULL;
+  if (!rdb_load_from_socket(db, client->fd, client->rdb_expected_bytes, eof_mark, &buf, &len)) {
+    fprintf(stderr, "failed to load RDB snapshot from master\n");
+    free(buf);
+    redis_db_destroy(db);
+    handle_client_disconnection(client);
+    return;
+  }
+  printf("RDB snapshot loaded from the master's socket: %zu keys\n", redis_db_dbsize(db));
+  finish_fullresync(client, db);
+  redis_db_destroy(db);
+
+  // the stream that follows the snapshot may have been read along with it
+  if (len > 0) {
+    client_append_input(client, buf, len);
+    process_client_received_input(client);
+  }
+  free(buf);
+}
+
+/*
+Writes the snapshot the master sends to a temporary file and loads it once complete. Part of the
+snapshot may already be in the input buffer, read together with the reply before it, so the buffer
+is drained before reading from the socket, and no more than the rest of the snapshot is read. A
+snapshot sent without its length is written until its marker arrived, whatever follows the marker
+stays in the input buffer.
+*/
+void replica_receive_rdb_snapshot(Client *client) {
   // open a temporary file for writing
   if (client->tmp_rdb_fp == NULL) {
     char *file_path = construct_file_path(g_server_config.dir, "temp_snapshot.rdb");
     client->tmp_rdb_fp = fopen(file_path, "wb");
     if (!client->tmp_rdb_fp) {
       perror("could not open temporary RDB file for writing received snapshot\n");
+      free(file_path);
+      handle_client_disconnection(client);
       return;
     }
     printf("opened temporary file: %s\n", file_path);
     free(file_path);
   }
 
-  // continusly read from socket into ring buffer
-  // and drain the ring buffer into the file.
-  while (1) {
-    char *write_buf;
+  // alternately drain the ring buffer into the file and read from the socket into the ring buffer
+  bool eof_framed = client->rdb_expected_bytes == -1;
+  bool complete = !eof_framed && client->rdb_written_bytes >= client->rdb_expected_bytes;
+  while (!complete) {
     char *read_buf;
-    size_t writable_len;
     size_t readable_len;
-    if (client->rdb_received_bytes < client->rdb_expected_bytes) {
-      // we haven't received the expected number of bytes yet
-      // get the writable portion of the ring buffer
-      if (rb_writable(client->input_buffer, &write_buf, &writable_len) != 0) {
-        fprintf(stderr, "failed to get writable buffer\n");
-        return;
-      }
+    if (rb_readable(client->input_buffer, &read_buf, &readable_len) != 0) {
+      fprintf(stderr, "failed to get readable buffer\n");
+      return;
+    }
 
-      if (writable_len == 0) {
-        fprintf(stderr, "input buffer full\n");
+    size_t remaining_bytes =
+        eof_framed ? SIZE_MAX : client->rdb_expected_bytes - client->rdb_written_bytes;
+    if (readable_len > 0) {
+      size_t bytes_to_write = readable_len < remaining_bytes ? readable_len : remaining_bytes;
+      size_t mark_end = eof_framed ? find_eof_mark(client, read_buf, readable_len) : 0;
+      if (mark_end > 0) bytes_to_write = mark_end;
+      size_t bytes_written = fwrite(read_buf, 1, bytes_to_write, client->tmp_rdb_fp);
+      if (bytes_written != bytes_to_write) {
+        perror("failed to write received snapshot");
+        handle_client_disconnection(client);
         return;
       }
+      if (eof_framed) update_eof_tail(client, read_buf, bytes_written);
+      client->rdb_written_bytes += bytes_written;
+      complete = eof_framed ? mark_end > 0 : bytes_written == remaining_bytes;
+      if (rb_read(client->input_buffer, bytes_written) != 0) {
+        fprintf(stderr, "error updating read index for ring buffer\n");
+      }
+      continue;
+    }
 
-      ssize_t remaining_bytes_to_read = client->rdb_expected_bytes - client->rdb_received_bytes;
+    char *write_buf;
+    size_t writable_len;
+    if (rb_writable(client->input_buffer, &write_buf, &writable_len) != 0) {
+      fprintf(stderr, "failed to get writable buffer\n");
+      return;
+    }
+    size_t bytes_to_read = writable_len < remaining_bytes ? writable_len : remaining_bytes;
+    ssize_t bytes_read = read(client->fd, write_buf, bytes_to_read);
+    if (bytes_read == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      perror("error reading from master socket");
+      handle_client_disconnection(client);
+      return;
+    }
+    if (bytes_read == 0) {
+      printf("master closed connection\n");
+      handle_client_disconnection(client);
+      return;
+    }
+    if (rb_write(client->input_buffer, bytes_read)) {
+      fprintf(stderr, "failed to update write index\n");
+    }
+    client->rdb_received_bytes += bytes_read;
+    client->repl_last_io = current_time_millis();
+  }
 
-      bytes_read = read(client->fd, write_buf, remaining_bytes_to_read);
+  printf("RDB snapshot completely received and written to temp file: %lld bytes.\n",
+         client->rdb_written_bytes);
+  // the marker is not part of the snapshot
+  if (eof_framed && (fflush(client->tmp_rdb_fp) != 0 ||
+                     ftruncate(fileno(client->tmp_rdb_fp),
+                               client->rdb_written_bytes - RDB_EOF_MARK_SIZE) != 0)) {
+    perror("failed to remove the EOF marker from received snapshot");
+  }
+  fclose(client->tmp_rdb_fp);
+  client->tmp_rdb_fp = NULL;
 
-      if (bytes_read == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          return;
-        } else if (errno == EINTR) {
-          continue;
-        } else {
-          perror("sendfile failed\n");
-          return;
-        }
-      } else if (bytes_read == 0) {
-        break;
-      }
+  // like the snapshot loaded from the socket it replaces the dataset only once it loaded completely
+  redis_db_t *db = redis_db_create();
+  if (!db) {
+    perror("failed to allocate database for received snapshot");
+    exit(EXIT_FAILURE);
+  }
+  if (rdb_load_data_from_file(db, g_server_config.dir, "temp_snapshot.rdb", NULL) != 0) {
+    fprintf(stderr, "failed to load RDB snapshot from master\n");
+    redis_db_destroy(db);
+    handle_client_disconnection(client);
+    return;
+  }
+  finish_fullresync(client, db);
+  redis_db_destroy(db);
 
-      if (rb_write(client->input_buffer, bytes_read)) {
-        fprintf(stderr, "failed to update write index\n");
-      }
+  // the stream that follows the snapshot may have been read along with it
+  char *read_buf;
+  size_t readable_len;
+  if (rb_readable(client->input_buffer, &read_buf, &readable_len) == 0 && readable_len > 0) {
+    process_client_received_input(client);
+  }
+}
 
-      client->rdb_received_bytes += bytes_read;
+// the replica is told which offset its snapshot corresponds to before the snapshot is sent
+static void set_fullresync_preamble(Client *client, long long offset) {
+  client->repl_preamble_len = snprintf(client->repl_preamble, sizeof(client->repl_preamble),
+                                       "+FULLRESYNC %s %lld\r\n", g_server_info.master_replid,
+                                       offset);
+}
 
-      printf("receiving rdb data from master: read %ld bytes into input buffer\n", bytes_read);
+/*
+Lets the replica receive the snapshot being written, it then needs the stream from the fork on.
+Returns false when that part of the stream is not in the replication buffer anymore.
+*/
+static bool wait_for_running_bgsave(Client *client) {
+  repl_block *block;
+  size_t pos;
+  if (!repl_buffer_find(g_server_info.rdb_child_repl_offset, &block, &pos)) return false;
+  set_replica_cursor(client, block, pos);
+  set_fullresync_preamble(client, g_server_info.rdb_child_repl_offset);
+  client->master_repl_state = MASTER_REPL_STATE_WAIT_BGSAVE_END;
+  client_enable_write_events(client);
+  return true;
+}
 
-      if (bytes_read == 0) {
-        // master closed connection. signals end of RDB transfer
-        printf("master closed connection\n");
-        break;
-      } else if (bytes_read == -1) {
-        if (errno == EINTR)
-          continue; // interrupted retry
-        else {
-          perror("error reading from master socket.");
-          return;
-        }
-      }
+/*
+Starts a full resync without blocking the master: the snapshot is written by a background save and
+sent once the child exited. The commands the master executes meanwhile stay in the replication
+buffer and are sent after the snapshot. Replicas arriving while a background save runs share it
+when the stream since its fork is still buffered, otherwise they wait for the next one.
+*/
+void begin_fullresync(Client *client) {
+  printf("beginning full resync\n");
+  if (g_server_config.repl_diskless_sync) {
+    // a transfer to sockets can't be joined once it started, the replica waits for the next one
+    add_replica(client);
+    client->master_repl_state = MASTER_REPL_STATE_WAIT_BGSAVE_START;
+    client->repl_wait_start = current_time_millis();
+    replication_start_waiting_bgsave();
+    return;
+  }
+  if (!rdb_background_save_in_progress() && aof_rewrite_in_progress()) {
+    // only one child runs at a time, the snapshot is saved once the rewrite finished
+    add_replica(client);
+    printf("replica %d waits for the AOF rewrite to finish\n", client->fd);
+    client->master_repl_state = MASTER_REPL_STATE_WAIT_BGSAVE_START;
+    return;
+  }
+  if (!rdb_background_save_in_progress()) {
+    if (!rdb_save_background(client->db)) {
+      add_error_reply(client, "ERR could not start background save for full resync");
+      return;
     }
+    add_replica(client);
+    wait_for_running_bgsave(client);
+    return;
+  }
 
-    if (rb_readable(client->input_buffer, &read_buf, &readable_len) != 0) {
-      fprintf(stderr, "failed to get readable buffer\n");
-      return;
+  add_replica(client);
+  // the backlog or a replica waiting for the same snapshot may still hold the stream since the fork
+  if (g_server_info.rdb_child_type == RDB_CHILD_TYPE_DISK && wait_for_running_bgsave(client)) {
+    printf("replica %d shares the running background save\n", client->fd);
+    return;
+  }
+
+  printf("replica %d waits for the next background save\n", client->fd);
+  client->master_repl_state = MASTER_REPL_STATE_WAIT_BGSAVE_START;
+}
+
+/*
+Called once a background save finished. Replicas waiting for it get the snapshot, or are
+disconnected when the save failed, and a new background save starts for the replicas that arrived
+too late for this one.
+*/
+void replication_background_save_done(bool saved) {
+  char *db_file_path = construct_file_path(g_server_config.dir, g_server_config.dbfilename);
+  // iterate backwards since disconnecting a replica swaps the last one into its slot
+  for (int i = (int)g_server_info.num_replicas - 1; i >= 0; i--) {
+    Client *replica = g_server_info.replicas[i];
+    if (replica->master_repl_state != MASTER_REPL_STATE_WAIT_BGSAVE_END) continue;
+
+    struct stat statbuf;
+    int rdb_file_fd = saved ? open(db_file_path, O_RDONLY) : -1;
+    if (rdb_file_fd == -1 || fstat(rdb_file_fd, &statbuf) != 0) {
+      fprintf(stderr, "background save failed, disconnecting replica %d\n", replica->fd);
+      if (rdb_file_fd != -1) close(rdb_file_fd);
+      handle_client_disconnection(replica);
+      continue;
     }
 
-    if (readable_len == 0) {
-      fprintf(stderr, "input buffer empty, nothing to write to disk\n");
+    // send $<length_of_file>\r\n<file_content> after whatever of the preamble is left
+    replica->rdb_fd = rdb_file_fd;
+    replica->rdb_file_size = statbuf.st_size;
+    replica->rdb_file_offset = 0;
+    replica->repl_preamble_len +=
+        snprintf(replica->repl_preamble + replica->repl_preamble_len,
+                 sizeof(replica->repl_preamble) - replica->repl_preamble_len, "$%lld\r\n",
+                 (long long)statbuf.st_size);
+    replica->master_repl_state = MASTER_REPL_STATE_SENDING_RDB_DATA;
+    client_enable_write_events(replica);
+  }
+  free(db_file_path);
+
+  replication_start_waiting_bgsave();
+}
+
+/*
+Streams a snapshot to the replicas waiting for a full resync once the longest waiting one waited
+repl_diskless_sync_delay seconds, so replicas connecting around the same time share the transfer.
+The FULLRESYNC reply is sent before the fork, the child owns the sockets until it exited.
+*/
+static void start_diskless_sync() {
+  long long now = current_time_millis();
+  long long longest_wait = -1;
+  for (size_t i = 0; i < g_server_info.num_replicas; i++) {
+    Client *replica = g_server_info.replicas[i];
+    if (replica->master_repl_state != MASTER_REPL_STATE_WAIT_BGSAVE_START) continue;
+    long long waited = now - replica->repl_wait_start;
+    if (waited > longest_wait) longest_wait = waited;
+  }
+  if (longest_wait < 0 || longest_wait < g_server_config.repl_diskless_sync_delay * 1000LL) return;
+
+  int *fds = malloc(g_server_info.num_replicas * sizeof(int));
+  int fd_count = 0;
+  if (!fds) {
+    perror("failed to allocate replica sockets for diskless sync");
+    return;
+  }
+  for (int i = (int)g_server_info.num_replicas - 1; i >= 0; i--) {
+    Client *replica = g_server_info.replicas[i];
+    if (replica->master_repl_state != MASTER_REPL_STATE_WAIT_BGSAVE_START) continue;
+    set_fullresync_preamble(replica, g_server_info.master_repl_offset);
+    if (!send_repl_preamble(replica)) {
+      fprintf(stderr, "could not send FULLRESYNC, disconnecting replica %d\n", replica->fd);
+      handle_client_disconnection(replica);
+      continue;
     }
+    fds[fd_count++] = replica->fd;
+  }
+  bool started =
+      fd_count > 0 && rdb_save_background_to_sockets(g_server_info.replicas[0]->db, fds, fd_count);
+  free(fds);
+  for (int i = (int)g_server_info.num_replicas - 1; i >= 0; i--) {
+    Client *replica = g_server_info.replicas[i];
+    if (replica->master_repl_state != MASTER_REPL_STATE_WAIT_BGSAVE_START) continue;
+    if (!started) {
+      fprintf(stderr, "could not start diskless sync, disconnecting replica %d\n", replica->fd);
+      handle_client_disconnection(replica);
+      continue;
+    }
+    // the stream that follows the snapshot is buffered until the child exited
+    repl_block *tail = g_server_info.repl_buffer_tail;
+    set_replica_cursor(replica, tail, tail->used);
+    replica->master_repl_state = MASTER_REPL_STATE_WAIT_BGSAVE_END;
+    client_disable_write_events(replica);
+  }
+}
 
-    // write to disk
-    ssize_t bytes_written = fwrite(read_buf, 1, bytes_read, client->tmp_rdb_fp);
+/*
+Called once a snapshot was streamed to the replicas' sockets. The replicas that received all of it
+are sent the stream buffered since, the others are disconnected.
+*/
+void replication_socket_save_done(const int *synced_fds, size_t count) {
+  // iterate backwards since disconnecting a replica swaps the last one into its slot
+  for (int i = (int)g_server_info.num_replicas - 1; i >= 0; i--) {
+    Client *replica = g_server_info.replicas[i];
+    if (replica->master_repl_state != MASTER_REPL_STATE_WAIT_BGSAVE_END) continue;
 
-    printf("writing rdb data from buffer: wrote %ld bytes into temp file\n", bytes_read);
+    bool synced = false;
+    for (size_t j = 0; j < count && !synced; j++) synced = synced_fds[j] == replica->fd;
+    if (!synced) {
+      fprintf(stderr, "diskless sync failed, disconnecting replica %d\n", replica->fd);
+      handle_client_disconnection(replica);
+      continue;
+    }
+    printf("RDB snapshot streamed to replica %d\n", replica->fd);
+    replica->master_repl_state = MASTER_REPL_STATE_PROPAGATE;
+    // the replica loads the snapshot before it acknowledges anything
+    replica->repl_ack_time = current_time_millis();
+    client_enable_write_events(replica);
+  }
+
+  replication_start_waiting_bgsave();
+}
+
+/*
+Starts a background save for the replicas waiting for one, after the previous background save or
+AOF rewrite finished.
+*/
+void replication_start_waiting_bgsave() {
+  if (rdb_background_save_in_progress() || aof_rewrite_in_progress()) return;
+  if (g_server_config.repl_diskless_sync) {
+    start_diskless_sync();
+    return;
+  }
 
-    client->rdb_written_bytes += bytes_written;
-    if (rb_read(client->input_buffer, bytes_written) != 0) {
-      fprintf(stderr, "error updating read index for ring buffer\n");
+  bool started = false;
+  for (int i = (int)g_server_info.num_replicas - 1; i >= 0; i--) {
+    Client *replica = g_server_info.replicas[i];
+    if (replica->master_repl_state != MASTER_REPL_STATE_WAIT_BGSAVE_START) continue;
+    if (!started && !rdb_save_background(replica->db)) {
+      fprintf(stderr, "could not start background save, disconnecting replica %d\n", replica->fd);
+      handle_client_disconnection(replica);
+      continue;
     }
+    started = true;
+    wait_for_running_bgsave(replica);
+  }
+}
 
-    if (client->rdb_written_bytes == client->rdb_expected_bytes) {
-      printf("RDB snapshot completely received and written to temp file: %lld bytes.\n",
-             client->rdb_expected_bytes);
+// the replica's side of the cron: connects to the master, drops a silent link and acknowledges
+static void replica_cron(redis_db_t *db, long long now) {
+  static long long last_ack_time = 0;
+  Client *master_client = g_server_info.master;
+  if (!master_client) {
+    if (now >= next_connect_time) replication_connect_to_master(db);
+    return;
+  }
+  if (now - master_client->repl_last_io > g_server_config.repl_timeout * 1000LL) {
+    fprintf(stderr, "no data from master for %d seconds, dropping the link\n",
+            g_server_config.repl_timeout);
+    handle_client_disconnection(master_client);
+    return;
+  }
+  if (master_client->repl_client_state == REPL_STATE_READY &&
+      (master_client->repl_ack_requested || now - last_ack_time >= REPL_ACK_INTERVAL)) {
+    send_ack(master_client);
+    last_ack_time = now;
+  }
+}
 
-      fclose(client->tmp_rdb_fp);
+/*
+The master's side of the cron. Every repl_ping_replica_period seconds the replicas streaming the
+commands are sent a PING through the stream, and the ones waiting for their snapshot a newline, so
+they can tell an idle master from a dead link. Replicas that acknowledged nothing for repl_timeout
+seconds are disconnected.
+*/
+static void replicas_cron(long long now) {
+  static long long last_ping_time = 0;
+  bool ping = now - last_ping_time >= g_server_config.repl_ping_replica_period * 1000LL;
+  if (ping) last_ping_time = now;
 
-      rdb_load_data_from_file(client->db, g_server_config.dir, "temp_snapshot.rdb");
+  // a replica passes on the pings of its master to its own replicas
+  if (ping && g_server_info.role == ROLE_MASTER && g_server_info.num_replicas > 0) {
+    static const char ping_command[] = "*1\r\n$4\r\nPING\r\n";
+    replication_feed(ping_command, sizeof(ping_command) - 1);
+  }
 
-      client->repl_client_state = REPL_STATE_READY;
-      client_enable_read_events(client); // start monitoring for EPOLLIN from master
-      return;
+  for (size_t i = g_server_info.num_replicas; i-- > 0;) {
+    Client *replica = g_server_info.replicas[i];
+    if (replica->master_repl_state == MASTER_REPL_STATE_PROPAGATE) {
+      if (now - replica->repl_ack_time > g_server_config.repl_timeout * 1000LL) {
+        fprintf(stderr, "no acknowledgement from replica %d for %d seconds, disconnecting it\n",
+                replica->fd, g_server_config.repl_timeout);
+        handle_client_disconnection(replica);
+      }
+      continue;
+    }
+    // the FULLRESYNC reply goes out first, and a child streaming the snapshot owns the socket
+    bool waiting = replica->master_repl_state == MASTER_REPL_STATE_WAIT_BGSAVE_START ||
+                   (replica->master_repl_state == MASTER_REPL_STATE_WAIT_BGSAVE_END &&
+                    g_server_info.rdb_child_type == RDB_CHILD_TYPE_DISK);
+    if (ping && waiting && replica->repl_preamble_len == 0 && write(replica->fd, "\n", 1) == -1 &&
+        errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("failed to send keepalive to replica");
     }
   }
 }
 
-void begin_fullresync(Client *client) {
-  printf("beginning full resync\n");
-  add_fullresync_reply(client, g_server_info.master_replid, g_server_info.master_repl_offset);
-  // call save
-  redis_db_save(client->db);
+/*
+Runs the replication tasks of the server cron: a replica connects to its master again once the delay
+after a failed attempt passed, drops a link the master was silent on for repl_timeout seconds, and
+acknowledges the stream it processed every REPL_ACK_INTERVAL milliseconds, and when the master asked
+for an acknowledgement that was not sent yet. A master pings its replicas, disconnects the ones that
+timed out and starts a delayed diskless sync.
+*/
+void replication_cron(redis_db_t *db) {
+  long long now = current_time_millis();
+  if (g_server_info.role == ROLE_SLAVE) replica_cron(db, now);
+  replicas_cron(now);
+  replication_start_waiting_bgsave();
+}
 
-  char *db_file_path = construct_file_path(g_server_config.dir, g_server_config.dbfilename);
-  printf("%s\n", db_file_path);
-  FILE *file = fopen(db_file_path, "rb");
-  if (!file) {
-    perror("Failed to open RDB file or it does not exist\n");
+// counts the replicas streaming the commands that acknowledged the stream up to offset
+static long long count_acked_replicas(long long offset) {
+  long long count = 0;
+  for (size_t i = 0; i < g_server_info.num_replicas; i++) {
+    Client *replica = g_server_info.replicas[i];
+    if (replica->master_repl_state == MASTER_REPL_STATE_PROPAGATE &&
+        replica->repl_ack_offset >= offset) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/*
+Waits for numreplicas replicas to acknowledge the stream written so far, for at most timeout
+milliseconds, 0 waits forever. Returns the number of replicas that acknowledged it when there are
+enough already. Otherwise returns -1 and blocks the client, the event loop keeps serving the other
+clients and replication_handle_waiting_clients replies once the wait is over.
+*/
+long long replication_wait(Client *client, long long numreplicas, long long timeout) {
+  long long offset = g_server_info.master_repl_offset;
+  long long acked = count_acked_replicas(offset);
+  if (acked >= numreplicas) return acked;
+
+  if (num_waiting_clients == waiting_clients_capacity) {
+    size_t capacity = waiting_clients_capacity ? waiting_clients_capacity * 2 : 16;
+    Client **clients = realloc(waiting_clients, capacity * sizeof(Client *));
+    if (!clients) {
+      perror("failed to grow the array of waiting clients");
+      exit(EXIT_FAILURE);
+    }
+    waiting_clients = clients;
+    waiting_clients_capacity = capacity;
+  }
+  client->wait_offset = offset;
+  client->wait_replicas = numreplicas;
+  client->wait_deadline = timeout > 0 ? current_time_millis() + timeout : 0;
+  client->blocked = true;
+  waiting_clients[num_waiting_clients++] = client;
+  get_ack_pending = true;
+  return -1;
+}
+
+/*
+Replies to the clients in WAIT once enough replicas acknowledged their offset or they timed out,
+with the number of replicas that acknowledged it, and resumes them. Called once per event loop
+iteration, the timeouts are as precise as the server cron wakes the loop up.
+*/
+void replication_handle_waiting_clients() {
+  if (num_waiting_clients == 0) return;
+  long long now = current_time_millis();
+  // iterate backwards since a resumed client is swapped out for the last one
+  for (int i = (int)num_waiting_clients - 1; i >= 0; i--) {
+    Client *client = waiting_clients[i];
+    long long acked = count_acked_replicas(client->wait_offset);
+    bool timed_out = client->wait_deadline > 0 && now >= client->wait_deadline;
+    if (acked < client->wait_replicas && !timed_out && !client->close_asap) continue;
+
+    waiting_clients[i] = waiting_clients[--num_waiting_clients];
+    // a client that disconnected meanwhile is destroyed by unblock_client
+    if (!client->close_asap) add_integer_reply(client, acked);
+    unblock_client(client);
   }
-  int rdb_file_fd = fileno(file);
-  struct stat statbuf;
-  fstat(rdb_file_fd, &statbuf);
-  off_t db_file_size = (off_t)statbuf.st_size;
+}
 
-  client->rdb_fd = rdb_file_fd;
-  client->rdb_file_size = db_file_size;
-  printf("rdb file size: %ld\n", db_file_size);
-  client->rdb_file_offset = 0;
+/*
+Continues the replica's stream from the offset it has, a partial resync. The replica follows the
+stream under its current id or, when this server was promoted, under the id of its former master,
+which it continued up to second_replid_offset. Returns false when the replica follows another
+stream or the replication buffer does not hold the stream from its offset anymore.
+*/
+bool continue_psync(Client *client, const char *replid, long long offset) {
+  bool current_id = strcmp(replid, g_server_info.master_replid) == 0;
+  bool previous_id = g_server_info.second_replid_offset != -1 &&
+                     strcmp(replid, g_server_info.master_replid2) == 0 &&
+                     offset <= g_server_info.second_replid_offset;
+  if (!current_id && !previous_id) return false;
 
-  client->master_repl_state = MASTER_REPL_STATE_SENDING_RDB_DATA;
-  // send $<length_of_file>\r\n<file_content>
+  repl_block *block;
+  size_t pos;
+  if (!g_server_info.repl_backlog || !repl_buffer_find(offset, &block, &pos)) return false;
 
-  write_begin_bulk_string(client->output_buffer, (int64_t)db_file_size);
+  add_replica(client);
+  set_replica_cursor(client, block, pos);
+  // a replica that followed the previous id is told the id the stream continues under
+  client->repl_preamble_len =
+      current_id ? snprintf(client->repl_preamble, sizeof(client->repl_preamble), "+CONTINUE\r\n")
+                 : snprintf(client->repl_preamble, sizeof(client->repl_preamble),
+                            "+CONTINUE %s\r\n", g_server_info.master_replid);
+  client->master_repl_state = MASTER_REPL_STATE_PROPAGATE;
+  client->repl_ack_time = current_time_millis();
   client_enable_write_events(client);
+  return true;
 }
 
-void continue_psync(Client *client, ring_buffer repl_backlog) {
-  printf("continuing psync\n");
-  long long master_offset = g_server_info.master_repl_offset;
-  long long replica_offset = client->repl_offset;
+/*
+Turns a replica into a master, REPLICAOF NO ONE. The dataset is kept and the stream of the former
+master continues under a new id, so the other replicas of that master can partially resync with
+this server. Its own replicas are disconnected to learn the new id.
+*/
+void replication_unset_master() {
+  if (g_server_info.master) handle_client_disconnection(g_server_info.master);
+
+  char replid[REPLID_SIZE + 1];
+  random_hex(replid, REPLID_SIZE);
+  replid[REPLID_SIZE] = '\0';
+  shift_replid(replid);
+  disconnect_replicas();
+  g_server_info.role = ROLE_MASTER;
+  printf("# replica promoted to master\n");
+}
 
-  printf("master's offset is %lld\n", master_offset);
-  printf("replica's offset is %lld\n", replica_offset);
+/*
+Schedules the next attempt to connect to the master. The delay doubles with every failed attempt,
+and is jittered so replicas of a restarted master don't all connect at the same time.
+*/
+static void schedule_reconnect() {
+  int shift = connect_attempts < 6 ? connect_attempts : 6;
+  long long delay = (long long)REPL_RECONNECT_MIN_DELAY << shift;
+  if (delay > REPL_RECONNECT_MAX_DELAY) delay = REPL_RECONNECT_MAX_DELAY;
+  delay = delay / 2 + random() % (delay / 2 + 1);
+  connect_attempts++;
+  next_connect_time = current_time_millis() + delay;
+}
 
-  // check if the replica has caught up
-  if (replica_offset == master_offset) {
-    printf("replica has caught up, transitioning to PROPAGATE state.\n");
-    client->master_repl_state = MASTER_REPL_STATE_PROPAGATE;
-    client_disable_write_events(client); // no more backlog to send
-    return;
-  } else if (replica_offset >= master_offset) {
-    // invalid state, does not make sense, replica can't be ahead of master
-    fprintf(stderr, "replica offset is ahead of master offset\n. disconnecting client.\n");
-    handle_client_disconnection(client);
+/*
+Starts connecting to the master without blocking the event loop, the handshake begins once the
+socket became writable. When no attempt could be started the replica tries again after a delay.
+*/
+void replication_connect_to_master(redis_db_t *db) {
+  if (g_server_info.master_link_down_since == 0) {
+    g_server_info.master_link_down_since = current_time_millis();
   }
 
-  // determine how much data to send in this iteration.
-  // the amount to send is the difference between the master's offset and the replica's
-  long long bytes_to_send = master_offset - replica_offset;
-  if (bytes_to_send <= 0) {
-    // this case should not be reached if the catchup check is working correctly
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  int status = getaddrinfo(g_server_config.master_host, g_server_config.master_port, &hints, &res);
+  if (status != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+    schedule_reconnect();
     return;
   }
 
-  char *repl_backlog_read_buf;
-  size_t repl_backlog_readable_len;
-
-  if (rb_readable(repl_backlog, &repl_backlog_read_buf, &repl_backlog_readable_len) != 0) {
-    fprintf(stderr, "failed to get readable buf for repl backlog\n");
+  // connect to the first address a connect could be started to
+  int master_fd = -1;
+  for (struct addrinfo *p = res; p != NULL && master_fd == -1; p = p->ai_next) {
+    master_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (master_fd == -1) continue;
+    set_non_blocking(master_fd);
+    if (connect(master_fd, p->ai_addr, p->ai_addrlen) == -1 && errno != EINPROGRESS) {
+      close(master_fd);
+      master_fd = -1;
+    }
   }
-
-  if (bytes_to_send > repl_backlog_readable_len) {
-    // this should never happen
-    fprintf(stderr, "replica offset is outside backlog, disconnecting client\n");
-    handle_client_disconnection(client);
+  freeaddrinfo(res);
+  if (master_fd == -1) {
+    perror("failed to connect to master");
+    schedule_reconnect();
     return;
   }
 
-  size_t relative_offset = replica_offset - g_server_info.repl_backlog_base_offset;
-  char *source_ptr = repl_backlog_read_buf + relative_offset;
+  Client *master_client = create_client(master_fd);
+  master_client->db = db;
+  master_client->type = CLIENT_TYPE_MASTER;
+  master_client->repl_client_state = REPL_STATE_CONNECTING;
+  // the connect counts against repl_timeout as well
+  master_client->repl_last_io = current_time_millis();
+  // the replicated commands are not replied to, only REPLCONF GETACK is
+  master_client->should_reply = false;
+  g_server_info.master = master_client;
 
-  memcpy(client->output_buffer, source_ptr, bytes_to_send);
+  CommandHandler *command_handler = create_command_handler(master_client, 256, 10);
+  parser_init(master_client->parser, command_handler);
 
-  size_t bytes_sent = flush_client_output(client);
-  if (bytes_sent > 0) {
-    client->repl_offset += bytes_sent;
-    printf("sent %ld bytes to replica during PSYNC\n", bytes_sent);
-  }
-}
\ No newline at end of file
+  event_loop_add_client(g_event_loop, master_client);
+  // the connect completed once the socket is writable
+  client_enable_write_events(master_client);
+}
+
+/*
+Forgets the link to the master once it dropped. The replica keeps serving its dataset and
+connects again from replication_cron after a delay.
+*/
+void replication_handle_master_disconnection(Client *master_client) {
+  if (g_server_info.master != master_client) return;
+  g_server_info.master = NULL;
+  g_server_info.master_link_down_since = current_time_millis();
+  schedule_reconnect();
+}
+
+/*
+Makes this server a replica of the master at host and port, REPLICAOF host port. It keeps its
+replication id and offset, so a former master can continue with a replica that was promoted in its
+place. Its own replicas are disconnected, they sync again with the stream it follows now.
+*/
+void replication_set_master(redis_db_t *db, const char *host, const char *port) {
+  if (g_server_info.master) handle_client_disconnection(g_server_info.master);
+  disconnect_replicas();
+  snprintf(g_server_config.master_host, sizeof(g_server_config.master_host), "%s", host);
+  snprintf(g_server_config.master_port, sizeof(g_server_config.master_port), "%s", port);
+  g_server_info.role = ROLE_SLAVE;
+  printf("# replicating from %s:%s\n", host, port);
+  connect_attempts = 0;
+  replication_connect_to_master(db);
+}
@@ -3,14 +3,48 @@
 
 #include "client.h"
 #include "database.h"
+#include <stddef.h>
+
+/*
+Block of the shared replication buffer. The stream is appended to a list of blocks once, and the
+backlog and every replica read it through their own cursor. refcount counts the cursors pointing
+into the block, blocks are freed from the head of the list once no cursor points into them.
+*/
+typedef struct repl_block {
+  struct repl_block *next;
+  long long offset; // replication offset of the first byte
+  size_t refcount;
+  size_t used;
+  size_t size;
+  char buf[];
+} repl_block;
 
 void master_handle_replica_out(Client *client);
+int master_handle_replica_input(Client *client);
 void replica_handle_master_data(Client *master_client);
 
 void add_replica(Client *replica);
 void remove_replica(Client *replica);
 
+void replication_create_backlog();
+void replication_free_backlog();
+void replication_set_backlog_size(unsigned long long size);
+void replication_feed(const char *buf, size_t len);
+void replication_feed_master_stream(Client *master_client, const char *buf, size_t len,
+                                    const char *command_end);
+void replication_send_pending();
+
 void begin_fullresync(Client *client);
-void continue_psync(Client *client, ring_buffer repl_backlog);
+void replication_background_save_done(bool saved);
+void replication_start_waiting_bgsave();
+void replication_socket_save_done(const int *synced_fds, size_t count);
+void replication_cron(redis_db_t *db);
+bool continue_psync(Client *client, const char *replid, long long offset);
+long long replication_wait(Client *client, long long numreplicas, long long timeout);
+void replication_handle_waiting_clients();
+void replication_connect_to_master(redis_db_t *db);
+void replication_handle_master_disconnection(Client *master_client);
+void replication_set_master(redis_db_t *db, const char *host, const char *port);
+void replication_unset_master();
 
 #endif // REPLICATION.H
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "resp.h"
+#include "client.h"
 #include "handler.h"
 #include "ring_buffer.h"
 #include <errno.h>
@@ -13,162 +14,45 @@ const char cr = '\r';
 const char lf = '\n';
 const char crlf[2] = "\r\n";
 
-void write_begin_simple_string(ring_buffer rb) {
-  // check if there is enough writable space in the ring buffer
-  char *output_buf;
-  size_t writable_len;
+void write_begin_simple_string(Client *client) { client_append_output(client, "+", 1); }
 
-  // get writable space in the ring buffer
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < 1) {
-    perror("not enough space in ring buffer to write simple string start.\n");
-    return;
-  }
-
-  output_buf[0] = '+';
-  rb_write(rb, 1);
-}
-
-void write_end_simple_string(ring_buffer rb) {
-  char *output_buf;
-  size_t writable_len;
-
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < 2) {
-    perror("not enough space in ring buffer to write end simple string.\n");
-    return;
-  }
-
-  memcpy(output_buf, crlf, 2);
-  rb_write(rb, 2);
-}
-
-void write_begin_error(ring_buffer rb) {
-  // check if there is enough writable space in the ring buffer
-  char *output_buf;
-  size_t writable_len;
-
-  // get writable space in the ring buffer
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < 1) {
-    perror("not enough space in ring buffer to write begin error.\n");
-    return;
-  }
+void write_end_simple_string(Client *client) { client_append_output(client, crlf, 2); }
 
-  output_buf[0] = '-';
-  rb_write(rb, 1);
-}
-
-void write_end_error(ring_buffer rb) {
-  char *output_buf;
-  size_t writable_len;
+void write_begin_error(Client *client) { client_append_output(client, "-", 1); }
 
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < 2) {
-    perror("not enough space in ring buffer to write end error.\n");
-    return;
-  }
+void write_end_error(Client *client) { client_append_output(client, crlf, 2); }
 
-  memcpy(output_buf, crlf, 2);
-  rb_write(rb, 2);
-}
+void write_begin_integer(Client *client) { client_append_output(client, ":", 1); }
 
-void write_begin_integer(ring_buffer rb) {
-  // check if there is enough writable space in the ring buffer
-  char *output_buf;
-  size_t writable_len;
+void write_end_integer(Client *client) { client_append_output(client, crlf, 2); }
 
-  // get writable space in the ring buffer
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < 1) {
-    perror("not enough space in ring buffer to write begin integer.\n");
-    return;
-  }
+void write_begin_bulk_string(Client *client, int64_t len) {
+  char header[32];
 
-  output_buf[0] = ':';
-  rb_write(rb, 1);
+  // write the length prefixed by $, a null bulk string has no payload to separate
+  int header_len = snprintf(header, sizeof(header), len != -1 ? "$%ld\r\n" : "$%ld", len);
+  client_append_output(client, header, header_len);
 }
 
-void write_end_integer(ring_buffer rb) {
-  char *output_buf;
-  size_t writable_len;
+void write_end_bulk_string(Client *client) { client_append_output(client, crlf, 2); }
 
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < 2) {
-    perror("not enough space in ring buffer to write end integer.\n");
-    return;
-  }
-
-  memcpy(output_buf, crlf, 2);
-  rb_write(rb, 2);
-}
-
-void write_begin_bulk_string(ring_buffer rb, int64_t len) {
-  char *output_buf;
-  size_t writable_len;
-
-  int needed_length = snprintf(NULL, 0, "$%ld", len);
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 ||
-      writable_len < needed_length + (len != -1 ? 2 : 0)) {
-    perror("not enough space in ring buffer to write begin builk string.");
-    return;
-  }
-
-  // write the length prefixed by $
-  snprintf(output_buf, writable_len, "$%ld", len);
-
-  rb_write(rb, needed_length);
-  if (len != -1) {
-    memcpy(output_buf + needed_length, crlf, 2);
-    rb_write(rb, 2);
-  }
-}
-
-void write_end_bulk_string(ring_buffer rb) {
-  char *output_buf;
-  size_t writable_len;
-
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < 2) {
-    perror("not enough space in ring buffer to write end integer.\n");
-    return;
-  }
-
-  memcpy(output_buf, crlf, 2);
-  rb_write(rb, 2);
-}
-
-void write_begin_array(ring_buffer rb, int64_t len) {
-  char *output_buf;
-  size_t writable_len;
-
-  // calculate the needed length for the array header
-  int needed_length = snprintf(NULL, 0, "*%ld\r\n", len);
-
-  // check if there is enough writable space in the ring buffer
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < needed_length) {
-    perror("not enough space in ring buffer to write begin array.\n");
-    return;
-  }
+void write_begin_array(Client *client, int64_t len) {
+  char header[32];
 
   // write the length prefixed by '*'
-  snprintf(output_buf, writable_len, "*%ld\r\n", len);
-
-  // update the write index for the length
-  rb_write(rb, needed_length);
+  int header_len = snprintf(header, sizeof(header), "*%ld\r\n", len);
+  client_append_output(client, header, header_len);
 }
 
-void write_end_array(ring_buffer rb) {
+void write_end_array(Client *client) {
   // no specific end marker for arrays
   return;
 }
 
-void write_chars(ring_buffer rb, const char *str) {
-  char *output_buf;
-  size_t writable_len;
-
-  size_t str_length = strlen(str);
-
-  if (rb_writable(rb, &output_buf, &writable_len) != 0 || writable_len < str_length) {
-    perror("Not enough space in ring buffer to write string.\n");
-  }
-
-  memcpy(output_buf, str, str_length);
+void write_chars(Client *client, const char *str) { write_chars_len(client, str, strlen(str)); }
 
-  rb_write(rb, str_length);
+void write_chars_len(Client *client, const char *str, size_t len) {
+  client_append_output(client, str, len);
 }
 
 ParseResult parse_initial(Parser *parser, const char *begin, const char *end);
@@ -181,6 +65,7 @@ ParseResult parse_inline_command(Parser *parser, const char *begin, const char *
 void parser_init(Parser *parser, CommandHandler *command_handler) {
   parser->command_handler = command_handler;
   parser->stack_top = 0;
+  parser->value_end = NULL;
   parser->stack[0] = (StateInfo){STATE_INITIAL_TERMINAL, 0, parse_initial};
 }
 
@@ -200,19 +85,27 @@ void pop_state(Parser *parser) {
 
 const char *parser_parse(Parser *parser, const char *begin, const char *end) {
   bool keep_going = true;
+  parser->value_end = NULL;
   while (keep_going) {
     if (parser->command_handler && parser->command_handler->client &&
         parser->command_handler->client->type == CLIENT_TYPE_MASTER &&
-        parser->command_handler->client->repl_client_state ==
-            REPL_STATE_RECEIVED_FULLRESYNC_RESPONSE) {
-      // we are expecting the $<file_size>\r\n header before the rdb file contents
-      // are streamed, we do not want this parser to consume any bytes, another
-      // parser will take care of that
+        (parser->command_handler->client->repl_client_state ==
+             REPL_STATE_RECEIVED_FULLRESYNC_RESPONSE ||
+         parser->command_handler->client->repl_client_state == REPL_STATE_RECEIVED_CONTINUE)) {
+      // after FULLRESYNC we are expecting the $<file_size>\r\n header before the rdb file
+      // contents are streamed, another parser will take care of that. After CONTINUE the stream
+      // is parsed once the replica switched to it. we do not want this parser to consume any bytes
+      return begin;
+    }
+    if (parser->command_handler && parser->command_handler->client &&
+        parser->command_handler->client->blocked) {
+      // the last command blocked the client, leave the following commands in the buffer
       return begin;
     }
     ParseResult result = parser->stack[parser->stack_top].parse(parser, begin, end);
     keep_going = result.keep_going;
     begin = result.new_begin;
+    if (parser->stack_top == 0) parser->value_end = begin;
   }
   return begin;
 }
@@ -345,6 +238,8 @@ ParseResult parse_bulk_string(Parser *parser, const char *begin, const char *end
   int64_t output_length = min(length, input_length);
   g_handler->chars(parser->command_handler, begin, begin + output_length);
   length -= output_length;
+  // remember how much is left, the rest of the string may arrive in a later read
+  parser->stack[parser->stack_top].length = length;
 
   if (length == 0 && input_length >= output_length + 2) {
     g_handler->end_bulk_string(parser->command_handler);
@@ -14,39 +14,43 @@ extern "C" {
 // forward declarations:
 struct Parser;
 struct Handler;
+struct Client;
 
-// writes the beginning of a simple string to the ring buffer
-void write_begin_simple_string(ring_buffer rb);
+// writes the beginning of a simple string to the client's output
+void write_begin_simple_string(struct Client *client);
 
-// writes the end of a simple string to the ring buffer
-void write_end_simple_string(ring_buffer rb);
+// writes the end of a simple string to the client's output
+void write_end_simple_string(struct Client *client);
 
-// writes the beginning of an error message to the ring buffer
-void write_begin_error(ring_buffer rb);
+// writes the beginning of an error message to the client's output
+void write_begin_error(struct Client *client);
 
-// writes the end of an error message to the ring buffer
-void write_end_error(ring_buffer rb);
+// writes the end of an error message to the client's output
+void write_end_error(struct Client *client);
 
-// writes the beginning of an integer to the ring buffer
-void write_begin_integer(ring_buffer rb);
+// writes the beginning of an integer to the client's output
+void write_begin_integer(struct Client *client);
 
-// writes the end of an integer to the ring buffer
-void write_end_integer(ring_buffer rb);
+// writes the end of an integer to the client's output
+void write_end_integer(struct Client *client);
 
-// writes the beginning of a bulk string to the ring buffer with its length
-void write_begin_bulk_string(ring_buffer rb, int64_t len);
+// writes the beginning of a bulk string to the client's output with its length
+void write_begin_bulk_string(struct Client *client, int64_t len);
 
-// writes the end of a bulk string to the ring buffer
-void write_end_bulk_string(ring_buffer rb);
+// writes the end of a bulk string to the client's output
+void write_end_bulk_string(struct Client *client);
 
-// writes the beginning of an array to the ring buffer with its length
-void write_begin_array(ring_buffer rb, int64_t len);
+// writes the beginning of an array to the client's output with its length
+void write_begin_array(struct Client *client, int64_t len);
 
-// writes the end of an array to the ring buffer
-void write_end_array(ring_buffer rb);
+// writes the end of an array to the client's output
+void write_end_array(struct Client *client);
 
-// writes a string to the ring buffer
-void write_chars(ring_buffer rb, const char *str);
+// writes a string to the client's output
+void write_chars(struct Client *client, const char *str);
+
+// writes len bytes to the client's output, they may contain NULs
+void write_chars_len(struct Client *client, const char *str, size_t len);
 
 typedef enum {
   STATE_INITIAL_TERMINAL,
@@ -84,6 +88,8 @@ typedef struct Parser {
   struct CommandHandler *command_handler;
   StateInfo stack[MAX_STACK_DEPTH];
   int stack_top;
+  // where the last complete top-level value parsed by parser_parse ended, NULL when none did
+  const char *value_end;
 } Parser;
 
 void parser_init(Parser *parser, struct CommandHandler *command_handler);
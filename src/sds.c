@@ -0,0 +1,32 @@
+#include "sds.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Creates a string holding a copy of len bytes of init, or len zero bytes when init is NULL.
+*/
+sds sds_new_len(const void *init, size_t len) {
+  struct sds_header *header = malloc(sizeof(struct sds_header) + len + 1);
+  if (!header) {
+    perror("failed to allocate string");
+    exit(EXIT_FAILURE);
+  }
+  header->len = len;
+  if (init) {
+    memcpy(header->buf, init, len);
+  } else {
+    memset(header->buf, 0, len);
+  }
+  header->buf[len] = '\0';
+  return header->buf;
+}
+
+sds sds_new(const char *init) { return sds_new_len(init, init ? strlen(init) : 0); }
+
+sds sds_dup(const sds s) { return sds_new_len(s, sds_len(s)); }
+
+void sds_free(sds s) {
+  if (s == NULL) return;
+  free(s - sizeof(struct sds_header));
+}
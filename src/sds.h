@@ -0,0 +1,35 @@
+#ifndef SDS_H
+#define SDS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+Length-prefixed, binary-safe strings. An sds points at the string bytes, which are preceded by a
+header holding the length and always followed by a NUL, so an sds can also be passed wherever a
+C string is expected. Its length is read from the header instead of being scanned for.
+*/
+typedef char *sds;
+
+struct sds_header {
+  size_t len;
+  char buf[];
+};
+
+static inline size_t sds_len(const sds s) {
+  return ((struct sds_header *)(s - sizeof(struct sds_header)))->len;
+}
+
+sds sds_new_len(const void *init, size_t len);
+sds sds_new(const char *init);
+sds sds_dup(const sds s);
+void sds_free(sds s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SDS_H
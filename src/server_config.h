@@ -1,8 +1,13 @@
 #ifndef SERVER_CONFIG_H
 #define SERVER_CONFIG_H
+#include "database.h"
 #include "ring_buffer.h"
+#include <sys/types.h>
 
-#define MAX_REPLICAS 16
+typedef enum { IO_BACKEND_EPOLL, IO_BACKEND_IO_URING } io_backend_t;
+
+// when the commands appended to the AOF are forced to disk
+typedef enum { AOF_FSYNC_EVERYSEC, AOF_FSYNC_ALWAYS, AOF_FSYNC_NO } aof_fsync_policy_t;
 
 typedef struct server_config {
   char dir[256];
@@ -10,18 +15,64 @@ typedef struct server_config {
   char port[6];
   char master_host[128];
   char master_port[6];
+  int io_threads; // number of threads, including the main thread, doing socket I/O and parsing
+  int shards;     // when above 1, number of shared-nothing event loops each owning a keyspace slice
+  // mechanism the event loops use to wait for and perform socket I/O
+  io_backend_t io_backend;
+  int hz; // times per second the server cron runs background tasks
+  unsigned long long maxmemory; // bytes the keyspace may use, 0 for no limit
+  maxmemory_policy_t maxmemory_policy;
+  bool appendonly; // log every write command to the AOF and rebuild the dataset from it on start
+  aof_fsync_policy_t appendfsync;
+  char appendfilename[256];
+  // the AOF is rewritten once it grew by this percentage since the last rewrite, 0 disables it
+  int auto_aof_rewrite_percentage;
+  unsigned long long auto_aof_rewrite_min_size; // bytes the AOF needs before it is rewritten
+  // full resyncs stream the snapshot from a child to the replicas' sockets instead of a file
+  bool repl_diskless_sync;
+  int repl_diskless_sync_delay; // seconds to wait for more replicas before a diskless transfer
+  // a replica parses the snapshot from the socket into memory instead of saving it to disk first
+  bool repl_diskless_load;
+  unsigned long long repl_backlog_size; // bytes of the recent stream kept for partial resyncs
+  int repl_timeout; // seconds without data before either end of a replication link drops it
+  int repl_ping_replica_period; // seconds between the pings a master sends to its replicas
 } server_config_t;
 
 typedef enum { ROLE_MASTER, ROLE_SLAVE } server_role_t;
+
+// where the background save child writes the snapshot
+typedef enum { RDB_CHILD_TYPE_DISK, RDB_CHILD_TYPE_SOCKET } rdb_child_type_t;
+
 typedef struct server_info {
   server_role_t role;
-  char master_replid[40];
+  // id of the replication stream this server writes or, on a replica, follows. Empty on a replica
+  // that does not know a stream it can continue
+  char master_replid[REPLID_SIZE + 1];
   long long master_repl_offset;
-  ring_buffer repl_backlog;
+  // the previous id of the stream, a replica that was promoted continues the stream of its former
+  // master. Replicas of that master can partially resync up to second_replid_offset
+  char master_replid2[REPLID_SIZE + 1];
+  long long second_replid_offset; // -1 when there is no previous id
+  // the replication stream, a list of blocks shared by the backlog and the replicas
+  struct repl_block *repl_buffer_head;
+  struct repl_block *repl_buffer_tail;
+  // first block of the backlog, which keeps the recent stream for partial resyncs. NULL when this
+  // server keeps no replication stream
+  struct repl_block *repl_backlog;
   long long repl_backlog_base_offset;
   // fields for replica management
-  Client *replicas[MAX_REPLICAS];
+  Client **replicas;
   size_t num_replicas;
+  size_t replicas_capacity;
+  Client *master; // a replica's connection to its master, NULL until it connected
+  // when the replica lost or had not yet set up the link to its master, 0 while it is up
+  long long master_link_down_since;
+  // background save, at most one child writes a snapshot at a time
+  pid_t rdb_child_pid;             // -1 when no background save is running
+  long long rdb_child_repl_offset; // replication offset of the snapshot being written
+  rdb_child_type_t rdb_child_type;
+  int rdb_child_pipe; // a socket child reports the sockets that received the snapshot through it
+  bool loading; // set while the AOF is replayed, the replayed commands are not propagated
 } server_info_t;
 
 extern server_config_t g_server_config;
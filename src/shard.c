@@ -0,0 +1,393 @@
+#include "shard.h"
+#include "client.h"
+#include "command_handler.h"
+#include "commands.h"
+#include "database.h"
+#include "event_loop.h"
+#include "rdb.h"
+#include "redis-server.h"
+#include "resp.h"
+#include "ring_buffer.h"
+#include "server_config.h"
+#include "util.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+Shared-nothing sharded mode. Every shard is a thread with its own event loop, its own
+SO_REUSEPORT listening socket and its own redis_db_t holding the keys that hash to it. A client
+is served by the shard that accepted its connection; a command whose key belongs to another
+shard is forwarded to the owner through the owner's lock-free inbox, executed there, and the
+reply travels back the same way. The client is blocked while its command is in flight so
+pipelined commands keep their order.
+*/
+
+typedef enum { SHARD_MSG_EXECUTE, SHARD_MSG_REPLY } shard_msg_type_t;
+
+// a command forwarded to the shard owning its key, which then carries the reply back
+typedef struct shard_msg {
+  struct shard_msg *next;
+  shard_msg_type_t type;
+  int origin;     // shard the client is connected to
+  Client *client; // only ever touched by the origin shard
+  ParsedCommand command;
+  char *reply;
+  size_t reply_len;
+} shard_msg_t;
+
+typedef struct shard {
+  int id;
+  pthread_t thread;
+  event_loop_t *loop; // created by the shard's own thread
+  int listen_fd;
+  int event_fd; // signalled when messages are pushed to the inbox
+  redis_db_t *db;
+  _Atomic(shard_msg_t *) inbox; // lock-free multi producer, single consumer stack
+  atomic_size_t key_count;      // published once per loop iteration for DBSIZE
+  Client *exec_client;          // runs the commands forwarded by other shards
+} shard_t;
+
+static shard_t *shards = NULL;
+static int num_shards = 0;
+
+static __thread shard_t *current_shard = NULL;
+// shards that were sent messages during this loop iteration and still need waking up
+static __thread bool wakeup_pending[SHARDS_MAX];
+
+// FNV-1a, keys are spread over the shards by their hash
+static uint64_t key_hash(const char *key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static int shard_for_key(const char *key) { return (int)(key_hash(key) % num_shards); }
+
+bool shard_mode_enabled() { return num_shards > 1; }
+
+size_t shard_total_dbsize() {
+  size_t total = 0;
+  for (int i = 0; i < num_shards; i++) {
+    if (&shards[i] == current_shard) {
+      total += redis_db_dbsize(shards[i].db);
+    } else {
+      total += atomic_load_explicit(&shards[i].key_count, memory_order_relaxed);
+    }
+  }
+  return total;
+}
+
+static void shard_push(shard_t *target, shard_msg_t *msg) {
+  shard_msg_t *head = atomic_load_explicit(&target->inbox, memory_order_relaxed);
+  do {
+    msg->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&target->inbox, &head, msg,
+                                                  memory_order_release, memory_order_relaxed));
+  wakeup_pending[target->id] = true;
+}
+
+// wakes every shard that was sent messages, one eventfd write per shard per loop iteration
+static void flush_wakeups() {
+  for (int i = 0; i < num_shards; i++) {
+    if (!wakeup_pending[i]) continue;
+    wakeup_pending[i] = false;
+    uint64_t one = 1;
+    if (write(shards[i].event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+      perror("failed to wake up shard");
+    }
+  }
+}
+
+// runs a command forwarded by another shard and sends the reply back
+static void execute_forwarded_command(shard_t *shard, shard_msg_t *msg) {
+  Client *exec_client = shard->exec_client;
+  CommandHandler *ch = exec_client->parser->command_handler;
+
+  char **args = ch->args;
+  size_t *arg_lens = ch->arg_lens;
+  ch->args = msg->command.args;
+  ch->arg_lens = msg->command.arg_lens;
+  ch->arg_count = msg->command.arg_count;
+  handle_command(ch);
+  ch->args = args;
+  ch->arg_lens = arg_lens;
+  ch->arg_count = 0;
+  free(msg->command.args);
+  msg->command.args = NULL;
+
+  // collect the whole reply, including what spilled past the output buffer
+  char *reply;
+  size_t reply_len;
+  while (rb_readable(exec_client->output_buffer, &reply, &reply_len) == 0 && reply_len > 0) {
+    char *grown = realloc(msg->reply, msg->reply_len + reply_len);
+    if (!grown) {
+      perror("failed to allocate forwarded reply");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(grown + msg->reply_len, reply, reply_len);
+    msg->reply = grown;
+    msg->reply_len += reply_len;
+    client_release_output(exec_client, reply_len);
+  }
+
+  msg->type = SHARD_MSG_REPLY;
+  shard_push(&shards[msg->origin], msg);
+}
+
+// hands the reply of a forwarded command to the waiting client and resumes it
+static void deliver_reply(shard_msg_t *msg) {
+  Client *client = msg->client;
+  if (!client->close_asap) client_append_output(client, msg->reply, msg->reply_len);
+  free(msg->reply);
+  free(msg);
+  unblock_client(client);
+}
+
+static void drain_inbox(void *data) {
+  shard_t *shard = data;
+  uint64_t count;
+  if (read(shard->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    perror("failed to read shard eventfd");
+  }
+
+  shard_msg_t *msg = atomic_exchange_explicit(&shard->inbox, NULL, memory_order_acquire);
+
+  // the inbox is a stack, reverse it to handle messages in the order they were sent
+  shard_msg_t *ordered = NULL;
+  while (msg) {
+    shard_msg_t *next = msg->next;
+    msg->next = ordered;
+    ordered = msg;
+    msg = next;
+  }
+
+  while (ordered) {
+    shard_msg_t *next = ordered->next;
+    if (ordered->type == SHARD_MSG_EXECUTE) {
+      execute_forwarded_command(shard, ordered);
+    } else {
+      deliver_reply(ordered);
+    }
+    ordered = next;
+  }
+}
+
+/*
+Decides where a command runs. Returns false when it should run on the calling shard, true when
+it was forwarded to the shard owning its keys or rejected with an error reply.
+*/
+bool shard_dispatch_command(CommandHandler *ch, const RedisCommand *command) {
+  if (!current_shard || ch->client == current_shard->exec_client) return false;
+
+  if (command->flags & CMD_FLAG_NOSHARD) {
+    add_error_reply(ch->client, "ERR command not supported in sharded mode");
+    return true;
+  }
+  if (command->first_key == 0) return false;
+
+  // every key has to live on the same shard
+  int last_key = command->last_key < 0 ? (int)ch->arg_count + command->last_key : command->last_key;
+  int target = shard_for_key(ch->args[command->first_key]);
+  for (int i = command->first_key + command->key_step; i <= last_key; i += command->key_step) {
+    if (shard_for_key(ch->args[i]) != target) {
+      add_error_reply(ch->client, "CROSSSLOT Keys in request don't hash to the same shard");
+      return true;
+    }
+  }
+
+  if (target == current_shard->id) return false;
+
+  shard_msg_t *msg = malloc(sizeof(shard_msg_t));
+  if (!msg) {
+    perror("failed to allocate forwarded command");
+    exit(EXIT_FAILURE);
+  }
+  msg->type = SHARD_MSG_EXECUTE;
+  msg->origin = current_shard->id;
+  msg->client = ch->client;
+  copy_parsed_command(ch, &msg->command);
+  msg->reply = NULL;
+  msg->reply_len = 0;
+
+  ch->client->blocked = true;
+  shard_push(&shards[target], msg);
+  return true;
+}
+
+// runs the background tasks of a shard's own keyspace
+static void shard_cron(void *db) { redis_db_cron(db); }
+
+static void *shard_thread_main(void *arg) {
+  shard_t *shard = arg;
+  current_shard = shard;
+
+  // io_uring instances belong to the thread that created them
+  shard->loop = event_loop_create(g_server_config.io_backend, handle_client_event);
+  g_event_loop = shard->loop;
+  event_loop_add_listener(shard->loop, shard->listen_fd, accept_client, shard->db);
+  event_loop_add_wakeup(shard->loop, shard->event_fd, drain_inbox, shard);
+  // the background save, AOF and replication state is process-wide, only shard 0 looks after it
+  event_loop_add_timer(shard->loop, 1000 / g_server_config.hz,
+                       shard->id == 0 ? server_cron : shard_cron, shard->db);
+
+  while (!stop_server) {
+    flush_wakeups();
+    atomic_store_explicit(&shard->key_count, redis_db_dbsize(shard->db), memory_order_relaxed);
+    event_loop_process_events(shard->loop);
+  }
+
+  event_loop_destroy(shard->loop);
+  shard->loop = NULL;
+  g_event_loop = NULL;
+  return NULL;
+}
+
+static void init_shard(shard_t *shard, int id) {
+  shard->id = id;
+  shard->db = redis_db_create();
+  atomic_init(&shard->inbox, NULL);
+  atomic_init(&shard->key_count, 0);
+
+  shard->event_fd = eventfd(0, EFD_NONBLOCK);
+  if (shard->event_fd == -1) {
+    perror("failed to create shard eventfd");
+    exit(EXIT_FAILURE);
+  }
+  shard->listen_fd = create_listening_socket(port, true);
+
+  // not registered with the event loop, only runs forwarded commands and collects their replies
+  shard->exec_client = create_client(-1);
+  shard->exec_client->type = CLIENT_TYPE_REGULAR;
+  select_client_db(shard->exec_client, shard->db);
+  CommandHandler *command_handler = create_command_handler(shard->exec_client, 256, 10);
+  parser_init(shard->exec_client->parser, command_handler);
+}
+
+static void destroy_shard(shard_t *shard) {
+  shard_msg_t *msg = atomic_exchange(&shard->inbox, NULL);
+  while (msg) {
+    shard_msg_t *next = msg->next;
+    free(msg->command.args);
+    free(msg->reply);
+    free(msg);
+    msg = next;
+  }
+  destroy_client(shard->exec_client);
+  close(shard->listen_fd);
+  close(shard->event_fd);
+  redis_db_destroy(shard->db);
+}
+
+/*
+Loads the snapshot and hands every key to the shard owning it. Returns false when a snapshot exists
+but could not be loaded, the shards would save their dataset over it on shutdown.
+*/
+static bool load_shards() {
+  redis_db_t *db = redis_db_create();
+  int status = rdb_load_data_from_file(db, g_server_config.dir, g_server_config.dbfilename, NULL);
+  bool loaded = status == 0;
+  if (status == -1) {
+    // only a missing snapshot means there is nothing to load
+    char *path = construct_file_path(g_server_config.dir, g_server_config.dbfilename);
+    loaded = access(path, F_OK) == -1 && errno == ENOENT;
+    free(path);
+  }
+  if (loaded) {
+    redis_db_t *dbs[SHARDS_MAX];
+    for (int i = 0; i < num_shards; i++) dbs[i] = shards[i].db;
+    redis_db_split(db, dbs, shard_for_key);
+  }
+  redis_db_destroy(db);
+  return loaded;
+}
+
+/*
+Runs the server in sharded mode. The snapshot is split over the shards on startup. The calling
+thread runs shard 0 and handles signals, the other shards get their own threads. On shutdown the
+shards are merged into a single database which is saved like in the regular mode.
+*/
+int start_sharded_server(int count) {
+  if (g_server_info.role == ROLE_SLAVE) {
+    fprintf(stderr, "sharded mode does not support replication\n");
+    return EXIT_FAILURE;
+  }
+  if (count > SHARDS_MAX) count = SHARDS_MAX;
+  // the shards do their own socket I/O, I/O threads do not apply
+  g_server_config.io_threads = 1;
+
+  num_shards = count;
+  shards = calloc(num_shards, sizeof(shard_t));
+  if (!shards) {
+    perror("failed to allocate shards");
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < num_shards; i++) {
+    init_shard(&shards[i], i);
+  }
+  if (!load_shards()) {
+    fprintf(stderr, "failed to load %s, fix or remove it before starting the server\n",
+            g_server_config.dbfilename);
+    for (int i = 0; i < num_shards; i++) {
+      destroy_shard(&shards[i]);
+    }
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGINT, sigint_handler);
+
+  // the shard threads should never receive signals, those are handled by shard 0
+  sigset_t set, old_set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, &old_set);
+  for (int i = 1; i < num_shards; i++) {
+    if (pthread_create(&shards[i].thread, NULL, shard_thread_main, &shards[i]) != 0) {
+      perror("failed to create shard thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+  printf("# Started %d shards\n", num_shards);
+  printf("# Ready to accept connections\n");
+  shard_thread_main(&shards[0]);
+
+  printf("# User requested shutdown...\n");
+  for (int i = 1; i < num_shards; i++) {
+    uint64_t one = 1;
+    if (write(shards[i].event_fd, &one, sizeof(one)) == -1) {
+      perror("failed to wake up shard");
+    }
+    pthread_join(shards[i].thread, NULL);
+  }
+
+  printf("# Saving the final RDB snapshot before exiting.\n");
+  for (int i = 1; i < num_shards; i++) {
+    redis_db_merge(shards[0].db, shards[i].db);
+  }
+  if (redis_db_save(shards[0].db)) {
+    printf("# DB saved on disk\n");
+  }
+
+  for (int i = 0; i < num_shards; i++) {
+    destroy_shard(&shards[i]);
+  }
+  free(shards);
+  shards = NULL;
+  num_shards = 0;
+  printf("# redis_lite is now ready to exit, bye bye...\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,22 @@
+#ifndef SHARD_H
+#define SHARD_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "command_handler.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SHARDS_MAX 256
+
+int start_sharded_server(int num_shards);
+bool shard_dispatch_command(CommandHandler *ch, const RedisCommand *command);
+bool shard_mode_enabled();
+size_t shard_total_dbsize();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SHARD_H
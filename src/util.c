@@ -1,9 +1,33 @@
 #include "util.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+/*
+Fills buf with len random lowercase hex characters, e.g. for replication ids. The bytes come from
+/dev/urandom, or from random() when it can't be read. buf is not NUL-terminated.
+*/
+void random_hex(char *buf, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  unsigned char bytes[32];
+  int fd = open("/dev/urandom", O_RDONLY);
+  for (size_t i = 0; i < len; i++) {
+    size_t nibble = i % (2 * sizeof(bytes));
+    if (nibble == 0 && (fd == -1 || read(fd, bytes, sizeof(bytes)) != sizeof(bytes))) {
+      srandom(current_time_millis() ^ getpid() ^ i);
+      for (size_t j = 0; j < sizeof(bytes); j++) bytes[j] = random() & 0xFF;
+    }
+    unsigned char byte = bytes[nibble / 2];
+    buf[i] = digits[nibble % 2 == 0 ? byte >> 4 : byte & 0xF];
+  }
+  if (fd != -1) close(fd);
+}
 
 long long current_time_millis() {
   struct timeval tv;
@@ -44,6 +68,46 @@ int parse_long_long(const char *str, long long *result) {
   return ERR_NONE;
 }
 
+/*
+Parses len bytes as a long long only when they are its canonical representation, i.e. formatting
+the result gives back the same bytes: no sign other than a leading '-', no leading zeros and no
+surrounding spaces. Values stored this way can be kept as integers without changing what is read
+back. Returns ERR_VALUE otherwise.
+*/
+int string_to_long_long(const char *str, size_t len, long long *result) {
+  if (len == 0 || len >= LONG_STR_SIZE) return ERR_VALUE;
+  if (len == 1 && str[0] == '0') {
+    *result = 0;
+    return ERR_NONE;
+  }
+
+  const char *p = str;
+  const char *end = str + len;
+  bool negative = false;
+  if (*p == '-') {
+    negative = true;
+    if (++p == end) return ERR_VALUE;
+  }
+  if (*p < '1' || *p > '9') return ERR_VALUE;
+
+  unsigned long long value = 0;
+  for (; p < end; p++) {
+    if (*p < '0' || *p > '9') return ERR_VALUE;
+    unsigned long long digit = *p - '0';
+    if (value > (ULLONG_MAX - digit) / 10) return ERR_VALUE;
+    value = value * 10 + digit;
+  }
+
+  if (negative) {
+    if (value > (unsigned long long)LLONG_MAX + 1) return ERR_VALUE;
+    *result = (long long)(0 - value);
+  } else {
+    if (value > LLONG_MAX) return ERR_VALUE;
+    *result = (long long)value;
+  }
+  return ERR_NONE;
+}
+
 char *construct_file_path(const char *dir, const char *filename) {
   size_t path_len = strlen(dir) + strlen(filename) + 2;
   char *path = malloc(path_len);
@@ -66,4 +130,37 @@ void set_non_blocking(int fd) {
     perror("fcntl(F_SETFL) failed");
     exit(EXIT_FAILURE);
   }
-}
\ No newline at end of file
+}
+
+/*
+Parses a memory size such as 1048576, 100mb or 2gb. The units k, m and g are powers of 1000, kb, mb
+and gb powers of 1024, case is ignored. Returns ERR_VALUE when the string is not a size.
+*/
+int parse_memory_size(const char *str, unsigned long long *result) {
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (end == str || *str == '-' || errno == ERANGE) return ERR_VALUE;
+
+  unsigned long long multiplier;
+  if (*end == '\0' || strcasecmp(end, "b") == 0) {
+    multiplier = 1;
+  } else if (strcasecmp(end, "k") == 0) {
+    multiplier = 1000;
+  } else if (strcasecmp(end, "kb") == 0) {
+    multiplier = 1024;
+  } else if (strcasecmp(end, "m") == 0) {
+    multiplier = 1000 * 1000;
+  } else if (strcasecmp(end, "mb") == 0) {
+    multiplier = 1024 * 1024;
+  } else if (strcasecmp(end, "g") == 0) {
+    multiplier = 1000 * 1000 * 1000;
+  } else if (strcasecmp(end, "gb") == 0) {
+    multiplier = 1024 * 1024 * 1024;
+  } else {
+    return ERR_VALUE;
+  }
+  if (value > ULLONG_MAX / multiplier) return ERR_VALUE;
+  *result = value * multiplier;
+  return ERR_NONE;
+}
@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 
 #define ERR_NONE 0
@@ -9,10 +10,18 @@
 #define ERR_VALUE -2
 #define ERR_TYPE_MISMATCH -3
 #define ERR_KEY_NOT_FOUND -4
+#define ERR_OVERFLOW -5
+#define ERR_OOM -6
+
+// enough room for any long long formatted as a string, including the NUL
+#define LONG_STR_SIZE 21
 
 long long current_time_millis();
+void random_hex(char *buf, size_t len);
 int parse_integer(const char *str, long *result);
 int parse_long_long(const char *str, long long *result);
+int string_to_long_long(const char *str, size_t len, long long *result);
+int parse_memory_size(const char *str, unsigned long long *result);
 char *construct_file_path(const char *dir, const char *filename);
 void set_non_blocking(int fd);
 #endif // UTIL_H
\ No newline at end of file
@@ -1,9 +1,22 @@
+#include <array>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 extern "C" {
+#include "../src/aof.h"
 #include "../src/client.h"
 #include "../src/command_handler.h"
 #include "../src/database.h"
+#include "../src/handler.h"
+#include "../src/rdb.h"
+#include "../src/replication.h"
+#include "../src/resp.h"
 #include "../src/server_config.h"
+#include "../src/util.h"
 }
 
 redis_db_t *db;
@@ -26,7 +39,10 @@ protected:
   void ExecuteCommand(const std::vector<std::string> &args) {
     ch->arg_count = args.size();
     for (size_t i = 0; i < args.size(); ++i) {
-      ch->args[i] = strdup(args[i].c_str());
+      // copy the terminating NUL too, arguments may contain NULs of their own
+      ch->args[i] = (char *)malloc(args[i].size() + 1);
+      memcpy(ch->args[i], args[i].c_str(), args[i].size() + 1);
+      ch->arg_lens[i] = args[i].size();
     }
     handle_command(ch);
     for (size_t i = 0; i < args.size(); ++i) {
@@ -36,11 +52,13 @@ protected:
 
   // used to consume a reply out of the output buffer
   std::string GetReply() {
+    std::string reply;
     char *buf;
     size_t len;
-    rb_readable(client->output_buffer, &buf, &len);
-    std::string reply(buf, len);
-    rb_read(client->output_buffer, len);
+    while (rb_readable(client->output_buffer, &buf, &len) == 0 && len > 0) {
+      reply.append(buf, len);
+      client_release_output(client, len);
+    }
     return reply;
   }
 
@@ -148,6 +166,33 @@ TEST_F(CommandTest, GetCommand) {
   EXPECT_EQ(GetReply(), "$-1\r\n");
 }
 
+TEST_F(CommandTest, GetValueLargerThanTheOutputBuffer) {
+  std::string value(100000, 'x');
+  ExecuteCommand({"SET", "bigkey", value});
+  GetReply();
+
+  // the reply is not cut short, and the replies that follow it keep their order
+  ExecuteCommand({"GET", "bigkey"});
+  ExecuteCommand({"PING"});
+  EXPECT_EQ(GetReply(), "$100000\r\n" + value + "\r\n+PONG\r\n");
+}
+
+TEST_F(CommandTest, KeysContainingNulAreRejected) {
+  std::string key("a\0b", 3);
+  ExecuteCommand({"SET", key, "value"});
+  EXPECT_EQ(GetReply(), "-ERR keys containing NUL bytes are not supported\r\n");
+  ExecuteCommand({"DEL", "other", key});
+  EXPECT_EQ(GetReply(), "-ERR keys containing NUL bytes are not supported\r\n");
+
+  // the key was not stored under its prefix, values may still contain NULs
+  ExecuteCommand({"EXIST", "a"});
+  EXPECT_EQ(GetReply(), ":0\r\n");
+  ExecuteCommand({"SET", "a", key});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+  ExecuteCommand({"GET", "a"});
+  EXPECT_EQ(GetReply(), "$3\r\n" + key + "\r\n");
+}
+
 TEST_F(CommandTest, ExistCommand) {
   ExecuteCommand({"SET", "key1", "value1"});
   GetReply();
@@ -349,6 +394,19 @@ TEST_F(CommandTest, LrangeKeyNotFound) {
   EXPECT_EQ(GetReply(), "*0\r\n");
 }
 
+TEST_F(CommandTest, LrangeReplyLargerThanTheOutputBuffer) {
+  std::string expected = "*20000\r\n";
+  for (int i = 0; i < 20000; i++) {
+    std::string item = "item" + std::to_string(i);
+    ExecuteCommand({"RPUSH", "biglist", item});
+    GetReply();
+    expected += "$" + std::to_string(item.size()) + "\r\n" + item + "\r\n";
+  }
+
+  ExecuteCommand({"LRANGE", "biglist", "0", "-1"});
+  EXPECT_EQ(GetReply(), expected);
+}
+
 TEST_F(CommandTest, GetConfig) {
   strcpy(g_server_config.dir, "testdir");
   strcpy(g_server_config.dbfilename, "testdb.rdb");
@@ -361,4 +419,886 @@ TEST_F(CommandTest, GetConfig) {
   EXPECT_EQ(GetReply(), "*2\r\n$10\r\ndbfilename\r\n$" +
                             std::to_string(strlen(g_server_config.dbfilename)) + "\r\n" +
                             std::string(g_server_config.dbfilename) + "\r\n");
-}
\ No newline at end of file
+}
+TEST_F(CommandTest, DeferredCommandsExecuteInOrder) {
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+  ch->defer_execution = true;
+
+  const char *input = "*3\r\n$3\r\nSET\r\n$5\r\nmykey\r\n$2\r\nv1\r\n"
+                      "*2\r\n$3\r\nGET\r\n$5\r\nmykey\r\n";
+  const char *end = parser_parse(client->parser, input, input + strlen(input));
+  EXPECT_EQ(end, input + strlen(input));
+
+  // nothing runs until the main thread executes the queued commands
+  EXPECT_EQ(ch->pending_count, 2);
+  EXPECT_EQ(GetReply(), "");
+
+  execute_pending_commands(ch);
+  EXPECT_EQ(ch->pending_count, 0);
+  EXPECT_EQ(GetReply(), "+OK\r\n$2\r\nv1\r\n");
+
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+}
+
+TEST_F(CommandTest, BulkStringSplitAcrossReads) {
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+
+  const char *input = "*3\r\n$3\r\nSET\r\n$5\r\nmykey\r\n$10\r\n0123456789\r\n";
+  size_t split = strlen("*3\r\n$3\r\nSET\r\n$5\r\nmykey\r\n$10\r\n0123");
+  const char *begin = parser_parse(client->parser, input, input + split);
+  parser_parse(client->parser, begin, input + strlen(input));
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+
+  ExecuteCommand({"GET", "mykey"});
+  EXPECT_EQ(GetReply(), "$10\r\n0123456789\r\n");
+
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+}
+
+TEST_F(CommandTest, BlockedClientStopsParsing) {
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+
+  const char *input = "*1\r\n$4\r\nPING\r\n*1\r\n$4\r\nPING\r\n";
+  const char *first_end = input + strlen("*1\r\n$4\r\nPING\r\n");
+  client->blocked = true;
+  const char *begin = parser_parse(client->parser, input, input + strlen(input));
+  EXPECT_EQ(begin, input);
+
+  client->blocked = false;
+  begin = parser_parse(client->parser, input, first_end);
+  EXPECT_EQ(begin, first_end);
+  EXPECT_EQ(GetReply(), "+PONG\r\n");
+
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+}
+
+TEST_F(CommandTest, InputLargerThanInputBufferIsParsed) {
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+
+  // two commands that together do not fit in the 64KB input buffer
+  std::string value(40000, 'x');
+  std::string command = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$" + std::to_string(value.size()) +
+                        "\r\n" + value + "\r\n";
+  std::string input = command + command;
+  client_append_input(client, input.data(), input.size());
+  EXPECT_GT(client->input_spill_len, 0u);
+
+  process_client_received_input(client);
+  EXPECT_EQ(client->input_spill_len, 0u);
+  EXPECT_EQ(GetReply(), "+OK\r\n+OK\r\n");
+
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+}
+
+TEST_F(CommandTest, WholeBulkStringsAreBorrowedFromInput) {
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+  ch->borrow_input = true;
+
+  char input[] = "*3\r\n$3\r\nSET\r\n$5\r\nmykey\r\n$2\r\nv1\r\n";
+  parser_parse(client->parser, input, input + strlen(input));
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+  // nothing was copied into the handler's buffer
+  EXPECT_EQ(ch->buf_used, 0u);
+
+  ExecuteCommand({"GET", "mykey"});
+  EXPECT_EQ(GetReply(), "$2\r\nv1\r\n");
+
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+}
+
+TEST_F(CommandTest, BorrowedArgumentsAreReleasedBeforeInputIsReused) {
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+  ch->borrow_input = true;
+
+  char input[] = "*3\r\n$3\r\nSET\r\n$5\r\nmykey\r\n$10\r\n0123456789\r\n";
+  size_t split = strlen("*3\r\n$3\r\nSET\r\n$5\r\nmykey\r\n$10\r\n0123");
+  const char *begin = parser_parse(client->parser, input, input + split);
+  command_handler_release_input(ch);
+
+  // the consumed input is overwritten, as the next read into the ring buffer would
+  size_t consumed = begin - input;
+  memset(input, 'x', consumed);
+  parser_parse(client->parser, begin, input + strlen(input + consumed) + consumed);
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+
+  ExecuteCommand({"GET", "mykey"});
+  EXPECT_EQ(GetReply(), "$10\r\n0123456789\r\n");
+
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+}
+
+TEST_F(CommandTest, BinaryValueRoundTrips) {
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+  ch->borrow_input = true;
+
+  std::string set("*3\r\n$3\r\nSET\r\n$3\r\nbin\r\n$5\r\na\0b\r\n\r\n", 33);
+  std::string get("*2\r\n$3\r\nGET\r\n$3\r\nbin\r\n");
+  std::string input = set + get;
+  parser_parse(client->parser, &input[0], &input[0] + input.size());
+  EXPECT_EQ(GetReply(), "+OK\r\n" + std::string("$5\r\na\0b\r\n\r\n", 11));
+
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+}
+
+TEST_F(CommandTest, CommandNamesAreCaseInsensitive) {
+  ExecuteCommand({"set", "mykey", "v1"});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+
+  ExecuteCommand({"gEt", "mykey"});
+  EXPECT_EQ(GetReply(), "$2\r\nv1\r\n");
+
+  ExecuteCommand({"GETX", "mykey"});
+  EXPECT_EQ(GetReply(), "-ERR unknown command\r\n");
+}
+
+TEST_F(CommandTest, LookupCommandFindsTableEntries) {
+  const RedisCommand *command = lookup_command("lpush", 5);
+  ASSERT_NE(command, nullptr);
+  EXPECT_EQ(command->type, CMD_LPUSH);
+  EXPECT_TRUE(command->flags & CMD_FLAG_WRITE);
+  EXPECT_EQ(command->first_key, 1);
+
+  command = lookup_command("INFO", 4);
+  ASSERT_NE(command, nullptr);
+  EXPECT_EQ(command->type, CMD_INFO);
+  command = lookup_command("Incr", 4);
+  ASSERT_NE(command, nullptr);
+  EXPECT_EQ(command->type, CMD_INCR);
+
+  EXPECT_EQ(lookup_command("PONG", 4), nullptr);
+  EXPECT_EQ(lookup_command("", 0), nullptr);
+}
+
+TEST_F(CommandTest, ArityIsCheckedBeforeDispatch) {
+  ExecuteCommand({"GET"});
+  EXPECT_EQ(GetReply(), "-ERR wrong number of arguments for 'get' command\r\n");
+
+  ExecuteCommand({"GET", "a", "b"});
+  EXPECT_EQ(GetReply(), "-ERR wrong number of arguments for 'get' command\r\n");
+
+  ExecuteCommand({"LPUSH", "list"});
+  EXPECT_EQ(GetReply(), "-ERR wrong number of arguments for 'lpush' command\r\n");
+}
+
+TEST_F(CommandTest, WriteCommandsMarkTheDatasetDirty) {
+  long long dirty = db->dirty;
+  ExecuteCommand({"DEL", "missing"});
+  GetReply();
+  EXPECT_EQ(db->dirty, dirty);
+
+  ExecuteCommand({"RPUSH", "list", "a", "b"});
+  GetReply();
+  EXPECT_GT(db->dirty, dirty);
+}
+
+TEST_F(CommandTest, IncrbyAndDecrbyCommands) {
+  ExecuteCommand({"INCRBY", "counter", "10"});
+  EXPECT_EQ(GetReply(), ":10\r\n");
+
+  ExecuteCommand({"DECRBY", "counter", "15"});
+  EXPECT_EQ(GetReply(), ":-5\r\n");
+
+  ExecuteCommand({"GET", "counter"});
+  EXPECT_EQ(GetReply(), "$2\r\n-5\r\n");
+
+  ExecuteCommand({"INCRBY", "counter", "ten"});
+  EXPECT_EQ(GetReply(), "-ERR value is not an integer or out of range\r\n");
+}
+
+TEST_F(CommandTest, IncrOverflowIsRejected) {
+  ExecuteCommand({"SET", "counter", "9223372036854775807"});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+
+  ExecuteCommand({"INCR", "counter"});
+  EXPECT_EQ(GetReply(), "-ERR increment or decrement would overflow\r\n");
+
+  ExecuteCommand({"GET", "counter"});
+  EXPECT_EQ(GetReply(), "$19\r\n9223372036854775807\r\n");
+}
+
+TEST_F(CommandTest, IncrKeepsTheExpiration) {
+  ExecuteCommand({"SET", "counter", "1", "EX", "100"});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+  long long expiration = redis_db_get(db, "counter")->expiration;
+
+  ExecuteCommand({"INCR", "counter"});
+  EXPECT_EQ(GetReply(), ":2\r\n");
+  EXPECT_EQ(redis_db_get(db, "counter")->expiration, expiration);
+}
+
+TEST_F(CommandTest, IncrOnNonCanonicalIntegerFails) {
+  ExecuteCommand({"SET", "counter", "010"});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+
+  ExecuteCommand({"INCR", "counter"});
+  EXPECT_EQ(GetReply(), "-ERR value is not an integer\r\n");
+
+  ExecuteCommand({"GET", "counter"});
+  EXPECT_EQ(GetReply(), "$3\r\n010\r\n");
+}
+
+TEST_F(CommandTest, WritesAreRejectedWhenMaxmemoryIsReached) {
+  server_config_t saved_config = g_server_config;
+  ExecuteCommand({"SET", "key", "value"});
+  GetReply();
+  g_server_config.maxmemory = 1;
+  g_server_config.maxmemory_policy = MAXMEMORY_NO_EVICTION;
+
+  ExecuteCommand({"SET", "other", "value"});
+  EXPECT_EQ(GetReply(), "-OOM command not allowed when used memory > 'maxmemory'\r\n");
+  ExecuteCommand({"GET", "key"});
+  EXPECT_EQ(GetReply(), "$5\r\nvalue\r\n");
+  ExecuteCommand({"DEL", "key"});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+  g_server_config = saved_config;
+}
+
+TEST_F(CommandTest, BgsaveWritesSnapshotWhileServing) {
+  server_config_t saved_config = g_server_config;
+  strcpy(g_server_config.dir, "bgsave_testdir");
+  strcpy(g_server_config.dbfilename, "bgsave_test.rdb");
+  ExecuteCommand({"SET", "key", "value"});
+  GetReply();
+
+  ExecuteCommand({"BGSAVE"});
+  EXPECT_EQ(GetReply(), "+Background saving started\r\n");
+  ExecuteCommand({"SAVE"});
+  EXPECT_EQ(GetReply(), "-ERR Background save already in progress\r\n");
+  ExecuteCommand({"BGSAVE"});
+  EXPECT_EQ(GetReply(), "-ERR Background save already in progress\r\n");
+  // the parent keeps serving commands while the child writes the snapshot
+  ExecuteCommand({"GET", "key"});
+  EXPECT_EQ(GetReply(), "$5\r\nvalue\r\n");
+
+  while (rdb_background_save_in_progress()) {
+    rdb_check_background_save();
+    usleep(1000);
+  }
+  struct stat statbuf;
+  EXPECT_EQ(stat("bgsave_testdir/bgsave_test.rdb", &statbuf), 0);
+
+  redis_db_t *loaded = redis_db_create();
+  rdb_load_data_from_file(loaded, g_server_config.dir, g_server_config.dbfilename, NULL);
+  EXPECT_EQ(redis_db_dbsize(loaded), 1u);
+  redis_db_destroy(loaded);
+
+  unlink("bgsave_testdir/bgsave_test.rdb");
+  rmdir("bgsave_testdir");
+  g_server_config = saved_config;
+}
+
+TEST_F(CommandTest, DisklessSyncStreamsTheSnapshotToSockets) {
+  ExecuteCommand({"SET", "key", "value"});
+  GetReply();
+  ExecuteCommand({"RPUSH", "list", "a", "b", "c"});
+  GetReply();
+
+  // the first replica is gone already, the snapshot still reaches the second one
+  int gone[2], replica[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, gone), 0);
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, replica), 0);
+  close(gone[1]);
+  set_non_blocking(replica[0]);
+  set_non_blocking(replica[1]);
+  int fds[2] = {gone[0], replica[0]};
+  ASSERT_TRUE(rdb_save_background_to_sockets(db, fds, 2));
+  EXPECT_FALSE(rdb_save_background(db));
+  while (rdb_background_save_in_progress()) {
+    rdb_check_background_save();
+    usleep(1000);
+  }
+  // the replication stream follows the snapshot
+  ASSERT_EQ(write(replica[0], "+PING\r\n", 7), 7);
+
+  char header[5 + RDB_EOF_MARK_SIZE + 2];
+  ASSERT_EQ(read(replica[1], header, sizeof(header)), (ssize_t)sizeof(header));
+  ASSERT_EQ(memcmp(header, "$EOF:", 5), 0);
+  char *rest = NULL;
+  size_t rest_len = 0;
+  redis_db_t *loaded = redis_db_create();
+  ASSERT_TRUE(rdb_load_from_socket(loaded, replica[1], -1, header + 5, &rest, &rest_len));
+  EXPECT_EQ(redis_db_dbsize(loaded), 2u);
+  RedisValue *rv = redis_db_get(loaded, "list");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(get_list_length(rv->data.list), 3u);
+  EXPECT_EQ(std::string(rest, rest_len), "+PING\r\n");
+
+  free(rest);
+  redis_db_destroy(loaded);
+  close(gone[0]);
+  close(replica[0]);
+  close(replica[1]);
+}
+
+TEST_F(CommandTest, ReplicasStreamFromTheSharedReplicationBuffer) {
+  replication_create_backlog();
+  int pairs[2][2];
+  Client *replicas[2];
+  std::string received[2];
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]), 0);
+    set_non_blocking(pairs[i][0]);
+    set_non_blocking(pairs[i][1]);
+    replicas[i] = create_client(pairs[i][0]);
+  }
+  auto drain = [&]() {
+    char buf[65536];
+    for (bool progress = true; progress;) {
+      progress = false;
+      for (int i = 0; i < 2; i++) {
+        master_handle_replica_out(replicas[i]);
+        ssize_t n = read(pairs[i][1], buf, sizeof(buf));
+        if (n > 0) {
+          received[i].append(buf, n);
+          progress = true;
+        }
+      }
+    }
+  };
+
+  // more than the 64KB a client output buffer holds, the first replica gets all of it and the
+  // second one resumes 100 bytes in
+  ASSERT_TRUE(continue_psync(replicas[0], g_server_info.master_replid, 0));
+  std::string command = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+  std::string stream;
+  for (int i = 0; i < 4000; i++) {
+    replication_feed(command.data(), command.size());
+    stream += command;
+  }
+  ASSERT_TRUE(continue_psync(replicas[1], g_server_info.master_replid, 100));
+  EXPECT_FALSE(
+      continue_psync(client, g_server_info.master_replid, g_server_info.master_repl_offset + 1));
+  drain();
+  EXPECT_EQ(received[0], "+CONTINUE\r\n" + stream);
+  EXPECT_EQ(received[1], "+CONTINUE\r\n" + stream.substr(100));
+
+  // once the replicas caught up only the backlog holds on to the stream, and it keeps about
+  // a megabyte of it
+  std::string large(1 << 16, 'x');
+  for (int i = 0; i < 40; i++) {
+    replication_feed(large.data(), large.size());
+    drain();
+  }
+  EXPECT_GT(g_server_info.repl_backlog_base_offset, 0);
+  EXPECT_EQ(g_server_info.repl_buffer_head, g_server_info.repl_backlog);
+  EXPECT_GE(g_server_info.master_repl_offset - g_server_info.repl_backlog_base_offset, 1 << 20);
+  EXPECT_FALSE(continue_psync(client, g_server_info.master_replid, 0));
+  EXPECT_EQ(received[0].size(), 11 + stream.size() + 40 * large.size());
+
+  for (int i = 0; i < 2; i++) {
+    remove_replica(replicas[i]);
+    destroy_client(replicas[i]);
+    close(pairs[i][1]);
+  }
+  replication_free_backlog();
+  g_server_info.master_repl_offset = 0;
+}
+
+TEST_F(CommandTest, ConfigSetResizesTheBacklog) {
+  replication_create_backlog();
+  std::string large(1 << 16, 'x');
+  for (int i = 0; i < 32; i++) replication_feed(large.data(), large.size());
+  // two megabytes were written, the default backlog keeps about one of them
+  long long histlen = g_server_info.master_repl_offset - g_server_info.repl_backlog_base_offset;
+  EXPECT_GE(histlen, 1 << 20);
+  EXPECT_LT(histlen, 2 << 20);
+
+  // a smaller backlog lets go of the older blocks right away
+  ExecuteCommand({"CONFIG", "SET", "repl-backlog-size", "64kb"});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+  histlen = g_server_info.master_repl_offset - g_server_info.repl_backlog_base_offset;
+  EXPECT_GE(histlen, 1 << 16);
+  EXPECT_LT(histlen, 2 << 16);
+  EXPECT_EQ(g_server_info.repl_buffer_head, g_server_info.repl_backlog);
+
+  // a larger one keeps the stream written from now on
+  ExecuteCommand({"CONFIG", "SET", "repl-backlog-size", "100mb"});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+  long long base_offset = g_server_info.repl_backlog_base_offset;
+  for (int i = 0; i < 64; i++) replication_feed(large.data(), large.size());
+  EXPECT_EQ(g_server_info.repl_backlog_base_offset, base_offset);
+  ExecuteCommand({"CONFIG", "GET", "repl-backlog-size"});
+  EXPECT_EQ(GetReply(), "*2\r\n$17\r\nrepl-backlog-size\r\n$9\r\n104857600\r\n");
+
+  ExecuteCommand({"CONFIG", "SET", "repl-backlog-size", "lots"});
+  EXPECT_EQ(GetReply().compare(0, 4, "-ERR"), 0);
+  ExecuteCommand({"CONFIG", "SET", "dir", "/tmp"});
+  EXPECT_EQ(GetReply().compare(0, 4, "-ERR"), 0);
+
+  replication_set_backlog_size(1024 * 1024);
+  replication_free_backlog();
+  g_server_info.master_repl_offset = 0;
+}
+
+TEST_F(CommandTest, CommandsOfAnIterationAreSentToEveryReplicaAtOnce) {
+  replication_create_backlog();
+  const int count = 100;
+  std::vector<std::array<int, 2>> pairs(count);
+  std::vector<Client *> replicas(count);
+  char buf[4096];
+  for (int i = 0; i < count; i++) {
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i].data()), 0);
+    set_non_blocking(pairs[i][0]);
+    replicas[i] = create_client(pairs[i][0]);
+    ASSERT_TRUE(continue_psync(replicas[i], g_server_info.master_replid, 0));
+    master_handle_replica_out(replicas[i]);
+    ASSERT_EQ(read(pairs[i][1], buf, sizeof(buf)), 11);
+  }
+  EXPECT_EQ(g_server_info.num_replicas, (size_t)count);
+
+  std::string command = "*2\r\n$4\r\nINCR\r\n$7\r\ncounter\r\n";
+  for (int i = 0; i < 10; i++) replication_feed(command.data(), command.size());
+  for (int i = 0; i < count; i++) EXPECT_EQ(recv(pairs[i][1], buf, 1, MSG_DONTWAIT), -1);
+  replication_send_pending();
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(read(pairs[i][1], buf, sizeof(buf)), (ssize_t)(10 * command.size()));
+    EXPECT_FALSE(replicas[i]->epoll_events & EPOLLOUT);
+  }
+
+  for (int i = 0; i < count; i++) {
+    remove_replica(replicas[i]);
+    destroy_client(replicas[i]);
+    close(pairs[i][1]);
+  }
+  EXPECT_EQ(g_server_info.num_replicas, 0u);
+  replication_free_backlog();
+  g_server_info.master_repl_offset = 0;
+}
+
+TEST_F(CommandTest, WaitBlocksUntilReplicasAcknowledgeTheWrites) {
+  replication_create_backlog();
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+  int pair[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+  set_non_blocking(pair[0]);
+  set_non_blocking(pair[1]);
+  Client *replica = create_client(pair[0]);
+  parser_init(replica->parser, create_command_handler(replica, 256, 10));
+  ASSERT_TRUE(continue_psync(replica, g_server_info.master_replid, 0));
+  master_handle_replica_out(replica);
+  char buf[4096];
+  ASSERT_EQ(read(pair[1], buf, sizeof(buf)), 11);
+  auto ack = [&](long long offset) {
+    std::string value = std::to_string(offset);
+    std::string command = "*3\r\n$8\r\nREPLCONF\r\n$3\r\nACK\r\n$" +
+                          std::to_string(value.size()) + "\r\n" + value + "\r\n";
+    ASSERT_EQ(write(pair[1], command.data(), command.size()), (ssize_t)command.size());
+    ASSERT_EQ(master_handle_replica_input(replica), 0);
+  };
+
+  // nothing was written, every streaming replica has all of it
+  ExecuteCommand({"WAIT", "1", "0"});
+  EXPECT_EQ(GetReply(), ":1\r\n");
+
+  // the client is blocked until the replica acknowledged the SET, which it is asked for after it
+  ExecuteCommand({"SET", "key", "value"});
+  GetReply();
+  long long offset = g_server_info.master_repl_offset;
+  ExecuteCommand({"WAIT", "1", "0"});
+  EXPECT_TRUE(client->blocked);
+  replication_send_pending();
+  std::string getack = "*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n";
+  std::string set = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+  EXPECT_EQ(std::string(buf, read(pair[1], buf, sizeof(buf))), set + getack);
+  replication_handle_waiting_clients();
+  EXPECT_TRUE(client->blocked);
+  ack(offset - 1);
+  replication_handle_waiting_clients();
+  EXPECT_TRUE(client->blocked);
+  ack(g_server_info.master_repl_offset);
+  EXPECT_EQ(recv(pair[1], buf, 1, MSG_DONTWAIT), -1); // acknowledgements are not replied to
+  replication_handle_waiting_clients();
+  EXPECT_FALSE(client->blocked);
+  EXPECT_EQ(GetReply(), ":1\r\n");
+
+  // asking for more replicas than there are times out
+  ExecuteCommand({"WAIT", "2", "20"});
+  EXPECT_TRUE(client->blocked);
+  usleep(30000);
+  replication_handle_waiting_clients();
+  EXPECT_FALSE(client->blocked);
+  EXPECT_EQ(GetReply(), ":1\r\n");
+
+  ExecuteCommand({"INFO"});
+  std::string info = GetReply();
+  EXPECT_NE(info.find("connected_slaves:1\r\n"), std::string::npos);
+  EXPECT_NE(info.find("slave0:ip=?,port=0,state=online,offset=" +
+                      std::to_string(g_server_info.master_repl_offset) + ",lag=0\r\n"),
+            std::string::npos);
+
+  remove_replica(replica);
+  destroy_client(replica);
+  close(pair[1]);
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+  replication_free_backlog();
+  g_server_info.master_repl_offset = 0;
+}
+
+TEST_F(CommandTest, DeferredWaitHoldsBackTheCommandsPipelinedBehindIt) {
+  replication_create_backlog();
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+  ch->defer_execution = true;
+  int pair[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+  set_non_blocking(pair[0]);
+  Client *replica = create_client(pair[0]);
+  parser_init(replica->parser, create_command_handler(replica, 256, 10));
+  // it was accepted with the other clients, its acknowledgements are still handled right away
+  replica->parser->command_handler->defer_execution = true;
+  ASSERT_TRUE(continue_psync(replica, g_server_info.master_replid, 0));
+
+  const char *input = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n"
+                      "*3\r\n$4\r\nWAIT\r\n$1\r\n1\r\n$1\r\n0\r\n"
+                      "*1\r\n$4\r\nPING\r\n";
+  parser_parse(client->parser, input, input + strlen(input));
+  EXPECT_EQ(ch->pending_count, 3);
+
+  // the PING is not run before the WAIT replied
+  execute_pending_commands(ch);
+  EXPECT_TRUE(client->blocked);
+  EXPECT_EQ(ch->pending_count, 1);
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+  execute_pending_commands(ch);
+  EXPECT_EQ(GetReply(), "");
+
+  std::string offset = std::to_string(g_server_info.master_repl_offset);
+  std::string ack = "*3\r\n$8\r\nREPLCONF\r\n$3\r\nACK\r\n$" +
+                    std::to_string(offset.size()) + "\r\n" + offset + "\r\n";
+  ASSERT_EQ(write(pair[1], ack.data(), ack.size()), (ssize_t)ack.size());
+  ASSERT_EQ(master_handle_replica_input(replica), 0);
+  replication_handle_waiting_clients();
+  EXPECT_FALSE(client->blocked);
+  EXPECT_EQ(ch->pending_count, 0);
+  EXPECT_EQ(GetReply(), ":1\r\n+PONG\r\n");
+
+  remove_replica(replica);
+  destroy_client(replica);
+  close(pair[1]);
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+  replication_free_backlog();
+  g_server_info.master_repl_offset = 0;
+}
+
+TEST_F(CommandTest, ReplicaFeedsCompleteCommandsOfTheMasterStreamOn) {
+  g_server_info.role = ROLE_SLAVE;
+  replication_create_backlog();
+  g_handler = create_handler();
+  parser_init(client->parser, ch);
+  client->type = CLIENT_TYPE_MASTER;
+  client->repl_client_state = REPL_STATE_READY;
+  client->should_reply = false;
+
+  // a command split across reads is fed on once it is complete, the offset stays on its boundary
+  std::string set = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+  std::string incr = "*2\r\n$4\r\nINCR\r\n$7\r\ncounter\r\n";
+  client_append_input(client, set.data(), 20);
+  process_client_received_input(client);
+  EXPECT_EQ(g_server_info.master_repl_offset, 0);
+  std::string rest = set.substr(20) + incr.substr(0, 10);
+  client_append_input(client, rest.data(), rest.size());
+  process_client_received_input(client);
+  EXPECT_EQ(g_server_info.master_repl_offset, (long long)set.size());
+  client_append_input(client, incr.data() + 10, incr.size() - 10);
+  process_client_received_input(client);
+  EXPECT_EQ(g_server_info.master_repl_offset, (long long)(set.size() + incr.size()));
+
+  // the stream is fed on byte for byte, the commands ran without replies
+  repl_block *backlog = g_server_info.repl_backlog;
+  EXPECT_EQ(std::string(backlog->buf, backlog->used), set + incr);
+  EXPECT_NE(redis_db_get(db, "key"), nullptr);
+  EXPECT_EQ(GetReply(), "");
+
+  client->parser->command_handler = NULL;
+  destroy_handler(g_handler);
+  g_handler = NULL;
+  replication_free_backlog();
+  g_server_info.master_repl_offset = 0;
+  g_server_info.role = ROLE_MASTER;
+}
+
+TEST_F(CommandTest, PromotedReplicaContinuesTheStreamOfItsFormerMaster) {
+  std::string former(REPLID_SIZE, 'a');
+  g_server_info.role = ROLE_SLAVE;
+  memcpy(g_server_info.master_replid, former.c_str(), former.size() + 1);
+  replication_create_backlog();
+  std::string stream(200, 'x');
+  replication_feed(stream.data(), stream.size());
+
+  ExecuteCommand({"REPLICAOF", "NO", "ONE"});
+  EXPECT_EQ(GetReply(), "+OK\r\n");
+  EXPECT_EQ(g_server_info.role, ROLE_MASTER);
+  std::string replid = g_server_info.master_replid;
+  EXPECT_EQ(replid.size(), (size_t)REPLID_SIZE);
+  EXPECT_NE(replid, former);
+  EXPECT_EQ(std::string(g_server_info.master_replid2), former);
+  EXPECT_EQ(g_server_info.second_replid_offset, 200);
+
+  // a replica of the former master continues with the promoted one and learns its id
+  int pair[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+  set_non_blocking(pair[0]);
+  Client *replica = create_client(pair[0]);
+  std::string more(50, 'y');
+  replication_feed(more.data(), more.size());
+  ASSERT_TRUE(continue_psync(replica, former.c_str(), 100));
+  master_handle_replica_out(replica);
+  char buf[4096];
+  EXPECT_EQ(std::string(buf, read(pair[1], buf, sizeof(buf))),
+            "+CONTINUE " + replid + "\r\n" + stream.substr(100) + more);
+
+  // the former master's stream past the promotion is not the one the promoted replica has
+  EXPECT_FALSE(continue_psync(client, former.c_str(), 220));
+  EXPECT_FALSE(continue_psync(client, std::string(REPLID_SIZE, 'b').c_str(), 100));
+
+  ExecuteCommand({"REPLICAOF", "localhost", "not-a-port"});
+  EXPECT_EQ(GetReply(), "-ERR Invalid master port\r\n");
+  EXPECT_EQ(g_server_info.role, ROLE_MASTER);
+
+  remove_replica(replica);
+  destroy_client(replica);
+  close(pair[1]);
+  replication_free_backlog();
+  g_server_info.master_repl_offset = 0;
+  g_server_info.master_replid[0] = '\0';
+  g_server_info.master_replid2[0] = '\0';
+  g_server_info.second_replid_offset = -1;
+}
+
+TEST_F(CommandTest, MasterPingsItsReplicasAndDropsTheSilentOnes) {
+  replication_create_backlog();
+  int pairs[2][2];
+  Client *replicas[2];
+  char buf[4096];
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]), 0);
+    set_non_blocking(pairs[i][0]);
+    replicas[i] = create_client(pairs[i][0]);
+    ASSERT_TRUE(continue_psync(replicas[i], g_server_info.master_replid, 0));
+    master_handle_replica_out(replicas[i]);
+    ASSERT_EQ(read(pairs[i][1], buf, sizeof(buf)), 11);
+  }
+  // the second replica acknowledged nothing for longer than repl_timeout
+  replicas[1]->repl_ack_time = current_time_millis() - g_server_config.repl_timeout * 1000LL - 1;
+
+  replication_cron(client->db);
+  EXPECT_EQ(g_server_info.num_replicas, 1u);
+  EXPECT_EQ(read(pairs[1][1], buf, sizeof(buf)), 0);
+  replication_send_pending();
+  EXPECT_EQ(std::string(buf, read(pairs[0][1], buf, sizeof(buf))), "*1\r\n$4\r\nPING\r\n");
+
+  remove_replica(replicas[0]);
+  destroy_client(replicas[0]);
+  close(pairs[0][1]);
+  close(pairs[1][1]);
+  replication_free_backlog();
+  g_server_info.master_repl_offset = 0;
+}
+
+TEST_F(CommandTest, AppendOnlyFileReplaysTheWriteCommands) {
+  server_config_t saved_config = g_server_config;
+  g_server_config.appendfsync = AOF_FSYNC_ALWAYS;
+  g_handler = create_handler();
+  ASSERT_TRUE(aof_open("aof_testdir", "test.aof"));
+
+  ExecuteCommand({"SET", "counter", "1"});
+  ExecuteCommand({"INCR", "counter"});
+  ExecuteCommand({"SET", "session", "abc", "EX", "100"});
+  ExecuteCommand({"RPUSH", "queue", "a", "b"});
+  ExecuteCommand({"SET", "gone", "x"});
+  ExecuteCommand({"DEL", "gone"});
+  ExecuteCommand({"GET", "counter"});
+  ExecuteCommand({"SET", "counter", "5", "NX"}); // did not change the dataset
+  GetReply();
+  aof_close();
+
+  std::ifstream file("aof_testdir/test.aof", std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  std::string aof = contents.str();
+  EXPECT_EQ(aof.find("GET"), std::string::npos);
+  EXPECT_EQ(aof.find("NX"), std::string::npos);
+  // the relative expiration was logged as the absolute time the key got
+  EXPECT_EQ(aof.find("EX"), std::string::npos);
+  EXPECT_NE(aof.find("$4\r\nPXAT\r\n"), std::string::npos);
+
+  // a command cut off by a crash is dropped
+  std::ofstream append("aof_testdir/test.aof", std::ios::binary | std::ios::app);
+  append << "*3\r\n$3\r\nSET\r\n$7\r\ncounter";
+  append.close();
+
+  redis_db_t *loaded = redis_db_create();
+  ASSERT_EQ(aof_load_data_from_file(loaded, "aof_testdir", "test.aof"), 0);
+  EXPECT_EQ(redis_db_dbsize(loaded), 3u);
+  RedisValue *rv = redis_db_get(loaded, "counter");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(rv->data.integer, 2);
+  rv = redis_db_get(loaded, "session");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(rv->expiration, redis_db_get(db, "session")->expiration);
+  rv = redis_db_get(loaded, "queue");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(get_list_length(rv->data.list), 2u);
+  EXPECT_EQ(redis_db_get(loaded, "gone"), nullptr);
+  redis_db_destroy(loaded);
+
+  struct stat statbuf;
+  ASSERT_EQ(stat("aof_testdir/test.aof", &statbuf), 0);
+  EXPECT_EQ((size_t)statbuf.st_size, aof.size());
+
+  unlink("aof_testdir/test.aof");
+  rmdir("aof_testdir");
+  destroy_handler(g_handler);
+  g_handler = NULL;
+  g_server_config = saved_config;
+}
+
+TEST_F(CommandTest, AppendOnlyFileReplayIgnoresMaxmemory) {
+  server_config_t saved_config = g_server_config;
+  g_handler = create_handler();
+  ASSERT_EQ(mkdir("aof_oom_testdir", 0755), 0);
+  std::ofstream out("aof_oom_testdir/test.aof", std::ios::binary);
+  for (int i = 0; i < 100; i++) {
+    std::string key = "key" + std::to_string(i);
+    out << "*3\r\n$3\r\nSET\r\n$" << key.size() << "\r\n" << key << "\r\n$5\r\nvalue\r\n";
+  }
+  out.close();
+
+  // the replay neither evicts the keys it restored nor rejects the writes that follow them
+  g_server_config.maxmemory = 1;
+  maxmemory_policy_t policies[] = {MAXMEMORY_ALLKEYS_LRU, MAXMEMORY_NO_EVICTION};
+  for (maxmemory_policy_t policy : policies) {
+    g_server_config.maxmemory_policy = policy;
+    redis_db_t *loaded = redis_db_create();
+    ASSERT_EQ(aof_load_data_from_file(loaded, "aof_oom_testdir", "test.aof"), 0);
+    EXPECT_EQ(redis_db_dbsize(loaded), 100u);
+    EXPECT_EQ(loaded->evicted_keys, 0);
+    redis_db_destroy(loaded);
+  }
+
+  unlink("aof_oom_testdir/test.aof");
+  rmdir("aof_oom_testdir");
+  destroy_handler(g_handler);
+  g_handler = NULL;
+  g_server_config = saved_config;
+}
+
+TEST_F(CommandTest, ReplicaOverMaxmemoryKeepsTheKeysOfItsMaster) {
+  server_config_t saved_config = g_server_config;
+  g_server_config.maxmemory = 1;
+  g_server_config.maxmemory_policy = MAXMEMORY_ALLKEYS_LRU;
+  g_server_info.role = ROLE_SLAVE;
+
+  client->type = CLIENT_TYPE_MASTER;
+  client->should_reply = false;
+  for (int i = 0; i < 100; i++) {
+    ExecuteCommand({"SET", "key" + std::to_string(i), "value"});
+  }
+
+  // commands of regular clients do not evict what the master sent either
+  client->type = CLIENT_TYPE_REGULAR;
+  client->should_reply = true;
+  ExecuteCommand({"GET", "key0"});
+  EXPECT_EQ(GetReply(), "$5\r\nvalue\r\n");
+  ExecuteCommand({"DBSIZE"});
+  EXPECT_EQ(GetReply(), ":100\r\n");
+  EXPECT_EQ(db->evicted_keys, 0);
+
+  g_server_info.role = ROLE_MASTER;
+  g_server_config = saved_config;
+}
+
+TEST_F(CommandTest, BgrewriteaofCompactsTheAppendOnlyFile) {
+  server_config_t saved_config = g_server_config;
+  strcpy(g_server_config.dir, "aofrw_testdir");
+  strcpy(g_server_config.appendfilename, "rewrite.aof");
+  g_server_config.appendfsync = AOF_FSYNC_EVERYSEC;
+  g_handler = create_handler();
+  ASSERT_TRUE(aof_open(g_server_config.dir, g_server_config.appendfilename));
+
+  for (int i = 0; i < 200; i++) {
+    ExecuteCommand({"INCR", "counter"});
+    GetReply();
+  }
+  ExecuteCommand({"RPUSH", "queue", "a", "b"});
+  GetReply();
+
+  ExecuteCommand({"BGREWRITEAOF"});
+  EXPECT_EQ(GetReply(), "+Background append only file rewriting started\r\n");
+  ExecuteCommand({"BGREWRITEAOF"});
+  EXPECT_EQ(GetReply(), "-ERR Background append only file rewriting already in progress\r\n");
+  ExecuteCommand({"BGSAVE"});
+  EXPECT_EQ(GetReply(), "-ERR Background append only file rewriting in progress\r\n");
+  // executed while the child writes the preamble, they end up in the tail
+  ExecuteCommand({"INCR", "counter"});
+  GetReply();
+  ExecuteCommand({"SET", "during", "rewrite"});
+  GetReply();
+  aof_flush();
+
+  while (aof_rewrite_in_progress()) {
+    aof_check_background_rewrite(db);
+    usleep(1000);
+  }
+  // appended to the rewritten file
+  ExecuteCommand({"SET", "after", "rewrite"});
+  GetReply();
+  aof_close();
+
+  std::ifstream file("aofrw_testdir/rewrite.aof", std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  std::string aof = contents.str();
+  EXPECT_EQ(aof.compare(0, 9, "REDIS0012"), 0);
+  size_t incr = aof.find("INCR");
+  ASSERT_NE(incr, std::string::npos);
+  EXPECT_EQ(aof.find("INCR", incr + 1), std::string::npos);
+  EXPECT_NE(aof.find("during"), std::string::npos);
+  EXPECT_NE(aof.find("after"), std::string::npos);
+
+  redis_db_t *loaded = redis_db_create();
+  ASSERT_EQ(aof_load_data_from_file(loaded, g_server_config.dir, g_server_config.appendfilename),
+            0);
+  EXPECT_EQ(redis_db_dbsize(loaded), 4u);
+  RedisValue *rv = redis_db_get(loaded, "counter");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(rv->data.integer, 201);
+  rv = redis_db_get(loaded, "queue");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(get_list_length(rv->data.list), 2u);
+  EXPECT_NE(redis_db_get(loaded, "during"), nullptr);
+  EXPECT_NE(redis_db_get(loaded, "after"), nullptr);
+  redis_db_destroy(loaded);
+
+  unlink("aofrw_testdir/rewrite.aof");
+  rmdir("aofrw_testdir");
+  destroy_handler(g_handler);
+  g_handler = NULL;
+  g_server_config = saved_config;
+}
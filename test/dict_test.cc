@@ -0,0 +1,134 @@
+extern "C" {
+#include "dict.h"
+}
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+struct TestEntry {
+  dict_entry link;
+  std::string key;
+};
+
+class DictTest : public ::testing::Test {
+protected:
+  dict *d;
+  std::vector<TestEntry *> entries;
+
+  void SetUp() override { d = dict_create(); }
+
+  void TearDown() override {
+    dict_destroy(d, NULL);
+    for (TestEntry *entry : entries) {
+      delete entry;
+    }
+  }
+
+  dict_entry *Add(const std::string &key) {
+    TestEntry *entry = new TestEntry();
+    entry->key = key;
+    entry->link.key = entry->key.c_str();
+    entries.push_back(entry);
+    dict_add(d, &entry->link);
+    return &entry->link;
+  }
+};
+
+TEST_F(DictTest, AddFindAndUnlink) {
+  dict_entry *a = Add("a");
+  dict_entry *b = Add("b");
+  EXPECT_EQ(dict_size(d), 2);
+  EXPECT_EQ(dict_find(d, "a"), a);
+  EXPECT_EQ(dict_find(d, "b"), b);
+  EXPECT_EQ(dict_find(d, "c"), nullptr);
+
+  EXPECT_EQ(dict_unlink(d, "a"), a);
+  EXPECT_EQ(dict_find(d, "a"), nullptr);
+  EXPECT_EQ(dict_unlink(d, "a"), nullptr);
+  EXPECT_EQ(dict_size(d), 1);
+}
+
+TEST_F(DictTest, GrowingRehashesIncrementally) {
+  // grow until a rehash starts, it must not complete within the insert that started it
+  int i = 0;
+  while (!dict_is_rehashing(d) || dict_size(d) < 1000) {
+    Add("key:" + std::to_string(i++));
+  }
+  EXPECT_GT(d->tables[0].used, 0);
+  EXPECT_GT(d->tables[1].size, d->tables[0].size);
+
+  // every key stays reachable while it is split over both tables
+  for (int j = 0; j < i; j++) {
+    EXPECT_NE(dict_find(d, ("key:" + std::to_string(j)).c_str()), nullptr);
+  }
+
+  while (dict_rehash(d, 100)) {
+  }
+  EXPECT_FALSE(dict_is_rehashing(d));
+  EXPECT_EQ(d->tables[0].used, (size_t)i);
+  EXPECT_EQ(d->tables[1].size, 0);
+}
+
+TEST_F(DictTest, ExpandPreSizesTheTable) {
+  dict_expand(d, 1000);
+  EXPECT_EQ(d->tables[0].size, 1024);
+  for (int i = 0; i < 1000; i++) {
+    Add("key" + std::to_string(i));
+  }
+  // every entry fit without growing
+  EXPECT_FALSE(dict_is_rehashing(d));
+  EXPECT_EQ(d->tables[0].size, 1024);
+
+  // a larger size on a populated table starts an incremental rehash
+  dict_expand(d, 5000);
+  EXPECT_TRUE(dict_is_rehashing(d));
+  EXPECT_EQ(d->tables[1].size, 8192);
+  dict_rehash_milliseconds(d, 100);
+  EXPECT_EQ(d->tables[0].size, 8192);
+  EXPECT_NE(dict_find(d, "key999"), nullptr);
+}
+
+TEST_F(DictTest, RehashMillisecondsFinishesRehashing) {
+  while (!dict_is_rehashing(d) || dict_size(d) < 10000) {
+    Add("key:" + std::to_string(dict_size(d)));
+  }
+  while (dict_is_rehashing(d)) {
+    dict_rehash_milliseconds(d, 1);
+  }
+  EXPECT_EQ(dict_size(d), entries.size());
+}
+
+TEST_F(DictTest, IteratorVisitsEveryEntryWhileRehashing) {
+  while (!dict_is_rehashing(d) || dict_size(d) < 500) {
+    Add("key:" + std::to_string(dict_size(d)));
+  }
+
+  dict_iterator it;
+  dict_iter_init(&it, d);
+  long rehash_index = d->rehash_index;
+  size_t visited = 0;
+  dict_entry *entry;
+  while ((entry = dict_iter_next(&it))) {
+    // lookups do not move buckets while an iterator runs
+    EXPECT_EQ(dict_find(d, entry->key), entry);
+    visited++;
+  }
+  EXPECT_EQ(d->rehash_index, rehash_index);
+  dict_iter_release(&it);
+  EXPECT_EQ(visited, entries.size());
+}
+
+TEST_F(DictTest, IteratorAllowsUnlinkingTheCurrentEntry) {
+  for (int i = 0; i < 100; i++) {
+    Add("key:" + std::to_string(i));
+  }
+
+  dict_iterator it;
+  dict_iter_init(&it, d);
+  dict_entry *entry;
+  while ((entry = dict_iter_next(&it))) {
+    EXPECT_EQ(dict_unlink(d, entry->key), entry);
+  }
+  dict_iter_release(&it);
+  EXPECT_EQ(dict_size(d), 0);
+}
@@ -1,8 +1,15 @@
 extern "C" {
+#include "../src/client.h"
 #include "../src/database.h"
+#include "../src/linked_list.h"
+#include "../src/rdb.h"
+#include "../src/server_config.h"
 #include "../src/util.h"
 }
+#include <climits>
 #include <gtest/gtest.h>
+#include <string>
+#include <vector>
 #include <unistd.h>
 
 redis_db_t *db;
@@ -308,4 +315,413 @@ TEST_F(DatabaseTest, LrangeValidRange) {
   redis_db_delete(db, key); // delete the list
   result = redis_db_lrange(db, key, 0, 2, &range, &range_length);
   EXPECT_EQ(result, ERR_KEY_NOT_FOUND); // Expect an error for non-existent key
-}
\ No newline at end of file
+}
+TEST_F(DatabaseTest, SetValueStringWithEmbeddedNul) {
+  const char value[] = {'a', '\0', 'b', 'c'};
+  redis_db_set_string(db, "binary", value, sizeof(value), 0);
+
+  RedisValue *rv = redis_db_get(db, "binary");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(sds_len(rv->data.str), sizeof(value));
+  EXPECT_EQ(memcmp(rv->data.str, value, sizeof(value)), 0);
+}
+
+TEST_F(DatabaseTest, IntegerValuesAreIntegerEncoded) {
+  redis_db_set(db, "counter", "-42", TYPE_STRING, 0);
+  redis_db_set(db, "padded", "042", TYPE_STRING, 0);
+
+  RedisValue *rv = redis_db_get(db, "counter");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(rv->encoding, ENCODING_INT);
+  EXPECT_EQ(rv->data.integer, -42);
+
+  rv = redis_db_get(db, "padded");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(rv->encoding, ENCODING_EMBSTR);
+  EXPECT_STREQ(rv->data.str, "042");
+}
+
+TEST_F(DatabaseTest, IncrByUpdatesIntegerInPlace) {
+  long long result;
+  EXPECT_EQ(redis_db_incr_by(db, "counter", 5, &result), ERR_NONE);
+  EXPECT_EQ(result, 5);
+
+  RedisValue *rv = redis_db_get(db, "counter");
+  EXPECT_EQ(redis_db_incr_by(db, "counter", -7, &result), ERR_NONE);
+  EXPECT_EQ(result, -2);
+  EXPECT_EQ(redis_db_get(db, "counter"), rv);
+
+  char buf[LONG_STR_SIZE];
+  size_t len;
+  const char *str = redis_value_string(rv, buf, &len);
+  EXPECT_EQ(std::string(str, len), "-2");
+}
+
+TEST_F(DatabaseTest, StringToLongLongOnlyAcceptsCanonicalIntegers) {
+  long long value;
+  EXPECT_EQ(string_to_long_long("0", 1, &value), ERR_NONE);
+  EXPECT_EQ(value, 0);
+  EXPECT_EQ(string_to_long_long("-9223372036854775808", 20, &value), ERR_NONE);
+  EXPECT_EQ(value, LLONG_MIN);
+  EXPECT_EQ(string_to_long_long("9223372036854775807", 19, &value), ERR_NONE);
+  EXPECT_EQ(value, LLONG_MAX);
+
+  EXPECT_EQ(string_to_long_long("9223372036854775808", 19, &value), ERR_VALUE);
+  EXPECT_EQ(string_to_long_long("-0", 2, &value), ERR_VALUE);
+  EXPECT_EQ(string_to_long_long("+1", 2, &value), ERR_VALUE);
+  EXPECT_EQ(string_to_long_long("01", 2, &value), ERR_VALUE);
+  EXPECT_EQ(string_to_long_long(" 1", 2, &value), ERR_VALUE);
+  EXPECT_EQ(string_to_long_long("", 0, &value), ERR_VALUE);
+}
+
+TEST_F(DatabaseTest, ShortStringsAreEmbeddedAndOverwrittenInPlace) {
+  redis_db_set(db, "key", "a longer value", TYPE_STRING, 0);
+  RedisValue *rv = redis_db_get(db, "key");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(rv->encoding, ENCODING_EMBSTR);
+
+  // a value that fits in the entry reuses it
+  redis_db_set(db, "key", "short", TYPE_STRING, 0);
+  EXPECT_EQ(redis_db_get(db, "key"), rv);
+  EXPECT_STREQ(rv->data.str, "short");
+  EXPECT_EQ(sds_len(rv->data.str), 5);
+
+  redis_db_set(db, "key", "42", TYPE_STRING, 0);
+  EXPECT_EQ(redis_db_get(db, "key"), rv);
+  EXPECT_EQ(rv->encoding, ENCODING_INT);
+}
+
+TEST_F(DatabaseTest, LongStringsAreStoredSeparately) {
+  std::string value(1000, 'v');
+  redis_db_set(db, "key", "small", TYPE_STRING, 0);
+  redis_db_set(db, "key", value.c_str(), TYPE_STRING, 0);
+
+  RedisValue *rv = redis_db_get(db, "key");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(rv->encoding, ENCODING_RAW);
+  EXPECT_EQ(std::string(rv->data.str, sds_len(rv->data.str)), value);
+
+  // growing back into an embedded string that does not fit the entry moves it
+  std::string embedded(60, 'e');
+  redis_db_set(db, "key", embedded.c_str(), TYPE_STRING, 0);
+  rv = redis_db_get(db, "key");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(rv->encoding, ENCODING_EMBSTR);
+  EXPECT_EQ(std::string(rv->data.str), embedded);
+  EXPECT_EQ(db->key_count, 1);
+}
+
+TEST_F(DatabaseTest, ExpiryCountFollowsOverwritesAndDeletes) {
+  long long expiration = current_time_millis() + 10000;
+  redis_db_set(db, "key", "value", TYPE_STRING, expiration);
+  EXPECT_EQ(db->expiry_count, 1);
+
+  redis_db_set(db, "key", "value", TYPE_STRING, 0);
+  EXPECT_EQ(db->expiry_count, 0);
+
+  redis_db_set(db, "key", "value", TYPE_STRING, expiration);
+  redis_db_delete(db, "key");
+  EXPECT_EQ(db->expiry_count, 0);
+  EXPECT_EQ(db->key_count, 0);
+}
+
+TEST_F(DatabaseTest, ActiveExpireDeletesExpiredKeysWithoutReadingThem) {
+  long long now = current_time_millis();
+  for (int i = 0; i < 100; i++) {
+    std::string key = "expired:" + std::to_string(i);
+    // expirations in the past, in no particular order
+    redis_db_set(db, key.c_str(), "value", TYPE_STRING, now - 1 - (i * 37) % 100);
+  }
+  redis_db_set(db, "future", "value", TYPE_STRING, now + 60000);
+  redis_db_set(db, "persistent", "value", TYPE_STRING, 0);
+  EXPECT_EQ(db->expiry_count, 101);
+
+  EXPECT_EQ(redis_db_active_expire(db, 100), 100);
+  EXPECT_EQ(db->key_count, 2);
+  EXPECT_EQ(db->expiry_count, 1);
+  EXPECT_TRUE(redis_db_exist(db, "future"));
+  EXPECT_TRUE(redis_db_exist(db, "persistent"));
+}
+
+TEST_F(DatabaseTest, ActiveExpireFollowsChangedExpirations) {
+  long long now = current_time_millis();
+  redis_db_set(db, "a", "value", TYPE_STRING, now + 60000);
+  redis_db_set(db, "b", "value", TYPE_STRING, now + 60000);
+  redis_db_set(db, "c", "value", TYPE_STRING, now - 10);
+
+  // a now expires, c no longer has an expiration and b is grown into a new allocation
+  redis_db_set(db, "a", "value", TYPE_STRING, now - 10);
+  redis_db_set(db, "c", "value", TYPE_STRING, 0);
+  redis_db_set(db, "b", std::string(40, 'x').c_str(), TYPE_STRING, now - 5);
+  EXPECT_EQ(db->expiry_count, 2);
+
+  EXPECT_EQ(redis_db_active_expire(db, 100), 2);
+  EXPECT_FALSE(redis_db_exist(db, "a"));
+  EXPECT_FALSE(redis_db_exist(db, "b"));
+  EXPECT_TRUE(redis_db_exist(db, "c"));
+  EXPECT_EQ(db->expiry_count, 0);
+}
+
+TEST_F(DatabaseTest, UsedMemoryFollowsTheKeyspace) {
+  EXPECT_EQ(redis_db_used_memory(db), 0);
+  redis_db_set(db, "short", "value", TYPE_STRING, 0);
+  size_t short_usage = redis_db_used_memory(db);
+  EXPECT_GT(short_usage, 0);
+
+  redis_db_set(db, "long", std::string(1000, 'x').c_str(), TYPE_STRING, 0);
+  EXPECT_GT(redis_db_used_memory(db), short_usage + 1000);
+
+  int length;
+  redis_db_rpush(db, "list", "item", &length);
+  redis_db_rpush(db, "list", "item", &length);
+
+  redis_db_delete(db, "long");
+  redis_db_delete(db, "list");
+  EXPECT_EQ(redis_db_used_memory(db), short_usage);
+  redis_db_set(db, "short", std::string(1000, 'x').c_str(), TYPE_STRING, 0);
+  redis_db_delete(db, "short");
+  EXPECT_EQ(redis_db_used_memory(db), 0);
+}
+
+// the keys starting with 'b' go to the second database
+static int owner_by_first_letter(const char *key) { return key[0] == 'b' ? 1 : 0; }
+
+TEST_F(DatabaseTest, SplitMovesEveryKeyToItsOwner) {
+  redis_db_set(db, "apple", "1", TYPE_STRING, 0);
+  redis_db_set(db, "banana", "2", TYPE_STRING, 0);
+  redis_db_set(db, "berry", "3", TYPE_STRING, current_time_millis() + 100000);
+  redis_db_t *dsts[2] = {redis_db_create(), redis_db_create()};
+  redis_db_split(db, dsts, owner_by_first_letter);
+
+  EXPECT_EQ(redis_db_dbsize(db), 0u);
+  EXPECT_EQ(redis_db_used_memory(db), 0u);
+  EXPECT_EQ(redis_db_dbsize(dsts[0]), 1u);
+  EXPECT_NE(redis_db_get(dsts[0], "apple"), nullptr);
+  EXPECT_EQ(redis_db_dbsize(dsts[1]), 2u);
+  EXPECT_NE(redis_db_get(dsts[1], "banana"), nullptr);
+  EXPECT_EQ(redis_db_expiry_count(dsts[1]), 1u);
+  EXPECT_GT(redis_db_used_memory(dsts[1]), redis_db_used_memory(dsts[0]));
+  redis_db_destroy(dsts[0]);
+  redis_db_destroy(dsts[1]);
+}
+
+class EvictionTest : public DatabaseTest {
+protected:
+  server_config_t saved_config;
+
+  void SetUp() override {
+    DatabaseTest::SetUp();
+    saved_config = g_server_config;
+  }
+
+  void TearDown() override {
+    g_server_config = saved_config;
+    DatabaseTest::TearDown();
+  }
+};
+
+TEST_F(EvictionTest, NoEvictionReportsOutOfMemory) {
+  g_server_config.maxmemory_policy = MAXMEMORY_NO_EVICTION;
+  redis_db_set(db, "key", "value", TYPE_STRING, 0);
+  g_server_config.maxmemory = 1;
+  EXPECT_EQ(redis_db_evict_if_needed(db), ERR_OOM);
+  EXPECT_TRUE(redis_db_exist(db, "key"));
+
+  g_server_config.maxmemory = redis_db_used_memory(db);
+  EXPECT_EQ(redis_db_evict_if_needed(db), ERR_NONE);
+}
+
+TEST_F(EvictionTest, AllKeysLruEvictsTheLeastRecentlyUsedKey) {
+  g_server_config.maxmemory_policy = MAXMEMORY_ALLKEYS_LRU;
+  redis_db_set(db, "idle", "value", TYPE_STRING, 0);
+  redis_db_set(db, "busy", "value", TYPE_STRING, 0);
+  redis_db_get(db, "idle")->lru -= 100; // last used 100 seconds ago
+
+  g_server_config.maxmemory = redis_db_used_memory(db) - 1;
+  EXPECT_EQ(redis_db_evict_if_needed(db), ERR_NONE);
+  EXPECT_FALSE(redis_db_exist(db, "idle"));
+  EXPECT_TRUE(redis_db_exist(db, "busy"));
+  EXPECT_EQ(db->evicted_keys, 1);
+}
+
+TEST_F(EvictionTest, AllKeysLfuEvictsTheLeastFrequentlyUsedKey) {
+  g_server_config.maxmemory_policy = MAXMEMORY_ALLKEYS_LFU;
+  redis_db_set(db, "rare", "value", TYPE_STRING, 0);
+  redis_db_set(db, "frequent", "value", TYPE_STRING, 0);
+  for (int i = 0; i < 1000; i++) {
+    redis_db_get(db, "frequent");
+  }
+  EXPECT_GT(redis_db_get(db, "frequent")->lru & 0xFF, redis_db_get(db, "rare")->lru & 0xFF);
+
+  g_server_config.maxmemory = redis_db_used_memory(db) - 1;
+  EXPECT_EQ(redis_db_evict_if_needed(db), ERR_NONE);
+  EXPECT_FALSE(redis_db_exist(db, "rare"));
+  EXPECT_TRUE(redis_db_exist(db, "frequent"));
+}
+
+TEST_F(EvictionTest, VolatileTtlEvictsTheKeysClosestToExpiring) {
+  g_server_config.maxmemory_policy = MAXMEMORY_VOLATILE_TTL;
+  long long now = current_time_millis();
+  redis_db_set(db, "persistent", "value", TYPE_STRING, 0);
+  redis_db_set(db, "later", "value", TYPE_STRING, now + 60000);
+  redis_db_set(db, "soon", "value", TYPE_STRING, now + 1000);
+
+  g_server_config.maxmemory = redis_db_used_memory(db) - 1;
+  EXPECT_EQ(redis_db_evict_if_needed(db), ERR_NONE);
+  EXPECT_FALSE(redis_db_exist(db, "soon"));
+  EXPECT_TRUE(redis_db_exist(db, "later"));
+
+  // only keys with an expiration are candidates
+  g_server_config.maxmemory = 1;
+  EXPECT_EQ(redis_db_evict_if_needed(db), ERR_OOM);
+  EXPECT_TRUE(redis_db_exist(db, "persistent"));
+}
+
+TEST_F(DatabaseTest, ParseMemorySize) {
+  unsigned long long size;
+  EXPECT_EQ(parse_memory_size("1048576", &size), ERR_NONE);
+  EXPECT_EQ(size, 1048576);
+  EXPECT_EQ(parse_memory_size("100mb", &size), ERR_NONE);
+  EXPECT_EQ(size, 100ULL * 1024 * 1024);
+  EXPECT_EQ(parse_memory_size("2G", &size), ERR_NONE);
+  EXPECT_EQ(size, 2000000000ULL);
+  EXPECT_EQ(parse_memory_size("10kb", &size), ERR_NONE);
+  EXPECT_EQ(size, 10240);
+  EXPECT_EQ(parse_memory_size("10tb", &size), ERR_VALUE);
+  EXPECT_EQ(parse_memory_size("-1", &size), ERR_VALUE);
+  EXPECT_EQ(parse_memory_size("mb", &size), ERR_VALUE);
+}
+
+TEST_F(DatabaseTest, RdbSaveAndLoadRoundTripsStrings) {
+  // longer than the RDB write buffer, so it is written straight from the value
+  std::string large(3 << 20, 'x');
+  std::string medium(100, 'm');
+  long long expiration = current_time_millis() + 60000;
+  redis_db_set(db, "int8", "-42", TYPE_STRING, 0);
+  redis_db_set(db, "int16", "1000", TYPE_STRING, 0);
+  redis_db_set(db, "int32", "-100000", TYPE_STRING, expiration);
+  redis_db_set(db, "int64", "10000000000", TYPE_STRING, 0);
+  redis_db_set(db, "padded", "042", TYPE_STRING, 0);
+  redis_db_set(db, "123", "integer key", TYPE_STRING, 0);
+  redis_db_set(db, "medium", medium.c_str(), TYPE_STRING, 0);
+  redis_db_set(db, "large", large.c_str(), TYPE_STRING, 0);
+  ASSERT_TRUE(rdb_save_data_to_file(db, "rdb_testdir", "roundtrip.rdb"));
+
+  redis_db_t *loaded = redis_db_create();
+  ASSERT_EQ(rdb_load_data_from_file(loaded, "rdb_testdir", "roundtrip.rdb", NULL), 0);
+  EXPECT_EQ(redis_db_dbsize(loaded), 8u);
+  const char *keys[] = {"int8", "int16", "int32", "int64", "padded", "123", "medium", "large"};
+  for (const char *key : keys) {
+    RedisValue *expected = redis_db_get(db, key);
+    RedisValue *actual = redis_db_get(loaded, key);
+    ASSERT_NE(actual, nullptr) << key;
+    char expected_buf[LONG_STR_SIZE], actual_buf[LONG_STR_SIZE];
+    size_t expected_len, actual_len;
+    const char *expected_str = redis_value_string(expected, expected_buf, &expected_len);
+    const char *actual_str = redis_value_string(actual, actual_buf, &actual_len);
+    EXPECT_EQ(std::string(actual_str, actual_len), std::string(expected_str, expected_len)) << key;
+    EXPECT_EQ(actual->expiration, expected->expiration) << key;
+  }
+  redis_db_destroy(loaded);
+
+  unlink("rdb_testdir/roundtrip.rdb");
+  rmdir("rdb_testdir");
+}
+
+
+TEST_F(DatabaseTest, RdbKeepsTheReplicationStreamItWasTakenAt) {
+  std::string replid(REPLID_SIZE, 'c');
+  memcpy(g_server_info.master_replid, replid.c_str(), replid.size() + 1);
+  g_server_info.master_repl_offset = 123456789012LL;
+  redis_db_set(db, "key", "value", TYPE_STRING, 0);
+  ASSERT_TRUE(rdb_save_data_to_file(db, "rdb_testdir", "replinfo.rdb"));
+  g_server_info.master_replid[0] = '\0';
+  g_server_info.master_repl_offset = 0;
+
+  redis_db_t *loaded = redis_db_create();
+  rdb_repl_info repl_info;
+  ASSERT_EQ(rdb_load_data_from_file(loaded, "rdb_testdir", "replinfo.rdb", &repl_info), 0);
+  EXPECT_EQ(std::string(repl_info.replid), replid);
+  EXPECT_EQ(repl_info.offset, 123456789012LL);
+  EXPECT_EQ(redis_db_dbsize(loaded), 1u);
+  redis_db_destroy(loaded);
+}
+TEST_F(DatabaseTest, RdbLoadsLargeKeyCountsIntoAPreSizedKeyspace) {
+  long long expiration = current_time_millis() + 60000;
+  for (int i = 0; i < 1000; i++) {
+    std::string key = "key" + std::to_string(i);
+    // lengths around the 6 and 14-bit length encoding boundaries
+    std::string value(i % 2 ? 63 + i % 3 : 16383 + i % 3, 'v');
+    redis_db_set(db, key.c_str(), value.c_str(), TYPE_STRING, i % 3 == 0 ? expiration : 0);
+  }
+  ASSERT_TRUE(rdb_save_data_to_file(db, "rdb_testdir", "large.rdb"));
+
+  redis_db_t *loaded = redis_db_create();
+  ASSERT_EQ(rdb_load_data_from_file(loaded, "rdb_testdir", "large.rdb", NULL), 0);
+  EXPECT_EQ(redis_db_dbsize(loaded), 1000u);
+  EXPECT_EQ(loaded->expiry_count, 334u);
+  EXPECT_EQ(loaded->expires_capacity, 334u);
+  // sized from the snapshot, loading never had to grow the table
+  EXPECT_FALSE(dict_is_rehashing(loaded->keys));
+  EXPECT_EQ(loaded->keys->tables[0].size, 1024u);
+  RedisValue *rv = redis_db_get(loaded, "key999");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(sds_len(rv->data.str), 63u);
+  rv = redis_db_get(loaded, "key998");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(sds_len(rv->data.str), 16385u);
+  EXPECT_EQ(rv->expiration, 0);
+  redis_db_destroy(loaded);
+
+  unlink("rdb_testdir/large.rdb");
+  rmdir("rdb_testdir");
+}
+
+TEST_F(DatabaseTest, RdbSaveAndLoadRoundTripsLists) {
+  std::vector<std::string> elements = {"0", "127", "128", "-1", "-4096", "4095", "-4097", "32767",
+                                       "-32768", "8388607", "-8388608", "2147483647",
+                                       "-2147483648", "1099511627776", "-1099511627776",
+                                       "9223372036854775807", "-9223372036854775808", "007", "",
+                                       std::string(63, 'a'), std::string(64, 'b'),
+                                       std::string(4095, 'c'), std::string(4096, 'd'),
+                                       std::string(20000, 'e')};
+  // enough elements to span several listpacks
+  for (int i = 0; i < 5000; i++) {
+    elements.push_back("element" + std::to_string(i));
+  }
+  int length;
+  for (const std::string &element : elements) {
+    redis_db_rpush(db, "queue", element.c_str(), &length);
+  }
+  List expiring = create_list();
+  rpush(expiring, "job", &length);
+  long long expiration = current_time_millis() + 60000;
+  redis_db_set(db, "expiring", expiring, TYPE_LIST, expiration);
+  ASSERT_TRUE(rdb_save_data_to_file(db, "rdb_testdir", "lists.rdb"));
+
+  redis_db_t *loaded = redis_db_create();
+  ASSERT_EQ(rdb_load_data_from_file(loaded, "rdb_testdir", "lists.rdb", NULL), 0);
+  EXPECT_EQ(redis_db_dbsize(loaded), 2u);
+  RedisValue *rv = redis_db_get(loaded, "queue");
+  ASSERT_NE(rv, nullptr);
+  ASSERT_EQ(rv->type, TYPE_LIST);
+  ASSERT_EQ(get_list_length(rv->data.list), elements.size());
+  list_iterator it;
+  list_iter_init(&it, rv->data.list);
+  const char *data;
+  size_t len;
+  for (const std::string &element : elements) {
+    ASSERT_TRUE(list_iter_next(&it, &data, &len));
+    EXPECT_EQ(std::string(data, len), element);
+  }
+  EXPECT_EQ(redis_db_used_memory(loaded), redis_db_used_memory(db));
+
+  rv = redis_db_get(loaded, "expiring");
+  ASSERT_NE(rv, nullptr);
+  EXPECT_EQ(get_list_length(rv->data.list), 1u);
+  EXPECT_EQ(rv->expiration, expiration);
+  redis_db_destroy(loaded);
+
+  unlink("rdb_testdir/lists.rdb");
+  rmdir("rdb_testdir");
+}
@@ -133,4 +133,24 @@ TEST_F(LinkedListTest, LrangeNegativeIndices) {
   EXPECT_STREQ(range[1], "item2");
 
   cleanup_lrange_result(range, range_length);
-}
\ No newline at end of file
+}
+
+TEST_F(LinkedListTest, IteratorVisitsElementsFromHeadToTail) {
+  int length;
+  rpush(list, "second", &length);
+  lpush(list, "first", &length);
+  EXPECT_EQ(rpush_len(list, "third\0byte", 10), 0);
+
+  list_iterator it;
+  list_iter_init(&it, list);
+  const char *data;
+  size_t len;
+  ASSERT_TRUE(list_iter_next(&it, &data, &len));
+  EXPECT_EQ(std::string(data, len), "first");
+  ASSERT_TRUE(list_iter_next(&it, &data, &len));
+  EXPECT_EQ(std::string(data, len), "second");
+  ASSERT_TRUE(list_iter_next(&it, &data, &len));
+  EXPECT_EQ(std::string(data, len), std::string("third\0byte", 10));
+  EXPECT_FALSE(list_iter_next(&it, &data, &len));
+  EXPECT_EQ(get_list_length(list), 3);
+}
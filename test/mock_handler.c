@@ -50,13 +50,20 @@ CommandHandler *create_mock_command_handler() {
   mock_ch->buf_size = 0;
   mock_ch->buf_used = 0;
   mock_ch->args = NULL;
+  mock_ch->arg_lens = NULL;
+  mock_ch->arg_offsets = NULL;
   mock_ch->arg_capacity = 0;
   mock_ch->arg_count = 0;
-  mock_ch->ends = NULL;
-  mock_ch->ends_size = 0;
-  mock_ch->ends_capacity = 0;
+  mock_ch->bulk_len = -1;
+  mock_ch->bulk_start = 0;
+  mock_ch->bulk_slice = NULL;
+  mock_ch->borrow_input = false;
   mock_ch->client = NULL;
   mock_ch->should_respond = false;
+  mock_ch->defer_execution = false;
+  mock_ch->pending = NULL;
+  mock_ch->pending_count = 0;
+  mock_ch->pending_capacity = 0;
   return mock_ch;
 }
 void destroy_mock_command_handler(CommandHandler *mock_ch) { free(mock_ch); }
\ No newline at end of file
@@ -0,0 +1,48 @@
+extern "C" {
+#include "sds.h"
+}
+#include <gtest/gtest.h>
+
+TEST(SdsTest, NewFromCString) {
+  sds s = sds_new("hello");
+  EXPECT_EQ(sds_len(s), 5);
+  EXPECT_STREQ(s, "hello");
+  sds_free(s);
+}
+
+TEST(SdsTest, NewWithEmbeddedNul) {
+  const char value[] = {'a', '\0', 'b'};
+  sds s = sds_new_len(value, sizeof(value));
+  EXPECT_EQ(sds_len(s), 3);
+  EXPECT_EQ(memcmp(s, value, sizeof(value)), 0);
+  EXPECT_EQ(s[3], '\0');
+  sds_free(s);
+}
+
+TEST(SdsTest, NewWithoutInitIsZeroed) {
+  sds s = sds_new_len(NULL, 4);
+  EXPECT_EQ(sds_len(s), 4);
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(s[i], '\0');
+  }
+  sds_free(s);
+}
+
+TEST(SdsTest, Dup) {
+  const char value[] = {'x', '\0', 'y', 'z'};
+  sds s = sds_new_len(value, sizeof(value));
+  sds copy = sds_dup(s);
+  EXPECT_NE(copy, s);
+  EXPECT_EQ(sds_len(copy), 4);
+  EXPECT_EQ(memcmp(copy, value, sizeof(value)), 0);
+  sds_free(s);
+  sds_free(copy);
+}
+
+TEST(SdsTest, EmptyString) {
+  sds s = sds_new("");
+  EXPECT_EQ(sds_len(s), 0);
+  EXPECT_STREQ(s, "");
+  sds_free(s);
+  sds_free(NULL);
+}